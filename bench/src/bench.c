@@ -0,0 +1,686 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <disk.h>
+#include <filesys.h>
+#include <trace.h>
+#include <vfs.h>
+
+#define RAM_BLOCKS (65535)        // blocks of the RAM drive unless -m says otherwise; 32 MB, the most a drive can have
+#define CHURN_FILES (2000)        // files created, written, read and deleted per round of churn
+#define CHURN_ROUNDS (5)          // rounds of churn
+#define CHURN_MAX_BYTES (4096)    // largest file written by churn
+#define SEQ_MEGABYTES (8)         // size of the file written and read back by seq
+#define SEQ_CHUNK (64U << 10)     // bytes moved by a single write or read of seq
+#define RAND_OPS (20000)          // 512 byte reads and writes done by rand
+#define RAND_MEGABYTES (4)        // size of the file rand reads and writes at random
+#define RAND_WRITE_PERCENT (30)   // share of rand's operations that are writes
+#define MOUNT_OPS (200000)        // files opened, read and closed by mounts
+#define LIST_BATCH (64)           // directory entries fetched by one fs_readdir_batch
+#define TRACE_LINE (256)          // longest line of a trace
+
+// what a single workload did, and how long each of it's operations took
+typedef struct
+{
+    const char *name;
+    uint64_t *lat;        // latency of each operation, in nanoseconds
+    uint32_t ops, room;   // entries of lat in use, and it's room
+    uint32_t failed;      // operations the filesystem turned down
+    uint64_t bytes;       // file data written and read
+    double secs;          // wall clock time of the whole run, the closing sync included
+    fsstats_t before;     // counters when the run began
+    fsstats_t after;      // and when it ended
+} result_t;
+
+void usage(char *arg);
+uint64_t now_ns(void);
+uint32_t next_rand(uint64_t *state);
+bool parse_name(char *name_str, filename_t *name);
+void make_name(filename_t *name, char prefix, uint32_t number);
+void result_begin(result_t *result, filesys_t *filesys, const char *name);
+void result_op(result_t *result, uint64_t start, bool ok);
+void result_end(result_t *result, filesys_t *filesys, uint64_t start);
+int cmp_lat(const void *a, const void *b);
+double percentile(result_t *result, uint32_t pct);
+uint32_t list_all(filesys_t *filesys);
+bool run_churn(filesys_t *filesys, result_t *result, uint32_t files);
+bool run_seq(filesys_t *filesys, result_t *result, uint32_t megabytes);
+bool run_rand(filesys_t *filesys, result_t *result, uint32_t ops);
+bool run_replay(filesys_t *filesys, result_t *result, char *path);
+bool run_mounts(filesys_t *filesys, result_t *result, uint32_t ops);
+void print_text(result_t *results, uint32_t count);
+void print_json(result_t *results, uint32_t count, const char *drive, uint16_t blocks);
+drive_t *attach(uint8_t drive_num, uint16_t blocks, uint8_t mode, uint16_t chunk);
+int main(int argc, char **argv);
+
+void usage(char *arg)
+{
+    fprintf(stderr, "Usage: %s [-j] [-t <file>] [-m <blocks> | -d <drive>] [-r stripe | mirror] [-c <chunk>] [-l <us>[,<us>]] "
+                    "<workload> [argument]\n", arg);
+    fprintf(stderr, "Workloads:\n"
+                    "  churn [files]     small files created, written, read back and deleted, %d rounds (%d files a round)\n"
+                    "  seq [megabytes]   a large file written and read back sequentially, 64 KB at a time (%d MB)\n"
+                    "  rand [ops]        512 byte reads and writes at random offsets of a %d MB file (%d ops)\n"
+                    "  replay <trace>    the operations of a trace, one per line:\n"
+                    "                      create <name> | write <name> <offset> <len> | read <name> <offset> <len>\n"
+                    "                      list | delete <name>\n"
+                    "  mounts [ops]      files opened, read and closed by path, on %d RAM volumes mounted at /r00 on (%d ops)\n"
+                    "  all               churn, seq and rand, with their defaults\n",
+            CHURN_ROUNDS, CHURN_FILES, SEQ_MEGABYTES, RAND_MEGABYTES, RAND_OPS, VFS_MOUNTS, MOUNT_OPS);
+    fprintf(stderr, "Options:\n"
+                    "  -j                print the results as JSON\n"
+                    "  -t <file>         record a binary trace of the filesystem calls into file while the workloads run\n"
+                    "  -m <blocks>       run on a RAM drive of that many blocks (the default, %d blocks)\n"
+                    "  -d <drive>        run on the file of drive C or D instead; it's formatted, and whatever it held is lost\n"
+                    "  -r stripe|mirror  run on a drive made of two: RAM drives of -m blocks each, or with -d the files of C and D\n"
+                    "  -c <chunk>        blocks dealt to a member of a striped drive at a time (%d)\n"
+                    "  -l <us>[,<us>]    make every drive take that long over each request, and over each block of it, as a disk\n"
+                    "                    would; a drive serves one request at a time, so the members of -r show what they add\n",
+            RAM_BLOCKS, RAID_CHUNK);
+    fprintf(stderr, "Example:\n");
+    fprintf(stderr, "%s -j all\n", arg);
+
+    exit(EXIT_FAILURE);
+}
+
+uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// xorshift64; every run uses the same seed, so two runs do the very same operations
+uint32_t next_rand(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return (uint32_t)(*state >> 32);
+}
+
+// fills in name from a name of the form name.ext; returns false if it doesn't fit the 8.3 format
+bool parse_name(char *name_str, filename_t *name)
+{
+    char *dot;
+    size_t len;
+
+    if (!name_str || !name)
+        return false;
+
+    memset(name, 0, sizeof(filename_t));
+    dot = strrchr(name_str, '.');
+    len = dot ? (size_t)(dot - name_str) : strlen(name_str);
+    if (!len || len > FILENAME_LEN || (dot && strlen(dot + 1) > FILEEXT_LEN))
+        return false;
+
+    memcpy(name->name, name_str, len);
+    if (dot)
+        memcpy(name->extension, dot + 1, strlen(dot + 1));
+
+    return true;
+}
+
+// names made up by the synthetic workloads: the prefix and then number, in 7 digits
+void make_name(filename_t *name, char prefix, uint32_t number)
+{
+    char buf[FILENAME_LEN + 1];
+
+    memset(name, 0, sizeof(filename_t));
+    snprintf(buf, sizeof(buf), "%c%07u", prefix, number % 10000000);
+    memcpy(name->name, buf, FILENAME_LEN);
+}
+
+void result_begin(result_t *result, filesys_t *filesys, const char *name)
+{
+    memset(result, 0, sizeof(result_t));
+    result->name = name;
+    fs_stats(filesys, &result->before);
+}
+
+// records an operation that began at start; one that failed still took it's time, and is counted as such
+void result_op(result_t *result, uint64_t start, bool ok)
+{
+    uint64_t *lat;
+    uint64_t end;
+
+    end = now_ns();
+    if (!ok)
+        result->failed++;
+
+    if (result->ops == result->room)
+    {
+        lat = realloc(result->lat, (result->room ? result->room * 2 : 4096) * sizeof(uint64_t));
+        if (!lat)
+            return;
+
+        result->lat = lat;
+        result->room = result->room ? result->room * 2 : 4096;
+    }
+
+    result->lat[result->ops++] = end - start;
+}
+
+// everything the run wrote is synced before the clock stops, so it's blocks written are all on the drive;
+// the latencies are sorted for percentile
+void result_end(result_t *result, filesys_t *filesys, uint64_t start)
+{
+    fs_sync(filesys);
+    result->secs = (now_ns() - start) / 1e9;
+    fs_stats(filesys, &result->after);
+    qsort(result->lat, result->ops, sizeof(uint64_t), cmp_lat);
+}
+
+int cmp_lat(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// the latency under which pct percent of the operations finished, in microseconds; result_end has sorted them
+double percentile(result_t *result, uint32_t pct)
+{
+    uint32_t index;
+
+    if (!result->ops)
+        return 0;
+
+    index = (uint32_t)(((uint64_t)result->ops * pct + 99) / 100);
+    return result->lat[index ? index - 1 : 0] / 1e3;
+}
+
+// walks the whole listing, returning the number of entries in it
+uint32_t list_all(filesys_t *filesys)
+{
+    dirent_t entries[LIST_BATCH];
+    uint32_t cursor, total;
+    uint16_t got;
+
+    cursor = total = 0;
+    while ((got = fs_readdir_batch(filesys, &cursor, entries, LIST_BATCH)))
+        total += got;
+
+    return total;
+}
+
+bool run_churn(filesys_t *filesys, result_t *result, uint32_t files)
+{
+    static uint8_t data[CHURN_MAX_BYTES], back[CHURN_MAX_BYTES];
+    filename_t name;
+    uint16_t *inodes;
+    uint32_t round, index, len;
+    uint64_t state, start, op;
+
+    inodes = malloc(files * sizeof(uint16_t));
+    if (!inodes)
+        return false;
+
+    state = 0x9e3779b97f4a7c15ULL;
+    for (index = 0; index < sizeof(data); index++)
+        data[index] = next_rand(&state);
+
+    result_begin(result, filesys, "churn");
+    start = now_ns();
+    for (round = 0; round < CHURN_ROUNDS; round++)
+    {
+        for (index = 0; index < files; index++)
+        {
+            make_name(&name, 'c', round * files + index);
+            op = now_ns();
+            inodes[index] = fs_create(filesys, &name, TYPE_FILE);
+            result_op(result, op, inodes[index]);
+        }
+
+        for (index = 0; index < files; index++)
+        {
+            len = 1 + next_rand(&state) % CHURN_MAX_BYTES;
+            op = now_ns();
+            result_op(result, op, inodes[index] && fs_write(filesys, inodes[index], 0, data, len) == len);
+            result->bytes += len;
+        }
+
+        for (index = 0; index < files; index++)
+        {
+            op = now_ns();
+            result_op(result, op, inodes[index] && fs_read(filesys, inodes[index], 0, back, sizeof(back)));
+        }
+
+        for (index = 0; index < files; index++)
+        {
+            op = now_ns();
+            result_op(result, op, inodes[index] && fs_delete(filesys, inodes[index]));
+        }
+    }
+    result_end(result, filesys, start);
+
+    free(inodes);
+    return true;
+}
+
+bool run_seq(filesys_t *filesys, result_t *result, uint32_t megabytes)
+{
+    filename_t name;
+    uint8_t *chunk;
+    uint32_t offset, size, index;
+    uint16_t inode;
+    uint64_t start, op;
+
+    chunk = malloc(SEQ_CHUNK);
+    if (!chunk)
+        return false;
+    for (index = 0; index < SEQ_CHUNK; index++)
+        chunk[index] = index * 31;
+
+    size = megabytes << 20;
+    make_name(&name, 's', 0);
+
+    result_begin(result, filesys, "seq");
+    start = now_ns();
+    inode = fs_create(filesys, &name, TYPE_FILE | FLAG_EXTENTS);
+    for (offset = 0; inode && offset < size; offset += SEQ_CHUNK)
+    {
+        op = now_ns();
+        result_op(result, op, fs_write(filesys, inode, offset, chunk, SEQ_CHUNK) == SEQ_CHUNK);
+        result->bytes += SEQ_CHUNK;
+    }
+
+    for (offset = 0; inode && offset < size; offset += SEQ_CHUNK)
+    {
+        op = now_ns();
+        result_op(result, op, fs_read(filesys, inode, offset, chunk, SEQ_CHUNK) == SEQ_CHUNK);
+        result->bytes += SEQ_CHUNK;
+    }
+    result_end(result, filesys, start);
+
+    free(chunk);
+    if (inode)
+        fs_delete(filesys, inode);
+    return inode != 0;
+}
+
+bool run_rand(filesys_t *filesys, result_t *result, uint32_t ops)
+{
+    uint8_t block[BLOCK_SIZE];
+    filename_t name;
+    uint32_t size, offset, index;
+    uint16_t inode;
+    uint64_t state, start, op;
+    bool ok;
+
+    // the file is filled in before the clock starts, so every read finds data
+    size = RAND_MEGABYTES << 20;
+    make_name(&name, 'r', 0);
+    memset(block, 0xa5, sizeof(block));
+    inode = fs_create(filesys, &name, TYPE_FILE);
+    for (offset = 0, ok = inode != 0; ok && offset < size; offset += BLOCK_SIZE)
+        ok = fs_write(filesys, inode, offset, block, BLOCK_SIZE) == BLOCK_SIZE;
+    ok = ok && fs_sync(filesys);
+
+    state = 0x2545f4914f6cdd1dULL;
+    result_begin(result, filesys, "rand");
+    start = now_ns();
+    for (index = 0; ok && index < ops; index++)
+    {
+        offset = (next_rand(&state) % (size / BLOCK_SIZE)) * BLOCK_SIZE;
+        op = now_ns();
+        if (next_rand(&state) % 100 < RAND_WRITE_PERCENT)
+            result_op(result, op, fs_write(filesys, inode, offset, block, BLOCK_SIZE) == BLOCK_SIZE);
+        else
+            result_op(result, op, fs_read(filesys, inode, offset, block, BLOCK_SIZE) == BLOCK_SIZE);
+        result->bytes += BLOCK_SIZE;
+    }
+    result_end(result, filesys, start);
+
+    if (inode)
+        fs_delete(filesys, inode);
+    return ok;
+}
+
+// what it measures is the vfs resolving a path to it's volume, with the mount table as full as it gets; the volumes
+// are ramfs, so the filesystem under it costs next to nothing (filesys is only there for it's counters)
+bool run_mounts(filesys_t *filesys, result_t *result, uint32_t ops)
+{
+    uint8_t block[512];
+    char path[VFS_PATH_LEN];
+    vfs_file_t file;
+    uint32_t mounted, index;
+    uint64_t state, start, op;
+    bool ok;
+
+    memset(block, 0x5a, sizeof(block));
+    for (mounted = 0, ok = true; ok && mounted < VFS_MOUNTS; mounted++)
+    {
+        snprintf(path, sizeof(path), "/r%02u", mounted);
+        ok = vfs_mount(path, "ramfs", 0, false);
+        snprintf(path, sizeof(path), "/r%02u/data.bin", mounted);
+        ok = ok && vfs_open(path, true, &file);
+        ok = ok && vfs_write(&file, 0, block, sizeof(block)) == sizeof(block) && vfs_close(&file);
+    }
+
+    state = 0x853c49e6748fea9bULL;
+    result_begin(result, filesys, "mounts");
+    start = now_ns();
+    for (index = 0; ok && index < ops; index++)
+    {
+        snprintf(path, sizeof(path), "/r%02u/data.bin", next_rand(&state) % VFS_MOUNTS);
+        op = now_ns();
+        result_op(result, op, vfs_open(path, false, &file) && vfs_read(&file, 0, block, sizeof(block)) == sizeof(block) &&
+                                  vfs_close(&file));
+        result->bytes += sizeof(block);
+    }
+    result_end(result, filesys, start);
+
+    while (mounted--)
+    {
+        snprintf(path, sizeof(path), "/r%02u", mounted);
+        vfs_unmount(path);
+    }
+    return ok;
+}
+
+// files are looked up by name with fs_find_by_name as part of each operation, as a program opening them would
+bool run_replay(filesys_t *filesys, result_t *result, char *path)
+{
+    char line[TRACE_LINE], op_str[16], name_str[16];
+    filename_t name;
+    uint8_t *buf;
+    uint32_t buf_len, offset, len, line_num;
+    uint16_t inode;
+    uint64_t start, op;
+    FILE *trace;
+    int fields;
+    bool ok;
+
+    trace = fopen(path, "r");
+    if (!trace)
+    {
+        perror("fopen");
+        return false;
+    }
+
+    buf = NULL;
+    buf_len = 0;
+    line_num = 0;
+    result_begin(result, filesys, "replay");
+    start = now_ns();
+    while (fgets(line, sizeof(line), trace))
+    {
+        line_num++;
+        fields = sscanf(line, "%15s %15s %u %u", op_str, name_str, &offset, &len);
+        if (fields < 1 || op_str[0] == '#')
+            continue;
+
+        // a write's data is made up, and a read's thrown away; both go through buf
+        if (fields == 4 && len > buf_len)
+        {
+            free(buf);
+            buf = malloc(len);
+            buf_len = buf ? len : 0;
+            if (buf)
+                memset(buf, 0x5a, len);
+        }
+
+        if (!strcmp(op_str, "list"))
+        {
+            op = now_ns();
+            list_all(filesys);
+            result_op(result, op, true);
+            continue;
+        }
+
+        if (fields < 2 || !parse_name(name_str, &name) ||
+            ((!strcmp(op_str, "write") || !strcmp(op_str, "read")) && (fields < 4 || len > buf_len)))
+        {
+            fprintf(stderr, "%s:%u: can't make sense of this line\n", path, line_num);
+            continue;
+        }
+
+        op = now_ns();
+        if (!strcmp(op_str, "create"))
+            ok = fs_create(filesys, &name, TYPE_FILE) != 0;
+        else
+        {
+            ok = fs_find_by_name(filesys, &name, &inode, 1) == 1;
+            if (!strcmp(op_str, "write"))
+                ok = ok && fs_write(filesys, inode, offset, buf, len) == len;
+            else if (!strcmp(op_str, "read"))
+                ok = ok && fs_read(filesys, inode, offset, buf, len);
+            else if (!strcmp(op_str, "delete"))
+                ok = ok && fs_delete(filesys, inode);
+            else
+            {
+                fprintf(stderr, "%s:%u: unknown operation %s\n", path, line_num, op_str);
+                continue;
+            }
+        }
+        result_op(result, op, ok);
+        if (fields == 4)
+            result->bytes += len;
+    }
+    result_end(result, filesys, start);
+
+    free(buf);
+    fclose(trace);
+    return true;
+}
+
+void print_text(result_t *results, uint32_t count)
+{
+    result_t *result;
+    uint32_t index;
+    double lookups;
+
+    fprintf(stdout, "%-8s %9s %7s %11s %9s %9s %10s %10s %9s\n", "workload", "ops", "failed", "ops/s", "p50 us", "p99 us",
+            "blk read", "blk write", "cache hit");
+    for (index = 0; index < count; index++)
+    {
+        result = &results[index];
+        if (!result->name)
+            continue;
+
+        lookups = (double)(result->after.cache_lookups - result->before.cache_lookups);
+        fprintf(stdout, "%-8s %9u %7u %11.0f %9.2f %9.2f %10llu %10llu %8.1f%%\n", result->name, result->ops, result->failed,
+                result->secs > 0 ? result->ops / result->secs : 0.0, percentile(result, 50), percentile(result, 99),
+                (unsigned long long)(result->after.blocks_read - result->before.blocks_read),
+                (unsigned long long)(result->after.blocks_written - result->before.blocks_written),
+                lookups ? (result->after.cache_hits - result->before.cache_hits) * 100.0 / lookups : 0.0);
+    }
+}
+
+// one object per run, with every figure the text table has and the raw counters behind the rates
+void print_json(result_t *results, uint32_t count, const char *drive, uint16_t blocks)
+{
+    result_t *result;
+    uint32_t index;
+    uint64_t lookups, hits;
+    bool printed;
+
+    printed = false;
+    fprintf(stdout, "{\"drive\": \"%s\", \"blocks\": %u, \"results\": [", drive, blocks);
+    for (index = 0; index < count; index++)
+    {
+        result = &results[index];
+        if (!result->name)
+            continue;
+
+        lookups = result->after.cache_lookups - result->before.cache_lookups;
+        hits = result->after.cache_hits - result->before.cache_hits;
+        fprintf(stdout, "%s\n  {\"workload\": \"%s\", \"ops\": %u, \"failed\": %u, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+                        "\"bytes\": %llu, \"p50_us\": %.3f, \"p99_us\": %.3f, \"blocks_read\": %llu, \"blocks_written\": %llu, "
+                        "\"cache_lookups\": %llu, \"cache_hits\": %llu, \"cache_hit_rate\": %.4f}",
+                printed ? "," : "", result->name, result->ops, result->failed, result->secs,
+                result->secs > 0 ? result->ops / result->secs : 0.0, (unsigned long long)result->bytes,
+                percentile(result, 50), percentile(result, 99),
+                (unsigned long long)(result->after.blocks_read - result->before.blocks_read),
+                (unsigned long long)(result->after.blocks_written - result->before.blocks_written),
+                (unsigned long long)lookups, (unsigned long long)hits, lookups ? (double)hits / lookups : 0.0);
+        printed = true;
+    }
+    fprintf(stdout, "\n]}\n");
+}
+
+// the drive to run on: a RAM drive or the file of drive_num, or with mode set a drive made of two of them
+drive_t *attach(uint8_t drive_num, uint16_t blocks, uint8_t mode, uint16_t chunk)
+{
+    drive_t *members[2];
+    drive_t *drive;
+
+    if (!mode)
+        return drive_num ? d_attach(drive_num) : d_attach_mem(DriveC, blocks);
+
+    members[0] = drive_num ? d_attach(DriveC) : d_attach_mem(DriveC, blocks);
+    members[1] = drive_num ? d_attach(DriveD) : d_attach_mem(DriveD, blocks);
+    drive = members[0] && members[1] ? d_raid(members, 2, mode, chunk) : NULL;
+    if (!drive)
+    {
+        d_detach(members[0]);
+        d_detach(members[1]);
+    }
+
+    return drive;
+}
+
+int main(int argc, char **argv)
+{
+    result_t results[3];
+    filesys_t *filesys;
+    drive_t *drive;
+    char *workload, *arg, *drive_name, *trace_path, *end;
+    trace_stats_t trace_stats;
+    uint32_t count, index, value, access_us, block_us;
+    uint16_t blocks, chunk;
+    uint8_t drive_num, mode;
+    bool json, ok;
+    int next;
+
+    json = false;
+    trace_path = NULL;
+    drive_num = 0;
+    blocks = RAM_BLOCKS;
+    mode = 0;
+    chunk = 0;
+    access_us = block_us = 0;
+    for (next = 1; next < argc && argv[next][0] == '-'; next++)
+    {
+        if (!strcmp(argv[next], "-j"))
+            json = true;
+        else if (!strcmp(argv[next], "-t") && next + 1 < argc)
+            trace_path = argv[++next];
+        else if (!strcmp(argv[next], "-m") && next + 1 < argc && atoi(argv[next + 1]) > 0 && atoi(argv[next + 1]) <= RAM_BLOCKS)
+            blocks = atoi(argv[++next]);
+        else if (!strcmp(argv[next], "-d") && next + 1 < argc && (argv[next + 1][0] == 'c' || argv[next + 1][0] == 'C'))
+        {
+            drive_num = DriveC;
+            next++;
+        }
+        else if (!strcmp(argv[next], "-d") && next + 1 < argc && (argv[next + 1][0] == 'd' || argv[next + 1][0] == 'D'))
+        {
+            drive_num = DriveD;
+            next++;
+        }
+        else if (!strcmp(argv[next], "-r") && next + 1 < argc && !strcmp(argv[next + 1], "stripe"))
+        {
+            mode = RAID_STRIPE;
+            next++;
+        }
+        else if (!strcmp(argv[next], "-r") && next + 1 < argc && !strcmp(argv[next + 1], "mirror"))
+        {
+            mode = RAID_MIRROR;
+            next++;
+        }
+        else if (!strcmp(argv[next], "-c") && next + 1 < argc && atoi(argv[next + 1]) > 0 && atoi(argv[next + 1]) <= RAM_BLOCKS)
+            chunk = atoi(argv[++next]);
+        else if (!strcmp(argv[next], "-l") && next + 1 < argc)
+        {
+            access_us = (uint32_t)strtoul(argv[++next], &end, 10);
+            block_us = *end == ',' ? (uint32_t)strtoul(end + 1, NULL, 10) : 0;
+        }
+        else
+            usage(argv[0]);
+    }
+
+    if (next >= argc)
+        usage(argv[0]);
+    workload = argv[next];
+    arg = next + 1 < argc ? argv[next + 1] : NULL;
+    value = arg ? (uint32_t)strtoul(arg, NULL, 10) : 0;
+
+    // every run starts on a freshly formatted volume
+    drive = attach(drive_num, blocks, mode, chunk);
+    if (!drive)
+    {
+        fprintf(stderr, "Error -> the drive couldn't be attached\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!drive_num)
+        drive_name = mode == RAID_STRIPE ? "ram-stripe" : mode == RAID_MIRROR ? "ram-mirror" : "ram";
+    else
+        drive_name = d_getdrivename(drive->drive_num);
+    d_set_delay(drive, access_us, block_us);
+
+    filesys = fs_format(drive, NULL, true, false);
+    if (!filesys)
+    {
+        fprintf(stderr, "Error -> the drive couldn't be formatted\n");
+        d_detach(drive);
+        return EXIT_FAILURE;
+    }
+
+    // the trace covers the workloads alone, not the format before them
+    if (trace_path && !trace_start(trace_path))
+    {
+        fprintf(stderr, "Error -> the trace couldn't be started\n");
+        fs_unmount(filesys);
+        return EXIT_FAILURE;
+    }
+
+    // a workload that couldn't be set up leaves it's result unnamed, and out of the report
+    memset(results, 0, sizeof(results));
+    count = 0;
+    ok = true;
+    if (!strcmp(workload, "churn"))
+        ok = run_churn(filesys, &results[count++], value ? value : CHURN_FILES);
+    else if (!strcmp(workload, "seq"))
+        ok = run_seq(filesys, &results[count++], value ? value : SEQ_MEGABYTES);
+    else if (!strcmp(workload, "rand"))
+        ok = run_rand(filesys, &results[count++], value ? value : RAND_OPS);
+    else if (!strcmp(workload, "mounts"))
+        ok = run_mounts(filesys, &results[count++], value ? value : MOUNT_OPS);
+    else if (!strcmp(workload, "replay") && arg)
+        ok = run_replay(filesys, &results[count++], arg);
+    else if (!strcmp(workload, "all"))
+    {
+        ok = run_churn(filesys, &results[count++], CHURN_FILES) && run_seq(filesys, &results[count++], SEQ_MEGABYTES) &&
+             run_rand(filesys, &results[count++], RAND_OPS);
+    }
+    else
+    {
+        fs_unmount(filesys);
+        usage(argv[0]);
+    }
+
+    if (!ok)
+        fprintf(stderr, "Error -> a workload couldn't be set up; it's results are partial\n");
+
+    if (trace_path && trace_stop(&trace_stats))
+    {
+        fprintf(stderr, "Trace -> %llu records written to %s, %llu calls dropped%s\n", (unsigned long long)trace_stats.records,
+                trace_path, (unsigned long long)trace_stats.dropped, trace_stats.failed ? "; the file couldn't be written in full" : "");
+    }
+
+    if (json)
+        print_json(results, count, drive_name, filesys->drive->blocks);
+    else
+        print_text(results, count);
+
+    for (index = 0; index < count; index++)
+        free(results[index].lat);
+    fs_unmount(filesys);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
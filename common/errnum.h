@@ -8,18 +8,19 @@ typedef uint16_t err_t;
 
 #ifdef INSIDE_SYS
 public
-err_t errnum; // there should only be one copy of this variable, and that should
-              // be inside the OS, in sys.c
-              // rest all files should refer to that copy only
+__thread err_t errnum; // there should only be one copy of this variable, and that should
+                       // be inside the OS, in sys.c
+                       // rest all files should refer to that copy only
 #else
-extern public err_t errnum;
+extern public __thread err_t errnum;
 #endif
 
 // our OS api functions will return zero on error and 1 on success
-// the global variable errno will be set to indicate the error in the most recent
+// the variable errnum will be set to indicate the error in the most recent
 // failed call to the system
 
-// making this variable global results in making the entire OS single-threaded
+// errnum is thread-local, so every thread sees the error of it's own most recent call
+// and threads can use the OS concurrently
 
 #define ret_err(x)    \
     do                \
@@ -3,6 +3,7 @@
 #include <base.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 // we support only two drives for now, C and D
 #define DriveC 0x01 // 0001
@@ -11,22 +12,62 @@
 #define DRIVE_BASE_PATH "/home/raj/Desktop/neoSys/disk_emulator/drives/drive."
 #define BLOCK_SIZE (512)
 
+/*
+ * a drive can also be made of several others, it's members: striped, it's blocks are dealt out to the members
+ * a chunk at a time, so a long run is moved by all of them at once; mirrored, every member holds every block,
+ * writes go to all of them at once and reads to whichever is least busy. each member keeps a label in it's
+ * last block, from which d_attach puts the drive back together. a member can still be attached on it's own, which is
+ * how a set is broken up; anything written to it that way leaves the set inconsistent
+ */
+#define RAID_STRIPE 0x01
+#define RAID_MIRROR 0x02
+#define RAID_MEMBERS (8)  // most drives a drive can be made of
+#define RAID_CHUNK (16)   // blocks dealt to a member of a striped drive at a time, unless asked otherwise;
+                          // also the shortest run a mirrored drive splits between it's members
+#define RAID_MAGIC (0x44494152) // "RAID"
+
+typedef struct raid raid_t; // private to disk.c
+
 typedef struct
 {
-    int fd;            // the file descriptor backing this drive
+    int fd;            // the file descriptor backing this drive; -1 for a drive made of several
     uint16_t blocks;   // number of blocks in the drive; blocks are numbered from 0 to blocks - 1
-    uint8_t drive_num; // drive number
+    uint8_t drive_num; // drive number; for a drive made of several, those of it's members or'ed together
+    bool readonly;     // attached with d_attach_ro; shares the drive with other readers and can't be written
+    uint64_t blocks_read;    // blocks read since the drive was attached
+    uint64_t blocks_written; // blocks written since the drive was attached
+    uint32_t access_us;      // time every request takes on top of the copy, set with d_set_delay; 0 for none
+    uint32_t block_us;       // time every block of a request takes on top of that
+    pthread_mutex_t busy;    // a drive with a delay serves a single request at a time, as a disk would
+    raid_t *raid;            // the members of a drive made of several; NULL for a drive of it's own
 } drive_t;
 
 public
 drive_t *drive_test(uint8_t drive_num);
 
-internal bool d_is_drivenum_valid(uint8_t drive_num);
-internal drive_t *d_attach(uint8_t drive_num);
+internal bool d_is_drivenum_valid(uint8_t drive_num); // any of the drives, or several of them together
+internal drive_t *d_attach(uint8_t drive_num);    // exclusive: fails while any other process or thread has the drive attached;
+                                                  // several drive numbers or'ed together attach the drive made of them; a mirror
+                                                  // member dropped the last time round is copied up to date from the rest first
+internal drive_t *d_attach_ro(uint8_t drive_num); // shared: any number of readers, but no d_attach, at a time; a drive made of
+                                                  // several is attached with every member shared, and a member behind the rest left out
+internal drive_t *d_attach_mem(uint8_t drive_num, uint16_t blocks); // a zeroed drive of blocks blocks held in memory in place of the drive's file;
+                                                                    // it's gone once detached, and claims drive_num as d_attach does
+internal drive_t *d_raid(drive_t **members, uint8_t count, uint8_t mode, uint16_t chunk); // makes a RAID_STRIPE or RAID_MIRROR drive
+                                                  // of count attached drives, labelling each; what they held is lost, as with a format.
+                                                  // the new drive owns the members, and detaching it detaches them; chunk 0 is RAID_CHUNK
+internal bool d_set_delay(drive_t *drive, uint32_t access_us, uint32_t block_us); // makes every request take as long as on a disk;
+                                                  // for a drive made of several, sets it on each member
 internal bool d_detach(drive_t *drive);
 internal void d_show(drive_t *drive);
 internal bool d_read(drive_t *drive, uint8_t *dest, uint16_t block_num);
 internal bool d_write(drive_t *drive, uint8_t *src, uint16_t block_num);
+internal bool d_read_run(drive_t *drive, uint8_t *dest, uint16_t block_num, uint16_t count); // reads count contiguous blocks in one go
+internal bool d_write_run(drive_t *drive, uint8_t *src, uint16_t block_num, uint16_t count); // writes count contiguous blocks in one go
+internal bool d_sync(drive_t *drive);                                                       // makes every write issued so far durable
+internal uint8_t d_copies(drive_t *drive); // copies the drive keeps of each block: the members of a mirrored drive, else 1
+internal bool d_read_copy(drive_t *drive, uint8_t *dest, uint16_t block_num, uint16_t count, uint8_t copy); // as d_read_run, but from
+                                                  // the given copy alone; false for a copy that's failed
 internal char *d_getdrivename(uint8_t drive_num);
 
 // this will be true if and only if all the three statements return true
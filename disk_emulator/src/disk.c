@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // for memfd_create()
 #include <disk.h>
 #include <osapi.h>
 #include <stdlib.h>
@@ -5,14 +6,100 @@
 #include <fcntl.h>    // for open()
 #include <unistd.h>   // for close()
 #include <sys/stat.h> // for fstat()
+#include <sys/file.h> // for flock()
+#include <sys/mman.h> // for memfd_create()
+#include <sys/uio.h>  // for preadv() and pwritev()
+#include <time.h>
 
 #define is_pow_of_two(num) (!((num) & (num - 1)))
 
+#define RAID_IOV (64) // pieces of a run a member moves in a single request; a longer striped run is moved in turns
+#define RESYNC_RUN (128) // blocks copied at a time onto a mirror member that's behind the rest
+
+// what a member is asked to do
+#define IO_READ 0
+#define IO_WRITE 1
+#define IO_SYNC 2
+
+/*
+ * the label in the last block of every member of a drive made of several
+ */
+typedef struct packed
+{
+    uint32_t magic;  // RAID_MAGIC
+    uint32_t set;    // the same on every member of a drive, and different from drive to drive
+    uint8_t mode;    // RAID_STRIPE or RAID_MIRROR
+    uint8_t count;   // members in the drive
+    uint8_t index;   // place of this member among them
+    uint16_t chunk;  // blocks dealt to a member at a time
+    uint16_t usable; // blocks at the start of every member the drive uses; the label lies past them
+    uint32_t generation; // bumped on the members left whenever a mirror drops one, so the one dropped is known
+                         // to be behind the next time the drive is attached; 0 on a label written before it was kept
+} raidlabel_t;           // packed ensures this structure is always 19 bytes
+
+// requests handed to the workers by one caller, which waits for all of them
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    uint8_t pending; // requests the workers haven't finished yet
+} batch_t;
+
+// a member's part of a request made to the drive
+typedef struct memberio
+{
+    struct memberio *next; // in the queue of the workers
+    batch_t *batch;
+    uint8_t member; // place of the member in the drive
+    uint8_t op;     // IO_*
+    bool ok;        // set once it's done
+    off_t offset;   // on the member, in bytes
+    size_t len;     // bytes in iov
+    int iovcnt;
+    struct iovec iov[RAID_IOV];
+} memberio_t;
+
+struct raid
+{
+    uint8_t mode;
+    uint8_t count;
+    uint16_t chunk;
+    uint16_t usable;
+    uint32_t set;                    // as in the labels
+    uint32_t generation;             // as in the labels of the members that haven't failed
+    drive_t *member[RAID_MEMBERS];
+    bool failed[RAID_MEMBERS];       // mirror members dropped after an error; the drive carries on with the rest
+    uint32_t inflight[RAID_MEMBERS]; // requests under way on every member, so a mirrored read goes to the least busy
+    uint32_t turn;                   // breaks ties between members equally busy
+    pthread_t worker[RAID_MEMBERS];  // one a member, so every member of a request can be busy at once
+    memberio_t *queue;               // parts waiting for a worker, oldest first
+    memberio_t *last;
+    pthread_mutex_t lock;            // guards queue, last and stop, and the writing of labels
+    pthread_cond_t work;
+    bool stop;
+};
+
 // a bit-wise flag to see if a drive is attached or not
 // if drive C is attached, it will have it's LSB set
 // if drive D is attached, it will have it's 2nd LSB set and so on
 private uint8_t attached = 0;
 
+private void drive_init(drive_t *drive);
+private bool drive_io(drive_t *drive, struct iovec *iov, int iovcnt, off_t offset, size_t len, bool write);
+private drive_t *attach_file(uint8_t drive_num);
+private drive_t *attach_set(uint8_t drive_num, bool readonly);
+private drive_t *raid_make(drive_t **members, uint8_t count, raidlabel_t *label);
+private bool label_write(raid_t *raid, uint8_t member);
+private bool member_resync(drive_t *drive, uint8_t member);
+private void *member_worker(void *arg);
+private void member_run(raid_t *raid, memberio_t *io);
+private void member_fail(drive_t *drive, uint8_t member);
+private uint8_t least_busy(raid_t *raid);
+private void run_batch(raid_t *raid, memberio_t *io, uint8_t count);
+private bool stripe_io(drive_t *drive, uint8_t *buf, uint16_t block_num, uint16_t count, bool write);
+private bool mirror_io(drive_t *drive, uint8_t *buf, uint16_t block_num, uint16_t count, bool write);
+private bool raid_io(drive_t *drive, uint8_t *buf, uint16_t block_num, uint16_t count, bool write);
+
 internal char *d_getdrivename(uint8_t drive_num)
 {
     switch (drive_num)
@@ -21,6 +108,8 @@ internal char *d_getdrivename(uint8_t drive_num)
         return "DriveC";
     case DriveD:
         return "DriveD";
+    case DriveC | DriveD:
+        return "DriveCD";
     default:
         return NULL;
     }
@@ -40,49 +129,578 @@ public drive_t *drive_test(uint8_t drive_num)
 
 internal bool d_is_drivenum_valid(uint8_t drive_num)
 {
-    return (drive_num == DriveC || drive_num == DriveD);
+    return drive_num && !(drive_num & ~(DriveC | DriveD));
+}
+
+private void drive_init(drive_t *drive)
+{
+    drive->blocks_read = drive->blocks_written = 0;
+    drive->access_us = drive->block_us = 0;
+    drive->raid = NULL;
+    pthread_mutex_init(&drive->busy, NULL);
+}
+
+// a single request to a drive of it's own; with a delay set, the drive is held for as long as a disk would take over it
+private bool drive_io(drive_t *drive, struct iovec *iov, int iovcnt, off_t offset, size_t len, bool write)
+{
+    struct timespec delay;
+    uint64_t us;
+    ssize_t done;
+    bool slow;
+
+    slow = __atomic_load_n(&drive->access_us, __ATOMIC_RELAXED) || __atomic_load_n(&drive->block_us, __ATOMIC_RELAXED);
+    if (slow)
+        pthread_mutex_lock(&drive->busy);
+
+    // preadv/pwritev leave the shared file offset alone, so several threads can use one drive at once
+    done = write ? pwritev(drive->fd, iov, iovcnt, offset) : preadv(drive->fd, iov, iovcnt, offset);
+
+    if (slow)
+    {
+        us = drive->access_us + (uint64_t)drive->block_us * (len / BLOCK_SIZE);
+        delay.tv_sec = us / 1000000;
+        delay.tv_nsec = (us % 1000000) * 1000;
+        nanosleep(&delay, NULL);
+        pthread_mutex_unlock(&drive->busy);
+    }
+
+    if (done < (ssize_t)len)
+    {
+        return false;
+    }
+
+    __atomic_fetch_add(write ? &drive->blocks_written : &drive->blocks_read, len / BLOCK_SIZE, __ATOMIC_RELAXED);
+    return true;
 }
 
 internal bool d_read(drive_t *drive, uint8_t *dest, uint16_t block_num)
 {
+    struct iovec iov;
+
     if (!drive || !dest)
     {
         return false;
     }
 
-    if (lseek(drive->fd, block_num * BLOCK_SIZE, SEEK_SET) < 0)
+    if (drive->raid)
+    {
+        return raid_io(drive, dest, block_num, 1, false);
+    }
+
+    iov.iov_base = dest;
+    iov.iov_len = BLOCK_SIZE;
+    return drive_io(drive, &iov, 1, (off_t)block_num * BLOCK_SIZE, BLOCK_SIZE, false);
+}
+
+// a run of contiguous blocks is read with a single system call instead of one per block
+internal bool d_read_run(drive_t *drive, uint8_t *dest, uint16_t block_num, uint16_t count)
+{
+    struct iovec iov;
+
+    if (!drive || !dest || !count)
     {
         return false;
     }
 
-    if (read(drive->fd, (void *)dest, BLOCK_SIZE) < BLOCK_SIZE)
+    if ((uint32_t)block_num + count > drive->blocks)
     {
         return false;
     }
 
-    return true;
+    if (drive->raid)
+    {
+        return raid_io(drive, dest, block_num, count, false);
+    }
+
+    iov.iov_base = dest;
+    iov.iov_len = (size_t)count * BLOCK_SIZE;
+    return drive_io(drive, &iov, 1, (off_t)block_num * BLOCK_SIZE, iov.iov_len, false);
+}
+
+internal bool d_write_run(drive_t *drive, uint8_t *src, uint16_t block_num, uint16_t count)
+{
+    struct iovec iov;
+
+    if (!drive || !src || !count)
+    {
+        return false;
+    }
+
+    if ((uint32_t)block_num + count > drive->blocks)
+    {
+        return false;
+    }
+
+    if (drive->raid)
+    {
+        return raid_io(drive, src, block_num, count, true);
+    }
+
+    iov.iov_base = src;
+    iov.iov_len = (size_t)count * BLOCK_SIZE;
+    return drive_io(drive, &iov, 1, (off_t)block_num * BLOCK_SIZE, iov.iov_len, true);
 }
 
 internal bool d_write(drive_t *drive, uint8_t *src, uint16_t block_num)
 {
+    struct iovec iov;
+
     if (!drive || !src)
     {
         return false;
     }
 
-    if (lseek(drive->fd, block_num * BLOCK_SIZE, SEEK_SET) < 0)
+    if (drive->raid)
+    {
+        return raid_io(drive, src, block_num, 1, true);
+    }
+
+    iov.iov_base = src;
+    iov.iov_len = BLOCK_SIZE;
+    return drive_io(drive, &iov, 1, (off_t)block_num * BLOCK_SIZE, BLOCK_SIZE, true);
+}
+
+internal bool d_sync(drive_t *drive)
+{
+    memberio_t io[RAID_MEMBERS];
+    raid_t *raid;
+    uint8_t member, parts, index;
+    bool ok;
+
+    if (!drive)
     {
         return false;
     }
 
-    if (write(drive->fd, (void *)src, BLOCK_SIZE) < BLOCK_SIZE)
+    if (!drive->raid)
+    {
+        return fdatasync(drive->fd) != -1;
+    }
+
+    // every member flushes at once
+    raid = drive->raid;
+    parts = 0;
+    for (member = 0; member < raid->count; member++)
+    {
+        if (__atomic_load_n(&raid->failed[member], __ATOMIC_RELAXED))
+            continue;
+
+        io[parts].member = member;
+        io[parts].op = IO_SYNC;
+        parts++;
+    }
+
+    run_batch(raid, io, parts);
+    ok = parts > 0;
+    for (index = 0; index < parts; index++)
+        ok = ok && io[index].ok;
+
+    return ok;
+}
+
+internal uint8_t d_copies(drive_t *drive)
+{
+    if (!drive)
+        return 0;
+
+    return drive->raid && drive->raid->mode == RAID_MIRROR ? drive->raid->count : 1;
+}
+
+// lets a caller holding a block it doubts see what every copy of it holds, where d_read could give it the same one each time
+internal bool d_read_copy(drive_t *drive, uint8_t *dest, uint16_t block_num, uint16_t count, uint8_t copy)
+{
+    raid_t *raid;
+    struct iovec iov;
+
+    if (!drive || !dest || !count || copy >= d_copies(drive))
+    {
+        return false;
+    }
+
+    raid = drive->raid;
+    if (!raid || raid->mode != RAID_MIRROR)
+    {
+        return d_read_run(drive, dest, block_num, count);
+    }
+
+    if ((uint32_t)block_num + count > drive->blocks || __atomic_load_n(&raid->failed[copy], __ATOMIC_RELAXED))
+    {
+        return false;
+    }
+
+    iov.iov_base = dest;
+    iov.iov_len = (size_t)count * BLOCK_SIZE;
+    if (!drive_io(raid->member[copy], &iov, 1, (off_t)block_num * BLOCK_SIZE, iov.iov_len, false))
     {
         return false;
     }
 
+    __atomic_fetch_add(&drive->blocks_read, count, __ATOMIC_RELAXED);
     return true;
 }
 
+private void member_run(raid_t *raid, memberio_t *io)
+{
+    drive_t *member;
+
+    member = raid->member[io->member];
+    if (io->op == IO_SYNC)
+        io->ok = fdatasync(member->fd) != -1;
+    else
+        io->ok = drive_io(member, io->iov, io->iovcnt, io->offset, io->len, io->op == IO_WRITE);
+
+    __atomic_fetch_sub(&raid->inflight[io->member], 1, __ATOMIC_RELAXED);
+}
+
+private void *member_worker(void *arg)
+{
+    raid_t *raid;
+    memberio_t *io;
+    batch_t *batch;
+
+    raid = (raid_t *)arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&raid->lock);
+        while (!raid->queue && !raid->stop)
+            pthread_cond_wait(&raid->work, &raid->lock);
+
+        io = raid->queue;
+        if (!io)
+        {
+            pthread_mutex_unlock(&raid->lock);
+            return NULL;
+        }
+
+        raid->queue = io->next;
+        if (!raid->queue)
+            raid->last = NULL;
+        pthread_mutex_unlock(&raid->lock);
+
+        // the part lives on the stack of it's caller, which may return once pending drops to 0
+        batch = io->batch;
+        member_run(raid, io);
+
+        pthread_mutex_lock(&batch->lock);
+        if (!--batch->pending)
+            pthread_cond_signal(&batch->done);
+        pthread_mutex_unlock(&batch->lock);
+    }
+}
+
+// the caller moves the first part itself, and the workers the rest alongside it
+private void run_batch(raid_t *raid, memberio_t *io, uint8_t count)
+{
+    batch_t batch;
+    uint8_t index;
+
+    for (index = 0; index < count; index++)
+        __atomic_fetch_add(&raid->inflight[io[index].member], 1, __ATOMIC_RELAXED);
+
+    if (count <= 1)
+    {
+        if (count)
+            member_run(raid, io);
+        return;
+    }
+
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    batch.pending = count - 1;
+
+    pthread_mutex_lock(&raid->lock);
+    for (index = 1; index < count; index++)
+    {
+        io[index].batch = &batch;
+        io[index].next = NULL;
+        if (raid->last)
+            raid->last->next = &io[index];
+        else
+            raid->queue = &io[index];
+        raid->last = &io[index];
+    }
+    pthread_cond_broadcast(&raid->work);
+    pthread_mutex_unlock(&raid->lock);
+
+    member_run(raid, io);
+
+    pthread_mutex_lock(&batch.lock);
+    while (batch.pending)
+        pthread_cond_wait(&batch.done, &batch.lock);
+    pthread_mutex_unlock(&batch.lock);
+
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+}
+
+// a mirror carries on without a member that failed, unless it's the last one left
+private void member_fail(drive_t *drive, uint8_t member)
+{
+    raid_t *raid;
+    uint8_t index, left;
+
+    raid = drive->raid;
+    left = 0;
+    for (index = 0; index < raid->count; index++)
+        left += index != member && !__atomic_load_n(&raid->failed[index], __ATOMIC_RELAXED);
+
+    if (!left || __atomic_exchange_n(&raid->failed[member], true, __ATOMIC_ACQ_REL))
+        return;
+
+    fprintf(stderr, "Error -> %s dropped from %s after a failed request\n", d_getdrivename(raid->member[member]->drive_num),
+            d_getdrivename(drive->drive_num));
+
+    // a reader writes nothing, so the drive is as it was on the members once it's gone
+    if (drive->readonly)
+        return;
+
+    // the members left move on a generation, so the one dropped isn't taken for one of them once the drive is attached again;
+    // until the labels are written, a write that reached only the members left could be lost to it
+    pthread_mutex_lock(&raid->lock);
+    raid->generation++;
+    for (index = 0; index < raid->count; index++)
+    {
+        if (!__atomic_load_n(&raid->failed[index], __ATOMIC_RELAXED) && !label_write(raid, index))
+            fprintf(stderr, "Error -> the label of %s couldn't be brought up to date\n", d_getdrivename(raid->member[index]->drive_num));
+    }
+    pthread_mutex_unlock(&raid->lock);
+}
+
+// writes the label of a member as the drive stands; raid->lock is held, or the drive isn't in use yet
+private bool label_write(raid_t *raid, uint8_t member)
+{
+    raidlabel_t label;
+    uint8_t block[BLOCK_SIZE];
+
+    label.magic = RAID_MAGIC;
+    label.set = raid->set;
+    label.mode = raid->mode;
+    label.count = raid->count;
+    label.index = member;
+    label.chunk = raid->chunk;
+    label.usable = raid->usable;
+    label.generation = raid->generation;
+
+    zero(block, BLOCK_SIZE);
+    copy(block, &label, sizeof(raidlabel_t));
+    return d_write(raid->member[member], block, raid->member[member]->blocks - 1) && d_sync(raid->member[member]);
+}
+
+// copies everything the drive holds onto a mirror member that's behind the rest, from one that isn't, and then
+// gives it the label of the rest; the drive isn't in use yet
+private bool member_resync(drive_t *drive, uint8_t member)
+{
+    raid_t *raid;
+    uint8_t *buf;
+    uint16_t block_num, count;
+    uint8_t source;
+    bool ok;
+
+    raid = drive->raid;
+    for (source = 0; source < raid->count && (source == member || raid->failed[source]); source++)
+        ;
+
+    buf = malloc((size_t)RESYNC_RUN * BLOCK_SIZE);
+    if (source == raid->count || !buf)
+    {
+        free(buf);
+        return false;
+    }
+
+    ok = true;
+    for (block_num = 0; ok && block_num < raid->usable; block_num += count)
+    {
+        count = raid->usable - block_num < RESYNC_RUN ? raid->usable - block_num : RESYNC_RUN;
+        ok = d_read_run(raid->member[source], buf, block_num, count) && d_write_run(raid->member[member], buf, block_num, count);
+    }
+    free(buf);
+
+    return ok && d_sync(raid->member[member]) && label_write(raid, member);
+}
+
+// the member with the fewest requests under way, taking turns among those level; RAID_MEMBERS if every one has failed
+private uint8_t least_busy(raid_t *raid)
+{
+    uint8_t index, member, best;
+    uint32_t start;
+
+    start = __atomic_fetch_add(&raid->turn, 1, __ATOMIC_RELAXED);
+    best = RAID_MEMBERS;
+    for (index = 0; index < raid->count; index++)
+    {
+        member = (start + index) % raid->count;
+        if (__atomic_load_n(&raid->failed[member], __ATOMIC_RELAXED))
+            continue;
+
+        if (best == RAID_MEMBERS ||
+            __atomic_load_n(&raid->inflight[member], __ATOMIC_RELAXED) < __atomic_load_n(&raid->inflight[best], __ATOMIC_RELAXED))
+            best = member;
+    }
+
+    return best;
+}
+
+/*
+ * chunk c of the drive is chunk c / count of member c % count, so the chunks a member holds of a run lie
+ * one after another on it, and each member moves it's share of the run in a single request
+ */
+private bool stripe_io(drive_t *drive, uint8_t *buf, uint16_t block_num, uint16_t count, bool write)
+{
+    memberio_t io[RAID_MEMBERS];
+    memberio_t *part;
+    uint8_t slot[RAID_MEMBERS]; // place of each member's part in io; RAID_MEMBERS for none yet
+    raid_t *raid;
+    uint32_t row, block, end, turn_end, chunk, len;
+    uint8_t member, parts, index;
+    bool ok;
+
+    raid = drive->raid;
+    row = (uint32_t)raid->chunk * raid->count;
+    block = block_num;
+    end = (uint32_t)block_num + count;
+    ok = true;
+
+    while (ok && block < end)
+    {
+        // no more than RAID_IOV rows a turn, which is a chunk for every member a row
+        turn_end = (block / row + RAID_IOV) * row;
+        if (turn_end > end)
+            turn_end = end;
+
+        for (member = 0; member < raid->count; member++)
+            slot[member] = RAID_MEMBERS;
+        parts = 0;
+
+        for (; block < turn_end; block += len)
+        {
+            chunk = block / raid->chunk;
+            member = chunk % raid->count;
+            len = raid->chunk - block % raid->chunk;
+            if (len > turn_end - block)
+                len = turn_end - block;
+
+            if (slot[member] == RAID_MEMBERS)
+            {
+                slot[member] = parts;
+                part = &io[parts++];
+                part->member = member;
+                part->op = write ? IO_WRITE : IO_READ;
+                part->offset = ((off_t)(chunk / raid->count) * raid->chunk + block % raid->chunk) * BLOCK_SIZE;
+                part->len = 0;
+                part->iovcnt = 0;
+            }
+
+            part = &io[slot[member]];
+            part->iov[part->iovcnt].iov_base = buf + (size_t)(block - block_num) * BLOCK_SIZE;
+            part->iov[part->iovcnt].iov_len = (size_t)len * BLOCK_SIZE;
+            part->iovcnt++;
+            part->len += (size_t)len * BLOCK_SIZE;
+        }
+
+        run_batch(raid, io, parts);
+        for (index = 0; index < parts; index++)
+            ok = ok && io[index].ok;
+    }
+
+    return ok;
+}
+
+/*
+ * a write goes to every member at once, and holds so long as one of them took it; a read of RAID_CHUNK blocks
+ * or more per member is split between them, and a shorter one goes to the least busy
+ */
+private bool mirror_io(drive_t *drive, uint8_t *buf, uint16_t block_num, uint16_t count, bool write)
+{
+    memberio_t io[RAID_MEMBERS];
+    raid_t *raid;
+    uint32_t share, done;
+    uint8_t member, parts, index;
+    bool ok;
+
+    raid = drive->raid;
+    parts = 0;
+    for (member = 0; member < raid->count; member++)
+    {
+        if (__atomic_load_n(&raid->failed[member], __ATOMIC_RELAXED))
+            continue;
+
+        io[parts].member = member;
+        io[parts].op = write ? IO_WRITE : IO_READ;
+        io[parts].iovcnt = 1;
+        parts++;
+    }
+
+    if (!parts)
+        return false;
+
+    if (!write && parts > count / raid->chunk)
+    {
+        parts = count / raid->chunk ? count / raid->chunk : 1;
+        if (parts == 1)
+            io[0].member = least_busy(raid);
+    }
+
+    done = 0;
+    for (index = 0; index < parts; index++)
+    {
+        share = write ? count : (index == parts - 1 ? count - done : count / parts);
+        io[index].offset = ((off_t)block_num + (write ? 0 : done)) * BLOCK_SIZE;
+        io[index].len = (size_t)share * BLOCK_SIZE;
+        io[index].iov[0].iov_base = buf + (size_t)(write ? 0 : done) * BLOCK_SIZE;
+        io[index].iov[0].iov_len = io[index].len;
+        done += write ? 0 : share;
+    }
+
+    if (io[0].member == RAID_MEMBERS)
+        return false;
+
+    run_batch(raid, io, parts);
+
+    ok = !write;
+    for (index = 0; index < parts; index++)
+    {
+        if (io[index].ok)
+        {
+            ok = ok || write;
+            continue;
+        }
+
+        member_fail(drive, io[index].member);
+        if (write)
+            continue;
+
+        // a part that couldn't be read is read again from the others, one at a time
+        while ((member = least_busy(raid)) != RAID_MEMBERS && member != io[index].member)
+        {
+            io[index].member = member;
+            run_batch(raid, &io[index], 1);
+            if (io[index].ok)
+                break;
+
+            member_fail(drive, member);
+        }
+
+        ok = ok && io[index].ok;
+    }
+
+    return ok;
+}
+
+private bool raid_io(drive_t *drive, uint8_t *buf, uint16_t block_num, uint16_t count, bool write)
+{
+    bool ok;
+
+    if ((uint32_t)block_num + count > drive->blocks || (write && drive->readonly))
+        return false;
+
+    ok = drive->raid->mode == RAID_STRIPE ? stripe_io(drive, buf, block_num, count, write)
+                                          : mirror_io(drive, buf, block_num, count, write);
+    if (ok)
+        __atomic_fetch_add(write ? &drive->blocks_written : &drive->blocks_read, count, __ATOMIC_RELAXED);
+
+    return ok;
+}
+
 internal void d_show(drive_t *drive)
 {
     if (!drive)
@@ -95,37 +713,101 @@ internal void d_show(drive_t *drive)
     fprintf(stdout, "  File Descriptor : %d\n", drive->fd);
     fprintf(stdout, "  Number of Blocks: %u\n", drive->blocks);
     fprintf(stdout, "  Drive Number    : %u\n", drive->drive_num);
+    if (drive->raid)
+    {
+        fprintf(stdout, "  Layout          : %s of %u drives", drive->raid->mode == RAID_STRIPE ? "striped" : "mirrored",
+                drive->raid->count);
+        if (drive->raid->mode == RAID_STRIPE)
+            fprintf(stdout, ", %u blocks a chunk", drive->raid->chunk);
+        fprintf(stdout, "\n");
+    }
 
     return;
 }
 
 internal bool d_detach(drive_t *drive)
 {
+    raid_t *raid;
+    uint8_t member;
+
     if (!drive)
     {
         return false;
     }
 
-    attached &= ~(drive->drive_num); // turn off the drive number in the attached
+    // the members hold the drive numbers; they let them go as they're detached
+    if (drive->raid)
+    {
+        raid = drive->raid;
+        pthread_mutex_lock(&raid->lock);
+        raid->stop = true;
+        pthread_cond_broadcast(&raid->work);
+        pthread_mutex_unlock(&raid->lock);
+
+        for (member = 0; member < raid->count; member++)
+        {
+            pthread_join(raid->worker[member], NULL);
+            d_detach(raid->member[member]);
+        }
+
+        pthread_mutex_destroy(&raid->lock);
+        pthread_cond_destroy(&raid->work);
+        pthread_mutex_destroy(&drive->busy);
+        free(raid);
+        free(drive);
+        return true;
+    }
+
+    // a reader never claimed the drive's bit; closing the file drops it's lock either way
+    if (!drive->readonly)
+        __atomic_fetch_and(&attached, ~(drive->drive_num), __ATOMIC_ACQ_REL); // turn off the drive number in the attached
     close(drive->fd);
+    pthread_mutex_destroy(&drive->busy);
     free(drive);
 
     return true;
 }
 
+internal bool d_set_delay(drive_t *drive, uint32_t access_us, uint32_t block_us)
+{
+    uint8_t member;
+
+    if (!drive)
+    {
+        return false;
+    }
+
+    if (drive->raid)
+    {
+        for (member = 0; member < drive->raid->count; member++)
+            d_set_delay(drive->raid->member[member], access_us, block_us);
+        return true;
+    }
+
+    __atomic_store_n(&drive->access_us, access_us, __ATOMIC_RELAXED);
+    __atomic_store_n(&drive->block_us, block_us, __ATOMIC_RELAXED);
+    return true;
+}
+
 internal drive_t *d_attach(uint8_t drive_num)
+{
+    if (!d_is_drivenum_valid(drive_num))
+    {
+        return NULL;
+    }
+
+    return is_pow_of_two(drive_num) ? attach_file(drive_num) : attach_set(drive_num, false);
+}
+
+private drive_t *attach_file(uint8_t drive_num)
 {
     drive_t *drive;
     uint8_t *file;
     int ret;
     struct stat sbuf;
 
-    if (!(drive_num == DriveC || drive_num == DriveD))
-    {
-        return NULL;
-    }
-
-    if (attached & drive_num)
+    // claim the drive atomically, so two threads can't attach it at once
+    if (__atomic_fetch_or(&attached, drive_num, __ATOMIC_ACQ_REL) & drive_num)
     {
         // if already attached, return error
         return NULL;
@@ -134,6 +816,7 @@ internal drive_t *d_attach(uint8_t drive_num)
     drive = malloc(sizeof(drive_t));
     if (!drive)
     {
+        __atomic_fetch_and(&attached, ~drive_num, __ATOMIC_ACQ_REL);
         return NULL;
     }
 
@@ -141,6 +824,7 @@ internal drive_t *d_attach(uint8_t drive_num)
     if (!file)
     {
         free(drive);
+        __atomic_fetch_and(&attached, ~drive_num, __ATOMIC_ACQ_REL);
         return NULL;
     }
 
@@ -148,16 +832,19 @@ internal drive_t *d_attach(uint8_t drive_num)
     if (ret < 0)
     {
         free(drive);
+        __atomic_fetch_and(&attached, ~drive_num, __ATOMIC_ACQ_REL);
         perror("open");
         return NULL;
     }
     drive->fd = ret;
 
+    // the lock keeps out other processes, readers included
     ret = fstat(drive->fd, &sbuf);
-    if (ret < 0)
+    if (ret < 0 || flock(drive->fd, LOCK_EX | LOCK_NB) < 0)
     {
         close(drive->fd);
         free(drive);
+        __atomic_fetch_and(&attached, ~drive_num, __ATOMIC_ACQ_REL);
         return NULL;
     }
 
@@ -172,7 +859,334 @@ internal drive_t *d_attach(uint8_t drive_num)
     }
 
     drive->drive_num = drive_num;
-    attached |= drive_num;
+    drive->readonly = false;
+    drive_init(drive);
+
+    return drive;
+}
+
+// every member must carry a label of the same drive, and between them hold every place in it
+// with readonly set, every member is attached as d_attach_ro does, and nothing is written to any of them
+private drive_t *attach_set(uint8_t drive_num, bool readonly)
+{
+    drive_t *members[RAID_MEMBERS];
+    drive_t *ordered[RAID_MEMBERS];
+    uint32_t generation[RAID_MEMBERS];
+    drive_t *drive;
+    raidlabel_t first, label;
+    uint8_t block[BLOCK_SIZE];
+    uint8_t bit, count, index;
+
+    count = 0;
+    for (bit = 1; bit && count < RAID_MEMBERS; bit <<= 1)
+    {
+        if (!(drive_num & bit))
+            continue;
+
+        members[count] = readonly ? d_attach_ro(bit) : attach_file(bit);
+        if (!members[count])
+            goto fail;
+        count++;
+    }
+
+    zero(ordered, sizeof(ordered));
+    zero(&first, sizeof(raidlabel_t));
+    for (index = 0; index < count; index++)
+    {
+        if (!d_read(members[index], block, members[index]->blocks - 1))
+            goto fail;
+
+        copy(&label, block, sizeof(raidlabel_t));
+        if (!index)
+            first = label;
+
+        if (label.magic != RAID_MAGIC || label.set != first.set || label.mode != first.mode || label.chunk != first.chunk ||
+            label.usable != first.usable || label.count != count || label.index >= count || ordered[label.index] ||
+            label.usable > members[index]->blocks - 1 || !label.chunk)
+        {
+            fprintf(stderr, "Error -> %s doesn't belong with the rest of %s\n", d_getdrivename(members[index]->drive_num),
+                    d_getdrivename(drive_num));
+            goto fail;
+        }
+
+        ordered[label.index] = members[index];
+        generation[label.index] = label.generation;
+        if (label.generation > first.generation)
+            first.generation = label.generation;
+    }
+
+    // a member behind the rest was dropped from a mirror, and missed whatever was written since; a stripe never drops one
+    for (index = 0; index < count; index++)
+    {
+        if (generation[index] != first.generation && first.mode != RAID_MIRROR)
+        {
+            fprintf(stderr, "Error -> %s is behind the rest of %s\n", d_getdrivename(ordered[index]->drive_num), d_getdrivename(drive_num));
+            goto fail;
+        }
+    }
+
+    drive = raid_make(ordered, count, &first);
+    if (!drive)
+        goto fail;
+    drive->readonly = readonly;
+
+    // it's kept out of the drive until it's been brought up to date; one that can't be is left out for good
+    for (index = 0; index < count; index++)
+    {
+        if (generation[index] != first.generation)
+            drive->raid->failed[index] = true;
+    }
+
+    for (index = 0; index < count; index++)
+    {
+        if (generation[index] == first.generation)
+            continue;
+
+        if (readonly)
+        {
+            fprintf(stderr, "%s is behind the rest of %s, and is left out of it\n", d_getdrivename(ordered[index]->drive_num),
+                    d_getdrivename(drive_num));
+            continue;
+        }
+
+        fprintf(stderr, "%s is behind the rest of %s; bringing it up to date\n", d_getdrivename(ordered[index]->drive_num),
+                d_getdrivename(drive_num));
+        if (member_resync(drive, index))
+            drive->raid->failed[index] = false;
+        else
+            fprintf(stderr, "Error -> %s couldn't be brought up to date, and is left out of %s\n",
+                    d_getdrivename(ordered[index]->drive_num), d_getdrivename(drive_num));
+    }
+
+    return drive;
+
+fail:
+    while (count)
+        d_detach(members[--count]);
+    return NULL;
+}
+
+// a drive of count members, laid out as label says
+private drive_t *raid_make(drive_t **members, uint8_t count, raidlabel_t *label)
+{
+    drive_t *drive;
+    raid_t *raid;
+    uint8_t member;
+
+    drive = malloc(sizeof(drive_t));
+    raid = calloc(1, sizeof(raid_t));
+    if (!drive || !raid)
+    {
+        free(drive);
+        free(raid);
+        return NULL;
+    }
+
+    raid->mode = label->mode;
+    raid->count = count;
+    raid->chunk = label->chunk;
+    raid->usable = label->usable;
+    raid->set = label->set;
+    raid->generation = label->generation;
+    pthread_mutex_init(&raid->lock, NULL);
+    pthread_cond_init(&raid->work, NULL);
+
+    drive->fd = -1;
+    drive->drive_num = 0;
+    for (member = 0; member < count; member++)
+    {
+        raid->member[member] = members[member];
+        drive->drive_num |= members[member]->drive_num;
+    }
+
+    // a striped drive past what a block number reaches only uses as much as it does
+    if (raid->mode == RAID_STRIPE)
+        drive->blocks = (uint32_t)raid->usable * count > UINT16_MAX ? UINT16_MAX : raid->usable * count;
+    else
+        drive->blocks = raid->usable;
+
+    drive->readonly = false;
+    drive_init(drive);
+    drive->raid = raid;
+
+    for (member = 0; member < count; member++)
+    {
+        if (pthread_create(&raid->worker[member], NULL, member_worker, raid))
+        {
+            pthread_mutex_lock(&raid->lock);
+            raid->stop = true;
+            pthread_cond_broadcast(&raid->work);
+            pthread_mutex_unlock(&raid->lock);
+            while (member)
+                pthread_join(raid->worker[--member], NULL);
+
+            pthread_mutex_destroy(&raid->lock);
+            pthread_cond_destroy(&raid->work);
+            pthread_mutex_destroy(&drive->busy);
+            free(raid);
+            free(drive);
+            return NULL;
+        }
+    }
+
+    return drive;
+}
+
+internal drive_t *d_raid(drive_t **members, uint8_t count, uint8_t mode, uint16_t chunk)
+{
+    raidlabel_t label;
+    uint8_t block[BLOCK_SIZE];
+    uint16_t usable;
+    uint8_t index, taken;
+
+    if (!members || count < 2 || count > RAID_MEMBERS || (mode != RAID_STRIPE && mode != RAID_MIRROR))
+    {
+        return NULL;
+    }
+
+    chunk = chunk ? chunk : RAID_CHUNK;
+    usable = UINT16_MAX;
+    taken = 0;
+    for (index = 0; index < count; index++)
+    {
+        if (!members[index] || members[index]->readonly || members[index]->raid || members[index]->blocks < 2 ||
+            (taken & members[index]->drive_num))
+            return NULL;
+
+        taken |= members[index]->drive_num;
+        if (members[index]->blocks - 1 < usable)
+            usable = members[index]->blocks - 1;
+    }
+
+    // a striped drive only uses whole chunks of each member
+    if (mode == RAID_STRIPE)
+        usable -= usable % chunk;
+    if (!usable)
+        return NULL;
+
+    label.magic = RAID_MAGIC;
+    label.set = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+    label.mode = mode;
+    label.count = count;
+    label.chunk = chunk;
+    label.usable = usable;
+    label.generation = 0;
+    for (index = 0; index < count; index++)
+    {
+        label.index = index;
+        zero(block, BLOCK_SIZE);
+        copy(block, &label, sizeof(raidlabel_t));
+        if (!d_write(members[index], block, members[index]->blocks - 1) || !d_sync(members[index]))
+            return NULL;
+    }
+
+    return raid_make(members, count, &label);
+}
+
+internal drive_t *d_attach_ro(uint8_t drive_num)
+{
+    drive_t *drive;
+    uint8_t *file;
+    int ret;
+    struct stat sbuf;
+
+    if (!d_is_drivenum_valid(drive_num))
+    {
+        return NULL;
+    }
+
+    if (!is_pow_of_two(drive_num))
+    {
+        return attach_set(drive_num, true);
+    }
+
+    drive = malloc(sizeof(drive_t));
+    if (!drive)
+    {
+        return NULL;
+    }
+
+    file = strnum((uint8_t *)DRIVE_BASE_PATH, drive_num); // returns static memory (no need to free)
+    if (!file)
+    {
+        free(drive);
+        return NULL;
+    }
+
+    ret = open((const char *)file, O_RDONLY);
+    if (ret < 0)
+    {
+        free(drive);
+        perror("open");
+        return NULL;
+    }
+    drive->fd = ret;
+
+    // a shared lock lets in any number of readers, and keeps out d_attach in this process or any other
+    ret = fstat(drive->fd, &sbuf);
+    if (ret < 0 || flock(drive->fd, LOCK_SH | LOCK_NB) < 0)
+    {
+        close(drive->fd);
+        free(drive);
+        return NULL;
+    }
+
+    drive->blocks = is_pow_of_two(sbuf.st_blocks) ? sbuf.st_blocks : sbuf.st_blocks - 1;
+    drive->drive_num = drive_num;
+    drive->readonly = true;
+    drive_init(drive);
+
+    return drive;
+}
+
+// the drive lives in an anonymous memory file, so it's reads and writes cost no more than a copy; the drive's
+// own file is left alone, and nothing written to this one outlives d_detach
+internal drive_t *d_attach_mem(uint8_t drive_num, uint16_t blocks)
+{
+    drive_t *drive;
+    int ret;
+
+    if (!(drive_num == DriveC || drive_num == DriveD) || !blocks)
+    {
+        return NULL;
+    }
+
+    // claimed just as d_attach claims it, so the drive can't be attached both ways at once
+    if (__atomic_fetch_or(&attached, drive_num, __ATOMIC_ACQ_REL) & drive_num)
+    {
+        return NULL;
+    }
+
+    drive = malloc(sizeof(drive_t));
+    if (!drive)
+    {
+        __atomic_fetch_and(&attached, ~drive_num, __ATOMIC_ACQ_REL);
+        return NULL;
+    }
+
+    ret = memfd_create(d_getdrivename(drive_num), MFD_CLOEXEC);
+    if (ret < 0)
+    {
+        free(drive);
+        __atomic_fetch_and(&attached, ~drive_num, __ATOMIC_ACQ_REL);
+        perror("memfd_create");
+        return NULL;
+    }
+    drive->fd = ret;
+
+    // a memory file reads as zeroes up to it's size
+    if (ftruncate(drive->fd, (off_t)blocks * BLOCK_SIZE) < 0)
+    {
+        close(drive->fd);
+        free(drive);
+        __atomic_fetch_and(&attached, ~drive_num, __ATOMIC_ACQ_REL);
+        return NULL;
+    }
+
+    drive->blocks = blocks;
+    drive->drive_num = drive_num;
+    drive->readonly = false;
+    drive_init(drive);
 
     return drive;
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define FILESYS_H
 
 #include <stdint.h>
+#include <pthread.h>
 #include <base.h>
 #include <disk.h>
 
@@ -11,22 +12,28 @@
  * filesystem structure overview:
  *
  * block 0: superblock (contains metadata about the entire filesystem)
- * block 1 to n: inode blocks (each block contains 16 inodes, 32 bytes each)
- * block n+1 onwards: data blocks (actual file content and indirect pointer blocks)
+ * block 1 to n: inode blocks (each block contains 8 inodes, 64 bytes each)
+ * block n+1 to m: the allocation bitmap and the block reference counts, as saved by the last clean unmount,
+ *                 followed by the name index (a hash table from file name to inode)
+ * block m+1 onwards: data blocks (actual file content and indirect pointer blocks)
  *
  * each file is represented by an inode that contains:
  * - file metadata (name, size, type)
  * - 8 direct pointers to data blocks (for small files)
  * - 1 indirect pointer to a block containing 256 more data block pointers (for large files)
+ * - 1 double indirect pointer to a block containing 256 indirect block pointers
+ * - 1 triple indirect pointer to a block containing 256 double indirect block pointers
  *
- * this allows files up to: (8 + 256) * 512 = 135,168 bytes (~132kb) per file
+ * the pointers can address (8 + 256 + 256^2 + 256^3) * 512 bytes (~8gb) per file; the 32-bit
+ * file size caps that at 4gb, and with 16-bit block numbers a whole drive tops out at ~32mb anyway,
+ * so in practice a single file can grow to fill the drive
  */
 
 /*
 
 Block 1 to n are inode blocks.
 They are 10% (rounded up) of the total blocks on the drive.
-Each inode block contains 16, 32-byte inodes, indexed from 0 to 31 (inode_index_in_block)
+Each inode block contains 8, 64-byte inodes, indexed from 0 to 7 (inode_index_in_block)
 The inode index of an inode is given by ((inode_block_index - 1) * INODES_PER_BLOCK) + inode_index_in_block
 The inode block index of an inode is given by (inode_index / INODES_PER_BLOCK) + 1
 All indexes START from 0.
@@ -51,28 +58,120 @@ All indexes START from 0.
 // filesystem constants
 #define FILENAME_LEN (8)       // maximum filename length (8.3 format)
 #define FILEEXT_LEN (3)        // maximum file extension length
-#define BOOT_SECTOR_SIZE (500) // boot code area size in superblock
+#define BOOT_SECTOR_SIZE (380) // boot code area size in superblock
 
 // magic numbers for filesystem validation
 #define MAGIC1 (0xdd05) // first magic number to identify valid filesystem
 #define MAGIC2 (0xaa55) // second magic number (common boot signature)
 
+// on-disk format version; a volume of any other is refused, since it's inodes and pointer blocks can't be read
+// the same way. 1 is the first with 64-byte inodes, a 32-bit file size and double and triple indirect pointers;
+// on a volume from before, the field is part of the boot code (0 unless it was given any)
+#define FS_VERSION (1)
+
+#define STATE_CLEAN (0xc1ea) // superblock state of a volume unmounted cleanly; anything else means the saved bitmap can't be trusted
+
+// superblock features
+#define FEATURE_CSUM (0x0001) // the superblock, inodes and pointer, extent and xattr blocks carry crc32c checksums
+
 // layout constants
-#define INODES_PER_BLOCK (16) // how many 32-byte inodes fit in each 512-byte block
-#define PTR_PER_INODE (8)     // direct data block pointers per inode
-#define PTR_PER_BLOCK (256)   // indirect pointers per block (512 bytes / 2 bytes per pointer)
+#define INODES_PER_BLOCK (8) // how many 64-byte inodes fit in each 512-byte block
+#define PTR_PER_INODE (8)    // direct data block pointers per inode
+#define PTR_PER_BLOCK (256)  // indirect pointers per block (512 bytes / 2 bytes per pointer)
+#define INODE_RESERVED (5)   // unused bytes at the end of an inode, kept for future fields
+#define INODE_VERSION (1)    // inodes written before link counts are version 0 and have a single name
+
+// lazy inode table initialization
+#define LAZY_INIT_CHUNK (64)      // inode blocks zeroed by a single write
+#define LAZY_INIT_PAUSE_US (1000) // pause of the background zeroing between chunks, leaving the drive to foreground I/O
+
+// locking
+#define INODE_LOCKS (64)  // reader/writer locks striped over the inodes (inode i uses lock i % INODE_LOCKS)
+#define IBLOCK_LOCKS (16) // mutexes striped over the inode blocks, guarding their read-modify-write
+
+// write-back
+#define WB_BLOCKS (512)          // dirty blocks held in memory at most; a write finding no room syncs first
+#define WB_BUCKETS (1024)        // hash chains of the dirty block table
+#define WB_FREED_WORDS (1024)    // 64-bit words of a bitmap of every block a drive can have
+#define SYNC_RUN (64)            // most blocks a sync writes with a single d_write_run
+#define FLUSH_INTERVAL_MS (5000) // default period of the background flusher
+#define FLUSH_DIRTY_RATIO (50)   // default percentage of WB_BLOCKS dirty at which the flusher is woken early
+
+// block sharing
+#define REFS_MAX (UINT8_MAX)  // most extra references a block can carry
+#define DEDUP_BUCKETS (4096)  // hash chains of the dedup index
+
+// name index
+#define NAMES_PER_BLOCK (39) // name index entries held by a single block
+
+// defragmentation
+#define DEFRAG_WINDOW (256) // blocks of a file the defragmenter copies in one go
+
+// long file names
+#define LONG_NAME_LEN (255) // longest long file name
+
+// extended attributes
+#define XATTR_KEY_LEN (255)   // longest key of an extended attribute
+#define XATTR_VALUE_LEN (255) // longest value of an extended attribute
+#define XATTRS_PER_BLOCK (63) // most extended attributes a file can have, bounded by the entries of it's xattr block
+
+// checksums
+#define SUMS_PER_BLOCK (BLOCK_SIZE / 4) // block checksums held by a single block of the checksum table
+
+// scrubbing
+#define SCRUB_RUN (64)          // blocks in use the scrubber reads in one go
+#define SCRUB_CHECKPOINT (4096) // blocks scrubbed between saves of the scrubber's progress to the superblock
+#define SCRUB_YIELD_MS (20)     // pause of the scrubber whenever it finds the drive was used by others since it last looked
+#define SCRUB_YIELD_MAX (10)    // pauses in a row after which the scrubber reads a run anyway, so a busy volume is scrubbed slowly rather than never
+
+// space accounting
+#define QUOTA_OWNERS (16) // owners files can be charged to; owner 0 is the default
+#define RESV_SLOTS (64)   // files that can hold a space reservation at once
+
+// number of file blocks reachable through each level of pointers
+#define DIRECT_BLOCKS (PTR_PER_INODE)
+#define INDIRECT_BLOCKS (PTR_PER_BLOCK)
+#define DINDIRECT_BLOCKS ((uint32_t)PTR_PER_BLOCK * PTR_PER_BLOCK)
+#define TINDIRECT_BLOCKS ((uint32_t)PTR_PER_BLOCK * PTR_PER_BLOCK * PTR_PER_BLOCK)
+
+#define EXTENTS_PER_INODE (5)   // (start, length) extents stored inside an extent inode
+#define EXTENTS_PER_BLOCK (127) // extents held by an extent block, after it's 4-byte header
+#define INLINE_DATA_LEN (22)    // bytes of file data an inline inode holds in place of it's block mapping
 
 // bootsec_t is an alias for the type uint8_t[BOOT_SECTOR_SIZE], i.e, an array of BOOT_SECTOR_SIZE bytes
 typedef uint8_t bootsec_t[BOOT_SECTOR_SIZE];
 
+/*
+ * quota of an owner: the blocks charged to it's files, and the most it may have
+ * a file is charged a block for every BLOCK_SIZE bytes of it's size (holes included), and an inline file nothing
+ */
+typedef struct packed
+{
+    uint32_t used;  // blocks charged; only up to date on a clean volume
+    uint16_t limit; // most blocks the owner may be charged; 0 for no limit
+} quota_t;          // packed ensures this structure is always 6 bytes
+
 /*
  * superblock: the first block (block 0) of the filesystem
  * contains all metadata needed to understand the filesystem layout
  */
 typedef struct packed
 {
-    bootsec_t boot_sector; // space for bootloader code
-    uint16_t reserved;     // padding/future use
+    bootsec_t boot_sector;  // space for bootloader code
+    uint16_t version;       // FS_VERSION of the format the volume was made with
+    uint16_t scrub_next;    // block an interrupted scrub carries on from; 0 if none is under way
+    uint32_t checksum;      // crc32c of the rest of the superblock, if features has FEATURE_CSUM
+    uint16_t features;      // FEATURE_ flags the volume was formatted with
+    uint16_t sums_blocks;   // blocks of the checksum table, right after the name index; 0 on a volume that has none
+    quota_t quota[QUOTA_OWNERS]; // per owner usage and limit
+    uint16_t used_blocks;   // blocks in use as of the last clean unmount; 0 on a volume that never recorded it
+    uint16_t names_blocks;  // blocks of the name index, right after the reference counts; 0 on a volume that has none
+    uint16_t bitmap_start;  // first block of the saved allocation bitmap
+    uint16_t bitmap_blocks; // blocks of the saved allocation bitmap; 0 on a volume that has none
+    uint16_t state;         // STATE_CLEAN if the saved bitmap and reference counts are up to date
+    uint16_t refs_blocks;   // blocks of saved reference counts, right after the bitmap; 0 on a volume without block sharing
+    uint16_t inode_init;    // inode blocks 1 to inode_init hold valid inodes, the rest are still to be zeroed;
+                            // 0 means all of them are (an eagerly formatted volume)
     uint16_t blocks;       // total blocks in filesystem
     uint16_t inode_blocks; // how many blocks are used for inodes
     uint16_t inodes;       // total number of inodes currently used (and NOT the total possible number of inodes)
@@ -103,6 +202,29 @@ typedef struct packed
 #define TYPE_FILE 0x01
 #define TYPE_DIR 0x03
 
+// the low nibble of file_type is the type itself, the high nibble holds flags
+// describing how the file's data is laid out
+#define TYPE_MASK 0x0f
+#define FLAG_EXTENTS 0x10 // data is mapped by extents instead of block pointers
+#define FLAG_INLINE 0x20  // data lives inside the inode itself; cleared once the file outgrows it
+#define FLAG_LINK 0x40    // the inode is only another name for the inode in target and holds no data of it's own
+#define FLAG_NONAME 0x80  // the inode's own name was unlinked; it lives on for it's links, or as an orphan until freed
+
+#define inode_type(inode) ((inode)->file_type & TYPE_MASK)
+// names the file goes by; a version 0 inode has just it's own
+#define inode_links(inode) ((inode)->version ? (inode)->links : 1)
+
+/*
+ * extent: a run of length contiguous blocks starting at block start
+ * extents are kept in file order and leave no holes, so the file block an extent
+ * begins at is the sum of the lengths of all the extents before it
+ */
+typedef struct packed
+{
+    uint16_t start;  // first drive block of the run
+    uint16_t length; // number of blocks in the run; 0 marks an unused extent
+} extent_t;          // packed ensures this structure is always 4 bytes
+
 /*
  * inode: represents a single file or directory
  * contains all metadata and pointers to locate the file's data
@@ -112,24 +234,319 @@ typedef struct packed
     // file status and type information packed into single byte
     uint8_t file_type;
 
-    uint16_t file_size;                 // file size in bytes
+    uint32_t file_size;                 // file size in bytes
     filename_t file_name;               // file name and extension
-    uint16_t indirect_ptr;              // block number of a block containing 256 data block numbers
-    uint16_t direct_ptr[PTR_PER_INODE]; // block numbers of the first 8 data blocks
-} inode_t;                              // packed ensures this structure is always 32 bytes
+
+    // the 22 bytes of block mapping are either pointers, extents (FLAG_EXTENTS set)
+    // or the file data itself (FLAG_INLINE set)
+    union packed
+    {
+        struct packed
+        {
+            uint16_t indirect_ptr;              // block number of a block containing 256 data block numbers
+            uint16_t direct_ptr[PTR_PER_INODE]; // block numbers of the first 8 data blocks
+            uint16_t dindirect_ptr;             // block number of a block containing 256 indirect block numbers
+            uint16_t tindirect_ptr;             // block number of a block containing 256 double indirect block numbers
+        };
+        struct packed
+        {
+            extent_t extent[EXTENTS_PER_INODE]; // the first extents of the file
+            uint16_t extent_ptr;                // block number of the first extent block holding the rest
+        };
+        uint8_t inline_data[INLINE_DATA_LEN]; // contents of a file of at most INLINE_DATA_LEN bytes
+    };
+
+    uint8_t owner;                    // quota owner the file is charged to, below QUOTA_OWNERS
+    uint16_t xattr_ptr;               // block number of the file's xattr block; 0 if it has no extended attributes
+    uint32_t lname_hash;              // xxh32 of the long name
+    uint32_t lname_off;               // byte offset of the long name's record in the name heap
+    uint8_t lname_len;                // bytes of long name; 0 if the file only has it's 8.3 name
+    uint8_t version;                  // INODE_VERSION for inodes carrying links and target
+    uint16_t links;                   // names the file goes by: it's own (unless FLAG_NONAME) and one per link inode
+    uint16_t target;                  // inode a FLAG_LINK inode is another name for
+    uint32_t checksum;                // crc32c of the rest of the inode, seeded with it's index, if the volume has FEATURE_CSUM
+    uint8_t reserved[INODE_RESERVED]; // padding/future use
+} inode_t;                              // packed ensures this structure is always 64 bytes
+
+/*
+ * extent block: spills the extents of a file that don't fit inside it's inode
+ * extent blocks of a file are chained together through next
+ */
+typedef struct packed
+{
+    uint16_t extents;                   // number of extents in use in this block
+    uint16_t next;                      // block number of the next extent block; 0 if this is the last
+    extent_t extent[EXTENTS_PER_BLOCK]; // extents continuing on from the previous block (or the inode)
+} extblock_t;                           // packed ensures this structure is always BLOCK_SIZE (512 bytes)
+
+/*
+ * xattr block entry: where an extended attribute's key lives in it's xattr block, with it's value right after it
+ */
+typedef struct packed
+{
+    uint32_t hash;     // xxh32 of the key
+    uint16_t offset;   // byte offset of the key within the block
+    uint8_t key_len;   // bytes of key, 1 to XATTR_KEY_LEN
+    uint8_t value_len; // bytes of value, 0 to XATTR_VALUE_LEN
+} xattrent_t;          // packed ensures this structure is always 8 bytes
+
+/*
+ * xattr block: the extended attributes of a file
+ * the entries are sorted by key hash (and by key among equal hashes), so a single attribute is found
+ * by a binary search that only compares keys whose hashes match; the keys and values follow the
+ * last entry in the same order, and the rest of the block is zero. a set of attributes thus always
+ * makes up the same block, which lets files with identical sets share a single one
+ */
+typedef struct packed
+{
+    uint16_t count;                     // number of entries in use
+    uint16_t used;                      // bytes of the block in use: the header, the entries, and the keys and values
+    xattrent_t entry[XATTRS_PER_BLOCK]; // entries in use, followed by their keys and values
+    uint8_t reserved[4];                // padding/future use
+} xattrblock_t;                         // packed ensures this structure is always BLOCK_SIZE (512 bytes)
+
+/*
+ * name heap record: a long file name, kept in the name heap that makes up the data of it's directory
+ * (the root directory, the only one there is); the records follow each other back to back from the
+ * start of the heap, and a file refers to it's own by offset and length
+ */
+typedef struct packed
+{
+    uint16_t inode; // inode carrying the name; 0 marks free space
+    uint32_t size;  // bytes of the record, this header and the name (and any slack after it) included
+} heaprec_t;        // packed ensures this structure is always 6 bytes
+
+/*
+ * name index entry: a file name and the inode that carries it; an inode of 0 marks an unused entry
+ */
+typedef struct packed
+{
+    uint16_t inode;       // inode index
+    filename_t file_name; // file name and extension, in 8.3 format
+} nameent_t;              // packed ensures this structure is always 13 bytes
+
+/*
+ * name index block: a bucket of the on-disk name index
+ * a name hashes to a single block; when that block is full the entry goes into the next one with
+ * room (wrapping around), and every block passed over is marked spilled, so a lookup knows to carry on
+ */
+typedef struct packed
+{
+    uint8_t spilled;                  // nonzero if entries that hash here may live in the following blocks
+    nameent_t entry[NAMES_PER_BLOCK]; // entries of this bucket
+    uint8_t reserved[4];              // padding/future use
+} nameblock_t;                        // packed ensures this structure is always BLOCK_SIZE (512 bytes)
+
+/*
+ * directory entry: one packed record filled in by fs_readdir_batch
+ */
+typedef struct packed
+{
+    uint16_t inode;        // inode index
+    uint8_t file_type;     // file_type of the inode, flags included
+    uint32_t file_size;    // file size in bytes
+    filename_t file_name;  // file name and extension, in 8.3 format (not null-terminated)
+    uint32_t lname_hash;   // xxh32 of the long name, if lname_len isn't 0
+    uint8_t lname_len;     // bytes of long name; 0 if the file only has it's 8.3 name
+} dirent_t;                // packed ensures this structure is always 23 bytes
+
+// blocks 0 to last_meta_block(sb) hold the superblock, the inode table, the saved bitmap and reference counts,
+// the name index and the checksum table
+#define last_meta_block(sb) ((uint32_t)(sb)->inode_blocks + (sb)->bitmap_blocks + (sb)->refs_blocks + (sb)->names_blocks + (sb)->sums_blocks)
+#define refs_start(sb) ((sb)->bitmap_start + (sb)->bitmap_blocks)
+#define names_start(sb) (refs_start(sb) + (sb)->refs_blocks)
+#define sums_start(sb) (names_start(sb) + (sb)->names_blocks)
 
 typedef uint8_t *bitmap_t; // any bitmap_t variable is passed as a reference by defaul
 
+/*
+ * progress of a scrub, filled in by fs_scrub_status; the counts are of the pass under way (or the last one)
+ */
+typedef struct
+{
+    uint32_t checked;    // blocks in use read off the drive and checked; every copy of a mirrored drive counts
+    uint32_t skipped;    // blocks passed over because a newer copy was waiting to be written over them
+    uint32_t bad;        // superblock, inode, pointer, extent and xattr blocks that didn't match their checksums
+    uint32_t unreadable; // blocks the drive couldn't read
+    uint32_t repaired;   // of the bad and unreadable blocks, those written again from a good copy
+    uint32_t next;       // block the pass carries on from
+    uint32_t passes;     // passes completed since the mount
+    bool running;        // a pass is under way
+} scrub_t;
+
+/*
+ * a block written through the filesystem, held in memory until a sync writes it to the drive
+ */
+typedef struct
+{
+    uint16_t blocknum;
+    int16_t next;             // next entry of the same hash chain (or of the free list); -1 ends it
+    uint32_t gen;             // bumped by every write, so a sync can tell if the block changed while it was written out
+    uint8_t data[BLOCK_SIZE];
+} wbuf_t;
+
+/*
+ * the dedup index: data blocks of pointer-mapped files, chained by the hash of their contents
+ * block 0 never holds data, so it ends a chain
+ */
+typedef struct
+{
+    uint16_t chain[DEDUP_BUCKETS]; // first block of each hash chain
+    uint16_t *next;                // per block: next block of the same chain
+    uint32_t *hash;                // per block: xxh32 of it's contents, while it's indexed
+    bitmap_t indexed;              // blocks in the index
+    uint32_t hits;                 // block writes mapped onto an existing block
+} dedup_t;
+
+/*
+ * free space of the name heap, as runs of free records (adjacent ones merged) in offset order
+ */
+typedef struct
+{
+    uint32_t offset;
+    uint32_t size;
+} heapspan_t;
+
+typedef struct
+{
+    heapspan_t *free;  // free runs
+    uint32_t count;    // entries of free in use
+    uint32_t capacity; // room in free
+} nameheap_t;
+
+/*
+ * space set aside for the upcoming writes to a file
+ */
+typedef struct
+{
+    uint16_t inode;  // file holding the reservation; 0 marks an unused slot
+    uint32_t blocks; // blocks still promised to it, those for the pointers or extents mapping it's data included
+} resv_t;
+
+/*
+ * the dirty block table: every block written since the last sync, hashed by block number
+ */
+typedef struct
+{
+    wbuf_t buf[WB_BLOCKS];
+    int16_t chain[WB_BUCKETS]; // first entry of each hash chain; -1 if it's empty
+    int16_t free;              // first unused entry; -1 if there is none
+    uint16_t count;            // entries in use
+    uint32_t synced;           // bumped whenever a sync drops entries that reached the drive
+    uint64_t freed[2][WB_FREED_WORDS]; // blocks freed since the last full sync began ([0]) and since the one before it ([1]);
+                                       // the inodes on the drive may still point at them, so a data-only sync leaves them be
+} wback_t;
+
 /*
  * filesystem descriptor: main structure for mounted filesystem
  * contains all information needed to access files on this filesystem
+ *
+ * it is never written to the drive, so it isn't packed; the locks inside need their natural alignment
+ *
+ * locking: fs_read takes the inode's lock shared, fs_write and fs_delete take it exclusive;
+ * fs_get_inode/fs_put_inode/fs_create hold the inode block's mutex for the length of a block
+ * read-modify-write; the bitmap is only ever changed with atomic operations on it's 64-bit words,
+ * so allocating and freeing blocks takes no lock at all
+ *
+ * writes land in the dirty block table (under wback_lock) and only reach the drive when fs_sync
+ * runs, either called directly, by the background flusher, or by a write that finds the table full
+ *
+ * a data block of a pointer-mapped file can be shared; refs holds the number of references
+ * each block has beyond the first, and is changed with atomic operations. a write to a shared
+ * block copies it first. blocks become shared through the dedup index, under dedup_lock, and
+ * through fs_clone, under the source inode's lock
+ *
+ * an xattr block is shared the same way, by every file with the same set of extended attributes:
+ * a file changing it's set looks for the new one in xattrs, under xattr_lock, and rewrites it's
+ * own block in place only if nobody else has it
+ *
+ * a read-only mount takes none of these locks, as nothing it can see ever changes
+ *
+ * the name index is changed along with the inode table, by fs_create and fs_put_inode while they
+ * hold the inode block's mutex, and is itself guarded by names_lock
+ *
+ * the name heap, and heap along with it, is guarded by the lock of the root directory whose data it is;
+ * that lock is never held along with the lock of any other file, so a new long name is written to the
+ * heap first and only then taken up by it's file, and an old one is freed once the file has let go of it
+ *
+ * free_blocks follows every change to the bitmap and usage every change to an inode's size or owner,
+ * both with atomic operations. a write first claims the most blocks it could need out of those
+ * neither free nor reserved (or out of it's file's reservation), under quota_lock, and gives back
+ * what's left of the claim when it's done; so a reservation is never eaten into by other writes.
+ * anything that adds to an owner's charge claims the difference in held the same way, so two changes
+ * under way can't both fit in the room left under the owner's limit
+ *
+ * a file whose last name is unlinked goes on orphans, under orphan_lock, and is freed by the next sync; an
+ * orphan left behind by a crash is found again by the mount scan, which marks it's blocks like any other's.
+ * orphans live only in memory, so one that couldn't be queued (or freed) sets orphans_lost, and the unmount then
+ * leaves the volume unclean for the next mount to scan; a clean volume never has an orphan on it
+ *
+ * the checksum of a pointer, extent or xattr block in sums is set along with the block, under the exclusive lock
+ * of the file it maps, and cleared when the block is freed; blocks read from the drive are checked against it
+ *
+ * the scrubber reads the drive behind everybody's back, taking no file lock; a block with a newer copy in the
+ * dirty block table is passed over, and it's checked against the checksum that went with the copy it read,
+ * as blk_read_run does. it's progress is saved in the superblock, under super_lock
  */
-typedef struct packed
+typedef struct
 {
-    uint8_t drive_num;        // which physical drive this filesystem is on
-    drive_t *drive;           // pointer to drive hardware descriptor
-    bitmap_t bitmap;          // free/used block tracking bitmap (bit r of bitmap is linked to block r; 0 <= r < block_num)
-    superblock_t super_block; // copy of superblock for quick access
+    uint8_t drive_num;                          // which physical drive this filesystem is on
+    drive_t *drive;                             // pointer to drive hardware descriptor
+    bitmap_t bitmap;                            // free/used block tracking bitmap (bit r of bitmap is linked to block r; 0 <= r < block_num)
+    superblock_t super_block;                   // copy of superblock for quick access
+    uint8_t *occupancy;                         // number of inodes in use in each inode block (entry 0 is inode block 1)
+    uint16_t inode_init;                        // inode blocks 1 to inode_init are initialized; the rest read as empty
+    pthread_mutex_t super_lock;                 // serializes writes of the superblock
+    pthread_t init_thread;                      // zeroes the rest of the inode table in the background
+    bool init_running;                          // true while init_thread has to be joined
+    bool init_stop;                             // asks init_thread to stop early
+    pthread_rwlock_t inode_locks[INODE_LOCKS];  // per-inode reader/writer locks
+    pthread_mutex_t iblock_locks[IBLOCK_LOCKS]; // per-inode-block mutexes
+    wback_t *wback;                             // blocks written since the last sync
+    uint32_t bitmap_dirty;                      // bit i is set if block i of the saved bitmap is out of date
+    uint8_t *refs;                              // extra references of each block; NULL if the volume has no room to save them
+    uint64_t refs_dirty[2];                     // bit i is set if block i of the saved reference counts is out of date
+    uint32_t *sums;                             // crc32c of each pointer, extent and xattr block, 0 for any other block;
+                                                // NULL if the volume has no checksum table
+    uint64_t sums_dirty[8];                     // bit i is set if block i of the checksum table is out of date
+    dedup_t *dedup;                             // NULL unless dedup is on
+    uint8_t *view;                              // the metadata blocks mapped read-only, shared with the drive's other read-only mounts;
+                                                // NULL unless this is one
+    pthread_mutex_t dedup_lock;                 // guards dedup
+    dedup_t *xattrs;                            // the xattr blocks written or read this mount, by content; NULL until the first
+    pthread_mutex_t xattr_lock;                 // guards xattrs
+    uint16_t names_blocks;                      // blocks of the name index; 0 if the volume has none
+    pthread_mutex_t names_lock;                 // guards the name index
+    nameheap_t *heap;                           // free space of the name heap; NULL until a long name is first added or removed
+    uint16_t *orphans;                          // inodes left without a name, waiting for a sync to free them
+    uint32_t orphan_count;                      // entries of orphans in use
+    uint32_t orphan_room;                       // entries orphans has room for
+    bool orphans_lost;                          // an orphan is on the drive that orphans doesn't have
+    pthread_mutex_t orphan_lock;                // guards orphans
+    pthread_mutex_t wback_lock;                 // guards wback
+    uint64_t cache_lookups;                     // blocks looked for in wback by single-block reads
+    uint64_t cache_hits;                        // of those, blocks found there (or in the view), so the drive wasn't read
+    pthread_mutex_t sync_lock;                  // lets a single sync run at a time
+    uint32_t free_blocks;                       // blocks not in use
+    uint32_t usage[QUOTA_OWNERS];               // blocks charged to each owner
+    uint32_t held[QUOTA_OWNERS];                // blocks claimed against each owner's limit by changes under way
+    uint32_t reserved;                          // blocks claimed by reservations and by writes under way
+    resv_t resv[RESV_SLOTS];                    // reservations held by files
+    uint16_t resv_count;                        // slots of resv in use
+    pthread_mutex_t quota_lock;                 // guards held, reserved and resv
+    pthread_mutex_t flush_lock;                 // guards the flusher fields below
+    pthread_cond_t flush_cond;                  // wakes the flusher early
+    pthread_t flush_thread;                     // syncs in the background
+    bool flush_running;                         // true while flush_thread has to be joined
+    bool flush_stop;                            // asks flush_thread to stop
+    uint32_t flush_interval;                    // milliseconds between background syncs
+    uint8_t flush_ratio;                        // percentage of WB_BLOCKS dirty at which the flusher runs early
+    pthread_t scrub_thread;                     // scrubs the blocks in use in the background
+    bool scrub_running;                         // true while scrub_thread has to be joined
+    bool scrub_stop;                            // asks scrub_thread to stop, saving where it got to
+    uint32_t scrub_rate;                        // most blocks scrubbed per second; 0 for no limit
+    scrub_t scrub;                              // progress of the scrub
+    pthread_mutex_t scrub_lock;                 // guards scrub
 } filesys_t;
 
 /*
@@ -141,21 +558,245 @@ typedef union
     superblock_t superblock;         // when block 0 contains filesystem metadata
     uint8_t data[BLOCK_SIZE];        // when block contains raw file data
     uint16_t ptr[PTR_PER_BLOCK];     // when block contains indirect pointers
-    inode_t inode[INODES_PER_BLOCK]; // when block contains inode data (though typically 16 per block)
+    inode_t inode[INODES_PER_BLOCK]; // when block contains inode data (8 per block)
+    extblock_t extblock;             // when block contains the spilled extents of a file
+    nameblock_t names;               // when block is a bucket of the name index
+    xattrblock_t xattrs;             // when block holds the extended attributes of a file
 } datablock_t;                       // this data type is always BLOCK_SIZE (512 bytes)
 
+/*
+ * consistency report filled in by fs_check
+ */
+typedef struct
+{
+    uint32_t inodes;          // inodes in use
+    uint32_t blocks_read;     // blocks read off the drive during the check
+    uint32_t duplicate;       // blocks referenced more often than their reference count allows (or less often)
+    uint32_t out_of_range;    // pointers past the end of the drive
+    uint32_t into_inodes;     // pointers into the superblock, the inode blocks, the saved bitmap and reference counts, the name index or the checksum table
+    uint32_t size_mismatch;   // inodes whose file size disagrees with the blocks they map
+    uint32_t bitmap_mismatch; // blocks the allocation bitmap has in the wrong state
+    uint32_t bad_checksum;    // superblock, inodes and pointer, extent and xattr blocks that don't match their checksum
+    uint32_t bad_name;        // long names whose record in the name heap is missing or doesn't match them
+    uint32_t bad_links;       // link counts that disagree with the links found, and links to inodes that aren't files
+} fsck_t;
+
+/*
+ * report filled in by fs_defrag; an extent here is a run of contiguous blocks of a file, whichever way it's mapped
+ */
+typedef struct
+{
+    uint32_t files;          // files with data in blocks
+    uint32_t fragmented;     // files found in more than one extent
+    uint32_t moved;          // files rewritten into contiguous blocks
+    uint32_t skipped;        // fragmented files left as they were: extent-mapped, sharing blocks, sparse, or with no free run to go to
+    uint32_t blocks_moved;   // data blocks copied
+    uint32_t extents_before; // extents over all files before the run
+    uint32_t extents_after;  // and after it
+} defrag_t;
+
+/*
+ * free space report filled in by fs_space
+ */
+typedef struct
+{
+    uint32_t blocks;    // blocks on the drive
+    uint32_t free;      // blocks not in use
+    uint32_t reserved;  // free blocks promised to reservations (and writes under way)
+    uint32_t available; // free blocks a write without a reservation can have
+} space_t;
+
+/*
+ * I/O counters filled in by fs_stats, counted from the time the drive was attached
+ */
+typedef struct
+{
+    uint64_t blocks_read;    // blocks read off the drive
+    uint64_t blocks_written; // blocks written to the drive
+    uint64_t cache_lookups;  // single-block reads of metadata and data going through the filesystem
+    uint64_t cache_hits;     // of those, reads served from memory without going to the drive
+} fsstats_t;
+
+#define fsck_errors(report) ((report)->duplicate + (report)->out_of_range + (report)->into_inodes + \
+                             (report)->size_mismatch + (report)->bitmap_mismatch + (report)->bad_checksum + \
+                             (report)->bad_name + (report)->bad_links)
+
 public
 void filesys_test(drive_t *drive);
 
+// fs_mount, fs_get_inode, fs_put_inode, fs_create, fs_delete, fs_read, fs_write and fs_readdir_batch are
+// recorded while a trace is running (see trace.h)
+
 internal bitmap_t fs_mkbitmap(filesys_t *filesys, bool scan); // returns NULL upon failure
 internal void fs_dltbitmap(bitmap_t bitmap);                  // destroys bitmap
-internal filesys_t *fs_format(drive_t *drive, bootsec_t *boot_sector, bool force);
+internal filesys_t *fs_format(drive_t *drive, bootsec_t *boot_sector, bool force, bool lazy); // with lazy set, only the superblock and the first inode block are written,
+                                                                                                  // and the rest of the inode table is zeroed in the background or on first use
 internal uint16_t fs_first_free(filesys_t *filesys);                                  // returns the blocknum of the first free block in the filesystem; returns 0 on error
+                                                                                      // another thread may take the block before the caller does; alloc_block retries until it wins one
 internal void fs_show(filesys_t *filesys, bool show_bitmap);                          // prints filesystem metadata
 internal bool fs_get_inode(filesys_t *filesys, uint16_t inode_index, inode_t *inode); // inode index starts from 0; returns false if inode_index is out of range; gets the inode with index inode_index
+internal bool fs_put_inode(filesys_t *filesys, uint16_t inode_index, inode_t *inode); // writes inode back to the inode with index inode_index; returns false on failure
+
+// data path
+// fs_bmap maps the block file_block of the file onto a drive block, returning 0 for a hole (or on error);
+// with alloc set, missing data and indirect blocks are allocated on the way down and, if fresh is
+// non-NULL, *fresh tells whether the returned data block was just allocated (it's contents are garbage)
+// the caller owns inode, must hold it's lock exclusively when alloc is set, and must write it back
+// with fs_put_inode if it changed
+internal uint16_t fs_bmap(filesys_t *filesys, inode_t *inode, uint32_t file_block, bool alloc, bool *fresh);
+internal uint16_t fs_create(filesys_t *filesys, filename_t *name, uint8_t file_type); // returns the new inode index; returns 0 on error (0 is always the root directory)
+                                                                                      // with FLAG_INLINE, the file starts out stored inside it's inode and moves to
+                                                                                      // blocks (mapped by extents if FLAG_EXTENTS is set too) when it grows too large
+internal bool fs_delete(filesys_t *filesys, uint16_t inode_index);                     // frees the inode and every block it references; a file with
+                                                                                      // other names only loses this one, as with fs_unlink; an inode
+                                                                                      // whose own name is gone is left to the sync that frees orphans
+internal bool fs_rename(filesys_t *filesys, uint16_t inode_index, filename_t *name);   // gives the file a new 8.3 name, dropping any long name; returns false on failure
+
+// long file names: a file can have a name of up to LONG_NAME_LEN bytes (null-terminated) besides it's 8.3 one, which
+// is then made from the long name (it's first 8 characters and the first 3 of it's extension) so the file can
+// still be found by fs_find_by_name; the long names live in the name heap and each inode refers to it's own
+
+// creates a file with a long name; returns the new inode index, or 0 on error
+internal uint16_t fs_create_long(filesys_t *filesys, char *name, uint8_t file_type);
+
+// gives the file a new long name, along with the 8.3 name made from it; returns false on failure
+internal bool fs_rename_long(filesys_t *filesys, uint16_t inode_index, char *name);
+
+// copies the long name of the file into buf, null-terminated, or it's 8.3 name (as name.ext) if it has none
+// returns the length of the name; 0 if the file doesn't exist or the name doesn't fit in size bytes
+internal uint16_t fs_get_long_name(filesys_t *filesys, uint16_t inode_index, char *buf, uint16_t size);
+
+// stores in inodes the indexes of up to count files with the long name name, and returns how many it stored
+// the inodes carry the hash and length of their long names, so the heap is only read for the files whose
+// hash matches; a file that has nothing but an 8.3 name is found with fs_find_by_name
+internal uint16_t fs_find_by_long_name(filesys_t *filesys, char *name, uint16_t *inodes, uint16_t count);
+
+// hard links: a link is an inode of it's own holding a name (8.3 and maybe long) and the index of the file it names,
+// but no data; the file counts it's names in links. reading, writing, cloning, attributes, owner and reservations
+// all go through a link to the file, while renaming and unlinking act on the link itself
+
+// gives the file inode_index (or the file a link at inode_index names) one more name; returns the inode index
+// of the link, or 0 on error
+internal uint16_t fs_link(filesys_t *filesys, uint16_t inode_index, filename_t *name);
+
+// takes away the name at inode_index, be it a link or the file's own; once a file has no names left it's an
+// orphan, and it and it's blocks are freed by the next fs_sync (run by the flusher and by fs_unmount too)
+// returns false if there is no name at inode_index
+internal bool fs_unlink(filesys_t *filesys, uint16_t inode_index);
+
+// stores in inodes the indexes of up to count files named name, and returns how many it stored
+// with a name index on the volume this reads the one or two index blocks the name hashes to,
+// however many files there are; without one it falls back to a walk of the inode table
+internal uint16_t fs_find_by_name(filesys_t *filesys, filename_t *name, uint16_t *inodes, uint16_t count);
+
+// creates dst_name as a copy of the file src_inode that shares all of it's data blocks, taking a reference
+// to each and copying only the indirect blocks, so the cost is in the number of pointers rather than bytes;
+// a shared block is copied by the first write to it (from either file)
+// returns the new inode index; 0 on error, or for an extent file (whose extents can't be shared)
+internal uint16_t fs_clone(filesys_t *filesys, uint16_t src_inode, filename_t *dst_name);
+internal uint32_t fs_read(filesys_t *filesys, uint16_t inode_index, uint32_t offset, uint8_t *buf, uint32_t len);  // returns the number of bytes read
+
+// returns the number of bytes written; a write is turned away up front (returning 0) if it would take the file's owner
+// over it's quota, or if the blocks it could need aren't free (and not reserved for some other file)
+// the root directory can't be written, as it's data is the name heap
+internal uint32_t fs_write(filesys_t *filesys, uint16_t inode_index, uint32_t offset, uint8_t *buf, uint32_t len);
+
+// checks the whole filesystem in a single pass over the inode table, holding no more than
+// one bit per block (and a name count per inode) in memory; problems are printed as they are found if verbose is set
+// returns false if the superblock is invalid or the drive can't be read
+internal bool fs_check(filesys_t *filesys, fsck_t *report, bool verbose);
+
+// rewrites each fragmented pointer-mapped file into runs of contiguous free blocks, DEFRAG_WINDOW blocks at a time,
+// while the volume stays in use; a file is only locked while it's own blocks move. the copies are synced before
+// any pointer is changed, and the old blocks are only freed once the new pointers are synced too, so a crash
+// at any point leaves every file with either it's old blocks or it's new ones
+// budget caps the blocks copied per second (0 for no limit); per-file extent counts are printed if verbose is set
+// returns false on a read-only mount or if the drive can't be read or written
+internal bool fs_defrag(filesys_t *filesys, uint32_t budget, defrag_t *report, bool verbose);
+
+// space accounting: these read counters kept up to date by every allocation and every change to a file,
+// so none of them scans anything
+internal bool fs_space(filesys_t *filesys, space_t *space);
+internal bool fs_stats(filesys_t *filesys, fsstats_t *stats);
+internal bool fs_get_quota(filesys_t *filesys, uint8_t owner, quota_t *quota);
+
+// sets the most blocks the files of owner may be charged (0 for no limit) and saves it on the drive
+// a write that would take an owner over it's limit fails before it changes anything
+internal bool fs_set_quota(filesys_t *filesys, uint8_t owner, uint16_t limit);
+
+// charges the file to owner from now on; fails if it would take owner over it's limit
+internal bool fs_chown(filesys_t *filesys, uint16_t inode_index, uint8_t owner);
+
+// sets aside blocks free blocks (and enough on top to map them, written in order) for the upcoming writes
+// to the file, replacing what it had set aside before; other writes can't have them, and the file's
+// own writes draw on them first. a blocks of 0 gives the reservation back, as does deleting the file
+// returns false if there isn't that much free space (keeping the old reservation) or no slot left;
+// reservations live in memory and end with the mount
+internal bool fs_reserve(filesys_t *filesys, uint16_t inode_index, uint16_t blocks);
+
+// fills entries with up to count records of inodes in use, starting at the inode index *cursor (0 to start
+// a listing) and leaving *cursor where the next call should carry on from
+// returns the number of records filled in; 0 once the listing is complete (or on error)
+// inode blocks that the occupancy summary shows to be empty are skipped without being read
+internal uint16_t fs_readdir_batch(filesys_t *filesys, uint32_t *cursor, dirent_t *entries, uint16_t count);
+
+// extended attributes: up to XATTRS_PER_BLOCK (key, value) pairs per file, held together in an xattr block the
+// file may share with others; a key is a null-terminated string of 1 to XATTR_KEY_LEN bytes, a value up to
+// XATTR_VALUE_LEN bytes of anything. the block holds BLOCK_SIZE - 4 bytes of keys and values, with 8 bytes on
+// top for each attribute
+
+// sets the attribute key of the file to the len bytes at value, replacing any value it had; a NULL value
+// removes the attribute instead. returns false if the file doesn't exist, the attributes wouldn't fit in
+// a block, there's no free block for them, or (on removal) the file has no such attribute
+internal bool fs_setxattr(filesys_t *filesys, uint16_t inode_index, char *key, uint8_t *value, uint8_t len);
+
+// copies the value of the attribute key into value, which has room for *len bytes, and sets *len to
+// it's length; returns false if the file has no such attribute or the value doesn't fit
+// finding an attribute takes a binary search over the hashes of the keys, and no other key is looked at
+internal bool fs_getxattr(filesys_t *filesys, uint16_t inode_index, char *key, uint8_t *value, uint8_t *len);
+
+// returns the number of bytes the keys of the file's attributes take up, each null-terminated, and
+// copies them into keys if they fit in size bytes; 0 if the file has none (or doesn't exist)
+internal uint16_t fs_listxattr(filesys_t *filesys, uint16_t inode_index, char *keys, uint16_t size);
+
+// turns block level dedup on or off for this mount; while it's on, a block written to a pointer-mapped
+// file that is identical to one already in the index is mapped onto that block instead of being written
+// the index only covers blocks written since dedup was turned on, and isn't saved
+// returns false if the volume has no saved reference counts (it was formatted before they existed)
+internal bool fs_set_dedup(filesys_t *filesys, bool on);
+
+// scrubbing: walks the blocks the bitmap has in use, in the background, reading each off the drive; the superblock,
+// the inodes and the pointer, extent and xattr blocks are checked against their checksums, and every other block
+// only has to be readable. every copy a mirrored drive keeps is read; a bad superblock is written again from the
+// mount's copy, any other bad block from a copy of it that checks out, and all of them are printed and counted. the scrubber stops for SCRUB_YIELD_MS whenever the drive was used by anyone else since it
+// last looked (up to SCRUB_YIELD_MAX times in a row), and saves where it got to in the superblock every SCRUB_CHECKPOINT blocks and when stopped, so a
+// pass cut short by an unmount or a crash carries on from there with the next start
+
+// starts scrubbing from where the last pass left off (or from block 0), at no more than rate MB per second
+// (0 for no limit), restarting a scrub already running at the new rate; the scrubber stops by itself once
+// it's pass is done. returns false on a read-only mount or if the scrubber can't be started
+internal bool fs_scrub_start(filesys_t *filesys, uint32_t rate);
+
+// stops the scrubber, saving where it got to; returns false on a read-only mount
+internal bool fs_scrub_stop(filesys_t *filesys);
+internal bool fs_scrub_status(filesys_t *filesys, scrub_t *report);
+
+// writes every dirty block (data, inode, indirect, bitmap and reference count blocks) out in block number order,
+// coalescing neighbours into single writes, and ends the batch with one d_sync
+// writers carry on while a sync runs; what they write goes out with the next one
+internal bool fs_sync(filesys_t *filesys);
+
+// restarts the background flusher to sync every interval_ms milliseconds; as soon as dirty_ratio percent
+// of WB_BLOCKS are dirty it writes out just the data blocks, leaving the metadata for the timed sync
+// an interval_ms of 0 stops it; must not race with itself or fs_unmount
+internal bool fs_set_flusher(filesys_t *filesys, uint32_t interval_ms, uint8_t dirty_ratio);
 
-internal filesys_t *fs_mount(uint8_t drive_num);
+// a volume unmounted cleanly keeps it's bitmap on the drive, and mounting it skips the scan
+// with readonly set, any number of threads and processes can mount a clean volume at once (but not
+// while it's mounted read-write), each reading the metadata out of a single shared mapping of the
+// drive with no locks at all; every call that would change the volume fails on such a mount
+internal filesys_t *fs_mount(uint8_t drive_num, bool readonly);
 internal bool fs_ismounted(uint8_t drive_num);
-internal void fs_unmount(filesys_t *filesys);
+internal void fs_unmount(filesys_t *filesys); // stops the scrubber, syncs, saves the bitmap and marks the volume clean
 
 #endif // FILESYS_H
\ No newline at end of file
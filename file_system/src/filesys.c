@@ -4,22 +4,295 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>  // for sysconf()
+#include <pthread.h> // for the fs_mkbitmap workers
+#include <xxh32.h>   // content hashes of the dedup index
+#include <crc32.h>   // checksums of the metadata
+#include <sys/mman.h> // for the metadata view of read-only mounts
+#include <trace.h>    // for the tracing of the entry points
 
 #define BUF_LEN_FOR_FILENAME (13) // 8 (name) + 3 (extension) + 1 (dot) + 1 (null byte)
 
+#define BLOCKS_PER_MB ((1U << 20) / BLOCK_SIZE) // for rates given in MB per second
+
+// the 64-bit word of the bitmap holding the bit of blk, and the mask of that bit within it;
+// bit r of the bitmap is bit (r & 7) of byte (r >> 3), which is bit (r & 63) of 64-bit word (r >> 6)
+// on a little-endian machine
+#define bitmap_word(bitmap, blk) (((uint64_t *)(bitmap))[(blk) >> 6U])
+#define bitmap_mask(blk) (1ULL << ((blk) & 63))
+#define block_in_use(bitmap, blk) (__atomic_load_n(&bitmap_word(bitmap, blk), __ATOMIC_RELAXED) & bitmap_mask(blk))
+
+// inode blocks 1 to inode_watermark(filesys) are initialized
+#define inode_watermark(filesys) __atomic_load_n(&(filesys)->inode_init, __ATOMIC_ACQUIRE)
+
+#define inode_lock(filesys, index) (&(filesys)->inode_locks[(index) % INODE_LOCKS])
+#define iblock_lock(filesys, blk) (&(filesys)->iblock_locks[(blk) % IBLOCK_LOCKS])
+
+// the occupancy of an inode block isn't known until the block is read; a volume mounted
+// from it's saved bitmap starts out with every initialized block in this state
+#define OCCUPANCY_UNKNOWN (0xff)
+
+#define BITMAP_BLOCK_BITS (BLOCK_SIZE * 8) // blocks covered by a single block of the saved bitmap
+#define wb_chain(blocknum) ((blocknum) % WB_BUCKETS)
+
+#define SCAN_MAX_THREADS (32) // most workers fs_mkbitmap will use
+#define SCAN_MIN_BLOCKS (64)  // fewest inode blocks worth handing to a worker of it's own
+#define SCAN_BATCH (16)       // blocks read by a single d_read_run during the scan
+
+// blocks of the name index of a volume with inode_blocks inode blocks; a fifth of the entries stay free
+// even with every inode in use, so a bucket rarely has to spill into the next
+#define names_size(inode_blocks) ((uint16_t)(((uint32_t)(inode_blocks) * INODES_PER_BLOCK * 5 / 4 + NAMES_PER_BLOCK - 1) / NAMES_PER_BLOCK))
+#define names_home(filesys, name) (xxh32((name), sizeof(filename_t), 0) % (filesys)->names_blocks)
+
+// a read-only mount reads it's metadata straight out of the shared view, and writes nothing
+#define is_readonly(filesys) ((filesys)->view != NULL)
+#define view_block(filesys, blk) ((filesys)->view + (size_t)(blk) * BLOCK_SIZE)
+
+// blocks a file is charged: one per BLOCK_SIZE bytes of it's size; an inline file (or an unused inode) has none
+#define file_charge(inode) (((inode)->file_type == TYPE_NOT_VALID || ((inode)->file_type & FLAG_INLINE)) \
+                                ? 0                                                                     \
+                                : (uint32_t)(((inode)->file_size + BLOCK_SIZE - 1ULL) / BLOCK_SIZE))
+#define file_owner(inode) ((inode)->owner < QUOTA_OWNERS ? (inode)->owner : 0)
+
+// most blocks of pointers or extents needed to map n contiguous file blocks that aren't mapped yet
+#define map_blocks(n) ((uint32_t)(n) / EXTENTS_PER_BLOCK + 5)
+
+// a volume formatted with checksums; the checksum table can still be missing if it's size doesn't add up
+#define has_csum(filesys) ((filesys)->super_block.features & FEATURE_CSUM)
+#define sums_size(blocks) ((uint16_t)(((uint32_t)(blocks) + SUMS_PER_BLOCK - 1) / SUMS_PER_BLOCK))
+
+// an inode that has a name of it's own, and so an entry in the name index
+#define has_name(inode) ((inode)->file_type != TYPE_NOT_VALID && !((inode)->file_type & FLAG_NONAME))
+
+// an inode left without names, whose blocks are only waiting to be freed
+#define is_orphan(inode) (((inode)->file_type & FLAG_NONAME) && !inode_links(inode))
+
+// an unused inode isn't checked, since the inode blocks zeroed by the lazy init hold no checksums
+#define inode_bad(csum, inode, index) ((csum) && (inode)->file_type != TYPE_NOT_VALID && \
+                                       (inode)->checksum != inode_sum((inode), (index)))
+
+// an indirect block the scan still has to read, and how many levels of pointers hang below it
+typedef struct
+{
+    uint16_t blocknum;
+    uint8_t level;
+} pending_t;
+
+// one worker of the fs_mkbitmap scan; each worker owns a range of inode blocks and
+// marks what it finds in it's own shard, so workers never touch shared state
+typedef struct
+{
+    drive_t *drive;
+    uint16_t first, last; // inode blocks first to last (inclusive) belong to this worker
+    bitmap_t shard;       // blocks found in use by this worker
+    uint8_t *occupancy;   // the worker fills in the entries of it's own inode blocks; may be NULL
+    uint32_t usage[QUOTA_OWNERS]; // blocks charged to each owner by the files of this worker's inode blocks
+    bool csum;            // whether inodes carry checksums; an inode that fails it's own is passed over
+    uint32_t *sums;       // the checksum of every pointer, extent and xattr block read goes in here; may be NULL
+    bool count_refs;      // whether blocks found more than once are counted in extra
+    uint8_t *extra;       // references found beyond the first, per block; NULL until there is one
+    pending_t *pending;   // indirect blocks waiting to be read
+    uint32_t count;       // entries in pending
+    uint32_t capacity;    // room in pending
+    uint16_t *orphans;    // inodes with no names left, found in this worker's inode blocks
+    uint32_t orphan_count; // entries in orphans
+    uint32_t orphan_room; // room in orphans
+    bool ok;              // false if the worker hit an error
+} scan_t;
+
+// a block picked up by fs_sync; entry is -1 for a block of the saved bitmap, reference counts or checksum table
+typedef struct
+{
+    uint16_t blocknum;
+    int16_t entry;
+    uint32_t gen;
+} syncblk_t;
+
+// the metadata of a drive mapped into memory, shared by every read-only mount of it in this process
+typedef struct
+{
+    uint8_t *base;
+    size_t len;
+    uint32_t users; // read-only mounts using the view
+} view_t;
+
+// blocks claimed by a write that's under way: out of the space nobody has reserved, and out of it's file's reservation
+typedef struct
+{
+    uint32_t pool;
+    uint32_t own;
+} claim_t;
+
+// state of a running fs_defrag
+typedef struct
+{
+    filesys_t *filesys;
+    defrag_t *report;
+    uint16_t *map;         // per file block: the block holding it now; 0 for a hole
+    uint16_t *fresh;       // per file block: the block it's being moved to; 0 if it isn't
+    datablock_t *buf;      // a window of blocks on their way
+    uint32_t budget;       // most blocks copied per second; 0 for no limit
+    uint32_t copied;       // blocks copied so far
+    struct timespec start; // when the run began
+    bool verbose;
+} defrag_run_t;
+
+// state of a running fs_check
+typedef struct
+{
+    filesys_t *filesys;
+    fsck_t *report;
+    bitmap_t seen;       // blocks referenced so far
+    uint8_t *extra;      // references beyond the first found so far, per block; NULL until a shared block turns up
+    uint16_t inode;      // index of the inode being checked
+    uint32_t end;        // one past the highest file block the inode maps
+    int32_t *names;      // per inode: names it counts less names found for it so far
+    bool verbose;
+} check_t;
+
 private uint16_t find_free_block(bitmap_t bitmap, uint16_t total_blocks);
-private bool mark_block_used(bitmap_t bitmap, uint16_t block_num);
-private void mark_block_free(bitmap_t bitmap, uint16_t block_num);
-private bool get_file_name(inode_t *inode, uint8_t *name);
+private bool mark_block_used(filesys_t *filesys, uint16_t block_num);
+private void mark_block_free(filesys_t *filesys, uint16_t block_num);
+private void bitmap_touch(filesys_t *filesys, uint16_t start, uint32_t len);
+private void freed_mark(filesys_t *filesys, uint16_t start, uint32_t len);
+private bool ref_take(filesys_t *filesys, uint16_t blocknum);
+private bool ref_drop(filesys_t *filesys, uint16_t blocknum);
+private void release_block(filesys_t *filesys, uint16_t blocknum);
+private dedup_t *dedup_alloc(uint16_t blocks);
+private void dedup_free(dedup_t *dedup);
+private void dedup_index(dedup_t *dedup, uint16_t blocknum, uint32_t hash);
+private void dedup_unindex(dedup_t *dedup, uint16_t blocknum);
+private uint16_t dedup_find(filesys_t *filesys, dedup_t *dedup, uint32_t hash, uint8_t *data, uint16_t blocknum);
+private int xattr_cmp(xattrblock_t *block, uint8_t index, uint32_t hash, uint8_t *key, uint8_t key_len);
+private uint8_t xattr_search(xattrblock_t *block, uint32_t hash, uint8_t *key, uint8_t key_len);
+private bool xattr_put(xattrblock_t *block, uint32_t hash, uint8_t *key, uint8_t key_len, uint8_t *value, uint8_t value_len);
+private bool xattr_read(filesys_t *filesys, uint8_t *dest, uint16_t blocknum);
+private dedup_t *xattr_index(filesys_t *filesys);
+private uint16_t xattr_store(filesys_t *filesys, uint16_t inode_index, uint16_t blocknum, uint8_t *data);
+private uint16_t xattr_share(filesys_t *filesys, uint16_t blocknum);
+private void xattr_release(filesys_t *filesys, uint16_t blocknum);
+private bool same_name(filename_t *a, filename_t *b);
+private uint8_t name_slot(nameblock_t *block);
+private bool names_add(filesys_t *filesys, filename_t *name, uint16_t inode_index);
+private bool names_remove(filesys_t *filesys, filename_t *name, uint16_t inode_index);
+private bool names_update(filesys_t *filesys, uint16_t inode_index, filename_t *old_name, filename_t *new_name);
+private bool names_rebuild(filesys_t *filesys);
+private uint8_t *view_get(drive_t *drive, size_t len);
+private void view_put(filesys_t *filesys);
+private filesys_t *mount_ro(uint8_t drive_num);
+private filesys_t *mount_drive(uint8_t drive_num, bool readonly);
+private bool claim_blocks(filesys_t *filesys, uint16_t start, uint16_t len);
+private uint16_t claim_run(filesys_t *filesys, uint16_t len, uint32_t want, uint16_t hint);
+private uint32_t count_extents(uint16_t *map, uint32_t blocks);
+private void defrag_pace(defrag_run_t *run);
+private bool defrag_file(defrag_run_t *run, uint16_t inode_index);
+private uint16_t ptr_bmap(filesys_t *filesys, inode_t *inode, uint32_t file_block, bool alloc, bool *fresh, uint16_t replace);
+private void set_top_ptr(inode_t *inode, uint8_t levels, uint32_t file_block, uint16_t blocknum);
+private bool store_block(filesys_t *filesys, inode_t *inode, uint32_t file_block, uint16_t blocknum, uint8_t *data);
+private bool get_inode(filesys_t *filesys, uint16_t inode_index, inode_t *inode);
+private bool put_inode(filesys_t *filesys, uint16_t inode_index, inode_t *inode);
+private bool delete_inode(filesys_t *filesys, uint16_t inode_index, bool orphan);
+private uint16_t readdir_batch(filesys_t *filesys, uint32_t *cursor, dirent_t *entries, uint16_t count);
+private uint32_t read_inode(filesys_t *filesys, uint16_t inode_index, uint32_t offset, uint8_t *buf, uint32_t len);
+private uint32_t write_inode(filesys_t *filesys, uint16_t inode_index, uint32_t offset, uint8_t *buf, uint32_t len);
+private bool blk_read(filesys_t *filesys, uint8_t *dest, uint16_t blocknum);
+private bool blk_read_run(filesys_t *filesys, uint8_t *dest, uint16_t blocknum, uint32_t count);
+private bool blk_write(filesys_t *filesys, uint8_t *src, uint16_t blocknum);
+private bool sync_blocks(filesys_t *filesys, bool data_only);
+private uint32_t block_sum(uint8_t *data);
+private uint32_t inode_sum(inode_t *inode, uint16_t inode_index);
+private uint32_t super_sum(superblock_t *sb);
+private bool super_write(filesys_t *filesys);
+private void sum_set(filesys_t *filesys, uint16_t blocknum, uint32_t sum);
+private bool sum_ok(filesys_t *filesys, uint8_t *data, uint16_t blocknum);
+private bool meta_write(filesys_t *filesys, uint8_t *src, uint16_t blocknum);
+private void wb_init(wback_t *wback);
+private int16_t wb_find(wback_t *wback, uint16_t blocknum);
+private bitmap_t load_bitmap(filesys_t *filesys);
+private uint8_t count_inodes(datablock_t *block);
+private void *flush_worker(void *arg);
+private void stop_flusher(filesys_t *filesys);
+private bool scrub_super(filesys_t *filesys, datablock_t *buf);
+private bool scrub_block(filesys_t *filesys, uint8_t *data, uint16_t blocknum, uint32_t sum);
+private uint32_t scrub_run(filesys_t *filesys, datablock_t *buf, uint16_t blocknum, uint16_t count, uint8_t copy);
+private bool scrub_repair(filesys_t *filesys, uint8_t *data, uint16_t blocknum, uint8_t copy, uint32_t *io);
+private bool scrub_save(filesys_t *filesys, uint32_t next);
+private void *scrub_worker(void *arg);
+private void stop_scrubber(filesys_t *filesys);
+private bool get_file_name(filename_t *file_name, uint8_t *name);
+private uint16_t str_len(char *str, uint16_t max);
+private void short_name(filename_t *out, char *name, uint8_t len);
+private heapspan_t *heap_insert(nameheap_t *heap, uint32_t offset, uint32_t size);
+private bool heap_load(filesys_t *filesys);
+private uint32_t heap_alloc(filesys_t *filesys, uint16_t inode_index, char *name, uint8_t len);
+private void heap_release(filesys_t *filesys, uint16_t inode_index, uint32_t offset);
+private bool heap_name(filesys_t *filesys, uint16_t inode_index, inode_t *inode, char *buf);
+private bool lname_attach(filesys_t *filesys, uint16_t inode_index, char *name, uint8_t len, uint32_t offset);
+private uint16_t create_long(filesys_t *filesys, char *name, uint8_t file_type);
+private uint16_t create_inode(filesys_t *filesys, filename_t *name, uint8_t file_type, uint16_t target);
+private uint16_t link_target(filesys_t *filesys, uint16_t inode_index);
+private bool link_drop(filesys_t *filesys, uint16_t inode_index);
+private bool orphan_push(filesys_t *filesys, uint16_t inode_index);
+private void reclaim_orphans(filesys_t *filesys);
+private bool scan_push(scan_t *scan, uint16_t blocknum, uint8_t level);
+private bool scan_mark(scan_t *scan, uint16_t blocknum);
+private bool scan_orphan(scan_t *scan, uint16_t inode_index);
+private void *scan_worker(void *arg);
+private void scan_shard(scan_t *scan);
+private void free_tree(filesys_t *filesys, uint16_t blocknum, uint8_t level);
+private bool clone_tree(filesys_t *filesys, uint16_t *blocknum, uint8_t level);
+private uint16_t clone_file(filesys_t *filesys, uint16_t src_inode, filename_t *dst_name);
+private uint16_t alloc_block(filesys_t *filesys, bool zeroed);
+private uint32_t set_range(bitmap_t bitmap, uint16_t start, uint32_t len, bool used);
+private bool mark_extents(drive_t *drive, bitmap_t bitmap, inode_t *inode, uint32_t *sums);
+private uint16_t ext_bmap(filesys_t *filesys, inode_t *inode, uint32_t file_block, bool alloc, bool *fresh, uint32_t *run);
+private bool promote_inline(filesys_t *filesys, inode_t *inode);
+private void init_locks(filesys_t *filesys);
+private void destroy_locks(filesys_t *filesys);
+private bool init_inode_blocks(filesys_t *filesys, uint16_t upto);
+private void *lazy_init_worker(void *arg);
+private void start_lazy_init(filesys_t *filesys);
+private bool check_block(check_t *check, uint16_t blocknum);
+private bool check_sum(check_t *check, uint8_t *data, uint16_t blocknum);
+private bool check_tree(check_t *check, uint16_t blocknum, uint8_t level, uint32_t file_block);
+private bool check_inode(check_t *check, inode_t *inode);
+private uint32_t count_free(bitmap_t bitmap, uint16_t blocks);
+private bool counters_valid(superblock_t *sb);
+private resv_t *resv_find(filesys_t *filesys, uint16_t inode_index);
+private bool resv_set(filesys_t *filesys, uint16_t inode_index, uint32_t want);
+private bool space_claim(filesys_t *filesys, uint16_t inode_index, uint32_t need, claim_t *claim);
+private void space_release(filesys_t *filesys, uint16_t inode_index, claim_t *claim, int32_t taken);
+private bool quota_claim(filesys_t *filesys, uint8_t owner, uint32_t old_charge, uint32_t new_charge, uint32_t *held);
+private void quota_release(filesys_t *filesys, uint8_t owner, uint32_t held);
+private uint32_t tree_need(filesys_t *filesys, uint16_t blocknum, uint8_t level, uint32_t first, uint32_t last);
+private uint32_t write_need(filesys_t *filesys, inode_t *inode, uint32_t first, uint32_t last, bool exact);
+
+private uint8_t zero_blocks[LAZY_INIT_CHUNK * BLOCK_SIZE]; // source of the writes zeroing the inode table
+
+// blocks marked used less blocks marked free by the calling thread; a write reads it before and after
+// to know how many blocks it took
+private __thread int32_t blocks_taken;
+
+// set by fs_bmap on the calling thread when a pointer or extent block on the way couldn't be read (or failed
+// it's checksum), so a lookup coming back with 0 can be told apart from a hole
+private __thread bool bmap_failed;
+
+// set by read_inode and write_inode on the calling thread when the inode they were given is a link, to the
+// inode it names; the caller lets go of the link's lock and goes again with the file's
+private __thread uint16_t link_hop;
 
 private uint8_t mounted = 0; // initially, no drive is mounted
+private view_t views[2];     // views[0] is DriveC's, views[1] DriveD's; a drive made of several has none
+private pthread_mutex_t views_lock = PTHREAD_MUTEX_INITIALIZER;
 // last bit of mounted is DriveC and second last bit is DriveD
+// a drive's bit is claimed and released with atomic operations, so each drive is mounted at most once
+// even when several threads race to mount it
 
 public void
 filesys_test(drive_t *drive)
 {
     filesys_t *filesys = NULL;
-    if (!(filesys = fs_format(drive, NULL, true)))
+    if (!(filesys = fs_format(drive, NULL, true, false)))
         return;
 
     fs_show(filesys, true);
@@ -87,431 +360,5934 @@ private void hexdump(void *ptr, size_t num_bytes)
     printf("\n");
 }
 
-internal bool fs_get_inode(filesys_t *filesys, uint16_t inode_index, inode_t *inode)
+private void wb_init(wback_t *wback)
 {
-    uint16_t inode_blocks;
-    uint16_t inode_index_in_block;
-    uint16_t inode_block_index;
-    datablock_t inode_block;
+    uint16_t index;
 
-    if (!filesys || !inode)
-        return false;
+    for (index = 0; index < WB_BUCKETS; index++)
+        wback->chain[index] = -1;
 
-    inode_blocks = filesys->super_block.inode_blocks;
-    inode_block_index = inode_index / INODES_PER_BLOCK;
-    if (inode_block_index >= inode_blocks)
-        return false;
-    inode_block_index++; // inode blocks start at block index 1, after the superblock (block index 0)
-    inode_index_in_block = inode_index % INODES_PER_BLOCK;
+    for (index = 0; index < WB_BLOCKS; index++)
+        wback->buf[index].next = index + 1 < WB_BLOCKS ? index + 1 : -1;
 
-    if (!d_read(filesys->drive, (uint8_t *)inode_block.data, inode_block_index))
-        return false;
+    wback->free = 0;
+    wback->count = 0;
+    wback->synced = 0;
+    zero(wback->freed, sizeof(wback->freed));
+}
 
-    copy((void *)inode, (void *)&inode_block.inode[inode_index_in_block], sizeof(inode_t));
-    return true;
+// entry of the dirty block table holding blocknum, or -1; wback_lock must be held
+private int16_t wb_find(wback_t *wback, uint16_t blocknum)
+{
+    int16_t entry;
+
+    for (entry = wback->chain[wb_chain(blocknum)]; entry != -1; entry = wback->buf[entry].next)
+    {
+        if (wback->buf[entry].blocknum == blocknum)
+            return entry;
+    }
+
+    return -1;
 }
 
-internal bool fs_ismounted(uint8_t drive_num)
+// checksum a pointer, extent or xattr block goes by in the checksum table, where 0 stands for a block without one
+private uint32_t block_sum(uint8_t *data)
 {
-    if (!d_is_drivenum_valid(drive_num))
-        return false;
+    uint32_t sum;
 
-    return mounted & drive_num;
+    sum = crc32c(data, BLOCK_SIZE, 0);
+    return sum ? sum : 1;
 }
 
-internal filesys_t *fs_mount(uint8_t drive_num)
+// checksum of everything in an inode but the checksum itself, seeded with the inode's index
+// so that an inode block written to the wrong place doesn't pass either
+private uint32_t inode_sum(inode_t *inode, uint16_t inode_index)
 {
-    drive_t *drive_desc;
-    filesys_t *filesys;
-    if (!d_is_drivenum_valid(drive_num))
-        return NULL;
+    uint32_t sum;
+    size_t rest;
 
-    if (fs_ismounted(drive_num))
-        return NULL;
+    rest = offsetof(inode_t, checksum) + sizeof(inode->checksum);
+    sum = crc32c((uint8_t *)&inode_index, sizeof(inode_index), 0);
+    sum = crc32c((uint8_t *)inode, offsetof(inode_t, checksum), sum);
+    return crc32c((uint8_t *)inode + rest, sizeof(inode_t) - rest, sum);
+}
 
-    drive_desc = d_attach(drive_num);
-    if (!drive_desc)
-        return NULL;
+// checksum of everything in the superblock but the checksum itself
+private uint32_t super_sum(superblock_t *sb)
+{
+    size_t rest;
 
-    filesys = malloc(sizeof(filesys_t));
-    if (!filesys)
-        return NULL;
+    rest = offsetof(superblock_t, checksum) + sizeof(sb->checksum);
+    return crc32c((uint8_t *)sb + rest, sizeof(superblock_t) - rest, crc32c((uint8_t *)sb, offsetof(superblock_t, checksum), 0));
+}
 
-    filesys->drive = drive_desc;
-    filesys->drive_num = drive_num;
+// writes the superblock of filesys to block 0, checksummed on a volume with checksums; super_lock must be
+// held on a mounted volume
+private bool super_write(filesys_t *filesys)
+{
+    if (has_csum(filesys))
+        filesys->super_block.checksum = super_sum(&filesys->super_block);
 
-    if (!d_read(drive_desc, (uint8_t *)&filesys->super_block, 0))
+    return d_write(filesys->drive, (uint8_t *)&filesys->super_block, 0);
+}
+
+// records the checksum of blocknum, so the next sync saves it
+private void sum_set(filesys_t *filesys, uint16_t blocknum, uint32_t sum)
+{
+    __atomic_store_n(&filesys->sums[blocknum], sum, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&filesys->sums_dirty[blocknum / SUMS_PER_BLOCK / 64], 1ULL << (blocknum / SUMS_PER_BLOCK % 64), __ATOMIC_RELAXED);
+}
+
+// whether a block read off the drive matches the checksum it was written with; a block without one always does
+private bool sum_ok(filesys_t *filesys, uint8_t *data, uint16_t blocknum)
+{
+    uint32_t sum;
+
+    sum = filesys->sums && blocknum < filesys->drive->blocks ? __atomic_load_n(&filesys->sums[blocknum], __ATOMIC_RELAXED) : 0;
+    if (!sum || sum == block_sum(data))
+        return true;
+
+    kprintf("Drive %s: block %u doesn't match it's checksum", d_getdrivename(filesys->drive_num), blocknum);
+    return false;
+}
+
+// reads blocknum, from the dirty block table if it has a copy newer than the drive's
+// a block is only dropped from the table once the drive has it, so a miss can safely go to the drive
+private bool blk_read(filesys_t *filesys, uint8_t *dest, uint16_t blocknum)
+{
+    int16_t entry;
+
+    // a read-only mount has no dirty blocks, and it's metadata is already in memory
+    if (is_readonly(filesys))
     {
-        free(filesys);
-        return false;
+        __atomic_fetch_add(&filesys->cache_lookups, 1, __ATOMIC_RELAXED);
+        if (blocknum > last_meta_block(&filesys->super_block))
+            return d_read(filesys->drive, dest, blocknum) && sum_ok(filesys, dest, blocknum);
+
+        __atomic_fetch_add(&filesys->cache_hits, 1, __ATOMIC_RELAXED);
+        copy(dest, view_block(filesys, blocknum), BLOCK_SIZE);
+        return true;
     }
 
-    filesys->bitmap = fs_mkbitmap(filesys, true);
-    if (!filesys->bitmap)
+    // on a writable mount the counters only change under wback_lock
+    pthread_mutex_lock(&filesys->wback_lock);
+    filesys->cache_lookups++;
+    entry = wb_find(filesys->wback, blocknum);
+    if (entry != -1)
     {
-        free(filesys);
-        return false;
+        filesys->cache_hits++;
+        copy(dest, filesys->wback->buf[entry].data, BLOCK_SIZE);
+        pthread_mutex_unlock(&filesys->wback_lock);
+        return true;
     }
+    pthread_mutex_unlock(&filesys->wback_lock);
 
-    mounted |= drive_num;
-    kprintf("Drive %s mounted", d_getdrivename(drive_num));
-    return filesys;
+    // only what comes off the drive is checked; a dirty copy is the very one the checksum was taken of
+    return d_read(filesys->drive, dest, blocknum) && sum_ok(filesys, dest, blocknum);
 }
 
-// filesys should have it's drive and superblock field correctly initialized
-internal bitmap_t fs_mkbitmap(filesys_t *filesys, bool scan)
+// reads count contiguous blocks with one d_read_run, then lays the dirty ones over what came back
+// a sync finishing during the read may have dropped blocks the read came too early to see, so
+// the read is redone if one did
+private bool blk_read_run(filesys_t *filesys, uint8_t *dest, uint16_t blocknum, uint32_t count)
 {
-    uint16_t size, ptr, node, blocknum, indirect_ptr, blocks, blk, inode_blocks;
-    bitmap_t bitmap;
-    datablock_t buf, indirect_buf;
-    drive_t *drive;
-    uint16_t *block_ptr;
-    inode_t *inode;
+    wback_t *wback;
+    uint32_t synced, index;
+    int16_t entry;
 
-    if (!filesys)
-        return NULL;
+    if (is_readonly(filesys))
+        return d_read_run(filesys->drive, dest, blocknum, count);
 
-    // calculate bitmap size in bytes (1 bit per block, rounded up)
-    drive = filesys->drive;
-    blocks = drive->blocks;
-    size = (blocks + 7) / 8;
+    wback = filesys->wback;
+    while (true)
+    {
+        synced = __atomic_load_n(&wback->synced, __ATOMIC_ACQUIRE);
+        if (!d_read_run(filesys->drive, dest, blocknum, count))
+            return false;
 
-    // allocate and zero bitmap
-    bitmap = malloc(size);
-    if (!bitmap)
-        return NULL;
+        pthread_mutex_lock(&filesys->wback_lock);
+        if (wback->synced == synced)
+            break;
+        pthread_mutex_unlock(&filesys->wback_lock);
+    }
 
-    // Initialize bitmap to all zeros
-    zero(bitmap, size);
+    for (index = 0; wback->count && index < count; index++)
+    {
+        entry = wb_find(wback, blocknum + index);
+        if (entry != -1)
+            copy(dest + index * BLOCK_SIZE, wback->buf[entry].data, BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&filesys->wback_lock);
 
-    if (!scan)
-        return bitmap;
+    return true;
+}
 
-    // mark superblock and all inode blocks as used
-    inode_blocks = filesys->super_block.inode_blocks;
-    for (blk = 0; blk <= inode_blocks; blk++)
-        set_bit(bitmap, blk);
+// puts blocknum in the dirty block table; it reaches the drive with the next sync
+private bool blk_write(filesys_t *filesys, uint8_t *src, uint16_t blocknum)
+{
+    wback_t *wback;
+    int16_t entry;
+    bool wake, full;
 
-    // if a blockptr in an inode is zero, that means it's uninitialized since
-    // we set everything to zero by default;
-    // also, 0 is the blockptr for the superblock
+    if (blocknum >= filesys->drive->blocks)
+        return false;
 
-    // scan all inodes to mark used data blocks
-    for (blk = 1; blk <= inode_blocks; blk++)
+    wback = filesys->wback;
+    full = false;
+    while (true)
     {
-        if (!d_read(drive, (uint8_t *)&buf, blk))
+        pthread_mutex_lock(&filesys->wback_lock);
+        entry = wb_find(wback, blocknum);
+        if (entry == -1 && wback->free != -1)
         {
-            free(bitmap);
-            return NULL;
+            entry = wback->free;
+            wback->free = wback->buf[entry].next;
+            wback->buf[entry].blocknum = blocknum;
+            wback->buf[entry].next = wback->chain[wb_chain(blocknum)];
+            wback->chain[wb_chain(blocknum)] = entry;
+            wback->count++;
         }
 
-        // check each inode in this block
-        for (node = 0; node < INODES_PER_BLOCK; node++)
-        {
-            inode = &(buf.inode[node]);
-            if (inode->file_type == TYPE_NOT_VALID)
-                continue;
+        if (entry != -1)
+            break;
 
-            // mark direct pointers as used (assuming they store block numbers directly)
-            for (ptr = 0; ptr < PTR_PER_INODE; ptr++)
-            {
-                blocknum = (uint16_t)inode->direct_ptr[ptr];
-                if (blocknum)
-                    set_bit(bitmap, blocknum);
-            }
+        // every entry is dirty; write the data blocks out and look again, and only if that
+        // leaves no room (the table is all metadata) write out everything
+        pthread_mutex_unlock(&filesys->wback_lock);
+        if (!sync_blocks(filesys, !full))
+            return false;
+        full = true;
+    }
 
-            // mark indirect block and its pointers as used
-            indirect_ptr = (uint16_t)inode->indirect_ptr;
-            if (indirect_ptr)
-            {
-                set_bit(bitmap, indirect_ptr);
+    copy(wback->buf[entry].data, src, BLOCK_SIZE);
+    wback->buf[entry].gen++;
+    wake = (uint32_t)wback->count * 100 >= (uint32_t)WB_BLOCKS * filesys->flush_ratio;
+    pthread_mutex_unlock(&filesys->wback_lock);
 
-                // read indirect block and mark all referenced blocks
-                if (!d_read(drive, (uint8_t *)indirect_buf.data, indirect_ptr))
-                {
-                    free(bitmap);
-                    return NULL;
-                }
+    if (wake)
+        pthread_cond_signal(&filesys->flush_cond);
 
-                // parse indirect block as array of block numbers
-                block_ptr = (uint16_t *)indirect_buf.ptr;
-                for (ptr = 0; ptr < PTR_PER_BLOCK; ptr++)
-                {
-                    blocknum = block_ptr[ptr];
-                    if (blocknum)
-                        set_bit(bitmap, blocknum);
-                }
-            }
-        }
+    return true;
+}
+
+// blk_write for a pointer, extent or xattr block, which has it's checksum recorded along the way
+// both only change under the exclusive lock of the file the block maps, so no reader sees one without the other
+private bool meta_write(filesys_t *filesys, uint8_t *src, uint16_t blocknum)
+{
+    if (filesys->sums && blocknum < filesys->drive->blocks)
+        sum_set(filesys, blocknum, block_sum(src));
+
+    return blk_write(filesys, src, blocknum);
+}
+
+// number of inodes in use in an inode block
+private uint8_t count_inodes(datablock_t *block)
+{
+    uint8_t node, count;
+
+    for (node = count = 0; node < INODES_PER_BLOCK; node++)
+    {
+        if (block->inode[node].file_type != TYPE_NOT_VALID)
+            count++;
     }
 
-    return bitmap;
+    return count;
 }
 
-internal void fs_dltbitmap(bitmap_t bitmap) // destroys bitmap
+internal bool fs_get_inode(filesys_t *filesys, uint16_t inode_index, inode_t *inode)
 {
-    if (!bitmap)
-        return;
+    uint64_t start;
+    bool ret;
 
-    free(bitmap);
-    return;
+    start = trace_begin();
+    ret = get_inode(filesys, inode_index, inode);
+    trace_end(TRACE_GET_INODE, start, inode_index, 0, 0, ret);
+
+    return ret;
 }
 
-// buf should be of atleast 13 bytes
-private bool get_file_name(inode_t *inode, uint8_t *buf)
+internal bool fs_put_inode(filesys_t *filesys, uint16_t inode_index, inode_t *inode)
 {
-    uint8_t index;
-    uint8_t *ext;
-    uint8_t *name;
-    if (!inode || !buf)
+    uint64_t start;
+    bool ret;
+
+    start = trace_begin();
+    ret = put_inode(filesys, inode_index, inode);
+    trace_end(TRACE_PUT_INODE, start, inode_index, inode ? inode->file_type : 0, 0, ret);
+
+    return ret;
+}
+
+private bool get_inode(filesys_t *filesys, uint16_t inode_index, inode_t *inode)
+{
+    uint16_t inode_blocks;
+    uint16_t inode_index_in_block;
+    uint16_t inode_block_index;
+    datablock_t inode_block;
+
+    if (!filesys || !inode)
         return false;
 
-    index = 0;
-    ext = inode->file_name.extension;
-    name = inode->file_name.name;
+    inode_blocks = filesys->super_block.inode_blocks;
+    inode_block_index = inode_index / INODES_PER_BLOCK;
+    if (inode_block_index >= inode_blocks)
+        return false;
+    inode_block_index++; // inode blocks start at block index 1, after the superblock (block index 0)
+    inode_index_in_block = inode_index % INODES_PER_BLOCK;
 
-    // Handle empty filename
-    if (!*name && !*ext)
+    // a block past the watermark hasn't been zeroed yet, but it's inodes are all unused
+    if (inode_block_index > inode_watermark(filesys))
     {
-        buf[0] = 0;
+        zero(inode, sizeof(inode_t));
         return true;
     }
 
-    while (index < 8 && index < BUF_LEN_FOR_FILENAME - 1 && *name)
-        buf[index++] = *name++;
+    // nothing changes under a read-only mount, so it needs no lock
+    if (is_readonly(filesys))
+        copy(inode, view_block(filesys, inode_block_index) + inode_index_in_block * sizeof(inode_t), sizeof(inode_t));
+    else
+    {
+        // the block mutex keeps this read from seeing a half-written fs_put_inode
+        pthread_mutex_lock(iblock_lock(filesys, inode_block_index));
+        if (!blk_read(filesys, (uint8_t *)inode_block.data, inode_block_index))
+        {
+            pthread_mutex_unlock(iblock_lock(filesys, inode_block_index));
+            return false;
+        }
+        pthread_mutex_unlock(iblock_lock(filesys, inode_block_index));
 
-    if (*ext && index < BUF_LEN_FOR_FILENAME - 1)
+        copy((void *)inode, (void *)&inode_block.inode[inode_index_in_block], sizeof(inode_t));
+    }
+
+    // a damaged inode is turned away rather than have it's pointers followed
+    if (inode_bad(has_csum(filesys), inode, inode_index))
     {
-        buf[index++] = '.';
-        while (index < BUF_LEN_FOR_FILENAME - 1 && *ext)
-            buf[index++] = *ext++;
+        kprintf("Drive %s: inode %u doesn't match it's checksum", d_getdrivename(filesys->drive_num), inode_index);
+        return false;
     }
 
-    buf[index] = '\0';
     return true;
 }
 
-internal void fs_show(filesys_t *filesys, bool show_bitmap)
+private bool put_inode(filesys_t *filesys, uint16_t inode_index, inode_t *inode)
 {
-    uint16_t i, j, used_blocks, free_blocks;
-    uint16_t total_inodes, index;
-    bitmap_t bitmap;
-    inode_t inode;
-    uint8_t buf[BUF_LEN_FOR_FILENAME];
-
-    if (!filesys)
-        return;
+    uint16_t inode_index_in_block;
+    uint16_t inode_block_index;
+    datablock_t inode_block;
+    filename_t old_name;
+    uint8_t *occupancy;
+    uint32_t old_charge;
+    uint8_t old_owner;
+    bool ret, was_used, was_named;
 
-    // print filesystem header
-    printf("filesystem information:\n");
-    printf("======================\n");
+    if (!filesys || !inode || is_readonly(filesys))
+        return false;
 
-    // print superblock info
-    printf("drive number: %d\n", filesys->drive_num);
-    printf("total blocks: %d\n", filesys->super_block.blocks);
-    printf("inode blocks: %d\n", filesys->super_block.inode_blocks);
-    printf("total inodes: %d\n", filesys->super_block.inodes);
-    printf("magic numbers: 0x%04x 0x%04x\n", filesys->super_block.magic1, filesys->super_block.magic2);
+    inode_block_index = inode_index / INODES_PER_BLOCK;
+    if (inode_block_index >= filesys->super_block.inode_blocks)
+        return false;
+    inode_block_index++;
+    inode_index_in_block = inode_index % INODES_PER_BLOCK;
 
-    // print all inodes
-    printf("\n");
-    printf("inode table:\n");
-    printf("============\n");
+    // the block has to be initialized before any of it can be written
+    if (inode_block_index > inode_watermark(filesys) && !init_inode_blocks(filesys, inode_block_index))
+        return false;
 
-    total_inodes = filesys->super_block.inodes;
-    for (index = 0; index < total_inodes; index++)
+    // an inode is only a part of a block, so read-modify-write the whole block,
+    // holding the block mutex so that a write to a neighbouring inode isn't lost
+    pthread_mutex_lock(iblock_lock(filesys, inode_block_index));
+    ret = blk_read(filesys, (uint8_t *)inode_block.data, inode_block_index);
+    if (ret)
     {
-        if (!fs_get_inode(filesys, index, &inode))
-            continue;
+        was_used = inode_block.inode[inode_index_in_block].file_type != TYPE_NOT_VALID;
+        was_named = has_name(&inode_block.inode[inode_index_in_block]);
+        old_charge = file_charge(&inode_block.inode[inode_index_in_block]);
+        old_owner = file_owner(&inode_block.inode[inode_index_in_block]);
+        copy(&old_name, &inode_block.inode[inode_index_in_block].file_name, sizeof(filename_t));
+        copy((void *)&inode_block.inode[inode_index_in_block], (void *)inode, sizeof(inode_t));
+        if (has_csum(filesys))
+            inode_block.inode[inode_index_in_block].checksum = inode_sum(&inode_block.inode[inode_index_in_block], inode_index);
+        ret = blk_write(filesys, (uint8_t *)inode_block.data, inode_block_index);
 
-        if (!get_file_name(&inode, buf))
-            continue;
+        // the owner's usage follows the file's size (and the file)
+        if (ret && (old_charge != file_charge(inode) || old_owner != file_owner(inode)))
+        {
+            __atomic_fetch_sub(&filesys->usage[old_owner], old_charge, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&filesys->usage[file_owner(inode)], file_charge(inode), __ATOMIC_RELAXED);
+        }
 
-        // only show valid inodes to avoid garbage
-        if (inode.file_type != TYPE_NOT_VALID)
-            printf("inode_index %d: type=%d, file_size=%d (bytes), file_name=%s\n",
-                   index, inode.file_type, inode.file_size, (char *)buf);
+        // a file that appears, goes or changes name takes the name index along with it
+        if (ret)
+            ret = names_update(filesys, inode_index, was_named ? &old_name : NULL,
+                               has_name(inode) ? &inode->file_name : NULL);
+
+        // keep the occupancy in step while the block mutex still orders this against fs_create
+        occupancy = filesys->occupancy ? &filesys->occupancy[inode_block_index - 1] : NULL;
+        if (ret && occupancy && *occupancy != OCCUPANCY_UNKNOWN && was_used != (inode->file_type != TYPE_NOT_VALID))
+            __atomic_store_n(occupancy, *occupancy + (was_used ? -1 : 1), __ATOMIC_RELAXED);
     }
+    pthread_mutex_unlock(iblock_lock(filesys, inode_block_index));
 
-    printf("\n");
+    return ret;
+}
 
-    // calculate used/free blocks from bitmap
-    bitmap = filesys->bitmap;
-    used_blocks = 0;
-    free_blocks = 0;
+internal bool fs_ismounted(uint8_t drive_num)
+{
+    if (!d_is_drivenum_valid(drive_num))
+        return false;
 
-    if (bitmap)
-    {
-        for (i = 0; i < filesys->super_block.blocks; i++)
-        {
-            if (get_bit(bitmap, i))
-                used_blocks++;
-            else
-                free_blocks++;
-        }
-    }
+    return __atomic_load_n(&mounted, __ATOMIC_ACQUIRE) & drive_num;
+}
 
-    printf("used blocks: %d\n", used_blocks);
-    printf("free blocks: %d\n", free_blocks);
+private void init_locks(filesys_t *filesys)
+{
+    uint16_t index;
 
-    // show bitmap if requested
-    if (show_bitmap && bitmap)
-    {
-        printf("\nblock bitmap (0=free, 1=used):\n");
-        printf("==============================\n");
+    for (index = 0; index < INODE_LOCKS; index++)
+        pthread_rwlock_init(&filesys->inode_locks[index], NULL);
 
-        for (i = 0; i < filesys->super_block.blocks; i += 16)
-        {
-            printf("%04d: ", i);
+    for (index = 0; index < IBLOCK_LOCKS; index++)
+        pthread_mutex_init(&filesys->iblock_locks[index], NULL);
+
+    pthread_mutex_init(&filesys->super_lock, NULL);
+    filesys->init_running = false;
+    filesys->init_stop = false;
+
+    pthread_mutex_init(&filesys->wback_lock, NULL);
+    filesys->cache_lookups = filesys->cache_hits = 0;
+    pthread_mutex_init(&filesys->sync_lock, NULL);
+    pthread_mutex_init(&filesys->dedup_lock, NULL);
+    pthread_mutex_init(&filesys->xattr_lock, NULL);
+    pthread_mutex_init(&filesys->names_lock, NULL);
+    pthread_mutex_init(&filesys->orphan_lock, NULL);
+    pthread_mutex_init(&filesys->quota_lock, NULL);
+    filesys->reserved = 0;
+    filesys->resv_count = 0;
+    zero(filesys->resv, sizeof(filesys->resv));
+    zero(filesys->held, sizeof(filesys->held));
+
+    pthread_mutex_init(&filesys->flush_lock, NULL);
+    pthread_cond_init(&filesys->flush_cond, NULL);
+    filesys->flush_running = false;
+    filesys->flush_stop = false;
+    filesys->flush_interval = 0;
+    filesys->flush_ratio = 100;
+
+    pthread_mutex_init(&filesys->scrub_lock, NULL);
+    filesys->scrub_running = false;
+    filesys->scrub_stop = false;
+    filesys->scrub_rate = 0;
+    zero(&filesys->scrub, sizeof(scrub_t));
+}
+
+private void destroy_locks(filesys_t *filesys)
+{
+    uint16_t index;
+
+    for (index = 0; index < INODE_LOCKS; index++)
+        pthread_rwlock_destroy(&filesys->inode_locks[index]);
+
+    for (index = 0; index < IBLOCK_LOCKS; index++)
+        pthread_mutex_destroy(&filesys->iblock_locks[index]);
+
+    pthread_mutex_destroy(&filesys->super_lock);
+    pthread_mutex_destroy(&filesys->wback_lock);
+    pthread_mutex_destroy(&filesys->sync_lock);
+    pthread_mutex_destroy(&filesys->dedup_lock);
+    pthread_mutex_destroy(&filesys->xattr_lock);
+    pthread_mutex_destroy(&filesys->names_lock);
+    pthread_mutex_destroy(&filesys->orphan_lock);
+    pthread_mutex_destroy(&filesys->quota_lock);
+    pthread_mutex_destroy(&filesys->flush_lock);
+    pthread_cond_destroy(&filesys->flush_cond);
+    pthread_mutex_destroy(&filesys->scrub_lock);
+}
+
+// zeroes the inode blocks past the watermark up to and including upto, a chunk per write,
+// then moves the watermark (in memory and on the drive) up to upto
+// these writes skip the dirty block table: the zeroes have to be durable before the watermark
+// covering them is, and the watermark before any inode written into the blocks
+private bool init_inode_blocks(filesys_t *filesys, uint16_t upto)
+{
+    uint16_t blk, count;
+    bool ret;
+
+    pthread_mutex_lock(&filesys->super_lock);
+    ret = true;
+
+    for (blk = filesys->inode_init + 1; ret && blk <= upto; blk += count)
+    {
+        count = upto - blk + 1;
+        if (count > LAZY_INIT_CHUNK)
+            count = LAZY_INIT_CHUNK;
+
+        ret = d_write_run(filesys->drive, zero_blocks, blk, count);
+    }
+
+    // the blocks are zeroed before the watermark covering them reaches the drive
+    if (ret && upto > filesys->inode_init)
+    {
+        filesys->super_block.inode_init = upto < filesys->super_block.inode_blocks ? upto : 0;
+        ret = d_sync(filesys->drive) && super_write(filesys) && d_sync(filesys->drive);
+        if (ret)
+            __atomic_store_n(&filesys->inode_init, upto, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&filesys->super_lock);
+    return ret;
+}
+
+// zeroes the rest of the inode table a chunk at a time, pausing in between
+private void *lazy_init_worker(void *arg)
+{
+    filesys_t *filesys;
+    struct timespec pause;
+    uint16_t upto;
+
+    // none of the background threads' calls are the callers' doing, so none are traced
+    trace_pause();
+    filesys = (filesys_t *)arg;
+    pause.tv_sec = 0;
+    pause.tv_nsec = LAZY_INIT_PAUSE_US * 1000L;
+
+    while (!__atomic_load_n(&filesys->init_stop, __ATOMIC_ACQUIRE) &&
+           inode_watermark(filesys) < filesys->super_block.inode_blocks)
+    {
+        upto = inode_watermark(filesys) + LAZY_INIT_CHUNK;
+        if (upto > filesys->super_block.inode_blocks || upto < LAZY_INIT_CHUNK)
+            upto = filesys->super_block.inode_blocks;
+
+        if (!init_inode_blocks(filesys, upto))
+            break; // fs_put_inode and fs_create will initialize what they need
+
+        nanosleep(&pause, NULL);
+    }
+
+    return NULL;
+}
+
+// starts zeroing the rest of the inode table in the background, if there is any left
+private void start_lazy_init(filesys_t *filesys)
+{
+    if (inode_watermark(filesys) >= filesys->super_block.inode_blocks)
+        return;
+
+    filesys->init_running = !pthread_create(&filesys->init_thread, NULL, lazy_init_worker, filesys);
+}
+
+// reads the bitmap (and the reference counts, into filesys->refs, and the checksum table, into filesys->sums)
+// saved by the last clean unmount; returns NULL if there is none to trust
+private bitmap_t load_bitmap(filesys_t *filesys)
+{
+    superblock_t *sb;
+    bitmap_t bitmap;
+    uint8_t *buf;
+    uint16_t size;
+
+    sb = &filesys->super_block;
+    size = ((filesys->drive->blocks + 63) / 64) * 8;
+    if (sb->state != STATE_CLEAN || sb->blocks != filesys->drive->blocks || sb->bitmap_start != sb->inode_blocks + 1 ||
+        sb->bitmap_blocks != (size + BLOCK_SIZE - 1) / BLOCK_SIZE || last_meta_block(sb) >= sb->blocks)
+        return NULL;
+
+    buf = malloc((size_t)(sb->bitmap_blocks + sb->refs_blocks) * BLOCK_SIZE);
+    if (!buf)
+        return NULL;
+
+    bitmap = fs_mkbitmap(filesys, false);
+    if (!bitmap || !d_read_run(filesys->drive, buf, sb->bitmap_start, sb->bitmap_blocks + sb->refs_blocks))
+    {
+        free(bitmap);
+        free(buf);
+        return NULL;
+    }
+
+    copy(bitmap, buf, size);
+    if (filesys->refs)
+        copy(filesys->refs, buf + sb->bitmap_blocks * BLOCK_SIZE, filesys->drive->blocks);
+    free(buf);
+
+    // the checksum table sits past the name index, so it takes a read of it's own
+    if (filesys->sums && !d_read_run(filesys->drive, (uint8_t *)filesys->sums, sums_start(sb), sb->sums_blocks))
+    {
+        free(bitmap);
+        return NULL;
+    }
+
+    return bitmap;
+}
+
+// maps the first len bytes of the drive, or takes another reference to the view already mapped;
+// the mapping outlives the file descriptor it was made through
+// a drive made of several has no file of it's own to map, so each mount of one reads a copy of it's own
+private uint8_t *view_get(drive_t *drive, size_t len)
+{
+    view_t *view;
+    void *base;
+
+    if (drive->raid)
+    {
+        base = malloc(len);
+        if (base && !d_read_run(drive, base, 0, len / BLOCK_SIZE))
+        {
+            free(base);
+            base = NULL;
+        }
+        return base;
+    }
+
+    view = &views[__builtin_ctz(drive->drive_num)];
+    pthread_mutex_lock(&views_lock);
+    if (!view->users)
+    {
+        base = mmap(NULL, len, PROT_READ, MAP_SHARED, drive->fd, 0);
+        if (base == MAP_FAILED)
+        {
+            pthread_mutex_unlock(&views_lock);
+            return NULL;
+        }
+
+        view->base = base;
+        view->len = len;
+    }
+
+    // no one can write the drive while there are readers, so the view can't be out of date
+    base = view->len >= len ? view->base : NULL;
+    if (base)
+        view->users++;
+    pthread_mutex_unlock(&views_lock);
+
+    return base;
+}
+
+private void view_put(filesys_t *filesys)
+{
+    view_t *view;
+
+    if (filesys->drive->raid)
+    {
+        free(filesys->view);
+        return;
+    }
+
+    view = &views[__builtin_ctz(filesys->drive->drive_num)];
+    pthread_mutex_lock(&views_lock);
+    if (!--view->users)
+    {
+        munmap(view->base, view->len);
+        view->base = NULL;
+    }
+    pthread_mutex_unlock(&views_lock);
+}
+
+// fs_mount with readonly set; there is no bitmap to build, no dirty block table and no
+// background thread, and the superblock, inode table, saved bitmap and reference counts, the
+// name index and the checksum table are read straight out of the shared view
+private filesys_t *mount_ro(uint8_t drive_num)
+{
+    drive_t *drive_desc;
+    filesys_t *filesys;
+    superblock_t *sb;
+    uint8_t owner;
+
+    drive_desc = d_attach_ro(drive_num);
+    if (!drive_desc)
+        return NULL;
+
+    filesys = malloc(sizeof(filesys_t));
+    if (!filesys)
+    {
+        d_detach(drive_desc);
+        return NULL;
+    }
+
+    zero(filesys, sizeof(filesys_t));
+    filesys->drive = drive_desc;
+    filesys->drive_num = drive_num;
+    sb = &filesys->super_block;
+
+    // only a volume unmounted cleanly has metadata that can be used as it is
+    if (!d_read(drive_desc, (uint8_t *)sb, 0) || sb->magic1 != MAGIC1 || sb->magic2 != MAGIC2 || sb->version != FS_VERSION ||
+        (has_csum(filesys) && sb->checksum != super_sum(sb)) ||
+        sb->state != STATE_CLEAN || sb->blocks != drive_desc->blocks || last_meta_block(sb) >= drive_desc->blocks)
+    {
+        free(filesys);
+        d_detach(drive_desc);
+        return NULL;
+    }
+
+    filesys->view = view_get(drive_desc, (last_meta_block(sb) + 1) * BLOCK_SIZE);
+    if (!filesys->view)
+    {
+        free(filesys);
+        d_detach(drive_desc);
+        return NULL;
+    }
+
+    filesys->inode_init = sb->inode_init ? sb->inode_init : sb->inode_blocks;
+    filesys->names_blocks = sb->names_blocks == names_size(sb->inode_blocks) ? sb->names_blocks : 0;
+
+    // the saved bitmap and reference counts are up to date on a clean volume; they're never written
+    // through these pointers, as everything that would is turned away on a read-only mount
+    if (sb->bitmap_start == sb->inode_blocks + 1 && sb->bitmap_blocks)
+        filesys->bitmap = view_block(filesys, sb->bitmap_start);
+    if (filesys->bitmap && sb->refs_blocks == (drive_desc->blocks + BLOCK_SIZE - 1) / BLOCK_SIZE)
+        filesys->refs = view_block(filesys, refs_start(sb));
+    if (has_csum(filesys) && sb->sums_blocks == sums_size(drive_desc->blocks))
+        filesys->sums = (uint32_t *)view_block(filesys, sums_start(sb));
+
+    // the counters saved by the unmount are as good as the rest; a volume that didn't save them (or saved ones
+    // that don't add up) is left with it's free blocks counted off the bitmap, and nothing charged to anyone
+    if (counters_valid(sb))
+    {
+        filesys->free_blocks = sb->blocks - sb->used_blocks;
+        for (owner = 0; owner < QUOTA_OWNERS; owner++)
+            filesys->usage[owner] = sb->quota[owner].used;
+    }
+    else if (filesys->bitmap)
+        filesys->free_blocks = count_free(filesys->bitmap, sb->blocks);
+
+    init_locks(filesys);
+    kprintf("Drive %s mounted read-only", d_getdrivename(drive_num));
+    return filesys;
+}
+
+internal filesys_t *fs_mount(uint8_t drive_num, bool readonly)
+{
+    filesys_t *filesys;
+    uint64_t start;
+
+    start = trace_begin();
+    filesys = mount_drive(drive_num, readonly);
+    trace_end(TRACE_MOUNT, start, drive_num, readonly, 0, filesys != NULL);
+
+    return filesys;
+}
+
+private filesys_t *mount_drive(uint8_t drive_num, bool readonly)
+{
+    drive_t *drive_desc;
+    filesys_t *filesys;
+    uint16_t blk;
+    uint8_t owner;
+
+    if (!d_is_drivenum_valid(drive_num))
+        return NULL;
+
+    if (readonly)
+        return mount_ro(drive_num);
+
+    // claim the drive, failing if some other mount already has it
+    if (__atomic_fetch_or(&mounted, drive_num, __ATOMIC_ACQ_REL) & drive_num)
+        return NULL;
+
+    drive_desc = d_attach(drive_num);
+    if (!drive_desc)
+        goto release;
+
+    filesys = malloc(sizeof(filesys_t));
+    if (!filesys)
+    {
+        d_detach(drive_desc);
+        goto release;
+    }
+
+    filesys->drive = drive_desc;
+    filesys->drive_num = drive_num;
+    filesys->occupancy = NULL;
+    filesys->wback = NULL;
+    filesys->refs = NULL;
+    filesys->sums = NULL;
+    filesys->dedup = NULL;
+    filesys->xattrs = NULL;
+    filesys->heap = NULL;
+    filesys->orphans = NULL;
+    filesys->orphan_count = filesys->orphan_room = 0;
+    filesys->orphans_lost = false;
+    filesys->view = NULL;
+
+    if (!d_read(drive_desc, (uint8_t *)&filesys->super_block, 0))
+        goto fail;
+
+    if (filesys->super_block.magic1 != MAGIC1 || filesys->super_block.magic2 != MAGIC2)
+        goto fail;
+
+    // the inodes and pointer blocks of a volume of another format would be read as garbage
+    if (filesys->super_block.version != FS_VERSION)
+    {
+        kprintf("Drive %s: the volume is of format version %u, not %u", d_getdrivename(drive_num),
+                filesys->super_block.version, FS_VERSION);
+        goto fail;
+    }
+
+    // nothing in a superblock that doesn't match it's checksum can be trusted
+    if (has_csum(filesys) && filesys->super_block.checksum != super_sum(&filesys->super_block))
+    {
+        kprintf("Drive %s: the superblock doesn't match it's checksum", d_getdrivename(drive_num));
+        goto fail;
+    }
+
+    filesys->inode_init = filesys->super_block.inode_init ? filesys->super_block.inode_init : filesys->super_block.inode_blocks;
+
+    // a volume formatted before the name index existed has none
+    filesys->names_blocks = filesys->super_block.names_blocks;
+    if (filesys->names_blocks != names_size(filesys->super_block.inode_blocks) ||
+        last_meta_block(&filesys->super_block) >= drive_desc->blocks)
+        filesys->names_blocks = 0;
+
+    // filled in by the fs_mkbitmap scan (or read back from the drive)
+    filesys->occupancy = malloc(filesys->super_block.inode_blocks + 1);
+    filesys->wback = malloc(sizeof(wback_t));
+    if (!filesys->occupancy || !filesys->wback)
+        goto fail;
+
+    // blocks can only be shared on a volume with room to save their reference counts
+    if (filesys->super_block.refs_blocks &&
+        filesys->super_block.refs_blocks == (drive_desc->blocks + BLOCK_SIZE - 1) / BLOCK_SIZE &&
+        !(filesys->refs = malloc(drive_desc->blocks)))
+        goto fail;
+
+    // and pointer, extent and xattr blocks can only be checked on one with room for their checksums
+    if (has_csum(filesys) && filesys->super_block.sums_blocks == sums_size(drive_desc->blocks) &&
+        last_meta_block(&filesys->super_block) < drive_desc->blocks &&
+        !(filesys->sums = malloc((size_t)filesys->super_block.sums_blocks * BLOCK_SIZE)))
+        goto fail;
+
+    // a clean volume has an up to date bitmap on the drive; the occupancy of it's inode
+    // blocks is then worked out as they are read. anything else has to be scanned, and
+    // the bitmap the scan builds is saved by the next sync
+    filesys->bitmap = load_bitmap(filesys);
+
+    // a clean volume saved before the space counters were, or with counters that don't add up, has them
+    // worked out by a scan
+    if (filesys->bitmap && !counters_valid(&filesys->super_block))
+    {
+        fs_dltbitmap(filesys->bitmap);
+        filesys->bitmap = NULL;
+    }
+
+    if (filesys->bitmap)
+    {
+        for (blk = 1; blk <= filesys->super_block.inode_blocks; blk++)
+            filesys->occupancy[blk - 1] = blk <= filesys->inode_init ? OCCUPANCY_UNKNOWN : 0;
+        filesys->bitmap_dirty = 0;
+        filesys->refs_dirty[0] = filesys->refs_dirty[1] = 0;
+        zero(filesys->sums_dirty, sizeof(filesys->sums_dirty));
+
+        filesys->free_blocks = filesys->super_block.blocks - filesys->super_block.used_blocks;
+        for (owner = 0; owner < QUOTA_OWNERS; owner++)
+            filesys->usage[owner] = filesys->super_block.quota[owner].used;
+    }
+    else
+    {
+        filesys->bitmap = fs_mkbitmap(filesys, true);
+        filesys->bitmap_dirty = ~0U;
+        filesys->refs_dirty[0] = filesys->refs_dirty[1] = ~0ULL;
+        for (blk = 0; blk < sizeof(filesys->sums_dirty) / sizeof(uint64_t); blk++)
+            filesys->sums_dirty[blk] = ~0ULL;
+
+        // neither can the name index be trusted
+        if (filesys->bitmap && filesys->names_blocks && !names_rebuild(filesys))
+        {
+            fs_dltbitmap(filesys->bitmap);
+            filesys->bitmap = NULL;
+        }
+
+        // the scan charged every file to it's owner along the way
+        if (filesys->bitmap)
+            filesys->free_blocks = count_free(filesys->bitmap, drive_desc->blocks);
+    }
+
+    if (!filesys->bitmap)
+        goto fail;
+
+    wb_init(filesys->wback);
+    init_locks(filesys);
+    start_lazy_init(filesys);
+    fs_set_flusher(filesys, FLUSH_INTERVAL_MS, FLUSH_DIRTY_RATIO);
+    kprintf("Drive %s mounted", d_getdrivename(drive_num));
+    return filesys;
+
+fail:
+    free(filesys->occupancy);
+    free(filesys->wback);
+    free(filesys->refs);
+    free(filesys->sums);
+    free(filesys->orphans);
+    free(filesys);
+    d_detach(drive_desc);
+
+release:
+    __atomic_fetch_and(&mounted, ~drive_num, __ATOMIC_ACQ_REL);
+    return NULL;
+}
+
+// sets (or clears) len bits starting at bit start, a whole 64-bit word at a time, returning how many changed
+// every word is changed with one atomic operation, so it's safe on a bitmap other threads are allocating from
+private uint32_t set_range(bitmap_t bitmap, uint16_t start, uint32_t len, bool used)
+{
+    uint32_t blk, end, bits, changed;
+    uint64_t mask, old;
+
+    changed = 0;
+    end = (uint32_t)start + len;
+    for (blk = start; blk < end; blk += bits)
+    {
+        // the bits of [blk, end) that fall in the word of blk
+        bits = 64 - (blk & 63);
+        if (bits > end - blk)
+            bits = end - blk;
+        mask = (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) << (blk & 63);
+
+        if (used)
+        {
+            old = __atomic_fetch_or(&bitmap_word(bitmap, blk), mask, __ATOMIC_ACQ_REL);
+            changed += __builtin_popcountll(~old & mask);
+        }
+        else
+        {
+            old = __atomic_fetch_and(&bitmap_word(bitmap, blk), ~mask, __ATOMIC_ACQ_REL);
+            changed += __builtin_popcountll(old & mask);
+        }
+    }
+
+    return changed;
+}
+
+// marks every extent of an extent inode, and the extent blocks holding them, as used;
+// the checksums of the extent blocks go into sums, unless it's NULL
+private bool mark_extents(drive_t *drive, bitmap_t bitmap, inode_t *inode, uint32_t *sums)
+{
+    datablock_t buf;
+    uint16_t index, blocknum;
+
+    for (index = 0; index < EXTENTS_PER_INODE && inode->extent[index].length; index++)
+    {
+        if ((uint32_t)inode->extent[index].start + inode->extent[index].length <= drive->blocks)
+            set_range(bitmap, inode->extent[index].start, inode->extent[index].length, true);
+    }
+
+    for (blocknum = inode->extent_ptr; blocknum && blocknum < drive->blocks; blocknum = buf.extblock.next)
+    {
+        set_bit(bitmap, blocknum);
+        if (!d_read(drive, buf.data, blocknum))
+            return false;
+        if (sums)
+            sums[blocknum] = block_sum(buf.data);
+
+        for (index = 0; index < buf.extblock.extents && index < EXTENTS_PER_BLOCK; index++)
+        {
+            if ((uint32_t)buf.extblock.extent[index].start + buf.extblock.extent[index].length <= drive->blocks)
+                set_range(bitmap, buf.extblock.extent[index].start, buf.extblock.extent[index].length, true);
+        }
+    }
+
+    return true;
+}
+
+// queues an indirect block for the second phase of the scan
+private bool scan_push(scan_t *scan, uint16_t blocknum, uint8_t level)
+{
+    pending_t *pending;
+
+    // a zero pointer is unused; a pointer past the end of the drive is garbage and is ignored
+    if (!blocknum || blocknum >= scan->drive->blocks)
+        return true;
+
+    if (scan->count == scan->capacity)
+    {
+        pending = realloc(scan->pending, (scan->capacity ? scan->capacity * 2 : 64) * sizeof(pending_t));
+        if (!pending)
+            return false;
+
+        scan->pending = pending;
+        scan->capacity = scan->capacity ? scan->capacity * 2 : 64;
+    }
+
+    scan->pending[scan->count].blocknum = blocknum;
+    scan->pending[scan->count].level = level;
+    scan->count++;
+    return true;
+}
+
+// notes an inode found with no names left
+private bool scan_orphan(scan_t *scan, uint16_t inode_index)
+{
+    uint16_t *orphans;
+
+    if (scan->orphan_count == scan->orphan_room)
+    {
+        orphans = realloc(scan->orphans, (scan->orphan_room ? scan->orphan_room * 2 : 16) * sizeof(uint16_t));
+        if (!orphans)
+            return false;
+
+        scan->orphans = orphans;
+        scan->orphan_room = scan->orphan_room ? scan->orphan_room * 2 : 16;
+    }
+
+    scan->orphans[scan->orphan_count++] = inode_index;
+    return true;
+}
+
+// marks a data block as found in use; one found again is shared, and it's extra reference counted
+private bool scan_mark(scan_t *scan, uint16_t blocknum)
+{
+    if (!get_bit(scan->shard, blocknum) || !scan->count_refs)
+    {
+        set_bit(scan->shard, blocknum);
+        return true;
+    }
+
+    if (!scan->extra)
+    {
+        scan->extra = malloc(scan->drive->blocks);
+        if (!scan->extra)
+            return false;
+        zero(scan->extra, scan->drive->blocks);
+    }
+
+    if (scan->extra[blocknum] < REFS_MAX)
+        scan->extra[blocknum]++;
+    return true;
+}
+
+private int cmp_pending(const void *a, const void *b)
+{
+    return (int)((pending_t *)a)->blocknum - (int)((pending_t *)b)->blocknum;
+}
+
+// runs scan_shard untraced; the first shard (and any whose thread couldn't be started) runs on the
+// caller's thread, so the pause ends with it
+private void *scan_worker(void *arg)
+{
+    trace_pause();
+    scan_shard((scan_t *)arg);
+    trace_resume();
+    return NULL;
+}
+
+// walks the inode blocks of one worker, then reads the indirect blocks they reference
+// one level at a time, sorted by block number so that neighbouring blocks come in with one read
+private void scan_shard(scan_t *scan)
+{
+    drive_t *drive;
+    datablock_t buf[SCAN_BATCH];
+    pending_t *batch;
+    inode_t *inode;
+    uint32_t batch_count, index, run, i;
+    uint16_t blk, count, node, ptr, blocknum;
+
+    drive = scan->drive;
+    scan->ok = false;
+
+    for (blk = scan->first; blk <= scan->last; blk += count)
+    {
+        count = scan->last - blk + 1;
+        if (count > SCAN_BATCH)
+            count = SCAN_BATCH;
+
+        if (!d_read_run(drive, buf[0].data, blk, count))
+            return;
+
+        for (i = 0; i < count; i++)
+        {
+            if (scan->occupancy)
+                scan->occupancy[blk + i - 1] = 0;
+
+            // check each inode in this block
+            for (node = 0; node < INODES_PER_BLOCK; node++)
+            {
+                inode = &(buf[i].inode[node]);
+                if (inode->file_type != TYPE_NOT_VALID && scan->occupancy)
+                    scan->occupancy[blk + i - 1]++;
+
+                // the pointers of a damaged inode are garbage as likely as not; it keeps it's slot,
+                // but none of the blocks it names are taken to be in use
+                if (inode_bad(scan->csum, inode, (blk + i - 1) * INODES_PER_BLOCK + node))
+                {
+                    kprintf("Drive %s: inode %u doesn't match it's checksum, it's blocks are left out of the bitmap",
+                            d_getdrivename(drive->drive_num), (blk + i - 1) * INODES_PER_BLOCK + node);
+                    continue;
+                }
+                scan->usage[file_owner(inode)] += file_charge(inode);
+
+                // an orphan a crash left behind still has it's blocks marked; the mount frees it later
+                if (inode->file_type != TYPE_NOT_VALID && is_orphan(inode) &&
+                    !scan_orphan(scan, (blk + i - 1) * INODES_PER_BLOCK + node))
+                    return;
+
+                // an xattr block is only read for it's checksum
+                if (inode->file_type != TYPE_NOT_VALID && inode->xattr_ptr && inode->xattr_ptr < drive->blocks &&
+                    (!scan_mark(scan, inode->xattr_ptr) || (scan->sums && !scan_push(scan, inode->xattr_ptr, 0))))
+                    return;
+
+                // an inline inode has no blocks of data at all
+                if (inode->file_type == TYPE_NOT_VALID || (inode->file_type & FLAG_INLINE))
+                    continue;
+
+                // an extent is marked with a single range operation
+                if (inode->file_type & FLAG_EXTENTS)
+                {
+                    if (!mark_extents(drive, scan->shard, inode, scan->sums))
+                        return;
+                    continue;
+                }
+
+                for (ptr = 0; ptr < PTR_PER_INODE; ptr++)
+                {
+                    blocknum = inode->direct_ptr[ptr];
+                    if (blocknum && blocknum < drive->blocks && !scan_mark(scan, blocknum))
+                        return;
+                }
+
+                if (!scan_push(scan, inode->indirect_ptr, 1) ||
+                    !scan_push(scan, inode->dindirect_ptr, 2) ||
+                    !scan_push(scan, inode->tindirect_ptr, 3))
+                    return;
+            }
+        }
+    }
+
+    // every pass reads the blocks queued by the one before it; the level of a block
+    // drops by one on each pass, so this ends after at most three passes (an xattr block
+    // is queued with level 0, and nothing below it)
+    while (scan->count)
+    {
+        batch = scan->pending;
+        batch_count = scan->count;
+        scan->pending = NULL;
+        scan->count = scan->capacity = 0;
+
+        qsort(batch, batch_count, sizeof(pending_t), cmp_pending);
+
+        for (index = 0; index < batch_count; index += run)
+        {
+            for (run = 1; index + run < batch_count && run < SCAN_BATCH; run++)
+            {
+                if (batch[index + run].blocknum != batch[index].blocknum + run)
+                    break;
+            }
+
+            if (!d_read_run(drive, buf[0].data, batch[index].blocknum, run))
+            {
+                free(batch);
+                return;
+            }
+
+            for (i = 0; i < run; i++)
+            {
+                set_bit(scan->shard, batch[index + i].blocknum);
+                if (scan->sums)
+                    scan->sums[batch[index + i].blocknum] = block_sum(buf[i].data);
+                for (ptr = 0; batch[index + i].level && ptr < PTR_PER_BLOCK; ptr++)
+                {
+                    blocknum = buf[i].ptr[ptr];
+                    if (batch[index + i].level > 1)
+                    {
+                        if (!scan_push(scan, blocknum, batch[index + i].level - 1))
+                        {
+                            free(batch);
+                            return;
+                        }
+                    }
+                    else if (blocknum && blocknum < drive->blocks && !scan_mark(scan, blocknum))
+                    {
+                        free(batch);
+                        return;
+                    }
+                }
+            }
+        }
+
+        free(batch);
+    }
+
+    scan->ok = true;
+}
+
+// filesys should have it's drive and superblock field correctly initialized
+// if filesys->occupancy is set, the scan fills it in as well, and if filesys->refs is set, it
+// counts the references to each block beyond the first into it; every file is charged to it's owner in filesys->usage
+// if filesys->sums is set, it's rebuilt from the pointer, extent and xattr blocks found; the scan has nothing to
+// check them against, as only a clean volume has a checksum table it can trust
+// orphans found go on filesys->orphans; a link has no blocks, so blocks are counted once per file however many names it has
+// the scan is split across a pool of workers by inode block range; each fills it's own
+// shard of the bitmap and the shards are OR-ed together at the end
+internal bitmap_t fs_mkbitmap(filesys_t *filesys, bool scan)
+{
+    uint16_t size, blocks, blk, inode_blocks, per_worker;
+    uint16_t workers, worker, index;
+    uint8_t owner;
+    uint64_t overlap, *word;
+    uint32_t refs, orphan;
+    long cpus;
+    bitmap_t bitmap;
+    drive_t *drive;
+    scan_t scans[SCAN_MAX_THREADS];
+    pthread_t threads[SCAN_MAX_THREADS];
+    bool started[SCAN_MAX_THREADS];
+    bool ok;
+
+    if (!filesys)
+        return NULL;
+
+    // calculate bitmap size in bytes (1 bit per block, rounded up to whole 64-bit words,
+    // which is the unit the bitmap is atomically updated in)
+    drive = filesys->drive;
+    blocks = drive->blocks;
+    size = ((blocks + 63) / 64) * 8;
+
+    // allocate and zero bitmap (malloc memory is suitably aligned for 64-bit words)
+    bitmap = malloc(size);
+    if (!bitmap)
+        return NULL;
+
+    // Initialize bitmap to all zeros
+    zero(bitmap, size);
+
+    if (!scan)
+        return bitmap;
+
+    // mark the superblock, all inode blocks and the saved bitmap as used
+    inode_blocks = filesys->super_block.inode_blocks;
+    for (blk = 0; blk <= last_meta_block(&filesys->super_block) && blk < blocks; blk++)
+        set_bit(bitmap, blk);
+
+    // blocks past the watermark have no inodes in use, so only the initialized ones are scanned
+    for (blk = filesys->inode_init + 1; filesys->occupancy && blk <= inode_blocks; blk++)
+        filesys->occupancy[blk - 1] = 0;
+
+    if (filesys->refs)
+        zero(filesys->refs, blocks);
+    for (blk = 0; filesys->sums && blk < filesys->super_block.sums_blocks; blk++)
+        zero((uint8_t *)filesys->sums + (size_t)blk * BLOCK_SIZE, BLOCK_SIZE);
+    zero(filesys->usage, sizeof(filesys->usage));
+
+    inode_blocks = filesys->inode_init < inode_blocks ? filesys->inode_init : inode_blocks;
+    if (!inode_blocks)
+        return bitmap;
+
+    // one worker per SCAN_MIN_BLOCKS inode blocks, but no more than there are cores
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    workers = inode_blocks / SCAN_MIN_BLOCKS;
+    if (cpus > 0 && workers > cpus)
+        workers = cpus;
+    if (workers > SCAN_MAX_THREADS)
+        workers = SCAN_MAX_THREADS;
+    if (!workers)
+        workers = 1;
+
+    per_worker = (inode_blocks + workers - 1) / workers;
+    workers = (inode_blocks + per_worker - 1) / per_worker; // no worker is left without blocks
+
+    // worker 0 marks straight into the result, the others get a shard of their own
+    for (worker = 0; worker < workers; worker++)
+    {
+        scans[worker].drive = drive;
+        scans[worker].first = 1 + worker * per_worker;
+        scans[worker].last = (worker + 1) * per_worker < inode_blocks ? (worker + 1) * per_worker : inode_blocks;
+        scans[worker].pending = NULL;
+        scans[worker].count = scans[worker].capacity = 0;
+        scans[worker].orphans = NULL;
+        scans[worker].orphan_count = scans[worker].orphan_room = 0;
+        scans[worker].ok = false;
+        scans[worker].shard = worker ? malloc(size) : bitmap;
+        scans[worker].occupancy = filesys->occupancy;
+        scans[worker].count_refs = filesys->refs != NULL;
+        scans[worker].extra = worker ? NULL : filesys->refs;
+        scans[worker].csum = has_csum(filesys);
+        scans[worker].sums = filesys->sums;
+        zero(scans[worker].usage, sizeof(scans[worker].usage));
+        started[worker] = false;
+
+        if (!scans[worker].shard)
+            break;
+        if (worker)
+            zero(scans[worker].shard, size);
+    }
+
+    ok = worker == workers;
+    workers = worker;
+
+    // the calling thread takes worker 0; a worker whose thread can't be started runs
+    // on the calling thread once the rest are done
+    for (worker = 1; ok && worker < workers; worker++)
+        started[worker] = !pthread_create(&threads[worker], NULL, scan_worker, &scans[worker]);
+
+    if (ok)
+        scan_worker(&scans[0]);
+
+    for (worker = 1; worker < workers; worker++)
+    {
+        if (started[worker])
+            pthread_join(threads[worker], NULL);
+        else if (ok)
+            scan_worker(&scans[worker]);
+    }
+
+    // OR-reduce the shards into the result; a block some earlier shard has too is shared
+    for (worker = 0; worker < workers; worker++)
+    {
+        ok = ok && scans[worker].ok;
+        free(scans[worker].pending);
+        for (orphan = 0; orphan < scans[worker].orphan_count; orphan++)
+            ok = ok && orphan_push(filesys, scans[worker].orphans[orphan]);
+        free(scans[worker].orphans);
+        for (owner = 0; owner < QUOTA_OWNERS; owner++)
+            filesys->usage[owner] += scans[worker].usage[owner];
+        if (!worker)
+            continue;
+
+        for (index = 0; index < size / 8; index++)
+        {
+            word = &((uint64_t *)scans[worker].shard)[index];
+            for (overlap = filesys->refs ? ((uint64_t *)bitmap)[index] & *word : 0; overlap; overlap &= overlap - 1)
+            {
+                blk = index * 64 + __builtin_ctzll(overlap);
+                if (filesys->refs[blk] < REFS_MAX)
+                    filesys->refs[blk]++;
+            }
+            ((uint64_t *)bitmap)[index] |= *word;
+        }
+
+        for (blk = 0; scans[worker].extra && blk < blocks; blk++)
+        {
+            refs = (uint32_t)filesys->refs[blk] + scans[worker].extra[blk];
+            filesys->refs[blk] = refs < REFS_MAX ? refs : REFS_MAX;
+        }
+
+        free(scans[worker].extra);
+        free(scans[worker].shard);
+    }
+
+    if (!ok)
+    {
+        free(bitmap);
+        return NULL;
+    }
+
+    return bitmap;
+}
+
+internal void fs_dltbitmap(bitmap_t bitmap) // destroys bitmap
+{
+    if (!bitmap)
+        return;
+
+    free(bitmap);
+    return;
+}
+
+// buf should be of atleast 13 bytes
+private bool get_file_name(filename_t *file_name, uint8_t *buf)
+{
+    uint8_t index;
+    uint8_t *ext;
+    uint8_t *name;
+    if (!file_name || !buf)
+        return false;
+
+    index = 0;
+    ext = file_name->extension;
+    name = file_name->name;
+
+    // Handle empty filename
+    if (!*name && !*ext)
+    {
+        buf[0] = 0;
+        return true;
+    }
+
+    while (index < 8 && index < BUF_LEN_FOR_FILENAME - 1 && *name)
+        buf[index++] = *name++;
+
+    if (*ext && index < BUF_LEN_FOR_FILENAME - 1)
+    {
+        buf[index++] = '.';
+        while (index < BUF_LEN_FOR_FILENAME - 1 && ext < file_name->extension + FILEEXT_LEN && *ext)
+            buf[index++] = *ext++;
+    }
+
+    buf[index] = '\0';
+    return true;
+}
+
+// length of a null-terminated string, or 0 if it's empty or longer than max
+private uint16_t str_len(char *str, uint16_t max)
+{
+    uint16_t len;
+
+    for (len = 0; len <= max && str[len]; len++)
+        ;
+    return len <= max ? len : 0;
+}
+
+// the 8.3 name of a file with the long name name: the first FILENAME_LEN characters before it's last dot,
+// and the first FILEEXT_LEN after it, with dots and spaces left out
+private void short_name(filename_t *out, char *name, uint8_t len)
+{
+    uint16_t index, dot;
+    uint8_t count;
+
+    zero(out, sizeof(filename_t));
+    for (dot = len; dot && name[dot - 1] != '.'; dot--)
+        ;
+
+    // a name whose only dot leads it (".profile") is all name
+    if (dot <= 1)
+        dot = len + 1;
+
+    for (index = 0, count = 0; index < dot - 1 && count < FILENAME_LEN; index++)
+    {
+        if (name[index] != '.' && name[index] != ' ')
+            out->name[count++] = name[index];
+    }
+
+    for (index = dot, count = 0; index < len && count < FILEEXT_LEN; index++)
+    {
+        if (name[index] != ' ')
+            out->extension[count++] = name[index];
+    }
+
+    // a name made up of nothing but dots and spaces still needs something to be known by
+    if (!out->name[0])
+        out->name[0] = '_';
+}
+
+// adds the free run (offset, size) to heap, merging it with it's neighbours; returns the run it ended up in,
+// or NULL if there's no memory for it (the space is lost until the next mount)
+private heapspan_t *heap_insert(nameheap_t *heap, uint32_t offset, uint32_t size)
+{
+    heapspan_t *grown;
+    uint32_t index, move;
+
+    for (index = 0; index < heap->count && heap->free[index].offset < offset; index++)
+        ;
+
+    // a run already free (the walk of heap_load may have found it so first) stays as it is
+    if (index && heap->free[index - 1].offset + heap->free[index - 1].size > offset)
+        return &heap->free[index - 1];
+    if (index < heap->count && heap->free[index].offset == offset)
+        return &heap->free[index];
+
+    if (index && heap->free[index - 1].offset + heap->free[index - 1].size == offset)
+        heap->free[--index].size += size;
+    else
+    {
+        if (heap->count == heap->capacity)
+        {
+            grown = realloc(heap->free, (heap->capacity ? heap->capacity * 2 : 64) * sizeof(heapspan_t));
+            if (!grown)
+                return NULL;
+
+            heap->free = grown;
+            heap->capacity = heap->capacity ? heap->capacity * 2 : 64;
+        }
+
+        for (move = heap->count; move > index; move--)
+            heap->free[move] = heap->free[move - 1];
+        heap->free[index].offset = offset;
+        heap->free[index].size = size;
+        heap->count++;
+    }
+
+    if (index + 1 < heap->count && heap->free[index].offset + heap->free[index].size == heap->free[index + 1].offset)
+    {
+        heap->free[index].size += heap->free[index + 1].size;
+        for (move = index + 1; move + 1 < heap->count; move++)
+            heap->free[move] = heap->free[move + 1];
+        heap->count--;
+    }
+
+    return &heap->free[index];
+}
+
+// walks the name heap once, on the first change of a long name since the mount, to find it's free space;
+// a record is in use only if it's inode still refers to it, so one left behind by a crash is found free
+// the root directory's lock must be held exclusively
+private bool heap_load(filesys_t *filesys)
+{
+    nameheap_t *heap;
+    inode_t root, inode;
+    heaprec_t rec;
+    uint32_t offset;
+    bool used;
+
+    if (filesys->heap)
+        return true;
+
+    if (!fs_get_inode(filesys, 0, &root))
+        return false;
+
+    heap = malloc(sizeof(nameheap_t));
+    if (!heap)
+        return false;
+    zero(heap, sizeof(nameheap_t));
+
+    for (offset = 0; offset < root.file_size; offset += rec.size)
+    {
+        // nothing past a damaged record can be told apart from garbage, so it's all taken to be free
+        if (read_inode(filesys, 0, offset, (uint8_t *)&rec, sizeof(heaprec_t)) != sizeof(heaprec_t) ||
+            rec.size < sizeof(heaprec_t) || rec.size > root.file_size - offset)
+            rec.size = root.file_size - offset;
+        else
+        {
+            used = rec.inode && fs_get_inode(filesys, rec.inode, &inode) && inode.file_type != TYPE_NOT_VALID &&
+                   inode.lname_len && inode.lname_off == offset;
+            if (used)
+                continue;
+        }
+
+        if (!heap_insert(heap, offset, rec.size))
+        {
+            free(heap->free);
+            free(heap);
+            return false;
+        }
+    }
+
+    filesys->heap = heap;
+    return true;
+}
+
+// writes the long name name (len bytes) of the file inode_index to the name heap, in the first free run
+// it fits in or else at the end; returns the offset of it's record, or UINT32_MAX on failure
+private uint32_t heap_alloc(filesys_t *filesys, uint16_t inode_index, char *name, uint8_t len)
+{
+    uint8_t buf[sizeof(heaprec_t) + LONG_NAME_LEN];
+    heaprec_t *rec, rest;
+    inode_t root;
+    nameheap_t *heap;
+    uint32_t index, offset, need;
+    bool ok;
+
+    rec = (heaprec_t *)buf;
+    need = sizeof(heaprec_t) + len;
+    offset = UINT32_MAX;
+
+    pthread_rwlock_wrlock(inode_lock(filesys, 0));
+    if (!heap_load(filesys) || !fs_get_inode(filesys, 0, &root))
+    {
+        pthread_rwlock_unlock(inode_lock(filesys, 0));
+        return UINT32_MAX;
+    }
+
+    heap = filesys->heap;
+    for (index = 0; index < heap->count && heap->free[index].size < need; index++)
+        ;
+
+    // a run with too little left over for another record is taken whole
+    rec->inode = inode_index;
+    rec->size = index == heap->count ? need : heap->free[index].size;
+    if (rec->size - need >= sizeof(heaprec_t))
+        rec->size = need;
+    copy(buf + sizeof(heaprec_t), name, len);
+
+    offset = index == heap->count ? root.file_size : heap->free[index].offset;
+    ok = write_inode(filesys, 0, offset, buf, need) == need;
+
+    // what's left of the run becomes a free record of it's own
+    if (ok && index < heap->count && rec->size < heap->free[index].size)
+    {
+        rest.inode = 0;
+        rest.size = heap->free[index].size - rec->size;
+        ok = write_inode(filesys, 0, offset + rec->size, (uint8_t *)&rest, sizeof(heaprec_t)) == sizeof(heaprec_t);
+    }
+
+    if (ok && index < heap->count)
+    {
+        heap->free[index].offset += rec->size;
+        heap->free[index].size -= rec->size;
+        if (!heap->free[index].size)
+        {
+            for (; index + 1 < heap->count; index++)
+                heap->free[index] = heap->free[index + 1];
+            heap->count--;
+        }
+    }
+    pthread_rwlock_unlock(inode_lock(filesys, 0));
+
+    return ok ? offset : UINT32_MAX;
+}
+
+// frees the record at offset of the name heap, as long as it still belongs to the file inode_index
+private void heap_release(filesys_t *filesys, uint16_t inode_index, uint32_t offset)
+{
+    heaprec_t rec;
+    heapspan_t *span;
+
+    pthread_rwlock_wrlock(inode_lock(filesys, 0));
+    if (heap_load(filesys) && read_inode(filesys, 0, offset, (uint8_t *)&rec, sizeof(heaprec_t)) == sizeof(heaprec_t) &&
+        rec.inode == inode_index && rec.size >= sizeof(heaprec_t))
+    {
+        // the record merges with any free ones around it, and the first of them covers the lot
+        span = heap_insert(filesys->heap, offset, rec.size);
+        if (span)
+        {
+            rec.inode = 0;
+            rec.size = span->size;
+            write_inode(filesys, 0, span->offset, (uint8_t *)&rec, sizeof(heaprec_t));
+        }
+    }
+    pthread_rwlock_unlock(inode_lock(filesys, 0));
+}
+
+// reads the long name of the file inode_index, whose inode is inode, into buf (which has room for
+// LONG_NAME_LEN bytes); returns false if the heap doesn't hold it, which it no longer may if the
+// file was renamed since inode was read
+private bool heap_name(filesys_t *filesys, uint16_t inode_index, inode_t *inode, char *buf)
+{
+    heaprec_t rec;
+    bool ok;
+
+    if (!is_readonly(filesys))
+        pthread_rwlock_rdlock(inode_lock(filesys, 0));
+    ok = read_inode(filesys, 0, inode->lname_off, (uint8_t *)&rec, sizeof(heaprec_t)) == sizeof(heaprec_t) &&
+         rec.inode == inode_index && rec.size >= sizeof(heaprec_t) + inode->lname_len &&
+         read_inode(filesys, 0, inode->lname_off + sizeof(heaprec_t), (uint8_t *)buf, inode->lname_len) == inode->lname_len;
+    if (!is_readonly(filesys))
+        pthread_rwlock_unlock(inode_lock(filesys, 0));
+
+    return ok && xxh32(buf, inode->lname_len, 0) == inode->lname_hash;
+}
+
+// points the file inode_index at the long name name (len bytes) that heap_alloc wrote at offset, along with the
+// 8.3 name made from it, and frees the record of it's old long name; if the file is gone, the new record is freed
+private bool lname_attach(filesys_t *filesys, uint16_t inode_index, char *name, uint8_t len, uint32_t offset)
+{
+    inode_t inode;
+    uint32_t old;
+    bool ok;
+
+    old = UINT32_MAX;
+    pthread_rwlock_wrlock(inode_lock(filesys, inode_index));
+    ok = fs_get_inode(filesys, inode_index, &inode) && has_name(&inode);
+    if (ok)
+    {
+        if (inode.lname_len)
+            old = inode.lname_off;
+
+        short_name(&inode.file_name, name, len);
+        inode.lname_hash = xxh32(name, len, 0);
+        inode.lname_off = offset;
+        inode.lname_len = len;
+        ok = fs_put_inode(filesys, inode_index, &inode);
+    }
+    pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+
+    // the heap is only touched once the file's lock is let go
+    if (ok && old != UINT32_MAX)
+        heap_release(filesys, inode_index, old);
+    else if (!ok)
+        heap_release(filesys, inode_index, offset);
+
+    return ok;
+}
+
+// traced as a single create, so a file it gives up on isn't seen being deleted by the caller
+internal uint16_t fs_create_long(filesys_t *filesys, char *name, uint8_t file_type)
+{
+    uint64_t start;
+    uint16_t node;
+
+    start = trace_begin();
+
+    node = 0;
+    if (filesys && name && !is_readonly(filesys))
+        node = create_long(filesys, name, file_type);
+
+    trace_end(TRACE_CREATE, start, 0, file_type, 0, node);
+    return node;
+}
+
+private uint16_t create_long(filesys_t *filesys, char *name, uint8_t file_type)
+{
+    filename_t short_form;
+    uint16_t inode_index;
+    uint32_t offset;
+    uint8_t len;
+
+    len = str_len(name, LONG_NAME_LEN);
+    if (!len)
+        return 0;
+
+    short_name(&short_form, name, len);
+    inode_index = fs_create(filesys, &short_form, file_type);
+    if (!inode_index)
+        return 0;
+
+    offset = heap_alloc(filesys, inode_index, name, len);
+    if (offset == UINT32_MAX || !lname_attach(filesys, inode_index, name, len, offset))
+    {
+        fs_delete(filesys, inode_index);
+        return 0;
+    }
+
+    return inode_index;
+}
+
+internal bool fs_rename_long(filesys_t *filesys, uint16_t inode_index, char *name)
+{
+    uint32_t offset;
+    uint8_t len;
+
+    // the root directory has no name
+    if (!filesys || !inode_index || !name || is_readonly(filesys))
+        return false;
+
+    len = str_len(name, LONG_NAME_LEN);
+    if (!len)
+        return false;
+
+    offset = heap_alloc(filesys, inode_index, name, len);
+    return offset != UINT32_MAX && lname_attach(filesys, inode_index, name, len, offset);
+}
+
+internal uint16_t fs_get_long_name(filesys_t *filesys, uint16_t inode_index, char *buf, uint16_t size)
+{
+    inode_t inode;
+    char name[LONG_NAME_LEN + 1];
+    uint16_t len;
+    bool ok;
+
+    if (!filesys || !buf || !size)
+        return 0;
+
+    if (!is_readonly(filesys))
+        pthread_rwlock_rdlock(inode_lock(filesys, inode_index));
+    ok = fs_get_inode(filesys, inode_index, &inode) && inode.file_type != TYPE_NOT_VALID;
+    if (!is_readonly(filesys))
+        pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+
+    if (!ok)
+        return 0;
+
+    if (!inode.lname_len)
+    {
+        get_file_name(&inode.file_name, (uint8_t *)name);
+        len = str_len(name, BUF_LEN_FOR_FILENAME);
+    }
+    else if (heap_name(filesys, inode_index, &inode, name))
+        len = inode.lname_len;
+    else
+        return 0;
+
+    if (!len || len >= size)
+        return 0;
+
+    copy(buf, name, len);
+    buf[len] = '\0';
+    return len;
+}
+
+internal uint16_t fs_find_by_long_name(filesys_t *filesys, char *name, uint16_t *inodes, uint16_t count)
+{
+    dirent_t entries[INODES_PER_BLOCK * 4];
+    inode_t inode;
+    char found_name[LONG_NAME_LEN];
+    uint32_t cursor, hash;
+    uint16_t found, filled, index, pos;
+    uint8_t len;
+
+    if (!filesys || !name || !inodes || !count)
+        return 0;
+
+    len = str_len(name, LONG_NAME_LEN);
+    if (!len)
+        return 0;
+    hash = xxh32(name, len, 0);
+
+    found = 0;
+    cursor = 0;
+    while (found < count && (filled = fs_readdir_batch(filesys, &cursor, entries, sizeof(entries) / sizeof(dirent_t))))
+    {
+        for (index = 0; index < filled && found < count; index++)
+        {
+            // only a file whose hash matches sends the lookup to the heap
+            if (entries[index].lname_len != len || entries[index].lname_hash != hash)
+                continue;
+
+            if (!fs_get_inode(filesys, entries[index].inode, &inode) || inode.lname_len != len ||
+                !heap_name(filesys, entries[index].inode, &inode, found_name))
+                continue;
+
+            for (pos = 0; pos < len && found_name[pos] == name[pos]; pos++)
+                ;
+            if (pos == len)
+                inodes[found++] = entries[index].inode;
+        }
+    }
+
+    return found;
+}
+
+internal uint16_t fs_readdir_batch(filesys_t *filesys, uint32_t *cursor, dirent_t *entries, uint16_t count)
+{
+    uint64_t start;
+    uint32_t from;
+    uint16_t filled;
+
+    start = trace_begin();
+    from = cursor ? *cursor : 0;
+    filled = readdir_batch(filesys, cursor, entries, count);
+    trace_end(TRACE_READDIR, start, 0, from, count, filled);
+
+    return filled;
+}
+
+private uint16_t readdir_batch(filesys_t *filesys, uint32_t *cursor, dirent_t *entries, uint16_t count)
+{
+    datablock_t buf;
+    uint32_t total;
+    uint16_t filled, blk, node;
+    inode_t *inode, target;
+    uint8_t *occupancy;
+
+    if (!filesys || !cursor || !entries || !count)
+        return 0;
+
+    total = (uint32_t)inode_watermark(filesys) * INODES_PER_BLOCK;
+    filled = 0;
+
+    while (*cursor < total && filled < count)
+    {
+        blk = *cursor / INODES_PER_BLOCK + 1;
+
+        // an empty block has nothing to list, so don't even read it
+        occupancy = filesys->occupancy ? &filesys->occupancy[blk - 1] : NULL;
+        if (occupancy && !__atomic_load_n(occupancy, __ATOMIC_RELAXED))
+        {
+            *cursor = (uint32_t)blk * INODES_PER_BLOCK;
+            continue;
+        }
+
+        if (is_readonly(filesys))
+            copy(buf.data, view_block(filesys, blk), BLOCK_SIZE);
+        else
+        {
+            pthread_mutex_lock(iblock_lock(filesys, blk));
+            if (!blk_read(filesys, buf.data, blk))
+            {
+                pthread_mutex_unlock(iblock_lock(filesys, blk));
+                break;
+            }
+            if (occupancy && *occupancy == OCCUPANCY_UNKNOWN)
+                __atomic_store_n(occupancy, count_inodes(&buf), __ATOMIC_RELAXED);
+            pthread_mutex_unlock(iblock_lock(filesys, blk));
+        }
+
+        // the cursor only moves past an inode once it's record is in entries, so a
+        // full entries array leaves the rest of the block for the next call
+        for (node = *cursor % INODES_PER_BLOCK; node < INODES_PER_BLOCK && filled < count; node++)
+        {
+            inode = &buf.inode[node];
+            *cursor = (uint32_t)(blk - 1) * INODES_PER_BLOCK + node + 1;
+            // a file whose own name was unlinked is only listed under the names of it's links
+            if (!has_name(inode) || inode_bad(has_csum(filesys), inode, *cursor - 1))
+                continue;
+
+            entries[filled].inode = *cursor - 1;
+            entries[filled].file_type = inode->file_type;
+            entries[filled].file_size = inode->file_size;
+            copy(&entries[filled].file_name, &inode->file_name, sizeof(filename_t));
+
+            // a link is listed with the size and type of the file it names
+            if ((inode->file_type & FLAG_LINK) && fs_get_inode(filesys, inode->target, &target) && target.file_type != TYPE_NOT_VALID)
+            {
+                entries[filled].file_type = (target.file_type & ~FLAG_NONAME) | FLAG_LINK;
+                entries[filled].file_size = target.file_size;
+            }
+            entries[filled].lname_hash = inode->lname_hash;
+            entries[filled].lname_len = inode->lname_len;
+            filled++;
+        }
+    }
+
+    return filled;
+}
+
+internal void fs_show(filesys_t *filesys, bool show_bitmap)
+{
+    uint16_t i, j, used_blocks, free_blocks, shared_blocks;
+    uint32_t data_blocks, extra_refs;
+    uint16_t filled, index;
+    uint8_t owner;
+    space_t space;
+    quota_t quota;
+    uint32_t cursor;
+    bitmap_t bitmap;
+    dirent_t entries[INODES_PER_BLOCK * 4];
+    uint8_t buf[BUF_LEN_FOR_FILENAME];
+
+    if (!filesys)
+        return;
+
+    // print filesystem header
+    printf("filesystem information:\n");
+    printf("======================\n");
+
+    // print superblock info
+    printf("drive number: %d\n", filesys->drive_num);
+    printf("total blocks: %d\n", filesys->super_block.blocks);
+    printf("inode blocks: %d\n", filesys->super_block.inode_blocks);
+    printf("total inodes: %d\n", filesys->super_block.inodes);
+    printf("name index blocks: %d\n", filesys->names_blocks);
+    printf("checksums: %s\n", !has_csum(filesys) ? "none" : filesys->sums ? "superblock, inodes, pointer, extent and xattr blocks" : "superblock, inodes");
+    printf("magic numbers: 0x%04x 0x%04x\n", filesys->super_block.magic1, filesys->super_block.magic2);
+    printf("format version: %u\n", filesys->super_block.version);
+
+    // print all inodes
+    printf("\n");
+    printf("inode table:\n");
+    printf("============\n");
+
+    // only valid inodes come back from the listing
+    cursor = 0;
+    while ((filled = fs_readdir_batch(filesys, &cursor, entries, sizeof(entries) / sizeof(dirent_t))))
+    {
+        for (index = 0; index < filled; index++)
+        {
+            if (!get_file_name(&entries[index].file_name, buf))
+                continue;
+
+            printf("inode_index %d: type=%d, file_size=%u (bytes), file_name=%s\n",
+                   entries[index].inode, entries[index].file_type, entries[index].file_size, (char *)buf);
+        }
+    }
+
+    printf("\n");
+
+    // the counters are kept up to date by every allocation, so there's nothing to count here
+    bitmap = filesys->bitmap;
+    fs_space(filesys, &space);
+    free_blocks = space.free;
+    used_blocks = space.blocks - space.free;
+
+    printf("used blocks: %d\n", used_blocks);
+    printf("free blocks: %d\n", free_blocks);
+    printf("reserved blocks: %u\n", space.reserved);
+
+    for (owner = 0; owner < QUOTA_OWNERS; owner++)
+    {
+        if (fs_get_quota(filesys, owner, &quota) && (quota.used || quota.limit))
+            printf("owner %d: %u blocks, limit %u\n", owner, quota.used, quota.limit);
+    }
+
+    // the dedup ratio is the number of block references files hold over the data blocks backing them
+    if (filesys->refs)
+    {
+        shared_blocks = 0;
+        extra_refs = 0;
+        for (i = 0; i < filesys->super_block.blocks; i++)
+        {
+            shared_blocks += filesys->refs[i] != 0;
+            extra_refs += filesys->refs[i];
+        }
+
+        data_blocks = used_blocks > last_meta_block(&filesys->super_block) ? used_blocks - last_meta_block(&filesys->super_block) - 1 : 0;
+        printf("shared blocks: %d\n", shared_blocks);
+        printf("dedup ratio: %.2f\n", data_blocks ? (double)(data_blocks + extra_refs) / data_blocks : 1.0);
+        if (filesys->dedup)
+            printf("dedup hits: %u\n", filesys->dedup->hits);
+        if (filesys->xattrs)
+            printf("xattr blocks shared: %u\n", filesys->xattrs->hits);
+    }
+
+    // show bitmap if requested
+    if (show_bitmap && bitmap)
+    {
+        printf("\nblock bitmap (0=free, 1=used):\n");
+        printf("==============================\n");
+
+        for (i = 0; i < filesys->super_block.blocks; i += 16)
+        {
+            printf("%04d: ", i);
             for (j = 0; j < 16 && (i + j) < filesys->super_block.blocks; j++)
             {
-                printf("%d", get_bit(bitmap, i + j) ? 1 : 0);
+                printf("%d", get_bit(bitmap, i + j) ? 1 : 0);
+            }
+            printf("\n");
+        }
+    }
+
+    printf("\n");
+}
+
+// returns 0 either when filesys is NULL or when no free block found on the drive
+internal uint16_t fs_first_free(filesys_t *filesys)
+{
+    bitmap_t bitmap;
+    uint32_t index, size;
+    uint64_t word;
+    drive_t *drive;
+
+    if (!filesys)
+        return 0;
+
+    bitmap = filesys->bitmap;
+    if (!bitmap)
+        return 0;
+
+    drive = filesys->drive;
+    size = drive->blocks; // total number of blocks in the drive (filesystem)
+
+    // skip over full words, then pick the lowest clear bit of the first word that has one
+    for (index = 0; index < size; index += 64)
+    {
+        word = __atomic_load_n(&bitmap_word(bitmap, index), __ATOMIC_RELAXED);
+        if (~word)
+        {
+            index += __builtin_ctzll(~word);
+            break;
+        }
+    }
+
+    return (index >= size) ? 0 : index; // return 0 when no free block found
+}
+
+// notes that the bits of blocks start to start + len - 1 changed, so the next sync saves them
+private void bitmap_touch(filesys_t *filesys, uint16_t start, uint32_t len)
+{
+    uint32_t first, last;
+
+    if (!len)
+        return;
+
+    first = start / BITMAP_BLOCK_BITS;
+    last = ((uint32_t)start + len - 1) / BITMAP_BLOCK_BITS;
+    __atomic_fetch_or(&filesys->bitmap_dirty, ((2U << last) - 1) & ~((1U << first) - 1), __ATOMIC_RELAXED);
+}
+
+// notes that blocks start to start + len - 1 were freed, so no data-only sync writes them until the inodes that
+// pointed at them are on the drive without them
+private void freed_mark(filesys_t *filesys, uint16_t start, uint32_t len)
+{
+    uint32_t blk;
+
+    for (blk = start; blk < (uint32_t)start + len; blk++)
+        __atomic_fetch_or(&filesys->wback->freed[0][blk / 64], 1ULL << (blk % 64), __ATOMIC_RELAXED);
+}
+
+// atomically claims block_num; returns false if it was already used
+private bool mark_block_used(filesys_t *filesys, uint16_t block_num)
+{
+    uint64_t old;
+
+    old = __atomic_fetch_or(&bitmap_word(filesys->bitmap, block_num), bitmap_mask(block_num), __ATOMIC_ACQ_REL);
+    if (old & bitmap_mask(block_num))
+        return false;
+
+    __atomic_fetch_sub(&filesys->free_blocks, 1, __ATOMIC_RELAXED);
+    blocks_taken++;
+    bitmap_touch(filesys, block_num, 1);
+    return true;
+}
+
+private void mark_block_free(filesys_t *filesys, uint16_t block_num)
+{
+    uint64_t old;
+
+    // a pointer or extent block drops it's checksum while it's still in use, so it can't
+    // wipe out the one of whoever takes the block next
+    if (filesys->sums && __atomic_load_n(&filesys->sums[block_num], __ATOMIC_RELAXED))
+        sum_set(filesys, block_num, 0);
+
+    old = __atomic_fetch_and(&bitmap_word(filesys->bitmap, block_num), ~bitmap_mask(block_num), __ATOMIC_ACQ_REL);
+    if (old & bitmap_mask(block_num))
+    {
+        __atomic_fetch_add(&filesys->free_blocks, 1, __ATOMIC_RELAXED);
+        blocks_taken--;
+    }
+    bitmap_touch(filesys, block_num, 1);
+    freed_mark(filesys, block_num, 1);
+}
+
+// number of blocks of the bitmap that are clear
+private uint32_t count_free(bitmap_t bitmap, uint16_t blocks)
+{
+    uint32_t index, used;
+
+    used = 0;
+    for (index = 0; index < blocks / 64; index++)
+        used += __builtin_popcountll(((uint64_t *)bitmap)[index]);
+    if (blocks % 64)
+        used += __builtin_popcountll(((uint64_t *)bitmap)[index] & ((1ULL << (blocks % 64)) - 1));
+
+    return blocks - used;
+}
+
+// whether the space counters saved by the last clean unmount add up: the blocks in use take in all of the metadata
+// and no more than the drive has, and no owner is charged more than every inode holding a file of the largest size
+// would be. a volume that never saved them has used_blocks 0, which doesn't
+private bool counters_valid(superblock_t *sb)
+{
+    uint64_t most;
+    uint8_t owner;
+
+    if (sb->used_blocks <= last_meta_block(sb) || sb->used_blocks > sb->blocks)
+        return false;
+
+    most = (uint64_t)sb->inode_blocks * INODES_PER_BLOCK * (((uint64_t)UINT32_MAX + BLOCK_SIZE) / BLOCK_SIZE);
+    for (owner = 0; owner < QUOTA_OWNERS; owner++)
+    {
+        if (sb->quota[owner].used > most)
+            return false;
+    }
+
+    return true;
+}
+
+// takes another reference to blocknum; fails if it already has as many as it can carry
+private bool ref_take(filesys_t *filesys, uint16_t blocknum)
+{
+    uint8_t refs;
+
+    if (!filesys->refs)
+        return false;
+
+    refs = __atomic_load_n(&filesys->refs[blocknum], __ATOMIC_RELAXED);
+    do
+    {
+        if (refs == REFS_MAX)
+            return false;
+    } while (!__atomic_compare_exchange_n(&filesys->refs[blocknum], &refs, refs + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    __atomic_fetch_or(&filesys->refs_dirty[blocknum / BLOCK_SIZE / 64], 1ULL << (blocknum / BLOCK_SIZE % 64), __ATOMIC_RELAXED);
+    return true;
+}
+
+// gives up one reference to a shared block; returns false (changing nothing) if blocknum isn't
+// shared, in which case the caller holds the only reference
+// two owners of a block shared by just the two of them can race here; exactly one of them wins
+private bool ref_drop(filesys_t *filesys, uint16_t blocknum)
+{
+    uint8_t refs;
+
+    if (!filesys->refs)
+        return false;
+
+    refs = __atomic_load_n(&filesys->refs[blocknum], __ATOMIC_RELAXED);
+    do
+    {
+        if (!refs)
+            return false;
+    } while (!__atomic_compare_exchange_n(&filesys->refs[blocknum], &refs, refs - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    __atomic_fetch_or(&filesys->refs_dirty[blocknum / BLOCK_SIZE / 64], 1ULL << (blocknum / BLOCK_SIZE % 64), __ATOMIC_RELAXED);
+    return true;
+}
+
+// drops a reference to blocknum, freeing it along with the last one
+// with dedup on, the index lock keeps the block from being shared again between the two
+private void release_block(filesys_t *filesys, uint16_t blocknum)
+{
+    if (!__atomic_load_n(&filesys->dedup, __ATOMIC_ACQUIRE))
+    {
+        if (!ref_drop(filesys, blocknum))
+            mark_block_free(filesys, blocknum);
+        return;
+    }
+
+    pthread_mutex_lock(&filesys->dedup_lock);
+    if (!ref_drop(filesys, blocknum))
+    {
+        dedup_unindex(filesys->dedup, blocknum);
+        mark_block_free(filesys, blocknum);
+    }
+    pthread_mutex_unlock(&filesys->dedup_lock);
+}
+
+// an empty index over a drive of blocks blocks; NULL if there's no memory for it
+private dedup_t *dedup_alloc(uint16_t blocks)
+{
+    dedup_t *dedup;
+
+    dedup = malloc(sizeof(dedup_t));
+    if (!dedup)
+        return NULL;
+
+    dedup->next = malloc(blocks * sizeof(uint16_t));
+    dedup->hash = malloc(blocks * sizeof(uint32_t));
+    dedup->indexed = malloc((blocks + 7) / 8);
+    if (!dedup->next || !dedup->hash || !dedup->indexed)
+    {
+        dedup_free(dedup);
+        return NULL;
+    }
+
+    zero(dedup->chain, sizeof(dedup->chain));
+    zero(dedup->indexed, (blocks + 7) / 8);
+    dedup->hits = 0;
+    return dedup;
+}
+
+private void dedup_free(dedup_t *dedup)
+{
+    if (!dedup)
+        return;
+
+    free(dedup->next);
+    free(dedup->hash);
+    free(dedup->indexed);
+    free(dedup);
+}
+
+// adds blocknum to the index under hash; the lock guarding the index must be held
+private void dedup_index(dedup_t *dedup, uint16_t blocknum, uint32_t hash)
+{
+    if (!dedup)
+        return;
+
+    dedup_unindex(dedup, blocknum);
+    dedup->hash[blocknum] = hash;
+    dedup->next[blocknum] = dedup->chain[hash % DEDUP_BUCKETS];
+    dedup->chain[hash % DEDUP_BUCKETS] = blocknum;
+    set_bit(dedup->indexed, blocknum);
+}
+
+// takes blocknum out of the index, if it's in there; the lock guarding the index must be held
+private void dedup_unindex(dedup_t *dedup, uint16_t blocknum)
+{
+    uint16_t *link;
+
+    if (!dedup || !get_bit(dedup->indexed, blocknum))
+        return;
+
+    for (link = &dedup->chain[dedup->hash[blocknum] % DEDUP_BUCKETS]; *link != blocknum; link = &dedup->next[*link])
+        ;
+    *link = dedup->next[blocknum];
+    clear_bit(dedup->indexed, blocknum);
+}
+
+// looks for a block of the index holding exactly data, taking a reference to it; hashes only pick
+// the candidates, which are compared byte for byte. returns blocknum itself (taking no reference)
+// if it already holds data, and 0 if no block does; the lock guarding the index must be held
+private uint16_t dedup_find(filesys_t *filesys, dedup_t *dedup, uint32_t hash, uint8_t *data, uint16_t blocknum)
+{
+    datablock_t buf;
+    uint16_t blk, index;
+
+    for (blk = dedup->chain[hash % DEDUP_BUCKETS]; blk; blk = dedup->next[blk])
+    {
+        if (dedup->hash[blk] != hash || !blk_read(filesys, buf.data, blk))
+            continue;
+
+        for (index = 0; index < BLOCK_SIZE && buf.data[index] == data[index]; index++)
+            ;
+        if (index < BLOCK_SIZE)
+            continue;
+
+        if (blk == blocknum)
+            return blk;
+
+        if (ref_take(filesys, blk))
+        {
+            dedup->hits++;
+            return blk;
+        }
+    }
+
+    return 0;
+}
+
+internal bool fs_set_dedup(filesys_t *filesys, bool on)
+{
+    dedup_t *dedup;
+    uint16_t blocks;
+    bool ret;
+
+    if (!filesys || (on && (!filesys->refs || is_readonly(filesys))))
+        return false;
+
+    blocks = filesys->drive->blocks;
+    ret = true;
+    pthread_mutex_lock(&filesys->dedup_lock);
+    dedup = filesys->dedup;
+    if (on && !dedup)
+    {
+        dedup = dedup_alloc(blocks);
+        ret = dedup != NULL;
+        if (ret)
+            __atomic_store_n(&filesys->dedup, dedup, __ATOMIC_RELEASE);
+    }
+    else if (!on && dedup)
+    {
+        __atomic_store_n(&filesys->dedup, NULL, __ATOMIC_RELEASE);
+        dedup_free(dedup);
+    }
+    pthread_mutex_unlock(&filesys->dedup_lock);
+
+    return ret;
+}
+
+// orders entry index of block against the key (hash, key, key_len): by hash, then by key bytes, then by length
+// the key of the entry is only looked at if the hashes match
+private int xattr_cmp(xattrblock_t *block, uint8_t index, uint32_t hash, uint8_t *key, uint8_t key_len)
+{
+    xattrent_t *entry;
+    uint8_t *data;
+    uint8_t pos;
+
+    entry = &block->entry[index];
+    if (entry->hash != hash)
+        return entry->hash < hash ? -1 : 1;
+
+    // a damaged entry sorts after anything it could be mistaken for
+    if ((uint32_t)entry->offset + entry->key_len + entry->value_len > BLOCK_SIZE)
+        return 1;
+
+    data = (uint8_t *)block + entry->offset;
+    for (pos = 0; pos < entry->key_len && pos < key_len; pos++)
+    {
+        if (data[pos] != key[pos])
+            return data[pos] < key[pos] ? -1 : 1;
+    }
+
+    return (int)entry->key_len - (int)key_len;
+}
+
+// the index of the first entry of block that doesn't sort before the key; block->count if there is none
+private uint8_t xattr_search(xattrblock_t *block, uint32_t hash, uint8_t *key, uint8_t key_len)
+{
+    uint8_t low, high, mid;
+
+    low = 0;
+    high = block->count;
+    while (low < high)
+    {
+        mid = (low + high) / 2;
+        if (xattr_cmp(block, mid, hash, key, key_len) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+// appends an attribute to a block being built, whose count starts at 0 and used at the end of all the entries
+// it will have; returns false if the key and value don't fit
+private bool xattr_put(xattrblock_t *block, uint32_t hash, uint8_t *key, uint8_t key_len, uint8_t *value, uint8_t value_len)
+{
+    xattrent_t *entry;
+
+    if (block->count == XATTRS_PER_BLOCK || (uint32_t)block->used + key_len + value_len > BLOCK_SIZE)
+        return false;
+
+    entry = &block->entry[block->count++];
+    entry->hash = hash;
+    entry->offset = block->used;
+    entry->key_len = key_len;
+    entry->value_len = value_len;
+    copy((uint8_t *)block + block->used, key, key_len);
+    copy((uint8_t *)block + block->used + key_len, value, value_len);
+    block->used += key_len + value_len;
+    return true;
+}
+
+// reads the xattr block blocknum, which a file points at; returns false if it can't be read or isn't one
+private bool xattr_read(filesys_t *filesys, uint8_t *dest, uint16_t blocknum)
+{
+    xattrblock_t *block;
+
+    block = (xattrblock_t *)dest;
+    if (blocknum <= last_meta_block(&filesys->super_block) || blocknum >= filesys->drive->blocks ||
+        !blk_read(filesys, dest, blocknum))
+        return false;
+
+    return block->count <= XATTRS_PER_BLOCK && block->used <= BLOCK_SIZE;
+}
+
+// the index of xattr blocks by content, set up on first use; NULL if blocks can't be shared on this
+// volume (or there's no memory for it). xattr_lock must be held
+private dedup_t *xattr_index(filesys_t *filesys)
+{
+    if (!filesys->xattrs && filesys->refs)
+        filesys->xattrs = dedup_alloc(filesys->drive->blocks);
+    return filesys->xattrs;
+}
+
+// puts the xattr block data on the drive for a file whose xattr block is blocknum (0 if it has none), and
+// returns the block now holding it: an indexed block with the same contents (with a reference taken,
+// unless it's blocknum itself), blocknum rewritten in place if the file is it's only owner, or else
+// a new block; 0 on failure, leaving blocknum as it was
+private uint16_t xattr_store(filesys_t *filesys, uint16_t inode_index, uint16_t blocknum, uint8_t *data)
+{
+    dedup_t *xattrs;
+    claim_t claim;
+    uint16_t target;
+    uint32_t hash;
+    int32_t taken;
+
+    hash = xxh32(data, BLOCK_SIZE, 0);
+
+    // every reference to an xattr block is taken and dropped under xattr_lock, so a block found
+    // unshared here stays that way once it's out of the index
+    pthread_mutex_lock(&filesys->xattr_lock);
+    xattrs = xattr_index(filesys);
+    target = xattrs ? dedup_find(filesys, xattrs, hash, data, blocknum) : 0;
+    if (!target && blocknum && !(filesys->refs && filesys->refs[blocknum]))
+    {
+        dedup_unindex(xattrs, blocknum);
+        target = blocknum;
+    }
+    else if (target)
+    {
+        pthread_mutex_unlock(&filesys->xattr_lock);
+        return target;
+    }
+    pthread_mutex_unlock(&filesys->xattr_lock);
+
+    if (!target)
+    {
+        if (!space_claim(filesys, inode_index, 1, &claim))
+            return 0;
+
+        taken = blocks_taken;
+        target = alloc_block(filesys, false);
+        space_release(filesys, inode_index, &claim, blocks_taken - taken);
+        if (!target)
+            return 0;
+    }
+
+    if (!meta_write(filesys, data, target))
+    {
+        if (target != blocknum)
+            mark_block_free(filesys, target);
+        return 0;
+    }
+
+    pthread_mutex_lock(&filesys->xattr_lock);
+    dedup_index(xattrs, target, hash);
+    pthread_mutex_unlock(&filesys->xattr_lock);
+    return target;
+}
+
+// the xattr block a clone of a file with the xattr block blocknum should point at: blocknum itself with
+// a reference taken, or a copy if it has all it can carry; 0 on failure
+private uint16_t xattr_share(filesys_t *filesys, uint16_t blocknum)
+{
+    datablock_t buf;
+    bool shared;
+    uint16_t newblk;
+
+    pthread_mutex_lock(&filesys->xattr_lock);
+    shared = ref_take(filesys, blocknum);
+    pthread_mutex_unlock(&filesys->xattr_lock);
+    if (shared)
+        return blocknum;
+
+    if (!xattr_read(filesys, buf.data, blocknum))
+        return 0;
+
+    newblk = alloc_block(filesys, false);
+    if (newblk && !meta_write(filesys, buf.data, newblk))
+    {
+        mark_block_free(filesys, newblk);
+        return 0;
+    }
+
+    return newblk;
+}
+
+// drops a reference to the xattr block blocknum, freeing it (and taking it out of the index) along with the last one
+private void xattr_release(filesys_t *filesys, uint16_t blocknum)
+{
+    if (!blocknum || blocknum <= last_meta_block(&filesys->super_block) || blocknum >= filesys->drive->blocks)
+        return;
+
+    pthread_mutex_lock(&filesys->xattr_lock);
+    if (!ref_drop(filesys, blocknum))
+    {
+        dedup_unindex(filesys->xattrs, blocknum);
+        mark_block_free(filesys, blocknum);
+    }
+    pthread_mutex_unlock(&filesys->xattr_lock);
+}
+
+internal bool fs_setxattr(filesys_t *filesys, uint16_t inode_index, char *key, uint8_t *value, uint8_t len)
+{
+    inode_t inode;
+    datablock_t old, new;
+    xattrent_t *entry;
+    uint16_t blocknum, old_ptr;
+    uint32_t hash;
+    uint8_t key_len, pos, index, count;
+    bool found, ok;
+
+    if (!filesys || !key || is_readonly(filesys))
+        return false;
+
+    key_len = str_len(key, XATTR_KEY_LEN);
+    if (!key_len)
+        return false;
+    hash = xxh32(key, key_len, 0);
+
+    // the attributes of a link are those of the file it names
+    inode_index = link_target(filesys, inode_index);
+    pthread_rwlock_wrlock(inode_lock(filesys, inode_index));
+    ok = fs_get_inode(filesys, inode_index, &inode) && inode.file_type != TYPE_NOT_VALID;
+    old.xattrs.count = 0;
+    if (ok && inode.xattr_ptr)
+        ok = xattr_read(filesys, old.data, inode.xattr_ptr);
+
+    pos = ok ? xattr_search(&old.xattrs, hash, (uint8_t *)key, key_len) : 0;
+    found = ok && pos < old.xattrs.count && !xattr_cmp(&old.xattrs, pos, hash, (uint8_t *)key, key_len);
+    ok = ok && (value || found);
+
+    // the new block is the old one with the attribute taken out and put back in it's place in the order
+    count = old.xattrs.count - found + (value != NULL);
+    zero(new.data, BLOCK_SIZE);
+    new.xattrs.used = 2 * sizeof(uint16_t) + count * sizeof(xattrent_t);
+    for (index = 0; ok && index <= old.xattrs.count; index++)
+    {
+        if (index == pos && value)
+            ok = xattr_put(&new.xattrs, hash, (uint8_t *)key, key_len, value, len);
+
+        if (!ok || index == old.xattrs.count || (index == pos && found))
+            continue;
+
+        entry = &old.xattrs.entry[index];
+        ok = (uint32_t)entry->offset + entry->key_len + entry->value_len <= BLOCK_SIZE &&
+             xattr_put(&new.xattrs, entry->hash, old.data + entry->offset, entry->key_len,
+                       old.data + entry->offset + entry->key_len, entry->value_len);
+    }
+
+    // a file left with no attributes has no xattr block
+    blocknum = 0;
+    if (ok && count)
+    {
+        blocknum = xattr_store(filesys, inode_index, inode.xattr_ptr, new.data);
+        ok = blocknum != 0;
+    }
+
+    if (ok)
+    {
+        old_ptr = inode.xattr_ptr;
+        inode.xattr_ptr = blocknum;
+        ok = fs_put_inode(filesys, inode_index, &inode);
+
+        // the block given up goes once the inode no longer points at it; on failure, it's the new one that goes
+        if (blocknum != old_ptr)
+            xattr_release(filesys, ok ? old_ptr : blocknum);
+    }
+    pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+
+    return ok;
+}
+
+internal bool fs_getxattr(filesys_t *filesys, uint16_t inode_index, char *key, uint8_t *value, uint8_t *len)
+{
+    inode_t inode;
+    datablock_t buf;
+    xattrent_t *entry;
+    uint32_t hash;
+    uint8_t key_len, pos;
+    bool ok;
+
+    if (!filesys || !key || !value || !len)
+        return false;
+
+    key_len = str_len(key, XATTR_KEY_LEN);
+    if (!key_len)
+        return false;
+    hash = xxh32(key, key_len, 0);
+
+    inode_index = link_target(filesys, inode_index);
+    if (!is_readonly(filesys))
+        pthread_rwlock_rdlock(inode_lock(filesys, inode_index));
+    ok = fs_get_inode(filesys, inode_index, &inode) && inode.file_type != TYPE_NOT_VALID && inode.xattr_ptr &&
+         xattr_read(filesys, buf.data, inode.xattr_ptr);
+    if (!is_readonly(filesys))
+        pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+
+    pos = ok ? xattr_search(&buf.xattrs, hash, (uint8_t *)key, key_len) : 0;
+    ok = ok && pos < buf.xattrs.count && !xattr_cmp(&buf.xattrs, pos, hash, (uint8_t *)key, key_len);
+    if (!ok)
+        return false;
+
+    entry = &buf.xattrs.entry[pos];
+    if (entry->value_len > *len)
+        return false;
+
+    copy(value, buf.data + entry->offset + entry->key_len, entry->value_len);
+    *len = entry->value_len;
+    return true;
+}
+
+internal uint16_t fs_listxattr(filesys_t *filesys, uint16_t inode_index, char *keys, uint16_t size)
+{
+    inode_t inode;
+    datablock_t buf;
+    xattrent_t *entry;
+    uint16_t total, at;
+    uint8_t index;
+    bool ok;
+
+    if (!filesys)
+        return 0;
+
+    inode_index = link_target(filesys, inode_index);
+    if (!is_readonly(filesys))
+        pthread_rwlock_rdlock(inode_lock(filesys, inode_index));
+    ok = fs_get_inode(filesys, inode_index, &inode) && inode.file_type != TYPE_NOT_VALID && inode.xattr_ptr &&
+         xattr_read(filesys, buf.data, inode.xattr_ptr);
+    if (!is_readonly(filesys))
+        pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+
+    if (!ok)
+        return 0;
+
+    total = 0;
+    for (index = 0; index < buf.xattrs.count; index++)
+    {
+        entry = &buf.xattrs.entry[index];
+        if ((uint32_t)entry->offset + entry->key_len > BLOCK_SIZE)
+            return 0;
+        total += entry->key_len + 1;
+    }
+
+    if (!keys || total > size)
+        return total;
+
+    for (at = 0, index = 0; index < buf.xattrs.count; index++)
+    {
+        entry = &buf.xattrs.entry[index];
+        copy(keys + at, buf.data + entry->offset, entry->key_len);
+        at += entry->key_len;
+        keys[at++] = '\0';
+    }
+
+    return total;
+}
+
+private bool same_name(filename_t *a, filename_t *b)
+{
+    uint8_t index;
+
+    for (index = 0; index < sizeof(filename_t) && ((uint8_t *)a)[index] == ((uint8_t *)b)[index]; index++)
+        ;
+
+    return index == sizeof(filename_t);
+}
+
+// first unused entry of a name index block; NAMES_PER_BLOCK if it's full
+private uint8_t name_slot(nameblock_t *block)
+{
+    uint8_t slot;
+
+    for (slot = 0; slot < NAMES_PER_BLOCK && block->entry[slot].inode; slot++)
+        ;
+
+    return slot;
+}
+
+// adds (name, inode_index) to the name index, in the first block from the name's own with room;
+// names_lock must be held
+private bool names_add(filesys_t *filesys, filename_t *name, uint16_t inode_index)
+{
+    datablock_t buf;
+    uint32_t home, probe, blk;
+    uint8_t slot;
+
+    home = names_home(filesys, name);
+    for (probe = 0; probe < filesys->names_blocks; probe++)
+    {
+        blk = names_start(&filesys->super_block) + (home + probe) % filesys->names_blocks;
+        if (!blk_read(filesys, buf.data, blk))
+            return false;
+
+        slot = name_slot(&buf.names);
+        if (slot < NAMES_PER_BLOCK)
+        {
+            buf.names.entry[slot].inode = inode_index;
+            copy(&buf.names.entry[slot].file_name, name, sizeof(filename_t));
+            return blk_write(filesys, buf.data, blk);
+        }
+
+        // full, so lookups of names hashing here have to look further on from now on
+        if (!buf.names.spilled)
+        {
+            buf.names.spilled = 1;
+            if (!blk_write(filesys, buf.data, blk))
+                return false;
+        }
+    }
+
+    return false;
+}
+
+// takes (name, inode_index) out of the name index; it not being there is no error
+// names_lock must be held
+private bool names_remove(filesys_t *filesys, filename_t *name, uint16_t inode_index)
+{
+    datablock_t buf;
+    uint32_t home, probe, blk;
+    uint8_t slot;
+
+    home = names_home(filesys, name);
+    for (probe = 0; probe < filesys->names_blocks; probe++)
+    {
+        blk = names_start(&filesys->super_block) + (home + probe) % filesys->names_blocks;
+        if (!blk_read(filesys, buf.data, blk))
+            return false;
+
+        for (slot = 0; slot < NAMES_PER_BLOCK; slot++)
+        {
+            if (buf.names.entry[slot].inode != inode_index || !same_name(&buf.names.entry[slot].file_name, name))
+                continue;
+
+            // the spilled mark stays, as entries past this block may still depend on it
+            zero(&buf.names.entry[slot], sizeof(nameent_t));
+            return blk_write(filesys, buf.data, blk);
+        }
+
+        if (!buf.names.spilled)
+            break;
+    }
+
+    return true;
+}
+
+// moves the index entry of inode_index from old_name to new_name; either may be NULL, for an inode
+// that wasn't in use before or isn't any longer. the root directory is never indexed
+private bool names_update(filesys_t *filesys, uint16_t inode_index, filename_t *old_name, filename_t *new_name)
+{
+    bool ret;
+
+    if (!filesys->names_blocks || !inode_index || (old_name && new_name && same_name(old_name, new_name)))
+        return true;
+
+    pthread_mutex_lock(&filesys->names_lock);
+    ret = (!old_name || names_remove(filesys, old_name, inode_index)) &&
+          (!new_name || names_add(filesys, new_name, inode_index));
+    pthread_mutex_unlock(&filesys->names_lock);
+
+    return ret;
+}
+
+// builds the name index afresh from the inode table, for a volume whose index can't be trusted
+// after a crash; the index is put together in memory and written straight to the drive, which
+// only happens while mounting, before anything else of the mount is written
+private bool names_rebuild(filesys_t *filesys)
+{
+    nameblock_t *index;
+    datablock_t *chunk;
+    uint32_t home, probe, blk, run, node, bucket;
+    uint16_t inode_index;
+    uint8_t slot;
+    bool ret;
+
+    index = calloc(filesys->names_blocks, sizeof(nameblock_t));
+    chunk = malloc(SCAN_BATCH * sizeof(datablock_t));
+    ret = index && chunk;
+
+    // blocks past the watermark have no inodes in use
+    for (blk = 1; ret && blk <= filesys->inode_init; blk += run)
+    {
+        run = filesys->inode_init - blk + 1 < SCAN_BATCH ? filesys->inode_init - blk + 1 : SCAN_BATCH;
+        if (!d_read_run(filesys->drive, chunk->data, blk, run))
+        {
+            ret = false;
+            break;
+        }
+
+        for (node = 0; node < run * INODES_PER_BLOCK; node++)
+        {
+            inode_index = (blk - 1) * INODES_PER_BLOCK + node;
+            if (!inode_index || !has_name(&chunk[node / INODES_PER_BLOCK].inode[node % INODES_PER_BLOCK]) ||
+                inode_bad(has_csum(filesys), &chunk[node / INODES_PER_BLOCK].inode[node % INODES_PER_BLOCK], inode_index))
+                continue;
+
+            home = names_home(filesys, &chunk[node / INODES_PER_BLOCK].inode[node % INODES_PER_BLOCK].file_name);
+            for (probe = 0; probe < filesys->names_blocks; probe++)
+            {
+                bucket = (home + probe) % filesys->names_blocks;
+                slot = name_slot(&index[bucket]);
+                if (slot < NAMES_PER_BLOCK)
+                    break;
+                index[bucket].spilled = 1;
+            }
+
+            // the index is sized to hold every inode there is
+            if (probe == filesys->names_blocks)
+                continue;
+
+            index[bucket].entry[slot].inode = inode_index;
+            copy(&index[bucket].entry[slot].file_name, &chunk[node / INODES_PER_BLOCK].inode[node % INODES_PER_BLOCK].file_name,
+                 sizeof(filename_t));
+        }
+    }
+
+    if (ret)
+        ret = d_write_run(filesys->drive, (uint8_t *)index, names_start(&filesys->super_block), filesys->names_blocks);
+
+    free(index);
+    free(chunk);
+    return ret;
+}
+
+internal uint16_t fs_find_by_name(filesys_t *filesys, filename_t *name, uint16_t *inodes, uint16_t count)
+{
+    datablock_t buf;
+    dirent_t entries[INODES_PER_BLOCK * 4];
+    uint32_t home, probe, blk, cursor;
+    uint16_t found, filled, index;
+    uint8_t slot;
+
+    if (!filesys || !name || !inodes || !count)
+        return 0;
+
+    found = 0;
+
+    // a volume without an index can only be searched the slow way
+    if (!filesys->names_blocks)
+    {
+        cursor = 0;
+        while (found < count && (filled = fs_readdir_batch(filesys, &cursor, entries, sizeof(entries) / sizeof(dirent_t))))
+        {
+            for (index = 0; index < filled && found < count; index++)
+            {
+                if (entries[index].inode && same_name(&entries[index].file_name, name))
+                    inodes[found++] = entries[index].inode;
+            }
+        }
+
+        return found;
+    }
+
+    if (!is_readonly(filesys))
+        pthread_mutex_lock(&filesys->names_lock);
+    home = names_home(filesys, name);
+    for (probe = 0; probe < filesys->names_blocks && found < count; probe++)
+    {
+        blk = names_start(&filesys->super_block) + (home + probe) % filesys->names_blocks;
+        if (!blk_read(filesys, buf.data, blk))
+            break;
+
+        for (slot = 0; slot < NAMES_PER_BLOCK && found < count; slot++)
+        {
+            if (buf.names.entry[slot].inode && same_name(&buf.names.entry[slot].file_name, name))
+                inodes[found++] = buf.names.entry[slot].inode;
+        }
+
+        if (!buf.names.spilled)
+            break;
+    }
+    if (!is_readonly(filesys))
+        pthread_mutex_unlock(&filesys->names_lock);
+
+    return found;
+}
+
+// the reservation slot of a file; NULL if it has none
+// called with quota_lock held
+private resv_t *resv_find(filesys_t *filesys, uint16_t inode_index)
+{
+    uint16_t slot;
+
+    if (!filesys->resv_count || !inode_index)
+        return NULL;
+
+    for (slot = 0; slot < RESV_SLOTS; slot++)
+    {
+        if (filesys->resv[slot].inode == inode_index)
+            return &filesys->resv[slot];
+    }
+
+    return NULL;
+}
+
+// sets the blocks set aside for a file to want; fails if there's no room for the difference, or no slot
+private bool resv_set(filesys_t *filesys, uint16_t inode_index, uint32_t want)
+{
+    resv_t *resv;
+    uint32_t have, free;
+    uint16_t slot;
+    bool ret;
+
+    pthread_mutex_lock(&filesys->quota_lock);
+    resv = resv_find(filesys, inode_index);
+    have = resv ? resv->blocks : 0;
+    free = __atomic_load_n(&filesys->free_blocks, __ATOMIC_RELAXED);
+    ret = want <= have || (free >= filesys->reserved && free - filesys->reserved >= want - have);
+
+    for (slot = 0; ret && !resv && want && slot < RESV_SLOTS; slot++)
+    {
+        if (!filesys->resv[slot].inode)
+        {
+            resv = &filesys->resv[slot];
+            resv->inode = inode_index;
+            filesys->resv_count++;
+        }
+    }
+
+    if (ret && want && !resv)
+        ret = false;
+
+    if (ret)
+    {
+        filesys->reserved = filesys->reserved - have + want;
+        if (resv && want)
+            resv->blocks = want;
+        else if (resv)
+        {
+            resv->inode = 0;
+            resv->blocks = 0;
+            filesys->resv_count--;
+        }
+    }
+    pthread_mutex_unlock(&filesys->quota_lock);
+
+    return ret;
+}
+
+// claims need blocks for a write to the file inode_index (0 for one that isn't any file's), taking them out of the
+// file's reservation first and then out of the blocks that are free and not reserved; fails if there aren't enough
+private bool space_claim(filesys_t *filesys, uint16_t inode_index, uint32_t need, claim_t *claim)
+{
+    resv_t *resv;
+    uint32_t free;
+    bool ret;
+
+    claim->pool = claim->own = 0;
+    if (!need)
+        return true;
+
+    pthread_mutex_lock(&filesys->quota_lock);
+    resv = resv_find(filesys, inode_index);
+    claim->own = resv ? (need < resv->blocks ? need : resv->blocks) : 0;
+
+    // blocks allocated by writes still under way are off the free count while their claims still stand,
+    // so the free space can briefly look smaller than it is, never larger
+    free = __atomic_load_n(&filesys->free_blocks, __ATOMIC_RELAXED);
+    ret = free >= filesys->reserved && free - filesys->reserved >= need - claim->own;
+    if (ret)
+    {
+        claim->pool = need - claim->own;
+        filesys->reserved += claim->pool;
+    }
+    else
+        claim->own = 0;
+    pthread_mutex_unlock(&filesys->quota_lock);
+
+    return ret;
+}
+
+// ends a claim, once the write took taken blocks; what it took out of the file's reservation is gone from it for good
+private void space_release(filesys_t *filesys, uint16_t inode_index, claim_t *claim, int32_t taken)
+{
+    resv_t *resv;
+    uint32_t drawn;
+
+    if (!claim->pool && !claim->own)
+        return;
+
+    drawn = taken <= 0 ? 0 : ((uint32_t)taken < claim->own ? (uint32_t)taken : claim->own);
+
+    pthread_mutex_lock(&filesys->quota_lock);
+    filesys->reserved -= claim->pool + drawn;
+    resv = drawn ? resv_find(filesys, inode_index) : NULL;
+    if (resv)
+    {
+        resv->blocks -= drawn;
+        if (!resv->blocks)
+        {
+            resv->inode = 0;
+            filesys->resv_count--;
+        }
+    }
+    pthread_mutex_unlock(&filesys->quota_lock);
+}
+
+// claims what owner's charge grows by when a file of it's goes from old_charge blocks to new_charge, failing if
+// that would take it over it's limit; *held is set to what was claimed, for quota_release to give back once the
+// inode is written, which is when the charge itself goes up
+private bool quota_claim(filesys_t *filesys, uint8_t owner, uint32_t old_charge, uint32_t new_charge, uint32_t *held)
+{
+    uint16_t limit;
+    bool ret;
+
+    *held = 0;
+    limit = __atomic_load_n(&filesys->super_block.quota[owner].limit, __ATOMIC_RELAXED);
+    if (!limit || new_charge <= old_charge)
+        return true;
+
+    // a change that's charged but hasn't given back it's claim yet is counted twice; the owner can briefly
+    // look nearer it's limit than it is, never further from it
+    pthread_mutex_lock(&filesys->quota_lock);
+    ret = (uint64_t)__atomic_load_n(&filesys->usage[owner], __ATOMIC_RELAXED) + filesys->held[owner] + (new_charge - old_charge) <= limit;
+    if (ret)
+    {
+        *held = new_charge - old_charge;
+        filesys->held[owner] += *held;
+    }
+    pthread_mutex_unlock(&filesys->quota_lock);
+
+    return ret;
+}
+
+private void quota_release(filesys_t *filesys, uint8_t owner, uint32_t held)
+{
+    if (!held)
+        return;
+
+    pthread_mutex_lock(&filesys->quota_lock);
+    filesys->held[owner] -= held;
+    pthread_mutex_unlock(&filesys->quota_lock);
+}
+
+// blocks a write of the file blocks first to last (counted from the start of the tree) would have to allocate under
+// the pointer blocknum of the given level: data blocks that are holes or are shared, and the pointer blocks missing
+private uint32_t tree_need(filesys_t *filesys, uint16_t blocknum, uint8_t level, uint32_t first, uint32_t last)
+{
+    datablock_t buf;
+    uint32_t need, span, index, lo, hi;
+    uint8_t below;
+
+    if (!level)
+        return !blocknum || blocknum >= filesys->drive->blocks || (filesys->refs && filesys->refs[blocknum]);
+
+    // with nothing below, every block on the way is missing: the data blocks, and the pointer
+    // blocks of each level covering them
+    if (!blocknum || blocknum >= filesys->drive->blocks || !blk_read(filesys, buf.data, blocknum))
+    {
+        need = last - first + 1;
+        for (below = 1; below <= level; below++)
+            need += (last >> (8 * below)) - (first >> (8 * below)) + 1;
+        return need;
+    }
+
+    need = 0;
+    span = 1U << (8 * (level - 1));
+    for (index = first / span; index <= last / span; index++)
+    {
+        lo = index == first / span ? first % span : 0;
+        hi = index == last / span ? last % span : span - 1;
+        need += tree_need(filesys, buf.ptr[index], level - 1, lo, hi);
+    }
+
+    return need;
+}
+
+// the most blocks a write of the file blocks first to last can allocate, the blocks mapping them included
+// the cheap bound assumes every block has to be allocated; with exact set, the mapping is walked to count
+// just what's missing, which only matters when the cheap one doesn't fit
+private uint32_t write_need(filesys_t *filesys, inode_t *inode, uint32_t first, uint32_t last, bool exact)
+{
+    datablock_t ext;
+    extent_t *extents;
+    uint32_t data, end, free, base;
+    uint16_t count, index, next;
+
+    // an inline file moves to a block of it's own first, and an extent file fills in the blocks up to the write
+    if (inode->file_type & FLAG_INLINE)
+    {
+        data = (inode->file_type & FLAG_EXTENTS) ? last + 1 : last - first + 2;
+        return data + map_blocks(data);
+    }
+
+    // an extent file can't have holes, so a write past it's end fills the gap in as well
+    if (inode->file_type & FLAG_EXTENTS)
+    {
+        end = (uint32_t)((inode->file_size + BLOCK_SIZE - 1ULL) / BLOCK_SIZE);
+        data = last >= end ? last + 1 - end : 0;
+    }
+    else
+        data = last - first + 1;
+
+    if (!exact)
+        return data ? data + map_blocks(data) : 0;
+
+    if (!(inode->file_type & FLAG_EXTENTS))
+    {
+        data = 0;
+        for (base = first; base <= last && base < DIRECT_BLOCKS; base++)
+            data += tree_need(filesys, inode->direct_ptr[base], 0, 0, 0);
+
+        // the ranges of file blocks under the indirect, double and triple indirect pointers
+        base = DIRECT_BLOCKS;
+        if (last >= base && first < base + INDIRECT_BLOCKS)
+            data += tree_need(filesys, inode->indirect_ptr, 1, first > base ? first - base : 0,
+                              (last < base + INDIRECT_BLOCKS ? last : base + INDIRECT_BLOCKS - 1) - base);
+
+        base += INDIRECT_BLOCKS;
+        if (last >= base && first < base + DINDIRECT_BLOCKS)
+            data += tree_need(filesys, inode->dindirect_ptr, 2, first > base ? first - base : 0,
+                              (last < base + DINDIRECT_BLOCKS ? last : base + DINDIRECT_BLOCKS - 1) - base);
+
+        base += DINDIRECT_BLOCKS;
+        if (last >= base)
+            data += tree_need(filesys, inode->tindirect_ptr, 3, first > base ? first - base : 0,
+                              (last < base + TINDIRECT_BLOCKS ? last : base + TINDIRECT_BLOCKS - 1) - base);
+
+        return data;
+    }
+
+    // at worst every new block of an extent file is an extent of it's own; the free slots
+    // of it's last extent container take the first of them
+    if (!data)
+        return 0;
+
+    extents = inode->extent;
+    count = EXTENTS_PER_INODE;
+    next = inode->extent_ptr;
+    while (true)
+    {
+        for (index = 0; index < count && extents[index].length; index++)
+            ;
+        if (!next || next >= filesys->drive->blocks || !blk_read(filesys, ext.data, next))
+            break;
+
+        extents = ext.extblock.extent;
+        count = EXTENTS_PER_BLOCK;
+        next = ext.extblock.next;
+    }
+
+    free = count - index;
+    return data + (data > free ? (data - free + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK : 0);
+}
+
+// allocates the first free block; a block that will hold pointers must be zeroed
+// so that all of it's pointers start out unused
+private uint16_t alloc_block(filesys_t *filesys, bool zeroed)
+{
+    uint16_t blocknum;
+    datablock_t buf;
+
+    // another thread may claim the free block first, in which case look again
+    do
+    {
+        blocknum = fs_first_free(filesys);
+        if (!blocknum)
+            return 0;
+    } while (!mark_block_used(filesys, blocknum));
+
+    if (zeroed)
+    {
+        zero(buf.data, BLOCK_SIZE);
+        if (!meta_write(filesys, buf.data, blocknum))
+        {
+            mark_block_free(filesys, blocknum);
+            return 0;
+        }
+    }
+
+    return blocknum;
+}
+
+// fs_bmap for extent inodes; on a hit, *run (if non-NULL) is set to the number of contiguous
+// blocks from file_block to the end of it's extent
+// on a miss with alloc set, the file is grown a block at a time until it covers file_block,
+// growing the last extent in place whenever the block right after it is free; blocks skipped
+// over on the way are zeroed since an extent file can't have holes
+private uint16_t ext_bmap(filesys_t *filesys, inode_t *inode, uint32_t file_block, bool alloc, bool *fresh, uint32_t *run)
+{
+    datablock_t ext, buf;
+    extent_t *extents;     // extents of the container being looked at (the inode or ext)
+    uint16_t count, index; // capacity of the container and the number of extents used in it
+    uint16_t tail, next, blocknum, newblk, from, from_len;
+    uint32_t base; // file block at which extents[index] begins
+    bool dirty;
+
+    base = 0;
+    tail = 0; // block number of ext; 0 while looking at the extents inside the inode
+    extents = inode->extent;
+    count = EXTENTS_PER_INODE;
+
+    while (true)
+    {
+        for (index = 0; index < count && extents[index].length; index++)
+        {
+            if (file_block < base + extents[index].length)
+            {
+                if (run)
+                    *run = extents[index].length - (file_block - base);
+                return extents[index].start + (file_block - base);
+            }
+            base += extents[index].length;
+        }
+
+        next = tail ? ext.extblock.next : inode->extent_ptr;
+        if (!next)
+            break;
+
+        if (!blk_read(filesys, ext.data, next))
+        {
+            bmap_failed = true;
+            return 0;
+        }
+
+        tail = next;
+        extents = ext.extblock.extent;
+        count = EXTENTS_PER_BLOCK;
+    }
+
+    if (!alloc)
+        return 0;
+
+    // extents[index - 1] is now the last extent of the file (if there is one at all)
+    blocknum = 0;
+    dirty = false;
+    zero(buf.data, BLOCK_SIZE);
+
+    // where the blocks added to the container start, so they can be given back if it can't be saved
+    from = index ? index - 1 : 0;
+    from_len = index ? extents[index - 1].length : 0;
+
+    for (; base <= file_block; base++)
+    {
+        blocknum = index ? extents[index - 1].start + extents[index - 1].length : 0;
+        if (index && extents[index - 1].length < UINT16_MAX && blocknum &&
+            blocknum < filesys->drive->blocks && mark_block_used(filesys, blocknum))
+        {
+            extents[index - 1].length++;
+        }
+        else
+        {
+            blocknum = alloc_block(filesys, false);
+            if (!blocknum)
+                break;
+
+            if (index == count)
+            {
+                // the container is full; spill into a new extent block chained after it, zeroed so that
+                // it's an empty one should the write filling it in fail
+                newblk = alloc_block(filesys, true);
+                if (!newblk)
+                {
+                    mark_block_free(filesys, blocknum);
+                    blocknum = 0;
+                    break;
+                }
+
+                if (tail)
+                {
+                    ext.extblock.next = newblk;
+                    if (!meta_write(filesys, ext.data, tail))
+                    {
+                        ext.extblock.next = 0;
+                        mark_block_free(filesys, newblk);
+                        mark_block_free(filesys, blocknum);
+                        blocknum = 0;
+                        break;
+                    }
+                }
+                else
+                    inode->extent_ptr = newblk;
+
+                zero(ext.data, BLOCK_SIZE);
+                tail = newblk;
+                extents = ext.extblock.extent;
+                count = EXTENTS_PER_BLOCK;
+                index = from = from_len = 0;
+            }
+
+            extents[index].start = blocknum;
+            extents[index].length = 1;
+            index++;
+            if (tail)
+                ext.extblock.extents = index;
+        }
+
+        dirty = tail != 0;
+
+        // a block skipped over by the write must read back as zeroes; one that can't be is given back
+        if (base < file_block && !blk_write(filesys, buf.data, blocknum))
+        {
+            if (!--extents[index - 1].length)
+                index--;
+            if (tail)
+                ext.extblock.extents = index;
+            mark_block_free(filesys, blocknum);
+            blocknum = 0;
+            break;
+        }
+    }
+
+    // the blocks recorded only in an extent block that can't be written would be lost track of
+    if (dirty && !meta_write(filesys, ext.data, tail))
+    {
+        for (; from < index; from++, from_len = 0)
+        {
+            for (; from_len < extents[from].length; from_len++)
+                mark_block_free(filesys, extents[from].start + from_len);
+        }
+        return 0;
+    }
+
+    if (base <= file_block)
+        return 0; // ran out of space
+
+    if (fresh)
+        *fresh = true;
+    if (run)
+        *run = 1;
+
+    return blocknum;
+}
+
+internal uint16_t fs_bmap(filesys_t *filesys, inode_t *inode, uint32_t file_block, bool alloc, bool *fresh)
+{
+    if (fresh)
+        *fresh = false;
+
+    if (!filesys || !inode || (alloc && is_readonly(filesys)))
+        return 0;
+
+    // the data of an inline inode isn't in any block
+    if (inode->file_type & FLAG_INLINE)
+        return 0;
+
+    if (inode->file_type & FLAG_EXTENTS)
+        return ext_bmap(filesys, inode, file_block, alloc, fresh, NULL);
+
+    return ptr_bmap(filesys, inode, file_block, alloc, fresh, 0);
+}
+
+// fs_bmap for pointer-mapped inodes; with replace non-zero, a mapped file_block is pointed at
+// replace instead, and the block it was mapped to is returned
+private uint16_t ptr_bmap(filesys_t *filesys, inode_t *inode, uint32_t file_block, bool alloc, bool *fresh, uint16_t replace)
+{
+    uint16_t blocknum, next, parent, made[4]; // made: blocks allocated on the way down, the first pointed at from parent
+    uint8_t level, levels, count;
+    uint32_t shift, slot;
+    datablock_t buf;
+
+    // work out which pointer in the inode covers file_block, and how many levels
+    // of indirect blocks hang below it
+    if (file_block < DIRECT_BLOCKS)
+    {
+        blocknum = inode->direct_ptr[file_block];
+        levels = 0;
+    }
+    else if ((file_block -= DIRECT_BLOCKS) < INDIRECT_BLOCKS)
+    {
+        blocknum = inode->indirect_ptr;
+        levels = 1;
+    }
+    else if ((file_block -= INDIRECT_BLOCKS) < DINDIRECT_BLOCKS)
+    {
+        blocknum = inode->dindirect_ptr;
+        levels = 2;
+    }
+    else if ((file_block -= DINDIRECT_BLOCKS) < TINDIRECT_BLOCKS)
+    {
+        blocknum = inode->tindirect_ptr;
+        levels = 3;
+    }
+    else
+        return 0; // past the largest possible file
+
+    count = 0;
+    parent = slot = 0; // 0 for the inode
+    if (!blocknum)
+    {
+        if (!alloc)
+            return 0;
+
+        blocknum = alloc_block(filesys, levels > 0);
+        if (!blocknum)
+            return 0;
+
+        set_top_ptr(inode, levels, file_block, blocknum);
+        made[count++] = blocknum;
+
+        if (!levels && fresh)
+            *fresh = true;
+    }
+    else if (!levels && replace)
+        inode->direct_ptr[file_block] = replace;
+
+    // walk down the indirect blocks, using one byte of file_block as the index at each level
+    for (level = levels; level > 0; level--)
+    {
+        if (!blk_read(filesys, buf.data, blocknum))
+        {
+            bmap_failed = true;
+            goto undo;
+        }
+
+        shift = (uint32_t)(level - 1) * 8;
+        next = buf.ptr[(file_block >> shift) % PTR_PER_BLOCK];
+        if (!next)
+        {
+            if (!alloc)
+                return 0;
+
+            next = alloc_block(filesys, level > 1);
+            if (!next)
+                goto undo;
+
+            if (!count)
+            {
+                parent = blocknum;
+                slot = (file_block >> shift) % PTR_PER_BLOCK;
+            }
+            made[count++] = next;
+            buf.ptr[(file_block >> shift) % PTR_PER_BLOCK] = next;
+            if (!meta_write(filesys, buf.data, blocknum))
+                goto undo;
+
+            if (level == 1 && fresh)
+                *fresh = true;
+        }
+        else if (level == 1 && replace)
+        {
+            buf.ptr[(file_block >> shift) % PTR_PER_BLOCK] = replace;
+            if (!meta_write(filesys, buf.data, blocknum))
+                return 0;
+        }
+
+        blocknum = next;
+    }
+
+    return blocknum;
+
+undo:
+    // the blocks allocated on the way down lead nowhere; the pointer to the first is taken out again
+    // and they're given back, unless the block holding that pointer can't be rewritten
+    if (!count)
+        return 0;
+
+    if (!parent)
+        set_top_ptr(inode, levels, file_block, 0);
+    else
+    {
+        if (!blk_read(filesys, buf.data, parent))
+            return 0;
+        buf.ptr[slot] = 0;
+        if (!meta_write(filesys, buf.data, parent))
+            return 0;
+    }
+
+    while (count)
+        mark_block_free(filesys, made[--count]);
+    return 0;
+}
+
+// points the inode's pointer with levels levels of indirect blocks below it at blocknum; for a direct
+// pointer, file_block says which
+private void set_top_ptr(inode_t *inode, uint8_t levels, uint32_t file_block, uint16_t blocknum)
+{
+    if (!levels)
+        inode->direct_ptr[file_block] = blocknum;
+    else if (levels == 1)
+        inode->indirect_ptr = blocknum;
+    else if (levels == 2)
+        inode->dindirect_ptr = blocknum;
+    else
+        inode->tindirect_ptr = blocknum;
+}
+
+internal uint16_t fs_create(filesys_t *filesys, filename_t *name, uint8_t file_type)
+{
+    uint64_t start;
+    uint16_t node;
+
+    start = trace_begin();
+
+    // links and unnamed files are only ever made by fs_link and fs_unlink
+    node = 0;
+    if (filesys && name && !(file_type & (FLAG_LINK | FLAG_NONAME)))
+        node = create_inode(filesys, name, file_type, 0);
+
+    trace_end(TRACE_CREATE, start, 0, file_type, 0, node);
+    return node;
+}
+
+// fs_create, but a FLAG_LINK inode is created already naming target, so it's never seen naming anything else
+private uint16_t create_inode(filesys_t *filesys, filename_t *name, uint8_t file_type, uint16_t target)
+{
+    uint16_t blk, node;
+    datablock_t buf;
+    uint8_t *occupancy;
+
+    if (!filesys || !name || (file_type & TYPE_MASK) == TYPE_NOT_VALID || is_readonly(filesys))
+        return 0;
+
+    // take the first unused inode; inode 0 is the root directory so the scan never hands it out
+    // each block is searched and claimed under it's mutex, so two creates never get the same inode
+    for (blk = 1; blk <= filesys->super_block.inode_blocks; blk++)
+    {
+        // a full block has nothing to offer
+        occupancy = filesys->occupancy ? &filesys->occupancy[blk - 1] : NULL;
+        if (occupancy && __atomic_load_n(occupancy, __ATOMIC_RELAXED) == INODES_PER_BLOCK)
+            continue;
+
+        // first touch of a block past the watermark
+        if (blk > inode_watermark(filesys) && !init_inode_blocks(filesys, blk))
+            return 0;
+
+        pthread_mutex_lock(iblock_lock(filesys, blk));
+        if (!blk_read(filesys, buf.data, blk))
+        {
+            pthread_mutex_unlock(iblock_lock(filesys, blk));
+            return 0;
+        }
+
+        // the block has been read, so it's occupancy is known from here on
+        if (occupancy && *occupancy == OCCUPANCY_UNKNOWN)
+            __atomic_store_n(occupancy, count_inodes(&buf), __ATOMIC_RELAXED);
+
+        for (node = 0; node < INODES_PER_BLOCK; node++)
+        {
+            if (buf.inode[node].file_type != TYPE_NOT_VALID)
+                continue;
+
+            zero(&buf.inode[node], sizeof(inode_t));
+            buf.inode[node].file_type = file_type;
+            copy(&buf.inode[node].file_name, name, sizeof(filename_t));
+            buf.inode[node].version = INODE_VERSION;
+            buf.inode[node].links = (file_type & FLAG_LINK) ? 0 : 1;
+            buf.inode[node].target = target;
+            if (has_csum(filesys))
+                buf.inode[node].checksum = inode_sum(&buf.inode[node], (blk - 1) * INODES_PER_BLOCK + node);
+
+            if (!blk_write(filesys, buf.data, blk))
+                node = INODES_PER_BLOCK;
+            else if (occupancy)
+                __atomic_store_n(occupancy, count_inodes(&buf), __ATOMIC_RELAXED);
+
+            // an inode the name index can't find is of no use to anyone, so it's given back
+            if (node < INODES_PER_BLOCK && !names_update(filesys, (blk - 1) * INODES_PER_BLOCK + node, NULL, name))
+            {
+                zero(&buf.inode[node], sizeof(inode_t));
+                if (blk_write(filesys, buf.data, blk) && occupancy)
+                    __atomic_store_n(occupancy, count_inodes(&buf), __ATOMIC_RELAXED);
+                node = INODES_PER_BLOCK;
+            }
+            break;
+        }
+
+        pthread_mutex_unlock(iblock_lock(filesys, blk));
+        if (node < INODES_PER_BLOCK)
+            return (blk - 1) * INODES_PER_BLOCK + node;
+    }
+
+    return 0;
+}
+
+// frees blocknum and, for an indirect block of the given level, every block below it
+private void free_tree(filesys_t *filesys, uint16_t blocknum, uint8_t level)
+{
+    datablock_t buf;
+    uint16_t ptr;
+
+    if (!blocknum || blocknum >= filesys->drive->blocks)
+        return;
+
+    if (level && blk_read(filesys, buf.data, blocknum))
+    {
+        for (ptr = 0; ptr < PTR_PER_BLOCK; ptr++)
+            free_tree(filesys, buf.ptr[ptr], level - 1);
+    }
+
+    release_block(filesys, blocknum);
+}
+
+// shares the block *blocknum of the given level with a clone, pointing *blocknum at what the clone
+// should use: a data block is shared by taking a reference (or copied, if it has all it can carry), and
+// an indirect block is copied with every block below it shared in turn
+// on failure, whatever was taken for the clone is given back
+private bool clone_tree(filesys_t *filesys, uint16_t *blocknum, uint8_t level)
+{
+    datablock_t buf;
+    uint16_t ptr, index, newblk;
+
+    if (!*blocknum || *blocknum >= filesys->drive->blocks)
+    {
+        *blocknum = 0;
+        return true;
+    }
+
+    if (!level && ref_take(filesys, *blocknum))
+        return true;
+
+    if (!blk_read(filesys, buf.data, *blocknum))
+        return false;
+
+    for (ptr = 0; level && ptr < PTR_PER_BLOCK; ptr++)
+    {
+        if (clone_tree(filesys, &buf.ptr[ptr], level - 1))
+            continue;
+
+        for (index = 0; index < ptr; index++)
+            free_tree(filesys, buf.ptr[index], level - 1);
+        return false;
+    }
+
+    newblk = alloc_block(filesys, false);
+    if (!newblk || !(level ? meta_write(filesys, buf.data, newblk) : blk_write(filesys, buf.data, newblk)))
+    {
+        if (newblk)
+            mark_block_free(filesys, newblk);
+        for (ptr = 0; level && ptr < PTR_PER_BLOCK; ptr++)
+            free_tree(filesys, buf.ptr[ptr], level - 1);
+        return false;
+    }
+
+    *blocknum = newblk;
+    return true;
+}
+
+// traced as a whole, so the clone's create (and the delete of one given up on) isn't seen as the caller's
+internal uint16_t fs_clone(filesys_t *filesys, uint16_t src_inode, filename_t *dst_name)
+{
+    uint64_t start;
+    uint16_t node;
+
+    start = trace_begin();
+
+    node = 0;
+    if (filesys && dst_name && filesys->refs && !is_readonly(filesys))
+        node = clone_file(filesys, src_inode, dst_name);
+
+    trace_end(TRACE_CLONE, start, src_inode, 0, 0, node);
+    return node;
+}
+
+private uint16_t clone_file(filesys_t *filesys, uint16_t src_inode, filename_t *dst_name)
+{
+    inode_t inode;
+    uint16_t dst, ptr[PTR_PER_INODE + 3];
+    uint8_t index, count;
+    uint32_t held;
+    claim_t claim;
+    bool ok;
+
+    // a link is cloned as the file it names
+    src_inode = link_target(filesys, src_inode);
+
+    // the clone is charged to the same owner as the file, and needs room for copies of it's indirect blocks
+    // (and of it's xattr block)
+    held = 0;
+    pthread_rwlock_rdlock(inode_lock(filesys, src_inode));
+    ok = fs_get_inode(filesys, src_inode, &inode) && inode.file_type != TYPE_NOT_VALID && !(inode.file_type & FLAG_EXTENTS) &&
+         quota_claim(filesys, file_owner(&inode), 0, file_charge(&inode), &held) &&
+         space_claim(filesys, 0, (file_charge(&inode) ? map_blocks(file_charge(&inode)) : 0) + (inode.xattr_ptr != 0), &claim);
+    dst = ok ? fs_create(filesys, dst_name, inode.file_type & ~FLAG_NONAME) : 0;
+    if (!dst)
+    {
+        if (ok)
+            space_release(filesys, 0, &claim, 0);
+        quota_release(filesys, file_owner(&inode), held);
+        pthread_rwlock_unlock(inode_lock(filesys, src_inode));
+        return 0;
+    }
+
+    // an inline file is all inode; anything else shares the blocks behind it's pointers
+    if (!(inode.file_type & FLAG_INLINE))
+    {
+        for (index = 0; index < PTR_PER_INODE; index++)
+            ptr[index] = inode.direct_ptr[index];
+        ptr[PTR_PER_INODE] = inode.indirect_ptr;
+        ptr[PTR_PER_INODE + 1] = inode.dindirect_ptr;
+        ptr[PTR_PER_INODE + 2] = inode.tindirect_ptr;
+
+        for (count = 0; ok && count < PTR_PER_INODE + 3; count++)
+            ok = clone_tree(filesys, &ptr[count], count < PTR_PER_INODE ? 0 : count - PTR_PER_INODE + 1);
+
+        if (!ok)
+        {
+            for (index = 0; index + 1 < count; index++)
+                free_tree(filesys, ptr[index], index < PTR_PER_INODE ? 0 : index - PTR_PER_INODE + 1);
+        }
+        else
+        {
+            for (index = 0; index < PTR_PER_INODE; index++)
+                inode.direct_ptr[index] = ptr[index];
+            inode.indirect_ptr = ptr[PTR_PER_INODE];
+            inode.dindirect_ptr = ptr[PTR_PER_INODE + 1];
+            inode.tindirect_ptr = ptr[PTR_PER_INODE + 2];
+        }
+    }
+
+    // the extended attributes are shared along with the data
+    if (ok && inode.xattr_ptr && !(inode.xattr_ptr = xattr_share(filesys, inode.xattr_ptr)))
+    {
+        ok = false;
+        for (index = 0; !(inode.file_type & FLAG_INLINE) && index < PTR_PER_INODE + 3; index++)
+            free_tree(filesys, ptr[index], index < PTR_PER_INODE ? 0 : index - PTR_PER_INODE + 1);
+    }
+    space_release(filesys, 0, &claim, 0);
+    pthread_rwlock_unlock(inode_lock(filesys, src_inode));
+
+    // the new inode only takes over the pointers once it's written; until then they're given back on failure
+    // it goes by dst_name alone, the long name and the links of the file staying with the file
+    copy(&inode.file_name, dst_name, sizeof(filename_t));
+    inode.lname_hash = inode.lname_off = inode.lname_len = 0;
+    inode.file_type &= ~FLAG_NONAME;
+    inode.version = INODE_VERSION;
+    inode.links = 1;
+    if (ok && !fs_put_inode(filesys, dst, &inode))
+    {
+        ok = false;
+        for (index = 0; !(inode.file_type & FLAG_INLINE) && index < PTR_PER_INODE + 3; index++)
+            free_tree(filesys, ptr[index], index < PTR_PER_INODE ? 0 : index - PTR_PER_INODE + 1);
+        xattr_release(filesys, inode.xattr_ptr);
+    }
+    quota_release(filesys, file_owner(&inode), held);
+
+    if (!ok)
+    {
+        fs_delete(filesys, dst);
+        return 0;
+    }
+
+    return dst;
+}
+
+internal bool fs_delete(filesys_t *filesys, uint16_t inode_index)
+{
+    uint64_t start;
+    bool ret;
+
+    start = trace_begin();
+    ret = delete_inode(filesys, inode_index, false);
+    trace_end(TRACE_DELETE, start, inode_index, 0, 0, ret);
+
+    return ret;
+}
+
+// with orphan set, inode_index is freed only if it's still an orphan, and otherwise an inode with no name of
+// it's own is refused; orphans are on the queue of reclaim_orphans, which is the only one to free them, so a
+// slot it's about to free can't have been freed and handed out again in the meantime
+private bool delete_inode(filesys_t *filesys, uint16_t inode_index, bool orphan)
+{
+    inode_t inode;
+    datablock_t buf;
+    uint16_t ptr, blocknum;
+    uint32_t freed, old;
+    bool ret;
+
+    // the root directory can't be deleted
+    if (!filesys || !inode_index || is_readonly(filesys))
+        return false;
+
+    pthread_rwlock_wrlock(inode_lock(filesys, inode_index));
+    if (!fs_get_inode(filesys, inode_index, &inode) || inode.file_type == TYPE_NOT_VALID ||
+        (orphan ? !is_orphan(&inode) : (inode.file_type & FLAG_NONAME) != 0))
+    {
+        pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+        return false;
+    }
+
+    // a link, or a file with other names, only loses this name
+    if ((inode.file_type & FLAG_LINK) || inode_links(&inode) > 1)
+    {
+        pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+        return fs_unlink(filesys, inode_index);
+    }
+
+    freed = 0;
+    if (inode.file_type & FLAG_INLINE)
+    {
+        // nothing to free
+    }
+    else if (inode.file_type & FLAG_EXTENTS)
+    {
+        // each extent is freed with a single range operation; one running past the end of the drive is corrupt,
+        // and left for fs_check to report rather than cleared off the end of the bitmap
+        for (ptr = 0; ptr < EXTENTS_PER_INODE && inode.extent[ptr].length; ptr++)
+        {
+            if ((uint32_t)inode.extent[ptr].start + inode.extent[ptr].length > filesys->drive->blocks)
+                continue;
+
+            freed += set_range(filesys->bitmap, inode.extent[ptr].start, inode.extent[ptr].length, false);
+            bitmap_touch(filesys, inode.extent[ptr].start, inode.extent[ptr].length);
+            freed_mark(filesys, inode.extent[ptr].start, inode.extent[ptr].length);
+        }
+
+        // an extent block is read before it's freed, while it still has a checksum to be read against
+        for (blocknum = inode.extent_ptr; blocknum && blocknum < filesys->drive->blocks; blocknum = buf.extblock.next)
+        {
+            ret = blk_read(filesys, buf.data, blocknum);
+            mark_block_free(filesys, blocknum);
+            if (!ret)
+                break;
+
+            for (ptr = 0; ptr < buf.extblock.extents && ptr < EXTENTS_PER_BLOCK; ptr++)
+            {
+                if ((uint32_t)buf.extblock.extent[ptr].start + buf.extblock.extent[ptr].length > filesys->drive->blocks)
+                    continue;
+
+                freed += set_range(filesys->bitmap, buf.extblock.extent[ptr].start, buf.extblock.extent[ptr].length, false);
+                bitmap_touch(filesys, buf.extblock.extent[ptr].start, buf.extblock.extent[ptr].length);
+                freed_mark(filesys, buf.extblock.extent[ptr].start, buf.extblock.extent[ptr].length);
+            }
+        }
+        __atomic_fetch_add(&filesys->free_blocks, freed, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        for (ptr = 0; ptr < PTR_PER_INODE; ptr++)
+            free_tree(filesys, inode.direct_ptr[ptr], 0);
+
+        free_tree(filesys, inode.indirect_ptr, 1);
+        free_tree(filesys, inode.dindirect_ptr, 2);
+        free_tree(filesys, inode.tindirect_ptr, 3);
+    }
+    xattr_release(filesys, inode.xattr_ptr);
+    old = inode.lname_len ? inode.lname_off : UINT32_MAX;
+
+    // fs_put_inode takes the inode off the occupancy of it's block, and it's charge off it's owner
+    zero(&inode, sizeof(inode_t));
+    ret = fs_put_inode(filesys, inode_index, &inode);
+
+    // whatever the file still had set aside goes back
+    resv_set(filesys, inode_index, 0);
+    pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+
+    // and so does it's long name, once it's lock is let go
+    if (ret && old != UINT32_MAX)
+        heap_release(filesys, inode_index, old);
+
+    return ret;
+}
+
+// the file the name at inode_index is a name of: inode_index itself, or the file it names if it's a link
+private uint16_t link_target(filesys_t *filesys, uint16_t inode_index)
+{
+    inode_t inode;
+
+    if (fs_get_inode(filesys, inode_index, &inode) && (inode.file_type & FLAG_LINK))
+        return inode.target;
+
+    return inode_index;
+}
+
+internal uint16_t fs_link(filesys_t *filesys, uint16_t inode_index, filename_t *name)
+{
+    inode_t inode;
+    uint16_t target, link;
+    bool ok;
+
+    if (!filesys || !name || is_readonly(filesys))
+        return 0;
+
+    // the root directory has no name to share
+    target = link_target(filesys, inode_index);
+    if (!target)
+        return 0;
+
+    // the count goes up before the link is there, so a crash in between leaves the file with a name
+    // too many (and kept a while longer) rather than a link to nothing
+    pthread_rwlock_wrlock(inode_lock(filesys, target));
+    ok = fs_get_inode(filesys, target, &inode) && inode.file_type != TYPE_NOT_VALID && !(inode.file_type & FLAG_LINK) &&
+         !is_orphan(&inode) && inode_links(&inode) < UINT16_MAX;
+    if (ok)
+    {
+        inode.links = inode_links(&inode) + 1;
+        inode.version = INODE_VERSION;
+        ok = fs_put_inode(filesys, target, &inode);
+    }
+    pthread_rwlock_unlock(inode_lock(filesys, target));
+
+    if (!ok)
+        return 0;
+
+    link = create_inode(filesys, name, inode_type(&inode) | FLAG_LINK, target);
+    if (!link)
+        link_drop(filesys, target);
+
+    return link;
+}
+
+// takes the name of a link that's gone off the count of the file it named
+private bool link_drop(filesys_t *filesys, uint16_t inode_index)
+{
+    inode_t inode;
+    bool ret, orphan;
+
+    pthread_rwlock_wrlock(inode_lock(filesys, inode_index));
+    ret = fs_get_inode(filesys, inode_index, &inode) && inode.file_type != TYPE_NOT_VALID && !(inode.file_type & FLAG_LINK) &&
+          inode_links(&inode);
+    orphan = false;
+    if (ret)
+    {
+        inode.links = inode_links(&inode) - 1;
+        inode.version = INODE_VERSION;
+        orphan = is_orphan(&inode);
+        ret = fs_put_inode(filesys, inode_index, &inode);
+    }
+    pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+
+    if (ret && orphan)
+    {
+        pthread_mutex_lock(&filesys->orphan_lock);
+        if (!orphan_push(filesys, inode_index))
+            filesys->orphans_lost = true;
+        pthread_mutex_unlock(&filesys->orphan_lock);
+    }
+
+    return ret;
+}
+
+internal bool fs_unlink(filesys_t *filesys, uint16_t inode_index)
+{
+    inode_t inode;
+    uint16_t target;
+    uint32_t old;
+    bool ret, orphan;
+
+    // the root directory has no name
+    if (!filesys || !inode_index || is_readonly(filesys))
+        return false;
+
+    old = UINT32_MAX;
+    target = 0;
+    orphan = false;
+    pthread_rwlock_wrlock(inode_lock(filesys, inode_index));
+    ret = fs_get_inode(filesys, inode_index, &inode) && has_name(&inode);
+    if (ret)
+    {
+        if (inode.lname_len)
+            old = inode.lname_off;
+
+        if (inode.file_type & FLAG_LINK)
+        {
+            // the link goes before the count comes down, so a crash in between only keeps the file a while longer
+            target = inode.target;
+            zero(&inode, sizeof(inode_t));
+        }
+        else
+        {
+            // the file keeps it's inode (and it's data) for it's links, losing just it's own name
+            inode.links = inode_links(&inode) - 1;
+            inode.version = INODE_VERSION;
+            inode.file_type |= FLAG_NONAME;
+            inode.lname_hash = inode.lname_off = inode.lname_len = 0;
+            orphan = is_orphan(&inode);
+        }
+        ret = fs_put_inode(filesys, inode_index, &inode);
+    }
+    pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+
+    if (ret && old != UINT32_MAX)
+        heap_release(filesys, inode_index, old);
+
+    if (ret && target)
+        ret = link_drop(filesys, target);
+
+    // a file is left in place until the next sync frees it, so unlinking one costs the same whatever it's size
+    if (ret && orphan)
+    {
+        pthread_mutex_lock(&filesys->orphan_lock);
+        if (!orphan_push(filesys, inode_index))
+            filesys->orphans_lost = true;
+        pthread_mutex_unlock(&filesys->orphan_lock);
+    }
+
+    return ret;
+}
+
+// queues an inode left with no names for the next sync to free; the caller holds orphan_lock, unless
+// the filesystem is still being mounted. an orphan that can't be queued keeps it's blocks until a scan finds it again
+private bool orphan_push(filesys_t *filesys, uint16_t inode_index)
+{
+    uint16_t *orphans;
+
+    if (filesys->orphan_count == filesys->orphan_room)
+    {
+        orphans = realloc(filesys->orphans, (filesys->orphan_room ? filesys->orphan_room * 2 : 16) * sizeof(uint16_t));
+        if (!orphans)
+            return false;
+
+        filesys->orphans = orphans;
+        filesys->orphan_room = filesys->orphan_room ? filesys->orphan_room * 2 : 16;
+    }
+
+    filesys->orphans[filesys->orphan_count++] = inode_index;
+    return true;
+}
+
+// frees the orphans queued so far, and their blocks; no orphan is ever handed out again, so one
+// taken off the queue is still an orphan by the time it's freed. one that couldn't be freed is lost
+// track of, and left for the mount after the next to find
+private void reclaim_orphans(filesys_t *filesys)
+{
+    uint16_t *orphans;
+    uint32_t count, index;
+    bool lost;
+
+    pthread_mutex_lock(&filesys->orphan_lock);
+    orphans = filesys->orphans;
+    count = filesys->orphan_count;
+    filesys->orphans = NULL;
+    filesys->orphan_count = filesys->orphan_room = 0;
+    pthread_mutex_unlock(&filesys->orphan_lock);
+
+    lost = false;
+    for (index = 0; index < count; index++)
+        lost = !delete_inode(filesys, orphans[index], true) || lost;
+
+    free(orphans);
+    if (lost)
+    {
+        pthread_mutex_lock(&filesys->orphan_lock);
+        filesys->orphans_lost = true;
+        pthread_mutex_unlock(&filesys->orphan_lock);
+    }
+}
+
+internal bool fs_rename(filesys_t *filesys, uint16_t inode_index, filename_t *name)
+{
+    inode_t inode;
+    uint32_t old;
+    bool ret;
+
+    // the root directory has no name
+    if (!filesys || !inode_index || !name || is_readonly(filesys))
+        return false;
+
+    // fs_put_inode moves the entry of the name index
+    old = UINT32_MAX;
+    pthread_rwlock_wrlock(inode_lock(filesys, inode_index));
+    ret = fs_get_inode(filesys, inode_index, &inode) && has_name(&inode);
+    if (ret)
+    {
+        if (inode.lname_len)
+            old = inode.lname_off;
+
+        copy(&inode.file_name, name, sizeof(filename_t));
+        inode.lname_hash = inode.lname_off = inode.lname_len = 0;
+        ret = fs_put_inode(filesys, inode_index, &inode);
+    }
+    pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+
+    // the long name the file had goes once the file's lock is let go
+    if (ret && old != UINT32_MAX)
+        heap_release(filesys, inode_index, old);
+
+    return ret;
+}
+
+internal bool fs_chown(filesys_t *filesys, uint16_t inode_index, uint8_t owner)
+{
+    inode_t inode;
+    uint32_t held;
+    bool ret;
+
+    if (!filesys || owner >= QUOTA_OWNERS || is_readonly(filesys))
+        return false;
+
+    // fs_put_inode moves the file's charge over to the new owner
+    inode_index = link_target(filesys, inode_index);
+    pthread_rwlock_wrlock(inode_lock(filesys, inode_index));
+    ret = fs_get_inode(filesys, inode_index, &inode) && inode.file_type != TYPE_NOT_VALID;
+    if (ret && inode.owner != owner)
+    {
+        ret = quota_claim(filesys, owner, 0, file_charge(&inode), &held);
+        inode.owner = owner;
+        ret = ret && fs_put_inode(filesys, inode_index, &inode);
+        quota_release(filesys, owner, held);
+    }
+    pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+
+    return ret;
+}
+
+internal bool fs_reserve(filesys_t *filesys, uint16_t inode_index, uint16_t blocks)
+{
+    inode_t inode;
+    bool ret;
+
+    // the root directory takes no writes
+    if (!filesys || !inode_index || is_readonly(filesys))
+        return false;
+
+    // the file's lock keeps it from being deleted (and a write to it from drawing on the old reservation) meanwhile
+    inode_index = link_target(filesys, inode_index);
+    pthread_rwlock_wrlock(inode_lock(filesys, inode_index));
+    ret = fs_get_inode(filesys, inode_index, &inode) && inode.file_type != TYPE_NOT_VALID &&
+          resv_set(filesys, inode_index, blocks ? blocks + map_blocks(blocks) : 0);
+    pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+
+    return ret;
+}
+
+internal bool fs_space(filesys_t *filesys, space_t *space)
+{
+    if (!filesys || !space)
+        return false;
+
+    space->blocks = filesys->super_block.blocks;
+    space->free = __atomic_load_n(&filesys->free_blocks, __ATOMIC_RELAXED);
+    space->reserved = __atomic_load_n(&filesys->reserved, __ATOMIC_RELAXED);
+    space->available = space->free > space->reserved ? space->free - space->reserved : 0;
+    return true;
+}
+
+internal bool fs_stats(filesys_t *filesys, fsstats_t *stats)
+{
+    if (!filesys || !stats)
+        return false;
+
+    stats->blocks_read = __atomic_load_n(&filesys->drive->blocks_read, __ATOMIC_RELAXED);
+    stats->blocks_written = __atomic_load_n(&filesys->drive->blocks_written, __ATOMIC_RELAXED);
+    stats->cache_lookups = __atomic_load_n(&filesys->cache_lookups, __ATOMIC_RELAXED);
+    stats->cache_hits = __atomic_load_n(&filesys->cache_hits, __ATOMIC_RELAXED);
+    return true;
+}
+
+internal bool fs_get_quota(filesys_t *filesys, uint8_t owner, quota_t *quota)
+{
+    if (!filesys || !quota || owner >= QUOTA_OWNERS)
+        return false;
+
+    quota->used = __atomic_load_n(&filesys->usage[owner], __ATOMIC_RELAXED);
+    quota->limit = __atomic_load_n(&filesys->super_block.quota[owner].limit, __ATOMIC_RELAXED);
+    return true;
+}
+
+// the limit goes to the drive right away, with the rest of the superblock as it was last written;
+// the usage saved in it is only read back after a clean unmount, which saves it afresh
+internal bool fs_set_quota(filesys_t *filesys, uint8_t owner, uint16_t limit)
+{
+    uint16_t old;
+    bool ret;
+
+    if (!filesys || owner >= QUOTA_OWNERS || is_readonly(filesys))
+        return false;
+
+    pthread_mutex_lock(&filesys->super_lock);
+    old = filesys->super_block.quota[owner].limit;
+    __atomic_store_n(&filesys->super_block.quota[owner].limit, limit, __ATOMIC_RELAXED);
+    ret = super_write(filesys) && d_sync(filesys->drive);
+    if (!ret)
+        __atomic_store_n(&filesys->super_block.quota[owner].limit, old, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&filesys->super_lock);
+
+    return ret;
+}
+
+// claims the len blocks from start if all of them are free; a block another thread
+// takes in the meantime makes it give back the ones it already has
+private bool claim_blocks(filesys_t *filesys, uint16_t start, uint16_t len)
+{
+    uint32_t blk;
+
+    if ((uint32_t)start + len > filesys->drive->blocks)
+        return false;
+
+    for (blk = start; blk < (uint32_t)start + len; blk++)
+    {
+        if (!mark_block_used(filesys, blk))
+            break;
+    }
+
+    if (blk == (uint32_t)start + len)
+        return true;
+
+    while (blk-- > start)
+        mark_block_free(filesys, blk);
+    return false;
+}
+
+// claims len contiguous free blocks: at hint if they're free there, else at the start of the first
+// free run of at least want blocks, else of the first free run of at least len
+// returns the first block claimed; 0 if there's no free run long enough
+private uint16_t claim_run(filesys_t *filesys, uint16_t len, uint32_t want, uint16_t hint)
+{
+    uint32_t blk, start, first;
+
+    first = last_meta_block(&filesys->super_block) + 1;
+    if (hint >= first && claim_blocks(filesys, hint, len))
+        return hint;
+
+    while (true)
+    {
+        for (blk = first; blk < filesys->drive->blocks; blk++)
+        {
+            for (start = blk; blk < filesys->drive->blocks && blk - start < want && !block_in_use(filesys->bitmap, blk); blk++)
+                ;
+
+            if (blk - start >= want && claim_blocks(filesys, start, len))
+                return start;
+        }
+
+        if (want <= len)
+            return 0;
+        want = len;
+    }
+}
+
+// number of runs of contiguous blocks the blocks of a file fall into; holes don't break a run
+private uint32_t count_extents(uint16_t *map, uint32_t blocks)
+{
+    uint32_t index, extents;
+    uint16_t last;
+
+    for (index = extents = last = 0; index < blocks; index++)
+    {
+        if (!map[index])
+            continue;
+
+        if (!last || map[index] != last + 1)
+            extents++;
+        last = map[index];
+    }
+
+    return extents;
+}
+
+// sleeps for as long as it takes to bring the copying rate back down to the budget
+private void defrag_pace(defrag_run_t *run)
+{
+    struct timespec now;
+    double ahead;
+
+    if (!run->budget)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ahead = (double)run->copied / run->budget - ((now.tv_sec - run->start.tv_sec) + (now.tv_nsec - run->start.tv_nsec) / 1e9);
+    if (ahead > 0)
+        usleep((useconds_t)(ahead * 1e6));
+}
+
+// fs_defrag for a single file, with it's lock held exclusively
+private bool defrag_file(defrag_run_t *run, uint16_t inode_index)
+{
+    filesys_t *filesys;
+    inode_t inode;
+    uint32_t blocks, index, mapped, left, len, done, count;
+    uint32_t before, after;
+    uint16_t start, hint;
+    uint16_t src[DEFRAG_WINDOW];
+    claim_t claim;
+    bool shared, room, ok;
+
+    filesys = run->filesys;
+    if (!fs_get_inode(filesys, inode_index, &inode) || inode.file_type == TYPE_NOT_VALID || (inode.file_type & FLAG_INLINE))
+        return true;
+
+    blocks = (uint32_t)((inode.file_size + BLOCK_SIZE - 1ULL) / BLOCK_SIZE);
+    if (!blocks)
+        return true;
+    run->report->files++;
+
+    // a file spanning more blocks than the drive has is mostly holes; it's left alone
+    if (blocks > filesys->drive->blocks)
+    {
+        run->report->skipped++;
+        return true;
+    }
+
+    // where each block of the file is now, and whether any of them is shared
+    shared = false;
+    for (index = mapped = 0; index < blocks; index++)
+    {
+        run->map[index] = fs_bmap(filesys, &inode, index, false, NULL);
+        run->fresh[index] = 0;
+        mapped += run->map[index] != 0;
+        shared = shared || (run->map[index] && filesys->refs && filesys->refs[run->map[index]]);
+    }
+
+    before = count_extents(run->map, blocks);
+    run->report->extents_before += before;
+    if (before <= 1)
+    {
+        run->report->extents_after += before;
+        return true;
+    }
+
+    // moving a shared block would mean changing every file that has it; and the extents of an
+    // extent-mapped file can't be rewritten a block at a time
+    run->report->fragmented++;
+    if (shared || (inode.file_type & FLAG_EXTENTS))
+    {
+        run->report->skipped++;
+        run->report->extents_after += before;
+        return true;
+    }
+
+    // copy the file a window at a time, each window into free blocks right after the last if possible;
+    // the copies are claimed up front so the run never eats into a reservation
+    ok = true;
+    room = space_claim(filesys, 0, mapped, &claim);
+    hint = 0;
+    for (index = 0, left = room ? mapped : 0; ok && left; left -= len)
+    {
+        len = left < DEFRAG_WINDOW ? left : DEFRAG_WINDOW;
+        start = claim_run(filesys, len, left, hint);
+        if (!start)
+        {
+            room = false;
+            break;
+        }
+
+        for (done = 0; index < blocks && done < len; index++)
+        {
+            if (!run->map[index])
+                continue;
+
+            src[done] = run->map[index];
+            run->fresh[index] = start + done++;
+        }
+
+        // the old blocks are read a run at a time
+        for (done = 0; ok && done < len; done += count)
+        {
+            for (count = 1; done + count < len && src[done + count] == src[done] + count; count++)
+                ;
+            ok = blk_read_run(filesys, run->buf[done].data, src[done], count);
+        }
+
+        for (done = 0; ok && done < len; done++)
+            ok = blk_write(filesys, run->buf[done].data, start + done);
+
+        hint = start + len;
+        run->copied += len;
+        defrag_pace(run);
+    }
+
+    // the copies have to be on the drive before anything points at them; sync_blocks rather than fs_sync,
+    // as freeing an orphan could need the lock this file holds
+    if (!ok || !room || !sync_blocks(filesys, false))
+    {
+        // out of room, or the drive failed; the file keeps it's old blocks
+        for (index = 0; index < blocks; index++)
+        {
+            if (run->fresh[index])
+                mark_block_free(filesys, run->fresh[index]);
+        }
+
+        space_release(filesys, 0, &claim, 0);
+        run->report->skipped++;
+        run->report->extents_after += before;
+        return ok && !room;
+    }
+
+    for (index = 0; ok && index < blocks; index++)
+    {
+        if (run->fresh[index])
+            ok = ptr_bmap(filesys, &inode, index, false, NULL, run->fresh[index]) == run->map[index];
+    }
+
+    // and the new pointers have to be on the drive before the old blocks can be handed out again
+    ok = ok && fs_put_inode(filesys, inode_index, &inode) && sync_blocks(filesys, false);
+    for (index = 0; ok && index < blocks; index++)
+    {
+        if (run->fresh[index])
+            release_block(filesys, run->map[index]);
+    }
+
+    space_release(filesys, 0, &claim, 0);
+    if (!ok)
+        return false;
+
+    after = count_extents(run->fresh, blocks);
+    run->report->moved++;
+    run->report->blocks_moved += mapped;
+    run->report->extents_after += after;
+    if (run->verbose)
+        printf("inode %u: %u extents, now %u\n", inode_index, before, after);
+
+    return true;
+}
+
+internal bool fs_defrag(filesys_t *filesys, uint32_t budget, defrag_t *report, bool verbose)
+{
+    defrag_run_t run;
+    dirent_t entries[INODES_PER_BLOCK * 4];
+    uint32_t cursor;
+    uint16_t filled, index;
+    bool ok;
+
+    if (!filesys || !report || is_readonly(filesys))
+        return false;
+
+    zero(report, sizeof(defrag_t));
+    run.filesys = filesys;
+    run.report = report;
+    run.budget = budget;
+    run.copied = 0;
+    run.verbose = verbose;
+    run.map = malloc(filesys->drive->blocks * sizeof(uint16_t));
+    run.fresh = malloc(filesys->drive->blocks * sizeof(uint16_t));
+    run.buf = malloc(DEFRAG_WINDOW * sizeof(datablock_t));
+    clock_gettime(CLOCK_MONOTONIC, &run.start);
+
+    // each file is locked only while it's own blocks move, so the volume stays in use all along; the calls it takes
+    // to move them aren't the caller's, so aren't traced
+    ok = run.map && run.fresh && run.buf;
+    cursor = 0;
+    trace_pause();
+    while (ok && (filled = fs_readdir_batch(filesys, &cursor, entries, sizeof(entries) / sizeof(dirent_t))))
+    {
+        for (index = 0; ok && index < filled; index++)
+        {
+            pthread_rwlock_wrlock(inode_lock(filesys, entries[index].inode));
+            ok = defrag_file(&run, entries[index].inode);
+            pthread_rwlock_unlock(inode_lock(filesys, entries[index].inode));
+        }
+    }
+
+    trace_resume();
+
+    free(run.map);
+    free(run.fresh);
+    free(run.buf);
+    return ok;
+}
+
+// fs_read with the inode's lock held
+private uint32_t read_inode(filesys_t *filesys, uint16_t inode_index, uint32_t offset, uint8_t *buf, uint32_t len)
+{
+    inode_t inode;
+    datablock_t block;
+    uint32_t done, chunk, in_block, run;
+    uint16_t blocknum;
+
+    if (!filesys || !buf)
+        return 0;
+
+    if (!fs_get_inode(filesys, inode_index, &inode) || inode.file_type == TYPE_NOT_VALID)
+        return 0;
+
+    // a link has no data of it's own
+    if (inode.file_type & FLAG_LINK)
+    {
+        link_hop = inode.target;
+        return 0;
+    }
+
+    if (offset >= inode.file_size)
+        return 0;
+
+    if (len > inode.file_size - offset)
+        len = inode.file_size - offset;
+
+    // an inline file is served straight from the inode, without touching a data block; one whose size is more
+    // than the inode holds is corrupt, and nothing is read past it's inline data
+    if (inode.file_type & FLAG_INLINE)
+    {
+        if (inode.file_size > INLINE_DATA_LEN)
+        {
+            kprintf("Drive %s: inode %u is inline but %u bytes long", d_getdrivename(filesys->drive_num), inode_index, inode.file_size);
+            return 0;
+        }
+
+        copy(buf, inode.inline_data + offset, len);
+        return len;
+    }
+
+    for (done = 0; done < len; done += chunk)
+    {
+        in_block = (offset + done) % BLOCK_SIZE;
+        chunk = BLOCK_SIZE - in_block;
+        if (chunk > len - done)
+            chunk = len - done;
+
+        // whole blocks lying inside a single extent go straight into buf with one large read
+        if ((inode.file_type & FLAG_EXTENTS) && !in_block && len - done >= BLOCK_SIZE)
+        {
+            run = 0;
+            blocknum = ext_bmap(filesys, &inode, (offset + done) / BLOCK_SIZE, false, NULL, &run);
+            if (run > (len - done) / BLOCK_SIZE)
+                run = (len - done) / BLOCK_SIZE;
+
+            if (blocknum && blk_read_run(filesys, buf + done, blocknum, run))
+            {
+                chunk = run * BLOCK_SIZE;
+                continue;
+            }
+        }
+
+        // an unmapped block is a hole and reads back as zeroes; a mapping that can't be read is no hole
+        bmap_failed = false;
+        blocknum = fs_bmap(filesys, &inode, (offset + done) / BLOCK_SIZE, false, NULL);
+        if (!blocknum && bmap_failed)
+            break;
+        else if (!blocknum)
+            zero(block.data, BLOCK_SIZE);
+        else if (!blk_read(filesys, block.data, blocknum))
+            break;
+
+        copy(buf + done, block.data + in_block, chunk);
+    }
+
+    return done;
+}
+
+internal uint32_t fs_read(filesys_t *filesys, uint16_t inode_index, uint32_t offset, uint8_t *buf, uint32_t len)
+{
+    uint64_t start;
+    uint32_t done;
+    uint16_t node;
+    uint8_t hop;
+
+    start = trace_begin();
+
+    // a link is read through the file it names, under that file's own lock; a link never names another
+    done = 0;
+    node = inode_index;
+    for (hop = 0; filesys && buf && hop < 2; hop++)
+    {
+        link_hop = 0;
+        if (is_readonly(filesys))
+            done = read_inode(filesys, inode_index, offset, buf, len);
+        else
+        {
+            pthread_rwlock_rdlock(inode_lock(filesys, inode_index));
+            done = read_inode(filesys, inode_index, offset, buf, len);
+            pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+        }
+
+        if (!link_hop)
+            break;
+        inode_index = link_hop;
+    }
+
+    trace_end(TRACE_READ, start, node, offset, len, done);
+    return done;
+}
+
+// moves the data of an inline inode into a data block, turning it into a regular
+// (or extent, if FLAG_EXTENTS is set) inode; the caller writes the inode back
+private bool promote_inline(filesys_t *filesys, inode_t *inode)
+{
+    datablock_t block;
+    uint16_t blocknum;
+
+    // an inode whose size is more than it holds inline is corrupt, and nothing is copied from past it
+    if (inode->file_size > INLINE_DATA_LEN)
+        return false;
+
+    zero(block.data, BLOCK_SIZE);
+    copy(block.data, inode->inline_data, inode->file_size);
+
+    zero(inode->inline_data, INLINE_DATA_LEN);
+    inode->file_type &= ~FLAG_INLINE;
+
+    // an empty file needs no block yet
+    if (!inode->file_size)
+        return true;
+
+    blocknum = fs_bmap(filesys, inode, 0, true, NULL);
+    if (!blocknum)
+        return false;
+
+    if (!blk_write(filesys, block.data, blocknum))
+    {
+        mark_block_free(filesys, blocknum);
+        return false;
+    }
+
+    return true;
+}
+
+// writes data as file block file_block of a pointer-mapped inode, which maps it to blocknum
+// a shared blocknum is left to it's other owners and the data goes to a new block instead;
+// with dedup on, data identical to a block in the index is mapped onto that block without being written
+private bool store_block(filesys_t *filesys, inode_t *inode, uint32_t file_block, uint16_t blocknum, uint8_t *data)
+{
+    uint16_t target;
+    uint32_t hash;
+    bool shared, dedup;
+
+    target = 0;
+    hash = 0;
+    dedup = __atomic_load_n(&filesys->dedup, __ATOMIC_ACQUIRE) != NULL;
+
+    if (dedup)
+    {
+        pthread_mutex_lock(&filesys->dedup_lock);
+        dedup = filesys->dedup != NULL;
+        if (dedup)
+        {
+            hash = xxh32(data, BLOCK_SIZE, 0);
+            target = dedup_find(filesys, filesys->dedup, hash, data, blocknum);
+        }
+
+        if (target == blocknum)
+        {
+            // the block already holds exactly this
+            pthread_mutex_unlock(&filesys->dedup_lock);
+            return true;
+        }
+
+        shared = ref_drop(filesys, blocknum);
+        if (!shared)
+        {
+            // the block is ours alone, and has to leave the index before it changes (or goes)
+            dedup_unindex(filesys->dedup, blocknum);
+            if (target)
+                mark_block_free(filesys, blocknum);
+        }
+        pthread_mutex_unlock(&filesys->dedup_lock);
+    }
+    else
+        shared = ref_drop(filesys, blocknum);
+
+    if (!target)
+    {
+        // copy on write: the other owners keep the old block
+        target = shared ? alloc_block(filesys, false) : blocknum;
+        if (!target || !blk_write(filesys, data, target))
+        {
+            if (target && target != blocknum)
+                mark_block_free(filesys, target);
+            if (shared)
+                ref_take(filesys, blocknum);
+            return false;
+        }
+
+        if (dedup)
+        {
+            pthread_mutex_lock(&filesys->dedup_lock);
+            dedup_index(filesys->dedup, target, hash);
+            pthread_mutex_unlock(&filesys->dedup_lock);
+        }
+    }
+
+    return target == blocknum || ptr_bmap(filesys, inode, file_block, false, NULL, target);
+}
+
+// fs_write with the inode's lock held exclusively
+private uint32_t write_inode(filesys_t *filesys, uint16_t inode_index, uint32_t offset, uint8_t *buf, uint32_t len)
+{
+    inode_t inode;
+    datablock_t block;
+    uint32_t done, chunk, in_block, end, held;
+    uint16_t blocknum;
+    int32_t taken;
+    claim_t claim;
+    bool fresh, ret;
+
+    if (!filesys || !buf)
+        return 0;
+
+    if (!fs_get_inode(filesys, inode_index, &inode) || inode.file_type == TYPE_NOT_VALID)
+        return 0;
+
+    if (inode.file_type & FLAG_LINK)
+    {
+        link_hop = inode.target;
+        return 0;
+    }
+
+    // never let the 32-bit file size wrap around
+    if (len > UINT32_MAX - offset)
+        len = UINT32_MAX - offset;
+
+    if (inode.file_type & FLAG_INLINE)
+    {
+        if (offset <= INLINE_DATA_LEN && len <= INLINE_DATA_LEN - offset)
+        {
+            copy(inode.inline_data + offset, buf, len);
+            if (offset + len > inode.file_size)
+                inode.file_size = offset + len;
+
+            return fs_put_inode(filesys, inode_index, &inode) ? len : 0;
+        }
+    }
+
+    // a write that can't be finished is turned away before it changes anything: one taking the owner over
+    // it's quota, and one that could need more blocks than it can have
+    end = offset + len > inode.file_size ? offset + len : inode.file_size;
+    if (!quota_claim(filesys, file_owner(&inode), file_charge(&inode), (uint32_t)((end + BLOCK_SIZE - 1ULL) / BLOCK_SIZE), &held))
+        return 0;
+
+    claim.pool = claim.own = 0;
+    if (len && !space_claim(filesys, inode_index, write_need(filesys, &inode, offset / BLOCK_SIZE, (offset + len - 1) / BLOCK_SIZE, false), &claim) &&
+        !space_claim(filesys, inode_index, write_need(filesys, &inode, offset / BLOCK_SIZE, (offset + len - 1) / BLOCK_SIZE, true), &claim))
+    {
+        quota_release(filesys, file_owner(&inode), held);
+        return 0;
+    }
+    taken = blocks_taken;
+
+    // the file no longer fits inside the inode
+    if ((inode.file_type & FLAG_INLINE) && !promote_inline(filesys, &inode))
+    {
+        space_release(filesys, inode_index, &claim, blocks_taken - taken);
+        quota_release(filesys, file_owner(&inode), held);
+        return 0;
+    }
+
+    for (done = 0; done < len; done += chunk)
+    {
+        in_block = (offset + done) % BLOCK_SIZE;
+        chunk = BLOCK_SIZE - in_block;
+        if (chunk > len - done)
+            chunk = len - done;
+
+        blocknum = fs_bmap(filesys, &inode, (offset + done) / BLOCK_SIZE, true, &fresh);
+        if (!blocknum)
+            break; // drive full
+
+        // a partially written block keeps it's old contents, and a freshly allocated one starts out zeroed
+        if (chunk < BLOCK_SIZE)
+        {
+            if (fresh)
+                zero(block.data, BLOCK_SIZE);
+            else if (!blk_read(filesys, block.data, blocknum))
+                break;
+        }
+
+        copy(block.data + in_block, buf + done, chunk);
+
+        // a block of a pointer-mapped file may be shared, or have a twin in the dedup index
+        if (filesys->refs && !(inode.file_type & FLAG_EXTENTS))
+        {
+            if (!store_block(filesys, &inode, (offset + done) / BLOCK_SIZE, blocknum, block.data))
+                break;
+        }
+        else if (!blk_write(filesys, block.data, blocknum))
+            break;
+    }
+
+    if (offset + done > inode.file_size)
+        inode.file_size = offset + done;
+
+    // the inode is written back even on a short write, since blocks may have been allocated
+    space_release(filesys, inode_index, &claim, blocks_taken - taken);
+    ret = fs_put_inode(filesys, inode_index, &inode);
+    quota_release(filesys, file_owner(&inode), held);
+
+    return ret ? done : 0;
+}
+
+// records a reference to blocknum; returns true if it's a data block seen for the first time
+private bool check_block(check_t *check, uint16_t blocknum)
+{
+    if (blocknum >= check->filesys->drive->blocks)
+    {
+        check->report->out_of_range++;
+        if (check->verbose)
+            printf("inode %u: block %u is past the end of the drive\n", check->inode, blocknum);
+        return false;
+    }
+
+    if (blocknum <= last_meta_block(&check->filesys->super_block))
+    {
+        check->report->into_inodes++;
+        if (check->verbose)
+            printf("inode %u: block %u lies in the inode table or the saved bitmap\n", check->inode, blocknum);
+        return false;
+    }
+
+    if (get_bit(check->seen, blocknum))
+    {
+        // a shared block may be referenced as often as it's reference count says
+        if (check->filesys->refs && check->filesys->refs[blocknum])
+        {
+            if (!check->extra && (check->extra = malloc(check->filesys->drive->blocks)))
+                zero(check->extra, check->filesys->drive->blocks);
+            if (check->extra && check->extra[blocknum] < check->filesys->refs[blocknum])
+            {
+                check->extra[blocknum]++;
+                return true;
+            }
+        }
+
+        check->report->duplicate++;
+        if (check->verbose)
+            printf("inode %u: block %u is already referenced\n", check->inode, blocknum);
+        return false;
+    }
+
+    set_bit(check->seen, blocknum);
+    return true;
+}
+
+// whether a pointer, extent or xattr block read off the drive matches the checksum table; every one of them
+// should have a checksum there, so a missing one counts as a mismatch as well
+private bool check_sum(check_t *check, uint8_t *data, uint16_t blocknum)
+{
+    if (!check->filesys->sums || check->filesys->sums[blocknum] == block_sum(data))
+        return true;
+
+    check->report->bad_checksum++;
+    if (check->verbose)
+        printf("inode %u: block %u doesn't match it's checksum\n", check->inode, blocknum);
+    return false;
+}
+
+// checks blocknum and everything below it; file_block is the first file block it covers
+private bool check_tree(check_t *check, uint16_t blocknum, uint8_t level, uint32_t file_block)
+{
+    datablock_t buf;
+    uint32_t span;
+    uint16_t ptr;
+    uint8_t i;
+
+    if (!blocknum || !check_block(check, blocknum))
+        return true;
+
+    if (!level)
+    {
+        if (file_block + 1 > check->end)
+            check->end = file_block + 1;
+        return true;
+    }
+
+    if (!d_read(check->filesys->drive, buf.data, blocknum))
+        return false;
+    check->report->blocks_read++;
+
+    // nothing below a damaged block can be told from garbage
+    if (!check_sum(check, buf.data, blocknum))
+        return true;
+
+    // number of file blocks under each pointer of this block
+    for (span = 1, i = 1; i < level; i++)
+        span *= PTR_PER_BLOCK;
+
+    for (ptr = 0; ptr < PTR_PER_BLOCK; ptr++)
+    {
+        if (!check_tree(check, buf.ptr[ptr], level - 1, file_block + ptr * span))
+            return false;
+    }
+
+    return true;
+}
+
+private bool check_inode(check_t *check, inode_t *inode)
+{
+    datablock_t buf;
+    char name[LONG_NAME_LEN];
+    uint32_t mapped, blk;
+    uint16_t index, blocknum, count;
+    extent_t *extent;
+
+    check->end = 0;
+
+    // any file can have an xattr block, whatever maps it's data
+    if (inode->xattr_ptr && check_block(check, inode->xattr_ptr))
+    {
+        if (!d_read(check->filesys->drive, buf.data, inode->xattr_ptr))
+            return false;
+        check->report->blocks_read++;
+        check_sum(check, buf.data, inode->xattr_ptr);
+    }
+
+    // a long name has to be where the inode says, in a record of the heap that names the inode back
+    if (inode->lname_len && !heap_name(check->filesys, check->inode, inode, name))
+    {
+        check->report->bad_name++;
+        if (check->verbose)
+            printf("inode %u: long name isn't in the name heap\n", check->inode);
+    }
+
+    if (inode->file_type & FLAG_INLINE)
+    {
+        if (inode->file_size > INLINE_DATA_LEN)
+            goto size_mismatch;
+        return true;
+    }
+
+    if (inode->file_type & FLAG_EXTENTS)
+    {
+        // an extent file has no holes, so it's extents must add up to exactly it's size
+        mapped = 0;
+        extent = inode->extent;
+        count = EXTENTS_PER_INODE;
+        for (blocknum = 0;;)
+        {
+            for (index = 0; index < count && extent[index].length; index++)
+            {
+                // an extent running past the end of the drive is reported once, rather than wrapping round
+                // to blocks at the start of it
+                for (blk = extent[index].start; blk < (uint32_t)extent[index].start + extent[index].length; blk++)
+                {
+                    if (blk >= check->filesys->drive->blocks)
+                    {
+                        check->report->out_of_range++;
+                        if (check->verbose)
+                            printf("inode %u: extent from block %u runs past the end of the drive\n", check->inode, extent[index].start);
+                        break;
+                    }
+                    check_block(check, (uint16_t)blk);
+                }
+                mapped += extent[index].length;
+            }
+
+            blocknum = blocknum ? buf.extblock.next : inode->extent_ptr;
+            if (!blocknum || !check_block(check, blocknum))
+                break;
+
+            if (!d_read(check->filesys->drive, buf.data, blocknum))
+                return false;
+            check->report->blocks_read++;
+
+            if (!check_sum(check, buf.data, blocknum))
+                break;
+
+            extent = buf.extblock.extent;
+            count = buf.extblock.extents < EXTENTS_PER_BLOCK ? buf.extblock.extents : EXTENTS_PER_BLOCK;
+        }
+
+        if (mapped != (inode->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+            goto size_mismatch;
+        return true;
+    }
+
+    for (index = 0; index < PTR_PER_INODE; index++)
+        check_tree(check, inode->direct_ptr[index], 0, index);
+
+    if (!check_tree(check, inode->indirect_ptr, 1, DIRECT_BLOCKS) ||
+        !check_tree(check, inode->dindirect_ptr, 2, DIRECT_BLOCKS + INDIRECT_BLOCKS) ||
+        !check_tree(check, inode->tindirect_ptr, 3, DIRECT_BLOCKS + INDIRECT_BLOCKS + DINDIRECT_BLOCKS))
+        return false;
+
+    // holes are fine, but no block may be mapped past the end of the file
+    if (check->end > (inode->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+        goto size_mismatch;
+    return true;
+
+size_mismatch:
+    check->report->size_mismatch++;
+    if (check->verbose)
+        printf("inode %u: file size %u doesn't match the blocks it maps\n", check->inode, inode->file_size);
+    return true;
+}
+
+internal bool fs_check(filesys_t *filesys, fsck_t *report, bool verbose)
+{
+    datablock_t buf[SCAN_BATCH];
+    check_t check;
+    inode_t *inode;
+    uint16_t blk, count, node, i, size, inode_blocks;
+    uint32_t index;
+    bool ok;
+
+    if (!filesys || !report)
+        return false;
+
+    zero(report, sizeof(fsck_t));
+    if (filesys->super_block.magic1 != MAGIC1 || filesys->super_block.magic2 != MAGIC2 ||
+        filesys->super_block.version != FS_VERSION)
+        return false;
+
+    // the check reads the drive directly, so everything written so far has to be on it
+    if (!fs_sync(filesys))
+        return false;
+
+    inode_blocks = filesys->super_block.inode_blocks;
+    if (inode_blocks >= filesys->drive->blocks)
+        return false;
+
+    // the superblock on the drive, rather than the copy in memory, is what the next mount will go by
+    if (has_csum(filesys))
+    {
+        if (!d_read(filesys->drive, buf[0].data, 0))
+            return false;
+        report->blocks_read++;
+
+        if (buf[0].superblock.checksum != super_sum(&buf[0].superblock))
+        {
+            report->bad_checksum++;
+            if (verbose)
+                printf("the superblock doesn't match it's checksum\n");
+        }
+    }
+
+    size = (filesys->drive->blocks + 7) / 8;
+    check.filesys = filesys;
+    check.report = report;
+    check.verbose = verbose;
+    check.seen = malloc(size);
+    if (!check.seen)
+        return false;
+    zero(check.seen, size);
+    check.extra = NULL;
+    check.names = calloc((uint32_t)inode_blocks * INODES_PER_BLOCK, sizeof(int32_t));
+    if (!check.names)
+    {
+        free(check.seen);
+        return false;
+    }
+
+    // stream through the initialized part of the inode table a batch of blocks at a time
+    ok = true;
+    for (blk = 1; ok && blk <= inode_watermark(filesys) && blk <= inode_blocks; blk += count)
+    {
+        count = (inode_watermark(filesys) < inode_blocks ? inode_watermark(filesys) : inode_blocks) - blk + 1;
+        if (count > SCAN_BATCH)
+            count = SCAN_BATCH;
+
+        if (!d_read_run(filesys->drive, buf[0].data, blk, count))
+        {
+            ok = false;
+            break;
+        }
+        report->blocks_read += count;
+
+        for (i = 0; ok && i < count; i++)
+        {
+            for (node = 0; ok && node < INODES_PER_BLOCK; node++)
+            {
+                if (buf[i].inode[node].file_type == TYPE_NOT_VALID)
+                    continue;
+
+                report->inodes++;
+                check.inode = (blk + i - 1) * INODES_PER_BLOCK + node;
+                if (inode_bad(has_csum(filesys), &buf[i].inode[node], check.inode))
+                {
+                    report->bad_checksum++;
+                    if (verbose)
+                        printf("inode %u doesn't match it's checksum\n", check.inode);
+                    continue;
+                }
+
+                // a link is one of the names of it's target; anything else counts it's own
+                inode = &buf[i].inode[node];
+                if (!(inode->file_type & FLAG_LINK))
+                    check.names[check.inode] += inode_links(inode) - has_name(inode);
+                else if (inode->target < (uint32_t)inode_blocks * INODES_PER_BLOCK)
+                    check.names[inode->target]--;
+                else
+                {
+                    report->bad_links++;
+                    if (verbose)
+                        printf("inode %u: link to inode %u, past the inode table\n", check.inode, inode->target);
+                }
+
+                ok = check_inode(&check, inode);
             }
-            printf("\n");
         }
     }
 
-    printf("\n");
+    // every referenced block, and only those (plus the superblock, inode table and saved bitmap), should be in use
+    for (blk = 0; ok && filesys->bitmap && blk < filesys->drive->blocks; blk++)
+    {
+        if (!get_bit(check.seen, blk) == !get_bit(filesys->bitmap, blk) || blk <= last_meta_block(&filesys->super_block))
+            continue;
+
+        report->bitmap_mismatch++;
+        if (verbose)
+            printf("block %u is marked %s in the bitmap\n", blk, get_bit(filesys->bitmap, blk) ? "used but unreferenced" : "free but referenced");
+    }
+
+    // a shared block has to be referenced exactly as often as it's count says
+    for (blk = 0; ok && filesys->refs && blk < filesys->drive->blocks; blk++)
+    {
+        if (filesys->refs[blk] == (check.extra ? check.extra[blk] : 0))
+            continue;
+
+        report->duplicate++;
+        if (verbose)
+            printf("block %u has %u extra references, but %u were found\n", blk, filesys->refs[blk], check.extra ? check.extra[blk] : 0);
+    }
+
+    // and every file has to have as many names as it counts, where a link to anything but a file counts against it
+    for (index = 0; ok && index < (uint32_t)inode_blocks * INODES_PER_BLOCK; index++)
+    {
+        if (!check.names[index])
+            continue;
+
+        report->bad_links++;
+        if (verbose)
+            printf("inode %u: link count is off by %d\n", index, check.names[index]);
+    }
+
+    free(check.names);
+    free(check.extra);
+    free(check.seen);
+    return ok;
+}
+
+internal uint32_t fs_write(filesys_t *filesys, uint16_t inode_index, uint32_t offset, uint8_t *buf, uint32_t len)
+{
+    uint64_t start;
+    uint32_t done;
+    uint16_t node;
+    uint8_t hop;
+
+    start = trace_begin();
+
+    // the data of the root directory is the name heap, which only changes along with the long names;
+    // a link is written through the file it names, as with fs_read
+    done = 0;
+    node = inode_index;
+    for (hop = 0; filesys && buf && inode_index && !is_readonly(filesys) && hop < 2; hop++)
+    {
+        link_hop = 0;
+        pthread_rwlock_wrlock(inode_lock(filesys, inode_index));
+        done = write_inode(filesys, inode_index, offset, buf, len);
+        pthread_rwlock_unlock(inode_lock(filesys, inode_index));
+
+        if (!link_hop)
+            break;
+        inode_index = link_hop;
+    }
+
+    trace_end(TRACE_WRITE, start, node, offset, len, done);
+    return done;
+}
+
+internal filesys_t *fs_format(drive_t *drive, bootsec_t *boot_sector, bool force, bool lazy)
+{
+    uint8_t *names;
+
+    if (!drive)
+        return NULL;
+
+    // check for open files, erase if forced
+    if (openfiles(drive))
+    {
+        if (!force)
+            return NULL;
+        erase_all_files(drive);
+    }
+
+    // allocate filesystem structure
+    filesys_t *filesys = malloc(sizeof(filesys_t));
+    if (!filesys)
+        return NULL;
+
+    // calculate inode blocks (10% of total, rounded up)
+    uint16_t inode_blocks = (drive->blocks + 9) / 10;
+
+    // initialize superblock
+    filesys->super_block.magic1 = MAGIC1;
+    filesys->super_block.magic2 = MAGIC2;
+    filesys->super_block.version = FS_VERSION;
+
+    filesys->super_block.inodes = inode_blocks * INODES_PER_BLOCK;
+    filesys->super_block.blocks = drive->blocks;
+    filesys->super_block.inode_blocks = inode_blocks;
+    filesys->super_block.inode_init = 1; // only the root's inode block, until the rest is zeroed
+
+    // the saved bitmap follows the inode table; it's first written by the first sync, and
+    // only trusted once an unmount has marked the volume clean
+    filesys->super_block.bitmap_start = inode_blocks + 1;
+    filesys->super_block.bitmap_blocks = (((drive->blocks + 63) / 64) * 8 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    filesys->super_block.refs_blocks = (drive->blocks + BLOCK_SIZE - 1) / BLOCK_SIZE; // a byte per block, right after it
+    filesys->super_block.names_blocks = names_size(inode_blocks);                       // and the name index after that
+    filesys->super_block.sums_blocks = sums_size(drive->blocks);                         // and the checksum table after that
+    filesys->super_block.features = FEATURE_CSUM;
+    filesys->super_block.state = 0;
+    filesys->super_block.used_blocks = 0; // saved by the first clean unmount
+    filesys->super_block.scrub_next = 0;
+    zero(filesys->super_block.quota, sizeof(filesys->super_block.quota));
+    if (last_meta_block(&filesys->super_block) >= drive->blocks)
+    {
+        free(filesys);
+        return NULL;
+    }
+
+    // handle boot sector
+    if (boot_sector)
+    {
+        copy(&filesys->super_block.boot_sector, boot_sector, BOOT_SECTOR_SIZE);
+    }
+    else
+    {
+        zero(&filesys->super_block.boot_sector, BOOT_SECTOR_SIZE);
+    }
+
+    // set drive info
+    filesys->drive = drive;
+    filesys->drive_num = drive->drive_num;
+
+    // write superblock to drive
+    if (!super_write(filesys))
+    {
+        free(filesys);
+        return NULL;
+    }
+
+    // prepare root directory inode
+    inode_t root_inode;
+    zero((void *)&root_inode, sizeof(root_inode));
+    root_inode.file_type = TYPE_DIR;
+    root_inode.checksum = inode_sum(&root_inode, 0);
+
+    // write root inode to first inode block
+    uint8_t buf[BLOCK_SIZE];
+    zero(buf, BLOCK_SIZE);
+    copy(buf, &root_inode, sizeof(root_inode));
+
+    if (!d_write(drive, buf, 1))
+    {
+        free(filesys);
+        return NULL;
+    }
+
+    // the name index starts out empty; it's small enough next to the inode table to be zeroed even by a lazy format
+    // and so does the checksum table, out of the same zeroed buffer
+    names = calloc(filesys->super_block.names_blocks > filesys->super_block.sums_blocks ? filesys->super_block.names_blocks
+                                                                                         : filesys->super_block.sums_blocks,
+                   BLOCK_SIZE);
+    if (!names || !d_write_run(drive, names, names_start(&filesys->super_block), filesys->super_block.names_blocks) ||
+        !d_write_run(drive, names, sums_start(&filesys->super_block), filesys->super_block.sums_blocks))
+    {
+        free(names);
+        free(filesys);
+        return NULL;
+    }
+    free(names);
+
+    filesys->inode_init = 1;
+    filesys->names_blocks = filesys->super_block.names_blocks;
+    filesys->view = NULL;
+    filesys->occupancy = NULL;
+    filesys->dedup = NULL;
+    filesys->xattrs = NULL;
+    filesys->heap = NULL;
+    filesys->orphans = NULL;
+    filesys->orphan_count = filesys->orphan_room = 0;
+    filesys->orphans_lost = false;
+    filesys->wback = malloc(sizeof(wback_t));
+    filesys->refs = malloc(drive->blocks);
+    filesys->sums = calloc(filesys->super_block.sums_blocks, BLOCK_SIZE);
+    if (!filesys->wback || !filesys->refs || !filesys->sums)
+    {
+        free(filesys->wback);
+        free(filesys->refs);
+        free(filesys->sums);
+        free(filesys);
+        return NULL;
+    }
+
+    wb_init(filesys->wback);
+    init_locks(filesys);
+
+    // zero remaining inode blocks now, unless that's left for later
+    if (!lazy && !init_inode_blocks(filesys, inode_blocks))
+        goto fail;
+
+    // create initial bitmap, along with the occupancy of the inode blocks
+    filesys->occupancy = malloc(inode_blocks + 1);
+    if (!filesys->occupancy)
+        goto fail;
+
+    filesys->bitmap = fs_mkbitmap(filesys, true);
+    if (!filesys->bitmap)
+        goto fail;
+
+    filesys->free_blocks = count_free(filesys->bitmap, drive->blocks);
+    filesys->bitmap_dirty = ~0U;
+    filesys->refs_dirty[0] = filesys->refs_dirty[1] = ~0ULL;
+    zero(filesys->sums_dirty, sizeof(filesys->sums_dirty)); // the table on the drive is as empty as this one
+    start_lazy_init(filesys);
+    fs_set_flusher(filesys, FLUSH_INTERVAL_MS, FLUSH_DIRTY_RATIO);
+    return filesys;
+
+fail:
+    destroy_locks(filesys);
+    free(filesys->occupancy);
+    free(filesys->wback);
+    free(filesys->refs);
+    free(filesys->sums);
+    free(filesys);
+    return NULL;
+}
+
+private int cmp_syncblk(const void *a, const void *b)
+{
+    return (int)((syncblk_t *)a)->blocknum - (int)((syncblk_t *)b)->blocknum;
+}
+
+// marks the volume as in use before the first write of a mount reaches the drive,
+// so that a crash from here on makes the next mount scan instead of trusting the saved bitmap
+private bool mark_in_use(filesys_t *filesys)
+{
+    bool ret;
+
+    pthread_mutex_lock(&filesys->super_lock);
+    ret = true;
+    if (filesys->super_block.state == STATE_CLEAN)
+    {
+        filesys->super_block.state = 0;
+        ret = super_write(filesys) && d_sync(filesys->drive);
+        if (!ret)
+            filesys->super_block.state = STATE_CLEAN;
+    }
+    pthread_mutex_unlock(&filesys->super_lock);
+
+    return ret;
 }
 
-// returns 0 either when filesys is NULL or when no free block found on the drive
-internal uint16_t fs_first_free(filesys_t *filesys)
+internal bool fs_sync(filesys_t *filesys)
 {
-    bitmap_t bitmap;
-    uint16_t index, size;
-    drive_t *drive;
-
     if (!filesys)
-        return 0;
+        return false;
 
-    bitmap = filesys->bitmap;
-    if (!bitmap)
-        return 0;
+    // a read-only mount never has anything to write
+    if (is_readonly(filesys))
+        return true;
 
-    drive = filesys->drive;
-    size = drive->blocks; // total number of blocks in the drive (filesystem)
+    // the orphans go first, so the blocks they free are on the drive as free with the rest
+    reclaim_orphans(filesys);
+    return sync_blocks(filesys, false);
+}
 
-    index = 0;
-    while (index < size && get_bit(bitmap, index))
-        index++;
+// fs_sync, but with data_only set the superblock, inode table, saved bitmap, reference counts, checksum
+// table and name index stay behind, so that a run of writes commits it's metadata in one go at the next full sync
+// data blocks (indirect and extent blocks included) reaching the drive ahead of the metadata pointing at them
+// is harmless as long as nothing on the drive points at them yet; a block freed since the last full sync may
+// still belong to it's old file there, so it waits for a full sync whatever it now holds
+// a block stays in freed until the second full sync after it was freed begins, by which time the file that
+// freed it has long since put it's inode
+private bool sync_blocks(filesys_t *filesys, bool data_only)
+{
+    wback_t *wback;
+    syncblk_t *batch;
+    uint8_t *data;
+    uint32_t bitmap_dirty, size, offset, count, index, run, words;
+    uint64_t refs_dirty[2], sums_dirty[8];
+    uint16_t blk, bitmap_blocks, refs_blocks, sums_blocks, saved;
+    int16_t entry, *link;
+    bool ret;
 
-    return (index >= size) ? 0 : index; // return 0 when no free block found
+    wback = filesys->wback;
+    words = (filesys->drive->blocks + 63) / 64;
+    bitmap_blocks = data_only ? 0 : filesys->super_block.bitmap_blocks;
+    refs_blocks = filesys->refs && !data_only ? filesys->super_block.refs_blocks : 0;
+    sums_blocks = filesys->sums && !data_only ? filesys->super_block.sums_blocks : 0;
+    size = ((filesys->drive->blocks + 63) / 64) * 8;
+
+    batch = malloc((WB_BLOCKS + bitmap_blocks + refs_blocks + sums_blocks) * sizeof(syncblk_t));
+    data = malloc((size_t)(WB_BLOCKS + bitmap_blocks + refs_blocks + sums_blocks) * BLOCK_SIZE);
+    if (!batch || !data)
+    {
+        free(batch);
+        free(data);
+        return false;
+    }
+
+    pthread_mutex_lock(&filesys->sync_lock);
+
+    // pick up the dirty blocks and the changed parts of the bitmap and reference counts, sort them,
+    // and take a snapshot of each in that order, so that neighbouring blocks sit next to each other in data
+    pthread_mutex_lock(&filesys->wback_lock);
+    count = 0;
+    for (index = 0; index < WB_BUCKETS; index++)
+    {
+        for (entry = wback->chain[index]; entry != -1; entry = wback->buf[entry].next)
+        {
+            blk = wback->buf[entry].blocknum;
+            if (data_only && (blk <= last_meta_block(&filesys->super_block) ||
+                              ((__atomic_load_n(&wback->freed[0][blk / 64], __ATOMIC_RELAXED) | wback->freed[1][blk / 64]) &
+                               (1ULL << (blk % 64)))))
+                continue;
+
+            batch[count].blocknum = wback->buf[entry].blocknum;
+            batch[count].entry = entry;
+            batch[count].gen = wback->buf[entry].gen;
+            count++;
+        }
+    }
+
+    // whatever was freed before this point is settled on the drive by this sync, or failing that by the next
+    for (index = 0; !data_only && index < words; index++)
+        wback->freed[1][index] = __atomic_exchange_n(&wback->freed[0][index], 0, __ATOMIC_ACQ_REL);
+
+    bitmap_dirty = bitmap_blocks ? __atomic_exchange_n(&filesys->bitmap_dirty, 0, __ATOMIC_ACQ_REL) : 0;
+    for (blk = 0; blk < bitmap_blocks; blk++)
+    {
+        if (!(bitmap_dirty & (1U << blk)))
+            continue;
+
+        batch[count].blocknum = filesys->super_block.bitmap_start + blk;
+        batch[count].entry = -1;
+        count++;
+    }
+
+    refs_dirty[0] = refs_blocks ? __atomic_exchange_n(&filesys->refs_dirty[0], 0, __ATOMIC_ACQ_REL) : 0;
+    refs_dirty[1] = refs_blocks ? __atomic_exchange_n(&filesys->refs_dirty[1], 0, __ATOMIC_ACQ_REL) : 0;
+    for (blk = 0; blk < refs_blocks; blk++)
+    {
+        if (!(refs_dirty[blk / 64] & (1ULL << (blk % 64))))
+            continue;
+
+        batch[count].blocknum = refs_start(&filesys->super_block) + blk;
+        batch[count].entry = -1;
+        count++;
+    }
+
+    for (index = 0; index < sizeof(sums_dirty) / sizeof(uint64_t); index++)
+        sums_dirty[index] = sums_blocks ? __atomic_exchange_n(&filesys->sums_dirty[index], 0, __ATOMIC_ACQ_REL) : 0;
+    for (blk = 0; blk < sums_blocks; blk++)
+    {
+        if (!(sums_dirty[blk / 64] & (1ULL << (blk % 64))))
+            continue;
+
+        batch[count].blocknum = sums_start(&filesys->super_block) + blk;
+        batch[count].entry = -1;
+        count++;
+    }
+
+    qsort(batch, count, sizeof(syncblk_t), cmp_syncblk);
+    for (index = 0; index < count; index++)
+    {
+        if (batch[index].entry != -1)
+        {
+            copy(data + index * BLOCK_SIZE, wback->buf[batch[index].entry].data, BLOCK_SIZE);
+            continue;
+        }
+
+        // the checksum table is kept in whole blocks
+        if (batch[index].blocknum >= sums_start(&filesys->super_block))
+        {
+            offset = (uint32_t)(batch[index].blocknum - sums_start(&filesys->super_block)) * BLOCK_SIZE;
+            copy(data + index * BLOCK_SIZE, (uint8_t *)filesys->sums + offset, BLOCK_SIZE);
+            continue;
+        }
+
+        // the last block of the bitmap (or the reference counts) is only partly used
+        zero(data + index * BLOCK_SIZE, BLOCK_SIZE);
+        saved = batch[index].blocknum - filesys->super_block.bitmap_start;
+        if (saved < bitmap_blocks)
+        {
+            offset = (uint32_t)saved * BLOCK_SIZE;
+            copy(data + index * BLOCK_SIZE, filesys->bitmap + offset, size - offset < BLOCK_SIZE ? size - offset : BLOCK_SIZE);
+        }
+        else
+        {
+            offset = (uint32_t)(saved - bitmap_blocks) * BLOCK_SIZE;
+            copy(data + index * BLOCK_SIZE, filesys->refs + offset, filesys->drive->blocks - offset < BLOCK_SIZE ? filesys->drive->blocks - offset : BLOCK_SIZE);
+        }
+    }
+    pthread_mutex_unlock(&filesys->wback_lock);
+
+    // write runs of neighbouring blocks with one call each, then make the whole batch durable at once
+    ret = !count || mark_in_use(filesys);
+    for (index = 0; ret && index < count; index += run)
+    {
+        for (run = 1; index + run < count && run < SYNC_RUN; run++)
+        {
+            if (batch[index + run].blocknum != batch[index].blocknum + run)
+                break;
+        }
+
+        ret = d_write_run(filesys->drive, data + index * BLOCK_SIZE, batch[index].blocknum, run);
+    }
+    ret = ret && d_sync(filesys->drive);
+
+    // drop what reached the drive, unless it was written again in the meantime
+    pthread_mutex_lock(&filesys->wback_lock);
+    for (index = 0; ret && index < count; index++)
+    {
+        entry = batch[index].entry;
+        if (entry == -1 || wback->buf[entry].gen != batch[index].gen)
+            continue;
+
+        for (link = &wback->chain[wb_chain(batch[index].blocknum)]; *link != entry; link = &wback->buf[*link].next)
+            ;
+        *link = wback->buf[entry].next;
+        wback->buf[entry].next = wback->free;
+        wback->free = entry;
+        wback->count--;
+    }
+    if (ret && count)
+        __atomic_fetch_add(&wback->synced, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&filesys->wback_lock);
+
+    // the bitmap, reference count and checksum blocks that didn't make it go out with the next sync
+    if (!ret)
+    {
+        __atomic_fetch_or(&filesys->bitmap_dirty, bitmap_dirty, __ATOMIC_RELAXED);
+        __atomic_fetch_or(&filesys->refs_dirty[0], refs_dirty[0], __ATOMIC_RELAXED);
+        __atomic_fetch_or(&filesys->refs_dirty[1], refs_dirty[1], __ATOMIC_RELAXED);
+        for (index = 0; index < sizeof(sums_dirty) / sizeof(uint64_t); index++)
+            __atomic_fetch_or(&filesys->sums_dirty[index], sums_dirty[index], __ATOMIC_RELAXED);
+        for (index = 0; !data_only && index < words; index++)
+            __atomic_fetch_or(&wback->freed[0][index], wback->freed[1][index], __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&filesys->sync_lock);
+    free(batch);
+    free(data);
+    return ret;
 }
 
-private bool mark_block_used(bitmap_t bitmap, uint16_t block_num)
+// syncs every flush_interval milliseconds, or earlier when a write finds the table past flush_ratio
+private void *flush_worker(void *arg)
 {
-    if (get_bit(bitmap, block_num))
-        return false; // already used
-    set_bit(bitmap, block_num);
-    return true;
+    filesys_t *filesys;
+    struct timespec deadline;
+    bool early;
+
+    trace_pause();
+    filesys = (filesys_t *)arg;
+    pthread_mutex_lock(&filesys->flush_lock);
+    while (!filesys->flush_stop)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += filesys->flush_interval / 1000;
+        deadline.tv_nsec += (long)(filesys->flush_interval % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        early = !pthread_cond_timedwait(&filesys->flush_cond, &filesys->flush_lock, &deadline);
+        if (filesys->flush_stop)
+            break;
+
+        // woken early, the table is filling up, and making room only needs the data blocks written;
+        // the metadata waits for the timed sync (or the first one after the table is all metadata)
+        pthread_mutex_unlock(&filesys->flush_lock);
+        if (early)
+            sync_blocks(filesys, true);
+        if (!early || __atomic_load_n(&filesys->wback->count, __ATOMIC_RELAXED) * 100U >= (uint32_t)WB_BLOCKS * filesys->flush_ratio)
+        {
+            if (__atomic_load_n(&filesys->wback->count, __ATOMIC_RELAXED) || __atomic_load_n(&filesys->bitmap_dirty, __ATOMIC_RELAXED) ||
+                __atomic_load_n(&filesys->refs_dirty[0], __ATOMIC_RELAXED) || __atomic_load_n(&filesys->refs_dirty[1], __ATOMIC_RELAXED))
+                fs_sync(filesys);
+        }
+        pthread_mutex_lock(&filesys->flush_lock);
+    }
+    pthread_mutex_unlock(&filesys->flush_lock);
+
+    return NULL;
 }
 
-private void mark_block_free(bitmap_t bitmap, uint16_t block_num)
+private void stop_flusher(filesys_t *filesys)
 {
-    clear_bit(bitmap, block_num);
+    if (!filesys->flush_running)
+        return;
+
+    pthread_mutex_lock(&filesys->flush_lock);
+    filesys->flush_stop = true;
+    pthread_cond_signal(&filesys->flush_cond);
+    pthread_mutex_unlock(&filesys->flush_lock);
+
+    pthread_join(filesys->flush_thread, NULL);
+    filesys->flush_running = false;
 }
 
-internal filesys_t *fs_format(drive_t *drive, bootsec_t *boot_sector, bool force)
+internal bool fs_set_flusher(filesys_t *filesys, uint32_t interval_ms, uint8_t dirty_ratio)
 {
-    if (!drive)
-        return NULL;
+    if (!filesys || is_readonly(filesys))
+        return false;
 
-    // check for open files, erase if forced
-    if (openfiles(drive))
+    stop_flusher(filesys);
+    if (!interval_ms)
     {
-        if (!force)
-            return NULL;
-        erase_all_files(drive);
+        filesys->flush_ratio = 100;
+        return true;
     }
 
-    // allocate filesystem structure
-    filesys_t *filesys = malloc(sizeof(filesys_t));
-    if (!filesys)
-        return NULL;
-
-    // calculate inode blocks (10% of total, rounded up)
-    uint16_t inode_blocks = (drive->blocks + 9) / 10;
+    filesys->flush_interval = interval_ms;
+    filesys->flush_ratio = dirty_ratio && dirty_ratio <= 100 ? dirty_ratio : FLUSH_DIRTY_RATIO;
+    filesys->flush_stop = false;
+    filesys->flush_running = !pthread_create(&filesys->flush_thread, NULL, flush_worker, filesys);
 
-    // initialize superblock
-    filesys->super_block.magic1 = MAGIC1;
-    filesys->super_block.magic2 = MAGIC2;
+    return filesys->flush_running;
+}
 
-    filesys->super_block.inodes = inode_blocks * INODES_PER_BLOCK;
-    filesys->super_block.blocks = drive->blocks;
-    filesys->super_block.inode_blocks = inode_blocks;
-    filesys->super_block.reserved = 0;
+// checks every copy of the superblock on the drive, writing the mount's copy over them if one is bad; every write
+// of the superblock goes through super_lock, so holding it keeps the read from catching one half done
+// returns false if it was bad (repaired or not)
+private bool scrub_super(filesys_t *filesys, datablock_t *buf)
+{
+    bool readable, ok, repaired;
+    uint8_t copy;
 
-    // handle boot sector
-    if (boot_sector)
+    readable = true;
+    ok = true;
+    pthread_mutex_lock(&filesys->super_lock);
+    for (copy = 0; ok && copy < d_copies(filesys->drive); copy++)
     {
-        copy(&filesys->super_block.boot_sector, boot_sector, BOOT_SECTOR_SIZE);
+        readable = d_read_copy(filesys->drive, buf->data, 0, 1, copy);
+        ok = readable && (!has_csum(filesys) || buf->superblock.checksum == super_sum(&buf->superblock));
     }
+    repaired = !ok && super_write(filesys) && d_sync(filesys->drive);
+    pthread_mutex_unlock(&filesys->super_lock);
+
+    if (ok)
+        return true;
+
+    kprintf("Drive %s: scrub found the superblock %s%s", d_getdrivename(filesys->drive_num),
+            readable ? "doesn't match it's checksum" : "unreadable", repaired ? "; written again" : "");
+    pthread_mutex_lock(&filesys->scrub_lock);
+    if (readable)
+        filesys->scrub.bad++;
     else
+        filesys->scrub.unreadable++;
+    if (repaired)
+        filesys->scrub.repaired++;
+    pthread_mutex_unlock(&filesys->scrub_lock);
+
+    return false;
+}
+
+// whether a block read off the drive by the scrubber is good: every inode in use of an inode block has to match
+// it's checksum, and any other block the checksum sum it was written with (if it has one)
+private bool scrub_block(filesys_t *filesys, uint8_t *data, uint16_t blocknum, uint32_t sum)
+{
+    datablock_t *block;
+    uint8_t node;
+
+    // an inode block past the watermark only holds zeroes, or is being zeroed
+    if (blocknum <= filesys->super_block.inode_blocks)
     {
-        zero(&filesys->super_block.boot_sector, BOOT_SECTOR_SIZE);
+        if (blocknum > inode_watermark(filesys))
+            return true;
+
+        block = (datablock_t *)data;
+        for (node = 0; node < INODES_PER_BLOCK; node++)
+        {
+            if (inode_bad(has_csum(filesys), &block->inode[node], (blocknum - 1) * INODES_PER_BLOCK + node))
+                return false;
+        }
+        return true;
     }
 
-    // set drive info
-    filesys->drive = drive;
-    filesys->drive_num = drive->drive_num;
+    return !sum || sum == block_sum(data);
+}
 
-    // write superblock to drive
-    if (!d_write(drive, (uint8_t *)&filesys->super_block, 0))
+// puts a bad or unreadable block right from another copy of it that checks out, if the drive keeps more than one;
+// sync_lock keeps a sync from writing a newer copy of the block underneath the repair, and one that became dirty
+// (or changed it's checksum) since it was read is left to that sync
+private bool scrub_repair(filesys_t *filesys, uint8_t *data, uint16_t blocknum, uint8_t copy, uint32_t *io)
+{
+    uint32_t sum;
+    uint8_t other;
+    bool ok;
+
+    for (other = 0; other < d_copies(filesys->drive); other++)
     {
-        free(filesys);
-        return NULL;
+        if (other == copy)
+            continue;
+
+        pthread_mutex_lock(&filesys->sync_lock);
+        pthread_mutex_lock(&filesys->wback_lock);
+        sum = filesys->sums ? __atomic_load_n(&filesys->sums[blocknum], __ATOMIC_RELAXED) : 0;
+        ok = wb_find(filesys->wback, blocknum) == -1;
+        pthread_mutex_unlock(&filesys->wback_lock);
+
+        (*io)++;
+        ok = ok && d_read_copy(filesys->drive, data, blocknum, 1, other) && scrub_block(filesys, data, blocknum, sum);
+        if (ok)
+        {
+            (*io)++;
+            ok = d_write(filesys->drive, data, blocknum) && d_sync(filesys->drive);
+        }
+        pthread_mutex_unlock(&filesys->sync_lock);
+
+        if (ok)
+            return true;
     }
 
-    // prepare root directory inode
-    inode_t root_inode;
-    zero((void *)&root_inode, sizeof(root_inode));
-    root_inode.file_type = TYPE_DIR;
+    return false;
+}
 
-    // write root inode to first inode block
-    uint8_t buf[BLOCK_SIZE];
-    zero(buf, BLOCK_SIZE);
-    copy(buf, &root_inode, sizeof(root_inode));
+// reads the count blocks in use from blocknum off the given copy on the drive and checks them
+// a block whose copy on the drive is about to be written over isn't checked, since it's checksum goes with the new copy;
+// as with blk_read_run, the read is redone if a sync finished during it, and a mismatch is read and looked at once more
+// before it's reported, in case the block was caught between having it's checksum set and reaching the dirty table
+// returns the blocks it moved to and from the drive
+private uint32_t scrub_run(filesys_t *filesys, datablock_t *buf, uint16_t blocknum, uint16_t count, uint8_t copy)
+{
+    wback_t *wback;
+    uint32_t sums[SCRUB_RUN];
+    bool dirty[SCRUB_RUN];
+    uint32_t synced, io;
+    uint16_t index, blk;
+    bool readable, again;
+    scrub_t found;
 
-    if (!d_write(drive, buf, 1))
+    wback = filesys->wback;
+    zero(&found, sizeof(scrub_t));
+    io = count;
+    while (true)
     {
-        free(filesys);
-        return NULL;
+        synced = __atomic_load_n(&wback->synced, __ATOMIC_ACQUIRE);
+        readable = d_read_copy(filesys->drive, buf->data, blocknum, count, copy);
+
+        pthread_mutex_lock(&filesys->wback_lock);
+        if (!readable || wback->synced == synced)
+            break;
+        pthread_mutex_unlock(&filesys->wback_lock);
+        io += count;
     }
 
-    // zero remaining inode blocks
-    zero(buf, BLOCK_SIZE);
-    for (uint16_t i = 2; i <= inode_blocks; i++)
+    for (index = 0; index < count; index++)
+    {
+        dirty[index] = wb_find(wback, blocknum + index) != -1;
+        sums[index] = filesys->sums ? __atomic_load_n(&filesys->sums[blocknum + index], __ATOMIC_RELAXED) : 0;
+    }
+    pthread_mutex_unlock(&filesys->wback_lock);
+
+    for (index = 0; index < count; index++)
     {
-        if (!d_write(drive, buf, i))
+        blk = blocknum + index;
+        if (dirty[index])
         {
-            free(filesys);
-            return NULL;
+            found.skipped++;
+            continue;
+        }
+
+        // a run that couldn't be read is read again a block at a time, to find the blocks at fault
+        if (!readable && (io++, !d_read_copy(filesys->drive, buf[index].data, blk, 1, copy)))
+        {
+            kprintf("Drive %s: scrub found block %u unreadable", d_getdrivename(filesys->drive_num), blk);
+            found.unreadable++;
+            found.repaired += scrub_repair(filesys, buf[index].data, blk, copy, &io);
+            continue;
         }
+
+        found.checked++;
+        if (scrub_block(filesys, buf[index].data, blk, sums[index]))
+            continue;
+
+        io++;
+        again = d_read_copy(filesys->drive, buf[index].data, blk, 1, copy);
+        pthread_mutex_lock(&filesys->wback_lock);
+        sums[index] = filesys->sums ? __atomic_load_n(&filesys->sums[blk], __ATOMIC_RELAXED) : 0;
+        dirty[index] = wb_find(wback, blk) != -1;
+        pthread_mutex_unlock(&filesys->wback_lock);
+
+        if (!again || dirty[index] || scrub_block(filesys, buf[index].data, blk, sums[index]))
+            continue;
+
+        found.bad++;
+        again = scrub_repair(filesys, buf[index].data, blk, copy, &io);
+        found.repaired += again;
+        kprintf("Drive %s: scrub found block %u doesn't match it's checksum%s", d_getdrivename(filesys->drive_num), blk,
+                again ? "; written again from another copy" : "");
     }
 
-    // create initial bitmap
-    filesys->bitmap = fs_mkbitmap(filesys, true);
-    if (!filesys->bitmap)
+    pthread_mutex_lock(&filesys->scrub_lock);
+    filesys->scrub.checked += found.checked;
+    filesys->scrub.skipped += found.skipped;
+    filesys->scrub.bad += found.bad;
+    filesys->scrub.unreadable += found.unreadable;
+    filesys->scrub.repaired += found.repaired;
+    filesys->scrub.next = blocknum + count;
+    pthread_mutex_unlock(&filesys->scrub_lock);
+
+    return io;
+}
+
+// saves the block the scrub carries on from in the superblock; 0 once the pass is done
+// a save that doesn't make it only has the next pass redo some blocks
+private bool scrub_save(filesys_t *filesys, uint32_t next)
+{
+    bool ret;
+
+    pthread_mutex_lock(&filesys->super_lock);
+    filesys->super_block.scrub_next = next < filesys->drive->blocks ? next : 0;
+    ret = super_write(filesys);
+    pthread_mutex_unlock(&filesys->super_lock);
+
+    return ret;
+}
+
+// one pass over the blocks in use, from the saved checkpoint on, paced to scrub_rate
+private void *scrub_worker(void *arg)
+{
+    filesys_t *filesys;
+    datablock_t *buf;
+    struct timespec start, now;
+    uint64_t io, seen;
+    uint32_t blk, count, paced, since, waits;
+    uint8_t copy;
+    double ahead;
+
+    trace_pause();
+    filesys = (filesys_t *)arg;
+    buf = malloc(SCRUB_RUN * sizeof(datablock_t));
+
+    pthread_mutex_lock(&filesys->super_lock);
+    blk = filesys->super_block.scrub_next < filesys->drive->blocks ? filesys->super_block.scrub_next : 0;
+    pthread_mutex_unlock(&filesys->super_lock);
+
+    // a pass starts with the superblock, so one that's carried on from a checkpoint already has it
+    if (buf && !blk)
     {
-        free(filesys);
-        return NULL;
+        scrub_super(filesys, buf);
+        blk = 1;
     }
 
-    return filesys;
+    io = __atomic_load_n(&filesys->drive->blocks_read, __ATOMIC_RELAXED) + __atomic_load_n(&filesys->drive->blocks_written, __ATOMIC_RELAXED);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    paced = since = waits = 0;
+    while (buf && blk < filesys->drive->blocks && !__atomic_load_n(&filesys->scrub_stop, __ATOMIC_ACQUIRE))
+    {
+        // anyone else using the drive since the last look has it to themselves for a while;
+        // the rate is then measured afresh, so the scrubber doesn't make up for the time it gave away
+        seen = __atomic_load_n(&filesys->drive->blocks_read, __ATOMIC_RELAXED) + __atomic_load_n(&filesys->drive->blocks_written, __ATOMIC_RELAXED);
+        if (seen != io && waits++ < SCRUB_YIELD_MAX)
+        {
+            io = seen;
+            usleep(SCRUB_YIELD_MS * 1000);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            paced = 0;
+            continue;
+        }
+
+        if (!block_in_use(filesys->bitmap, blk))
+        {
+            blk++;
+            continue;
+        }
+
+        io = seen;
+        waits = 0;
+        for (count = 1; count < SCRUB_RUN && blk + count < filesys->drive->blocks && block_in_use(filesys->bitmap, blk + count); count++)
+            ;
+
+        for (copy = 0; copy < d_copies(filesys->drive); copy++)
+            io += scrub_run(filesys, buf, (uint16_t)blk, (uint16_t)count, copy);
+        blk += count;
+        paced += count * d_copies(filesys->drive);
+        since += count;
+        if (since >= SCRUB_CHECKPOINT)
+        {
+            if (scrub_save(filesys, blk))
+                io++;
+            since = 0;
+        }
+
+        // sleeps off what the scrubber is ahead of it's rate, as defrag_pace does
+        if (filesys->scrub_rate)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            ahead = (double)paced / filesys->scrub_rate - ((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9);
+            if (ahead > 0)
+                usleep((useconds_t)(ahead * 1e6));
+        }
+    }
+
+    // a pass cut short carries on from here next time
+    scrub_save(filesys, blk);
+    pthread_mutex_lock(&filesys->scrub_lock);
+    filesys->scrub.next = blk;
+    if (blk >= filesys->drive->blocks)
+        filesys->scrub.passes++;
+    filesys->scrub.running = false;
+    pthread_mutex_unlock(&filesys->scrub_lock);
+
+    free(buf);
+    return NULL;
+}
+
+private void stop_scrubber(filesys_t *filesys)
+{
+    if (!filesys->scrub_running)
+        return;
+
+    __atomic_store_n(&filesys->scrub_stop, true, __ATOMIC_RELEASE);
+    pthread_join(filesys->scrub_thread, NULL);
+    filesys->scrub_running = false;
+}
+
+internal bool fs_scrub_start(filesys_t *filesys, uint32_t rate)
+{
+    if (!filesys || is_readonly(filesys))
+        return false;
+
+    stop_scrubber(filesys);
+
+    // the counts are of the pass under way, which may be carried on from an earlier mount
+    pthread_mutex_lock(&filesys->scrub_lock);
+    filesys->scrub.checked = filesys->scrub.skipped = filesys->scrub.bad = 0;
+    filesys->scrub.unreadable = filesys->scrub.repaired = 0;
+    filesys->scrub.next = filesys->super_block.scrub_next;
+    filesys->scrub.running = true;
+    pthread_mutex_unlock(&filesys->scrub_lock);
+
+    filesys->scrub_rate = rate > UINT32_MAX / BLOCKS_PER_MB ? 0 : rate * BLOCKS_PER_MB;
+    filesys->scrub_stop = false;
+    filesys->scrub_running = !pthread_create(&filesys->scrub_thread, NULL, scrub_worker, filesys);
+    if (!filesys->scrub_running)
+    {
+        pthread_mutex_lock(&filesys->scrub_lock);
+        filesys->scrub.running = false;
+        pthread_mutex_unlock(&filesys->scrub_lock);
+    }
+
+    return filesys->scrub_running;
+}
+
+internal bool fs_scrub_stop(filesys_t *filesys)
+{
+    if (!filesys || is_readonly(filesys))
+        return false;
+
+    stop_scrubber(filesys);
+    return true;
+}
+
+internal bool fs_scrub_status(filesys_t *filesys, scrub_t *report)
+{
+    if (!filesys || !report)
+        return false;
+
+    pthread_mutex_lock(&filesys->scrub_lock);
+    copy(report, &filesys->scrub, sizeof(scrub_t));
+    pthread_mutex_unlock(&filesys->scrub_lock);
+
+    return true;
 }
 
 internal void fs_unmount(filesys_t *filesys)
 {
+    uint8_t owner;
+    bool synced;
+
     if (!filesys)
         return;
 
     if (!d_is_drivenum_valid(filesys->drive_num))
         return;
 
+    // a read-only mount wrote nothing, and only has it's reference to the view to give back
+    if (is_readonly(filesys))
+    {
+        view_put(filesys);
+        destroy_locks(filesys);
+        d_detach(filesys->drive);
+        kprintf("Drive %s unmounted", d_getdrivename(filesys->drive_num));
+        free(filesys);
+        return;
+    }
+
+    // the background zeroing has to stop before the drive goes away
+    if (filesys->init_running)
+    {
+        __atomic_store_n(&filesys->init_stop, true, __ATOMIC_RELEASE);
+        pthread_join(filesys->init_thread, NULL);
+    }
+
+    // write everything out, the bitmap included; only then can the volume be marked clean
+    // the scrubber goes first, saving where it got to in the superblock this writes
+    // a volume with an orphan the sync didn't free stays unclean, so the next mount scans for it;
+    // the clean mount reads no inodes, and would never find it
+    stop_scrubber(filesys);
+    stop_flusher(filesys);
+    synced = fs_sync(filesys) && filesys->super_block.bitmap_blocks;
+    if (synced && (filesys->orphans_lost || filesys->orphan_count))
+        kprintf("Drive %s has orphans left; the next mount scans for them", d_getdrivename(filesys->drive_num));
+    else if (synced)
+    {
+        // the counters are saved with the bitmap they were kept alongside
+        filesys->super_block.used_blocks = filesys->super_block.blocks - filesys->free_blocks;
+        for (owner = 0; owner < QUOTA_OWNERS; owner++)
+            filesys->super_block.quota[owner].used = filesys->usage[owner];
+        filesys->super_block.state = STATE_CLEAN;
+        if (!super_write(filesys) || !d_sync(filesys->drive))
+            kprintf("Drive %s couldn't be marked clean", d_getdrivename(filesys->drive_num));
+    }
+
     // free bitmap
     fs_dltbitmap(filesys->bitmap);
+    fs_set_dedup(filesys, false);
+    dedup_free(filesys->xattrs);
+    if (filesys->heap)
+        free(filesys->heap->free);
+    free(filesys->heap);
+    free(filesys->orphans);
+    free(filesys->occupancy);
+    free(filesys->wback);
+    free(filesys->refs);
+    free(filesys->sums);
+    destroy_locks(filesys);
     d_detach(filesys->drive);
 
+    // the drive can be mounted again
+    __atomic_fetch_and(&mounted, ~filesys->drive_num, __ATOMIC_ACQ_REL);
     kprintf("Drive %s unmounted", d_getdrivename(filesys->drive_num));
     free(filesys);
 
@@ -14,7 +14,11 @@
 #define NEOSTD "neostd/"
 #define UTILS "utils/"
 #define DISKUTIL "diskutil/"
+#define BENCH "bench/"
+#define TRACE "trace/"
+#define VFS "vfs/"
 #define COMMON "common/"
+#define CHECKSUM "buildsysdep/strix/allocator/src/checksum_implementations/"
 #define INC "inc/"
 #define BIN "bin/"
 
@@ -24,7 +28,7 @@
 #define DEBUG_FLAGS ""
 #endif
 
-#define SO_FLAGS "-ldl -shared" // create a shared library, with support for dynamic loading
+#define SO_FLAGS "-ldl -lpthread -shared" // create a shared library, with support for dynamic loading and threads
 
 #define CHECK_AND_RETURN(ret) \
     if (!ret)                 \
@@ -37,8 +41,11 @@
                " -I " OSAPI INC      \
                " -I " DISK INC       \
                " -I " FILESYS INC    \
+               " -I " TRACE INC      \
+               " -I " VFS INC        \
                " -I " COMMON         \
                " -I " LIB NEOSTD INC \
+               " -I " CHECKSUM       \
                    DEBUG_FLAGS
 
 #define LFLAGS NULL
@@ -58,9 +65,13 @@ int main(int argc, char **argv)
         neocmd_append(rm, SHELL SRC "shell.o");
         neocmd_append(rm, SYS SRC "syscalls.o");
         neocmd_append(rm, OSAPI SRC "osapi.o");
+        neocmd_append(rm, TRACE SRC "trace.o");
+        neocmd_append(rm, VFS SRC "vfs.o " VFS SRC "neofs.o " VFS SRC "ramfs.o");
         neocmd_append(rm, BIN "libos.so shell.neo");
         neocmd_append(rm, UTILS DISKUTIL SRC "diskutil.o");
         neocmd_append(rm, UTILS DISKUTIL BIN "diskutil.neo");
+        neocmd_append(rm, BENCH SRC "bench.o");
+        neocmd_append(rm, BIN "bench.neo");
 
         neocmd_run_sync(rm, NULL, NULL, false);
         neocmd_delete(rm);
@@ -85,6 +96,18 @@ int main(int argc, char **argv)
     ret = neo_compile_to_object_file(GCC, FILESYS SRC "filesys.c", NULL, CFLAGS, false);
     CHECK_AND_RETURN(ret);
 
+    ret = neo_compile_to_object_file(GCC, TRACE SRC "trace.c", NULL, CFLAGS, false);
+    CHECK_AND_RETURN(ret);
+
+    ret = neo_compile_to_object_file(GCC, VFS SRC "vfs.c", NULL, CFLAGS, false);
+    CHECK_AND_RETURN(ret);
+
+    ret = neo_compile_to_object_file(GCC, VFS SRC "neofs.c", NULL, CFLAGS, false);
+    CHECK_AND_RETURN(ret);
+
+    ret = neo_compile_to_object_file(GCC, VFS SRC "ramfs.c", NULL, CFLAGS, false);
+    CHECK_AND_RETURN(ret);
+
     // now we make all the kernel stuff into a shared library
     neocmd_t *cmd = neocmd_create(BASH);
     CHECK_AND_RETURN(cmd);
@@ -95,6 +118,10 @@ int main(int argc, char **argv)
     neocmd_append(cmd, DISK SRC "disk.o");
     neocmd_append(cmd, OSAPI SRC "osapi.o");
     neocmd_append(cmd, FILESYS SRC "filesys.o");
+    neocmd_append(cmd, TRACE SRC "trace.o");
+    neocmd_append(cmd, VFS SRC "vfs.o");
+    neocmd_append(cmd, VFS SRC "neofs.o");
+    neocmd_append(cmd, VFS SRC "ramfs.o");
 
     neocmd_run_sync(cmd, NULL, NULL, false);
     neocmd_delete(cmd);
@@ -108,6 +135,11 @@ int main(int argc, char **argv)
 
     // the disk utility needs some internal kernel headers and functions to link with it
     // so that it can do it's work properly
-    neo_link(GCC, UTILS DISKUTIL BIN "diskutil.neo", NULL, false, UTILS DISKUTIL SRC "diskutil.o", OSAPI SRC "osapi.o", DISK SRC "disk.o", FILESYS SRC "filesys.o");
+    neo_link(GCC, UTILS DISKUTIL BIN "diskutil.neo", "-lpthread", false, UTILS DISKUTIL SRC "diskutil.o", OSAPI SRC "osapi.o", DISK SRC "disk.o", FILESYS SRC "filesys.o", TRACE SRC "trace.o");
+
+    // the benchmark links with the kernel objects the same way, so it measures the very code the shell runs
+    neo_compile_to_object_file(GCC, BENCH SRC "bench.c", NULL, CFLAGS, false);
+    neo_link(GCC, BIN "bench.neo", "-lpthread", false, BENCH SRC "bench.o", OSAPI SRC "osapi.o", DISK SRC "disk.o", FILESYS SRC "filesys.o", TRACE SRC "trace.o",
+             VFS SRC "vfs.o", VFS SRC "neofs.o", VFS SRC "ramfs.o");
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -41,7 +41,7 @@ internal bool zero(void *mem, uint16_t bytes);
 internal bool copy(void *dest, void *source, uint16_t bytes);
 
 // appends the decimal representation of 'num' to string 'str'
-// returns pointer to a static buffer containing the result
+// returns pointer to a static (per-thread) buffer containing the result
 // maximum result length is 256 characters
 // if the final string would exceed 256 chars, the lower digits
 // of 'num' are truncated to fit within the limit
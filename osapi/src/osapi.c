@@ -38,7 +38,7 @@ internal uint8_t *strnum(uint8_t *str, uint8_t num)
         return NULL;
     }
 
-    static uint8_t buf[UINT8_MAX] = {0};
+    static __thread uint8_t buf[UINT8_MAX] = {0}; // one buffer per thread
     uint16_t len = stringlen(str);
 
     if (len >= 256)
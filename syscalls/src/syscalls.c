@@ -4,6 +4,7 @@
 #include <osapi.h>
 #include <stdbool.h>
 #include <errnum.h>
+#include <trace.h>
 
 #include <errno.h>    // for checking the error returned by fstat
 #include <sys/stat.h> // for using fstat during building
@@ -53,7 +54,35 @@ public bool isopen(const fd_t file)
     return true;
 }
 
+// store and load are traced around these, since they return from the middle through ret_err
+private bool store_byte(const fd_t file, const uint8_t chr);
+private uint8_t load_byte(const fd_t file);
+
 public bool store(const fd_t file, const uint8_t chr)
+{
+    uint64_t start;
+    bool ret;
+
+    start = trace_begin();
+    ret = store_byte(file, chr);
+    trace_end(TRACE_STORE, start, file, chr, 0, ret);
+
+    return ret;
+}
+
+public uint8_t load(const fd_t file)
+{
+    uint64_t start;
+    uint8_t ret;
+
+    start = trace_begin();
+    ret = load_byte(file);
+    trace_end(TRACE_LOAD, start, file, 0, 0, ret);
+
+    return ret;
+}
+
+private bool store_byte(const fd_t file, const uint8_t chr)
 {
     int ret;
     int posix_fd;
@@ -75,7 +104,7 @@ public bool store(const fd_t file, const uint8_t chr)
     ret_success;
 }
 
-public uint8_t load(const fd_t file)
+private uint8_t load_byte(const fd_t file)
 {
     int ret;
     int posix_fd;
@@ -0,0 +1,106 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <base.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * operation tracing: while a trace is running, every call made into the filesystem and syscall entry points
+ * below is recorded, with it's arguments, result, start and duration, into a ring of the calling thread;
+ * a background thread drains the rings into the trace file. a call made from inside another traced call
+ * isn't recorded, and neither is one made by the filesystem's own threads, so the trace holds what the
+ * callers did rather than how the filesystem went about it
+ *
+ * the file is a trace_header_t followed by trace_rec_t records, in the order each thread made it's calls;
+ * the records of different threads are interleaved as they were drained, and put back in order by their times
+ */
+
+#define TRACE_MAGIC (0x4352544e)  // "NTRC"
+#define TRACE_VERSION (1)
+#define TRACE_RINGS (64)          // most threads recording at once; the calls of any more aren't recorded
+#define TRACE_RING_RECORDS (8192) // records a thread can have waiting to be written; it's calls past that are dropped
+#define TRACE_FLUSH_US (5000)     // pause of the background thread between drains of the rings
+#define TRACE_CALIBRATE_US (10000) // time trace_start spends measuring the clock the records are timed with
+
+// operations recorded, and what their arguments hold
+#define TRACE_TIME 0x00      // not a call: arg1 and arg2 are the high and low halves of the time since the trace
+                             // began, in ns, that the next record of the thread counts it's delta from
+#define TRACE_MOUNT 0x01     // fs_mount: arg0 the drive number, arg1 readonly; ret nonzero if it mounted
+#define TRACE_GET_INODE 0x02 // fs_get_inode: arg0 the inode index; ret the result
+#define TRACE_PUT_INODE 0x03 // fs_put_inode: arg0 the inode index, arg1 the file type written; ret the result
+#define TRACE_CREATE 0x04    // fs_create: arg1 the file type; ret the new inode index
+#define TRACE_DELETE 0x05    // fs_delete: arg0 the inode index; ret the result
+#define TRACE_READ 0x06      // fs_read: arg0 the inode index, arg1 the offset, arg2 the length; ret bytes read
+#define TRACE_WRITE 0x07     // fs_write: as fs_read; ret bytes written
+#define TRACE_READDIR 0x08   // fs_readdir_batch: arg1 the cursor, arg2 the count; ret entries filled in
+#define TRACE_LOAD 0x09      // load: arg0 the file descriptor; ret the result
+#define TRACE_STORE 0x0a     // store: arg0 the file descriptor, arg1 the byte; ret the result
+#define TRACE_CLONE 0x0b     // fs_clone: arg0 the inode index cloned; ret the new inode index
+
+#define TRACE_NESTED (1) // what trace_enter returns for a call made from inside another; never a real time
+
+/*
+ * trace file header
+ */
+typedef struct packed
+{
+    uint32_t magic;       // TRACE_MAGIC
+    uint16_t version;     // TRACE_VERSION
+    uint16_t record_size; // sizeof(trace_rec_t)
+    uint64_t epoch;       // CLOCK_MONOTONIC time the trace began, in ns
+} trace_header_t;         // packed ensures this structure is always 16 bytes
+
+/*
+ * a single recorded call
+ */
+typedef struct packed
+{
+    uint8_t op;        // TRACE_* operation
+    uint8_t thread;    // ring the record came through; a ring is only ever held by one thread at a time
+    uint16_t arg0;     // inode index, drive number or file descriptor
+    uint32_t arg1;     // offset, file type, cursor or flag
+    uint32_t arg2;     // length or count
+    uint32_t ret;      // what the call returned
+    uint32_t delta;    // ns between the start of the thread's previous call (or the trace) and the start of this one
+    uint32_t duration; // ns the call took, capped at UINT32_MAX
+} trace_rec_t;         // packed ensures this structure is always 24 bytes
+
+/*
+ * figures filled in by trace_stop
+ */
+typedef struct
+{
+    uint64_t records; // records written to the trace file
+    uint64_t dropped; // calls that found their thread's ring full, or no ring left for their thread
+    bool failed;      // a write to the trace file failed, and the trace ends there
+} trace_stats_t;
+
+extern internal bool trace_on; // true while a trace is running
+
+// starts recording into the file at path, which is replaced; returns false if a trace is already running
+// or the file can't be written
+internal bool trace_start(const char *path);
+
+// stops recording, writes out what the rings still hold and closes the file; stats may be NULL
+// returns false if no trace was running
+internal bool trace_stop(trace_stats_t *stats);
+
+// between trace_pause and trace_resume, none of the calling thread's calls are recorded; the filesystem's own
+// threads pause for good as they start, and work it does on it's own behalf inside a call pauses for that long
+internal void trace_pause(void);
+internal void trace_resume(void);
+
+internal uint64_t trace_enter(void);
+internal void trace_leave(uint8_t op, uint64_t start, uint16_t arg0, uint32_t arg1, uint32_t arg2, uint32_t ret);
+
+// a traced call opens with trace_begin and closes with trace_end; with no trace running, that's a load and a branch
+#define trace_begin() (__atomic_load_n(&trace_on, __ATOMIC_RELAXED) ? trace_enter() : 0)
+#define trace_end(op, start, arg0, arg1, arg2, ret)                \
+    do                                                             \
+    {                                                              \
+        if (start)                                                 \
+            trace_leave((op), (start), (arg0), (arg1), (arg2), (ret)); \
+    } while (false)
+
+#endif // TRACE_H
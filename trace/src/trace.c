@@ -0,0 +1,368 @@
+#include <trace.h>
+#include <osapi.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>    // for open()
+#include <unistd.h>   // for write() and close()
+#include <pthread.h>
+
+// the time stamp counter is read in a few cycles, where even the vDSO's clock_gettime takes tens of ns;
+// it's ticks are turned into ns with the rate measured by trace_start
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define read_ticks() __rdtsc()
+#else
+#define read_ticks() now_ns()
+#define TICKS_NS // the ticks are ns already
+#endif
+
+/*
+ * the ring of a single thread: the thread alone moves head, and the flusher alone moves tail,
+ * so neither side takes a lock; a record is only visible to the flusher once head has moved past it
+ */
+typedef struct
+{
+    trace_rec_t rec[TRACE_RING_RECORDS];
+    uint32_t head;    // records written by the thread so far
+    uint32_t tail;    // records written out by the flusher so far
+    uint64_t last;    // start of the thread's last recorded call, in ns since the trace began
+    uint64_t dropped; // calls of the thread not recorded for want of room
+    uint8_t index;    // place of the ring in rings
+    bool taken;       // held by a live thread
+} ring_t;
+
+internal bool trace_on = false;
+
+private ring_t *rings[TRACE_RINGS]; // rings handed out so far; a ring is never freed, only handed to another thread
+private uint32_t ring_count;        // entries of rings in use
+private pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER; // guards the handing out and back of rings
+private pthread_key_t ring_key;     // gives a ring back when it's thread exits
+private pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+private __thread ring_t *my_ring;   // the calling thread's ring; NULL until it's first recorded call
+private __thread bool no_ring;      // the calling thread found no ring left, and records nothing
+private __thread uint32_t depth;    // traced calls the calling thread is inside of
+
+private pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER; // serializes trace_start and trace_stop
+private int trace_fd = -1;          // the trace file; -1 while no trace is running
+private uint64_t trace_epoch;       // when the trace began, in ticks
+private uint64_t tick_scale;        // ns in a tick, in 32.32 fixed point
+private pthread_t flusher;
+private bool flusher_stop;
+private uint64_t records;           // records written to the file
+private uint64_t unringed;          // calls of threads that found no ring left
+private bool write_failed;
+
+private uint64_t now_ns(void);
+private uint64_t ticks_ns(uint64_t ticks);
+private uint64_t calibrate(void);
+private void make_key(void);
+private void ring_release(void *arg);
+private ring_t *ring_claim(void);
+private void drain(void);
+private void *flush_rings(void *arg);
+
+private uint64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+private uint64_t ticks_ns(uint64_t ticks)
+{
+    return (uint64_t)(((unsigned __int128)ticks * tick_scale) >> 32);
+}
+
+// the ticks of a TRACE_CALIBRATE_US pause, against the ns of CLOCK_MONOTONIC
+private uint64_t calibrate(void)
+{
+#ifdef TICKS_NS
+    return 1ULL << 32;
+#else
+    struct timespec pause;
+    uint64_t ns, ticks;
+
+    pause.tv_sec = 0;
+    pause.tv_nsec = TRACE_CALIBRATE_US * 1000L;
+    ns = now_ns();
+    ticks = read_ticks();
+    nanosleep(&pause, NULL);
+    ticks = read_ticks() - ticks;
+    ns = now_ns() - ns;
+
+    return ticks ? (ns << 32) / ticks : 1ULL << 32;
+#endif
+}
+
+private void make_key(void)
+{
+    pthread_key_create(&ring_key, ring_release);
+}
+
+// what's left in the ring of an exiting thread is still written out; the next thread to take it carries on after it
+private void ring_release(void *arg)
+{
+    pthread_mutex_lock(&rings_lock);
+    ((ring_t *)arg)->taken = false;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+private ring_t *ring_claim(void)
+{
+    ring_t *ring;
+    uint32_t index;
+
+    pthread_once(&ring_once, make_key);
+
+    ring = NULL;
+    pthread_mutex_lock(&rings_lock);
+    for (index = 0; index < ring_count; index++)
+    {
+        if (!rings[index]->taken)
+        {
+            ring = rings[index];
+            break;
+        }
+    }
+
+    if (!ring && ring_count < TRACE_RINGS && (ring = calloc(1, sizeof(ring_t))))
+    {
+        ring->index = ring_count;
+        rings[ring_count] = ring;
+        __atomic_store_n(&ring_count, ring_count + 1, __ATOMIC_RELEASE);
+    }
+
+    if (ring)
+        ring->taken = true;
+    pthread_mutex_unlock(&rings_lock);
+
+    if (!ring)
+    {
+        no_ring = true;
+        return NULL;
+    }
+
+    pthread_setspecific(ring_key, ring);
+    my_ring = ring;
+    return ring;
+}
+
+// a paused thread is as good as inside a traced call, so trace_enter takes everything it calls as nested
+internal void trace_pause(void)
+{
+    depth++;
+}
+
+internal void trace_resume(void)
+{
+    depth--;
+}
+
+internal uint64_t trace_enter(void)
+{
+    // only the outermost call is recorded
+    if (depth++)
+        return TRACE_NESTED;
+
+    return read_ticks();
+}
+
+internal void trace_leave(uint8_t op, uint64_t start, uint16_t arg0, uint32_t arg1, uint32_t arg2, uint32_t ret)
+{
+    trace_rec_t *rec;
+    ring_t *ring;
+    uint64_t end, at, since;
+    uint32_t head;
+
+    depth--;
+    if (start == TRACE_NESTED)
+        return;
+
+    end = read_ticks();
+
+    ring = my_ring;
+    if (!ring && (no_ring || !(ring = ring_claim())))
+    {
+        __atomic_fetch_add(&unringed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // a call that began before the trace did is taken to have begun with it
+    at = start > trace_epoch ? ticks_ns(start - trace_epoch) : 0;
+    since = at > ring->last ? at - ring->last : 0;
+
+    // a gap too long for a delta is bridged by a TRACE_TIME record
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) + (since > UINT32_MAX) >= TRACE_RING_RECORDS)
+    {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (since > UINT32_MAX)
+    {
+        rec = &ring->rec[head++ % TRACE_RING_RECORDS];
+        zero(rec, sizeof(trace_rec_t));
+        rec->op = TRACE_TIME;
+        rec->thread = ring->index;
+        rec->arg1 = (uint32_t)(at >> 32);
+        rec->arg2 = (uint32_t)at;
+        since = 0;
+    }
+
+    rec = &ring->rec[head++ % TRACE_RING_RECORDS];
+    rec->op = op;
+    rec->thread = ring->index;
+    rec->arg0 = arg0;
+    rec->arg1 = arg1;
+    rec->arg2 = arg2;
+    rec->ret = ret;
+    rec->delta = (uint32_t)since;
+    end = end > start ? ticks_ns(end - start) : 0;
+    rec->duration = end > UINT32_MAX ? UINT32_MAX : (uint32_t)end;
+    ring->last = at;
+
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+}
+
+// writes out every record the rings hold, each ring's in as few writes as it's wrap-around allows
+private void drain(void)
+{
+    ring_t *ring;
+    uint32_t count, index, head, tail, run;
+    ssize_t len;
+
+    count = __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE);
+    for (index = 0; index < count; index++)
+    {
+        ring = rings[index];
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (tail = ring->tail; tail != head && !write_failed; tail += run)
+        {
+            run = head - tail;
+            if (run > TRACE_RING_RECORDS - tail % TRACE_RING_RECORDS)
+                run = TRACE_RING_RECORDS - tail % TRACE_RING_RECORDS;
+
+            len = write(trace_fd, &ring->rec[tail % TRACE_RING_RECORDS], (size_t)run * sizeof(trace_rec_t));
+            if (len != (ssize_t)(run * sizeof(trace_rec_t)))
+                write_failed = true;
+            else
+                records += run;
+        }
+
+        // once the file can't be written, records are thrown away, so the threads don't stall on full rings
+        __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+    }
+}
+
+private void *flush_rings(void *arg)
+{
+    struct timespec pause;
+
+    (void)arg;
+    pause.tv_sec = 0;
+    pause.tv_nsec = TRACE_FLUSH_US * 1000L;
+    while (!__atomic_load_n(&flusher_stop, __ATOMIC_ACQUIRE))
+    {
+        drain();
+        nanosleep(&pause, NULL);
+    }
+
+    // whatever the threads recorded before the trace stopped
+    drain();
+    return NULL;
+}
+
+internal bool trace_start(const char *path)
+{
+    trace_header_t header;
+    uint32_t index;
+
+    if (!path)
+        return false;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd != -1)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return false;
+    }
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0)
+    {
+        trace_fd = -1;
+        pthread_mutex_unlock(&trace_lock);
+        perror("open");
+        return false;
+    }
+
+    tick_scale = calibrate();
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_rec_t);
+    header.epoch = now_ns();
+    trace_epoch = read_ticks();
+
+    // the rings carry on from the last trace; anything a call left in one after that trace stopped is dropped
+    for (index = 0; index < __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE); index++)
+    {
+        rings[index]->tail = __atomic_load_n(&rings[index]->head, __ATOMIC_ACQUIRE);
+        rings[index]->last = 0;
+        rings[index]->dropped = 0;
+    }
+
+    records = 0;
+    unringed = 0;
+    write_failed = false;
+    flusher_stop = false;
+    if (write(trace_fd, &header, sizeof(header)) != sizeof(header) || pthread_create(&flusher, NULL, flush_rings, NULL))
+    {
+        close(trace_fd);
+        trace_fd = -1;
+        pthread_mutex_unlock(&trace_lock);
+        return false;
+    }
+
+    __atomic_store_n(&trace_on, true, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+    return true;
+}
+
+internal bool trace_stop(trace_stats_t *stats)
+{
+    uint32_t index;
+    uint64_t dropped;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd == -1)
+    {
+        pthread_mutex_unlock(&trace_lock);
+        return false;
+    }
+
+    // a call already past trace_begin still records; the flusher picks it up on it's last drain, unless it's
+    // later still, in which case the next trace drops it
+    __atomic_store_n(&trace_on, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&flusher_stop, true, __ATOMIC_RELEASE);
+    pthread_join(flusher, NULL);
+
+    dropped = __atomic_load_n(&unringed, __ATOMIC_RELAXED);
+    for (index = 0; index < __atomic_load_n(&ring_count, __ATOMIC_ACQUIRE); index++)
+        dropped += __atomic_load_n(&rings[index]->dropped, __ATOMIC_RELAXED);
+
+    if (stats)
+    {
+        stats->records = records;
+        stats->dropped = dropped;
+        stats->failed = write_failed;
+    }
+
+    close(trace_fd);
+    trace_fd = -1;
+    pthread_mutex_unlock(&trace_lock);
+    return true;
+}
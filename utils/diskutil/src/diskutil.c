@@ -1,24 +1,183 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h> // for usleep()
+#include <sys/stat.h>
 
 #include <disk.h>
 #include <filesys.h>
 
+#define PIPE_DEPTH (64)           // most files a stage of export or import can run ahead of the next by
+#define PIPE_BYTES (16U << 20)    // most bytes of file data queued between two stages, unless it's a single file
+#define IMPORT_FLUSH_MS (60000)   // flusher period during an import; the metadata is committed once, at the end
+#define IMPORT_FLUSH_RATIO (25)   // percentage of the dirty block table at which the flusher writes out file data
+
+// a file on it's way from one stage of export or import to the next
+typedef struct
+{
+    filename_t name;
+    uint8_t *data;
+    uint32_t size;
+} item_t;
+
+// a bounded queue handing files between two pipeline stages
+typedef struct
+{
+    item_t item[PIPE_DEPTH];
+    uint32_t head, count;
+    uint32_t bytes;     // file data held by the queued items
+    bool closed;        // the producing stage is done
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+} pipe_t;
+
+// the host side of an import, reading files off the host into the pipe
+typedef struct
+{
+    char *dir;
+    pipe_t pipe;
+    uint32_t skipped; // host files that couldn't be read or have no 8.3 name
+} import_t;
+
+// the volume side of an export, reading files off the volume into the pipe
+typedef struct
+{
+    filesys_t *filesys;
+    pipe_t pipe;
+    uint32_t skipped; // files that couldn't be read
+} export_t;
+
 void usage(char *arg);
 void usage_format(char *arg);
+void usage_fsck(char *arg);
+void usage_find(char *arg);
+void usage_export(char *arg);
+void usage_import(char *arg);
+void usage_defrag(char *arg);
+void usage_quota(char *arg);
+void usage_scrub(char *arg);
+void usage_mkraid(char *arg);
+uint8_t parse_drive(char *drive_str);
+bool parse_name(char *name_str, filename_t *name);
+void format_name(filename_t *name, char *buf);
+double elapsed(struct timespec *start);
+void pipe_init(pipe_t *pipe);
+void pipe_destroy(pipe_t *pipe);
+void pipe_push(pipe_t *pipe, item_t *item);
+bool pipe_pop(pipe_t *pipe, item_t *item);
+void pipe_close(pipe_t *pipe);
+void *import_reader(void *arg);
+void *export_reader(void *arg);
 void cmd_format(char *, char *);
+void cmd_fsck(char *, char *);
+void cmd_find(char *, char *);
+void cmd_export(char *, char *);
+void cmd_import(char *, char *);
+void cmd_defrag(char *, char *, char *);
+void cmd_quota(char *, char *, char *);
+void cmd_scrub(char *, char *);
+void cmd_mkraid(char *, char *);
 int main(int argc, char **argv);
 
 void usage(char *arg)
 {
     fprintf(stderr, "Usage: %s <command> [arguments]\n", arg);
     fprintf(stderr, "Available commands:\n"
-                    "1. format\n");
+                    "1. format\n"
+                    "2. fsck\n"
+                    "3. find\n"
+                    "4. export\n"
+                    "5. import\n"
+                    "6. defrag\n"
+                    "7. quota\n"
+                    "8. scrub\n"
+                    "9. mkraid\n");
 
     exit(EXIT_FAILURE);
 }
 
+// returns the drive number named by drive_str, or 0 if it names no drive; several drive letters
+// (as in CD:) name the drive made of those drives by mkraid
+uint8_t parse_drive(char *drive_str)
+{
+    uint8_t drive = 0;
+
+    if (!drive_str)
+        return 0;
+
+    for (; *drive_str; drive_str++) // based on the leading drive letters of drive_string
+    {
+        switch (*drive_str)
+        {
+        case 'c':
+        case 'C':
+            drive |= DriveC;
+            continue;
+        case 'd':
+        case 'D':
+            drive |= DriveD;
+            continue;
+        default:
+            break;
+        }
+        break;
+    }
+
+    return drive;
+}
+
+// fills in name from a name of the form name.ext; returns false if it doesn't fit the 8.3 format
+bool parse_name(char *name_str, filename_t *name)
+{
+    char *dot;
+    size_t len;
+
+    if (!name_str || !name)
+        return false;
+
+    memset(name, 0, sizeof(filename_t));
+    dot = strrchr(name_str, '.');
+    len = dot ? (size_t)(dot - name_str) : strlen(name_str);
+    if (!len || len > FILENAME_LEN || (dot && strlen(dot + 1) > FILEEXT_LEN))
+        return false;
+
+    memcpy(name->name, name_str, len);
+    if (dot)
+        memcpy(name->extension, dot + 1, strlen(dot + 1));
+
+    return true;
+}
+
+// buf should be of atleast 13 bytes; gets name as name.ext
+void format_name(filename_t *name, char *buf)
+{
+    size_t len;
+
+    for (len = 0; len < FILENAME_LEN && name->name[len]; len++)
+        *buf++ = name->name[len];
+
+    if (name->extension[0])
+        *buf++ = '.';
+
+    for (len = 0; len < FILEEXT_LEN && name->extension[len]; len++)
+        *buf++ = name->extension[len];
+
+    *buf = '\0';
+}
+
+// seconds passed since start
+double elapsed(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
 void cmd_format(char *arg1, char *arg2)
 {
     char drive = 0;
@@ -27,8 +186,10 @@ void cmd_format(char *arg1, char *arg2)
     filesys_t *filesys = NULL;
 
     bool bootable = false;
+    bool lazy = false;
     char force = true;
     int ret = 0;
+    struct timespec start;
 
     if (!arg1)
         usage_format("diskutil");
@@ -44,24 +205,18 @@ void cmd_format(char *arg1, char *arg2)
             bootable = true;
             drive_str = arg2;
         }
+        else if (!strcmp((const char *)arg1, "-l"))
+        {
+            lazy = true;
+            drive_str = arg2;
+        }
         else
             usage_format("diskutil");
     }
 
-    switch (*drive_str) // based on the first character of drive_string
-    {
-    case 'c':
-    case 'C':
-        drive = DriveC;
-        break;
-    case 'd':
-    case 'D':
-        drive = DriveD;
-        break;
-    default:
+    drive = parse_drive(drive_str);
+    if (!drive)
         usage_format("diskutil");
-        break;
-    }
 
     if (bootable)
     {
@@ -91,27 +246,817 @@ void cmd_format(char *arg1, char *arg2)
         return;
     }
 
-    filesys = fs_format(drive_desc, NULL, true);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    filesys = fs_format(drive_desc, NULL, true, lazy);
     if (!filesys)
     {
         fprintf(stderr, "Error formatting the drive %s\n", drive_str);
         return;
     }
 
+    fprintf(stdout, "Formatted drive %s in %.3f ms\n", drive_str, elapsed(&start) * 1000);
+    if (lazy)
+        fprintf(stdout, "The rest of the inode table is zeroed in the background once the drive is mounted\n");
+
+    // unmounting saves the bitmap, so the first mount doesn't have to scan for it
+    fs_unmount(filesys);
+
     return;
 }
 void usage_format(char *arg)
 {
-    fprintf(stderr, "Usage: %s format [-s] <drive>\n", arg);
+    fprintf(stderr, "Usage: %s format [-s | -l] <drive>\n", arg);
+    fprintf(stderr, "  -s: make the drive bootable\n");
+    fprintf(stderr, "  -l: lazy format; only write the superblock and the first inode block\n");
     fprintf(stderr, "Example:\n");
     fprintf(stderr, "%s format C:\n", arg);
 
     exit(EXIT_FAILURE);
 }
 
+void cmd_fsck(char *arg1, char *arg2)
+{
+    uint8_t drive = 0;
+    bool verbose = false;
+    char *drive_str = NULL;
+    filesys_t *filesys = NULL;
+    fsck_t report;
+    struct timespec start;
+    double secs;
+    bool ret;
+
+    if (!arg1)
+        usage_fsck("diskutil");
+    if (!arg2)
+        drive_str = arg1;
+    else
+    {
+        if (!strcmp((const char *)arg1, "-v"))
+        {
+            verbose = true;
+            drive_str = arg2;
+        }
+        else
+            usage_fsck("diskutil");
+    }
+
+    drive = parse_drive(drive_str);
+    if (!drive)
+        usage_fsck("diskutil");
+
+    filesys = fs_mount(drive, false);
+    if (!filesys)
+    {
+        fprintf(stderr, "Error mounting the drive %s\n", drive_str);
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = fs_check(filesys, &report, verbose);
+    secs = elapsed(&start);
+
+    if (!ret)
+    {
+        fprintf(stderr, "Drive %s has no valid filesystem or could not be read\n", drive_str);
+        fs_unmount(filesys);
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(stdout, "inodes in use       : %u\n", report.inodes);
+    fprintf(stdout, "duplicate blocks    : %u\n", report.duplicate);
+    fprintf(stdout, "out of range        : %u\n", report.out_of_range);
+    fprintf(stdout, "into inode table    : %u\n", report.into_inodes);
+    fprintf(stdout, "size mismatches     : %u\n", report.size_mismatch);
+    fprintf(stdout, "bitmap mismatches   : %u\n", report.bitmap_mismatch);
+    fprintf(stdout, "bad checksums       : %u\n", report.bad_checksum);
+    fprintf(stdout, "bad long names      : %u\n", report.bad_name);
+    fprintf(stdout, "bad link counts     : %u\n", report.bad_links);
+    fprintf(stdout, "checked %u blocks in %.3f s (%.0f blocks/s)\n", report.blocks_read, secs,
+            secs > 0 ? report.blocks_read / secs : 0.0);
+
+    fs_unmount(filesys);
+    if (fsck_errors(&report))
+        exit(EXIT_FAILURE);
+
+    return;
+}
+
+void usage_fsck(char *arg)
+{
+    fprintf(stderr, "Usage: %s fsck [-v] <drive>\n", arg);
+    fprintf(stderr, "Example:\n");
+    fprintf(stderr, "%s fsck -v C:\n", arg);
+
+    exit(EXIT_FAILURE);
+}
+
+void pipe_init(pipe_t *pipe)
+{
+    pipe->head = pipe->count = pipe->bytes = 0;
+    pipe->closed = false;
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->not_empty, NULL);
+    pthread_cond_init(&pipe->not_full, NULL);
+}
+
+void pipe_destroy(pipe_t *pipe)
+{
+    pthread_mutex_destroy(&pipe->lock);
+    pthread_cond_destroy(&pipe->not_empty);
+    pthread_cond_destroy(&pipe->not_full);
+}
+
+// waits for room and queues item; the pipe takes over it's data
+void pipe_push(pipe_t *pipe, item_t *item)
+{
+    pthread_mutex_lock(&pipe->lock);
+    while (pipe->count == PIPE_DEPTH || (pipe->count && pipe->bytes + item->size > PIPE_BYTES))
+        pthread_cond_wait(&pipe->not_full, &pipe->lock);
+
+    pipe->item[(pipe->head + pipe->count) % PIPE_DEPTH] = *item;
+    pipe->count++;
+    pipe->bytes += item->size;
+    pthread_cond_signal(&pipe->not_empty);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+// waits for the next item; returns false once the pipe is closed and drained
+bool pipe_pop(pipe_t *pipe, item_t *item)
+{
+    pthread_mutex_lock(&pipe->lock);
+    while (!pipe->count && !pipe->closed)
+        pthread_cond_wait(&pipe->not_empty, &pipe->lock);
+
+    if (!pipe->count)
+    {
+        pthread_mutex_unlock(&pipe->lock);
+        return false;
+    }
+
+    *item = pipe->item[pipe->head];
+    pipe->head = (pipe->head + 1) % PIPE_DEPTH;
+    pipe->count--;
+    pipe->bytes -= item->size;
+    pthread_cond_signal(&pipe->not_full);
+    pthread_mutex_unlock(&pipe->lock);
+    return true;
+}
+
+void pipe_close(pipe_t *pipe)
+{
+    pthread_mutex_lock(&pipe->lock);
+    pipe->closed = true;
+    pthread_cond_broadcast(&pipe->not_empty);
+    pthread_mutex_unlock(&pipe->lock);
+}
+
+// first stage of an import: reads every regular file of the host directory whole
+void *import_reader(void *arg)
+{
+    import_t *import;
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    char path[4096];
+    item_t item;
+    FILE *file;
+
+    import = (import_t *)arg;
+    dir = opendir(import->dir);
+    while (dir && (entry = readdir(dir)))
+    {
+        snprintf(path, sizeof(path), "%s/%s", import->dir, entry->d_name);
+        if (stat(path, &st) || !S_ISREG(st.st_mode))
+            continue;
+
+        if (!parse_name(entry->d_name, &item.name) || (uint64_t)st.st_size > UINT32_MAX)
+        {
+            import->skipped++;
+            continue;
+        }
+
+        item.size = (uint32_t)st.st_size;
+        item.data = malloc(item.size ? item.size : 1);
+        file = fopen(path, "rb");
+        if (!item.data || !file || fread(item.data, 1, item.size, file) != item.size)
+        {
+            import->skipped++;
+            free(item.data);
+            if (file)
+                fclose(file);
+            continue;
+        }
+
+        fclose(file);
+        pipe_push(&import->pipe, &item);
+    }
+
+    if (dir)
+        closedir(dir);
+    pipe_close(&import->pipe);
+    return NULL;
+}
+
+// first stage of an export: lists the volume and reads every file whole
+void *export_reader(void *arg)
+{
+    export_t *export;
+    dirent_t entries[64];
+    uint32_t cursor;
+    uint16_t filled, index;
+    item_t item;
+
+    export = (export_t *)arg;
+    cursor = 0;
+    while ((filled = fs_readdir_batch(export->filesys, &cursor, entries, sizeof(entries) / sizeof(dirent_t))))
+    {
+        for (index = 0; index < filled; index++)
+        {
+            if (!entries[index].inode || (entries[index].file_type & TYPE_MASK) != TYPE_FILE)
+                continue;
+
+            item.name = entries[index].file_name;
+            item.size = entries[index].file_size;
+            item.data = malloc(item.size ? item.size : 1);
+            if (!item.data || fs_read(export->filesys, entries[index].inode, 0, item.data, item.size) != item.size)
+            {
+                export->skipped++;
+                free(item.data);
+                continue;
+            }
+
+            pipe_push(&export->pipe, &item);
+        }
+    }
+
+    pipe_close(&export->pipe);
+    return NULL;
+}
+
+// copies every file of the volume into a host directory; the volume is read by one thread
+// while the host files are written by another
+void cmd_export(char *arg1, char *arg2)
+{
+    uint8_t drive = 0;
+    filesys_t *filesys = NULL;
+    export_t export;
+    pthread_t reader;
+    item_t item;
+    char name[13], path[4096];
+    uint64_t bytes;
+    uint32_t files, failed;
+    struct timespec start;
+    double secs;
+    FILE *file;
+
+    if (!arg1 || !arg2)
+        usage_export("diskutil");
+
+    drive = parse_drive(arg1);
+    if (!drive)
+        usage_export("diskutil");
+
+    if (mkdir(arg2, 0755) && errno != EEXIST)
+    {
+        fprintf(stderr, "Error creating the directory %s\n", arg2);
+        exit(EXIT_FAILURE);
+    }
+
+    // a volume that wasn't unmounted cleanly can't be mounted read-only
+    filesys = fs_mount(drive, true);
+    if (!filesys)
+        filesys = fs_mount(drive, false);
+    if (!filesys)
+    {
+        fprintf(stderr, "Error mounting the drive %s\n", arg1);
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    export.filesys = filesys;
+    export.skipped = 0;
+    pipe_init(&export.pipe);
+    if (pthread_create(&reader, NULL, export_reader, &export))
+    {
+        fprintf(stderr, "Error starting the export\n");
+        fs_unmount(filesys);
+        exit(EXIT_FAILURE);
+    }
+
+    bytes = files = failed = 0;
+    while (pipe_pop(&export.pipe, &item))
+    {
+        format_name(&item.name, name);
+        snprintf(path, sizeof(path), "%s/%s", arg2, name);
+        file = fopen(path, "wb");
+        if (file && fwrite(item.data, 1, item.size, file) == item.size)
+        {
+            files++;
+            bytes += item.size;
+        }
+        else
+            failed++;
+
+        if (file)
+            fclose(file);
+        free(item.data);
+    }
+
+    pthread_join(reader, NULL);
+    secs = elapsed(&start);
+    pipe_destroy(&export.pipe);
+    fs_unmount(filesys);
+
+    fprintf(stdout, "exported %u files (%llu bytes) in %.3f s: %.2f MB/s, %.0f files/s\n", files,
+            (unsigned long long)bytes, secs, secs > 0 ? bytes / secs / (1 << 20) : 0.0, secs > 0 ? files / secs : 0.0);
+    if (export.skipped + failed)
+    {
+        fprintf(stderr, "%u files couldn't be exported\n", export.skipped + failed);
+        exit(EXIT_FAILURE);
+    }
+
+    return;
+}
+
+void usage_export(char *arg)
+{
+    fprintf(stderr, "Usage: %s export <drive> <host_dir>\n", arg);
+    fprintf(stderr, "Example:\n");
+    fprintf(stderr, "%s export C: ./backup\n", arg);
+
+    exit(EXIT_FAILURE);
+}
+
+// copies every regular file of a host directory whose name fits the 8.3 format onto the volume,
+// replacing files of the same name; host files are read by one thread, written into the volume's
+// dirty block table by this one, and written out to the drive by the flusher. the inode table,
+// bitmap and name index changes all go out together with the final sync
+void cmd_import(char *arg1, char *arg2)
+{
+    uint8_t drive = 0;
+    filesys_t *filesys = NULL;
+    import_t import;
+    pthread_t reader;
+    item_t item;
+    uint16_t inodes[PIPE_DEPTH];
+    uint16_t inode, found, index;
+    uint64_t bytes;
+    uint32_t files, failed;
+    struct timespec start;
+    double secs;
+    bool synced;
+
+    if (!arg1 || !arg2)
+        usage_import("diskutil");
+
+    drive = parse_drive(arg2);
+    if (!drive)
+        usage_import("diskutil");
+
+    filesys = fs_mount(drive, false);
+    if (!filesys)
+    {
+        fprintf(stderr, "Error mounting the drive %s\n", arg2);
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fs_set_flusher(filesys, IMPORT_FLUSH_MS, IMPORT_FLUSH_RATIO);
+    import.dir = arg1;
+    import.skipped = 0;
+    pipe_init(&import.pipe);
+    if (pthread_create(&reader, NULL, import_reader, &import))
+    {
+        fprintf(stderr, "Error starting the import\n");
+        fs_unmount(filesys);
+        exit(EXIT_FAILURE);
+    }
+
+    bytes = files = failed = 0;
+    while (pipe_pop(&import.pipe, &item))
+    {
+        found = fs_find_by_name(filesys, &item.name, inodes, PIPE_DEPTH);
+        for (index = 0; index < found; index++)
+            fs_delete(filesys, inodes[index]);
+
+        inode = fs_create(filesys, &item.name, TYPE_FILE | (item.size <= INLINE_DATA_LEN ? FLAG_INLINE : 0));
+        if (inode && (!item.size || fs_write(filesys, inode, 0, item.data, item.size) == item.size))
+        {
+            files++;
+            bytes += item.size;
+        }
+        else
+        {
+            if (inode)
+                fs_delete(filesys, inode);
+            failed++;
+        }
+
+        free(item.data);
+    }
+
+    pthread_join(reader, NULL);
+    synced = fs_sync(filesys);
+    secs = elapsed(&start);
+    pipe_destroy(&import.pipe);
+    fs_unmount(filesys);
+
+    fprintf(stdout, "imported %u files (%llu bytes) in %.3f s: %.2f MB/s, %.0f files/s\n", files,
+            (unsigned long long)bytes, secs, secs > 0 ? bytes / secs / (1 << 20) : 0.0, secs > 0 ? files / secs : 0.0);
+    if (import.skipped)
+        fprintf(stderr, "%u host files were skipped (unreadable, or no 8.3 name)\n", import.skipped);
+    if (failed || !synced)
+    {
+        fprintf(stderr, "%u files couldn't be imported%s\n", failed, synced ? "" : ", and the drive couldn't be synced");
+        exit(EXIT_FAILURE);
+    }
+
+    return;
+}
+
+void usage_import(char *arg)
+{
+    fprintf(stderr, "Usage: %s import <host_dir> <drive>\n", arg);
+    fprintf(stderr, "Example:\n");
+    fprintf(stderr, "%s import ./backup C:\n", arg);
+
+    exit(EXIT_FAILURE);
+}
+
+// defragments a mounted volume; the budget caps the blocks copied per second
+void cmd_defrag(char *arg1, char *arg2, char *arg3)
+{
+    uint8_t drive = 0;
+    bool verbose = false;
+    char *drive_str = NULL, *budget_str = NULL, *end = NULL;
+    unsigned long budget = 0;
+    filesys_t *filesys = NULL;
+    defrag_t report;
+    struct timespec start;
+    double secs;
+    bool ret;
+
+    if (!arg1)
+        usage_defrag("diskutil");
+    if (!strcmp((const char *)arg1, "-v"))
+    {
+        verbose = true;
+        drive_str = arg2;
+        budget_str = arg3;
+    }
+    else
+    {
+        drive_str = arg1;
+        budget_str = arg2;
+    }
+
+    drive = parse_drive(drive_str);
+    if (!drive)
+        usage_defrag("diskutil");
+
+    if (budget_str)
+    {
+        budget = strtoul(budget_str, &end, 10);
+        if (!*budget_str || *end || budget > UINT32_MAX)
+            usage_defrag("diskutil");
+    }
+
+    filesys = fs_mount(drive, false);
+    if (!filesys)
+    {
+        fprintf(stderr, "Error mounting the drive %s\n", drive_str);
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ret = fs_defrag(filesys, (uint32_t)budget, &report, verbose);
+    secs = elapsed(&start);
+    fs_unmount(filesys);
+
+    fprintf(stdout, "files               : %u\n", report.files);
+    fprintf(stdout, "fragmented          : %u\n", report.fragmented);
+    fprintf(stdout, "moved               : %u\n", report.moved);
+    fprintf(stdout, "left fragmented     : %u\n", report.skipped);
+    fprintf(stdout, "extents             : %u before, %u after\n", report.extents_before, report.extents_after);
+    fprintf(stdout, "moved %u blocks in %.3f s (%.0f blocks/s)\n", report.blocks_moved, secs,
+            secs > 0 ? report.blocks_moved / secs : 0.0);
+
+    if (!ret)
+    {
+        fprintf(stderr, "Drive %s couldn't be read or written\n", drive_str);
+        exit(EXIT_FAILURE);
+    }
+
+    return;
+}
+
+void usage_defrag(char *arg)
+{
+    fprintf(stderr, "Usage: %s defrag [-v] <drive> [blocks_per_second]\n", arg);
+    fprintf(stderr, "  -v: print the extents of every file moved\n");
+    fprintf(stderr, "  blocks_per_second: most blocks copied per second; no limit if left out\n");
+    fprintf(stderr, "Example:\n");
+    fprintf(stderr, "%s defrag C: 2000\n", arg);
+
+    exit(EXIT_FAILURE);
+}
+
+#define FIND_MAX (64) // most matches find lists
+
+void cmd_find(char *arg1, char *arg2)
+{
+    uint8_t drive = 0;
+    filesys_t *filesys = NULL;
+    filename_t name;
+    inode_t inode;
+    uint16_t inodes[FIND_MAX];
+    uint16_t found, index;
+    struct timespec start;
+    double secs;
+
+    if (!arg1 || !arg2)
+        usage_find("diskutil");
+
+    drive = parse_drive(arg1);
+    if (!drive || !parse_name(arg2, &name))
+        usage_find("diskutil");
+
+    // a volume that wasn't unmounted cleanly can't be mounted read-only
+    filesys = fs_mount(drive, true);
+    if (!filesys)
+        filesys = fs_mount(drive, false);
+    if (!filesys)
+    {
+        fprintf(stderr, "Error mounting the drive %s\n", arg1);
+        exit(EXIT_FAILURE);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    found = fs_find_by_name(filesys, &name, inodes, FIND_MAX);
+    secs = elapsed(&start);
+
+    for (index = 0; index < found; index++)
+    {
+        if (fs_get_inode(filesys, inodes[index], &inode))
+            fprintf(stdout, "inode %u: %s, %u bytes\n", inodes[index], arg2, inode.file_size);
+    }
+
+    fprintf(stdout, "found %u file%s in %.3f ms%s\n", found, found == 1 ? "" : "s", secs * 1000,
+            filesys->names_blocks ? "" : " (no name index, the inode table was walked)");
+
+    fs_unmount(filesys);
+    if (!found)
+        exit(EXIT_FAILURE);
+
+    return;
+}
+
+void usage_find(char *arg)
+{
+    fprintf(stderr, "Usage: %s find <drive> <name>\n", arg);
+    fprintf(stderr, "Example:\n");
+    fprintf(stderr, "%s find C: notes.txt\n", arg);
+
+    exit(EXIT_FAILURE);
+}
+
+// prints the free space and what each owner is charged, or sets an owner's limit
+void cmd_quota(char *arg1, char *arg2, char *arg3)
+{
+    uint8_t drive = 0;
+    filesys_t *filesys = NULL;
+    unsigned long owner = 0, limit = 0;
+    char *end = NULL;
+    space_t space;
+    quota_t quota;
+
+    if (!arg1 || (arg2 && !arg3))
+        usage_quota("diskutil");
+
+    drive = parse_drive(arg1);
+    if (!drive)
+        usage_quota("diskutil");
+
+    if (arg2)
+    {
+        owner = strtoul(arg2, &end, 10);
+        if (!*arg2 || *end || owner >= QUOTA_OWNERS)
+            usage_quota("diskutil");
+        limit = strtoul(arg3, &end, 10);
+        if (!*arg3 || *end || limit > UINT16_MAX)
+            usage_quota("diskutil");
+    }
+
+    // just looking needs no more than a read-only mount
+    filesys = arg2 ? NULL : fs_mount(drive, true);
+    if (!filesys)
+        filesys = fs_mount(drive, false);
+    if (!filesys)
+    {
+        fprintf(stderr, "Error mounting the drive %s\n", arg1);
+        exit(EXIT_FAILURE);
+    }
+
+    if (arg2 && !fs_set_quota(filesys, (uint8_t)owner, (uint16_t)limit))
+    {
+        fprintf(stderr, "Limit couldn't be saved on drive %s\n", arg1);
+        fs_unmount(filesys);
+        exit(EXIT_FAILURE);
+    }
+
+    fs_space(filesys, &space);
+    fprintf(stdout, "blocks    : %u\n", space.blocks);
+    fprintf(stdout, "free      : %u\n", space.free);
+    fprintf(stdout, "reserved  : %u\n", space.reserved);
+    fprintf(stdout, "available : %u\n", space.available);
+
+    for (owner = 0; owner < QUOTA_OWNERS; owner++)
+    {
+        if (fs_get_quota(filesys, (uint8_t)owner, &quota) && (quota.used || quota.limit))
+        {
+            if (quota.limit)
+                fprintf(stdout, "owner %2lu  : %u of %u blocks\n", owner, quota.used, quota.limit);
+            else
+                fprintf(stdout, "owner %2lu  : %u blocks\n", owner, quota.used);
+        }
+    }
+
+    fs_unmount(filesys);
+    return;
+}
+
+void usage_quota(char *arg)
+{
+    fprintf(stderr, "Usage: %s quota <drive> [owner limit]\n", arg);
+    fprintf(stderr, "  owner limit: sets the most blocks owner (0 to %d) may be charged; a limit of 0 lifts it\n", QUOTA_OWNERS - 1);
+    fprintf(stderr, "Example:\n");
+    fprintf(stderr, "%s quota C: 1 4096\n", arg);
+
+    exit(EXIT_FAILURE);
+}
+
+#define SCRUB_POLL_MS (100) // time between looks at the progress of scrub
+#define SCRUB_LINE_POLLS (10) // looks between it's progress lines
+
+// scrubs a mounted volume to the end of the pass, carrying on from where an interrupted one left off
+void cmd_scrub(char *arg1, char *arg2)
+{
+    uint8_t drive = 0;
+    char *end = NULL;
+    unsigned long rate = 0;
+    filesys_t *filesys = NULL;
+    scrub_t report;
+    struct timespec start;
+    double secs;
+    uint32_t polls;
+
+    drive = parse_drive(arg1);
+    if (!drive)
+        usage_scrub("diskutil");
+
+    if (arg2)
+    {
+        rate = strtoul(arg2, &end, 10);
+        if (!*arg2 || *end || rate > UINT32_MAX)
+            usage_scrub("diskutil");
+    }
+
+    filesys = fs_mount(drive, false);
+    if (!filesys)
+    {
+        fprintf(stderr, "Error mounting the drive %s\n", arg1);
+        exit(EXIT_FAILURE);
+    }
+
+    if (filesys->super_block.scrub_next)
+        fprintf(stdout, "carrying on from block %u\n", filesys->super_block.scrub_next);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!fs_scrub_start(filesys, (uint32_t)rate))
+    {
+        fs_unmount(filesys);
+        fprintf(stderr, "The scrub of drive %s couldn't be started\n", arg1);
+        exit(EXIT_FAILURE);
+    }
+
+    // an interrupted scrub has saved where it got to, and the next one carries on from there
+    for (polls = 0; fs_scrub_status(filesys, &report) && report.running; polls++)
+    {
+        if (polls && !(polls % SCRUB_LINE_POLLS))
+            fprintf(stdout, "block %u of %u, %u checked\n", report.next, filesys->super_block.blocks, report.checked);
+        usleep(SCRUB_POLL_MS * 1000);
+    }
+    fs_scrub_stop(filesys);
+    secs = elapsed(&start);
+    fs_scrub_status(filesys, &report);
+    fs_unmount(filesys);
+
+    fprintf(stdout, "checked             : %u\n", report.checked);
+    fprintf(stdout, "skipped (dirty)     : %u\n", report.skipped);
+    fprintf(stdout, "bad checksums       : %u\n", report.bad);
+    fprintf(stdout, "unreadable          : %u\n", report.unreadable);
+    fprintf(stdout, "repaired            : %u\n", report.repaired);
+    fprintf(stdout, "scrubbed in %.3f s (%.1f MB/s)\n", secs, secs > 0 ? report.checked * (double)BLOCK_SIZE / (1 << 20) / secs : 0.0);
+
+    if (report.bad + report.unreadable > report.repaired)
+        exit(EXIT_FAILURE);
+
+    return;
+}
+
+void usage_scrub(char *arg)
+{
+    fprintf(stderr, "Usage: %s scrub <drive> [MB_per_second]\n", arg);
+    fprintf(stderr, "  MB_per_second: most data read per second; no limit if left out\n");
+    fprintf(stderr, "Example:\n");
+    fprintf(stderr, "%s scrub C: 4\n", arg);
+
+    exit(EXIT_FAILURE);
+}
+
+void cmd_mkraid(char *arg1, char *arg2)
+{
+    uint8_t mode = 0;
+    char *end = NULL;
+    unsigned long chunk = 0;
+    drive_t *members[2] = {NULL, NULL};
+    drive_t *drive = NULL;
+    filesys_t *filesys = NULL;
+    char force = true;
+    int ret = 0;
+
+    if (!arg1)
+        usage_mkraid("diskutil");
+    if (!strcmp(arg1, "stripe"))
+        mode = RAID_STRIPE;
+    else if (!strcmp(arg1, "mirror"))
+        mode = RAID_MIRROR;
+    else
+        usage_mkraid("diskutil");
+
+    if (arg2)
+    {
+        chunk = strtoul(arg2, &end, 10);
+        if (*end || !chunk || chunk > UINT16_MAX || mode != RAID_STRIPE)
+            usage_mkraid("diskutil");
+    }
+
+    fprintf(stdout, "This will format and ERASE your drives C: and D:\n");
+    fprintf(stdout, "Continue? (y/n): ");
+
+    ret = scanf("%c", &force);
+    if (ret < 1)
+    {
+        fprintf(stderr, "Error reading the choice\n");
+        return;
+    }
+
+    force = (force == 'y' || (char)force == 'Y') ? 1 : 0;
+    if (!force)
+        return;
+
+    members[0] = d_attach(DriveC);
+    members[1] = d_attach(DriveD);
+    if (members[0] && members[1])
+        drive = d_raid(members, 2, mode, (uint16_t)chunk);
+
+    if (!drive)
+    {
+        fprintf(stderr, "Error making a drive of C: and D:\n");
+        d_detach(members[0]);
+        d_detach(members[1]);
+        return;
+    }
+
+    filesys = fs_format(drive, NULL, true, false);
+    if (!filesys)
+    {
+        fprintf(stderr, "Error formatting the drive CD:\n");
+        d_detach(drive);
+        return;
+    }
+
+    d_show(drive);
+    fprintf(stdout, "Formatted drive CD:; it's mounted and checked as CD: from now on\n");
+    fs_unmount(filesys);
+
+    return;
+}
+void usage_mkraid(char *arg)
+{
+    fprintf(stderr, "Usage: %s mkraid <stripe | mirror> [chunk]\n", arg);
+    fprintf(stderr, "  stripe: deal the blocks out to C: and D: a chunk at a time, for twice the room and speed\n");
+    fprintf(stderr, "  mirror: keep every block on both C: and D:, so either can fail or rot and the other fills in\n");
+    fprintf(stderr, "  chunk: blocks dealt to a drive at a time when striping (%d)\n", RAID_CHUNK);
+    fprintf(stderr, "Example:\n");
+    fprintf(stderr, "%s mkraid mirror\n", arg);
+
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv)
 {
-    char *arg1 = NULL, *arg2 = NULL, *cmd = NULL;
+    char *arg1 = NULL, *arg2 = NULL, *arg3 = NULL, *cmd = NULL;
 
     if (argc < 2)
         usage(argv[0]);
@@ -125,10 +1070,27 @@ int main(int argc, char **argv)
     {
         arg1 = argv[2];
         arg2 = argv[3];
+        arg3 = argc > 4 ? argv[4] : NULL;
     }
 
     if (!strcmp(cmd, "format"))
         cmd_format(arg1, arg2);
+    else if (!strcmp(cmd, "fsck"))
+        cmd_fsck(arg1, arg2);
+    else if (!strcmp(cmd, "find"))
+        cmd_find(arg1, arg2);
+    else if (!strcmp(cmd, "export"))
+        cmd_export(arg1, arg2);
+    else if (!strcmp(cmd, "import"))
+        cmd_import(arg1, arg2);
+    else if (!strcmp(cmd, "defrag"))
+        cmd_defrag(arg1, arg2, arg3);
+    else if (!strcmp(cmd, "quota"))
+        cmd_quota(arg1, arg2, arg3);
+    else if (!strcmp(cmd, "scrub"))
+        cmd_scrub(arg1, arg2);
+    else if (!strcmp(cmd, "mkraid"))
+        cmd_mkraid(arg1, arg2);
     else
         usage(argv[0]);
 
@@ -0,0 +1,128 @@
+#ifndef VFS_H
+#define VFS_H
+
+#include <base.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * the virtual filesystem: volumes of any filesystem type are mounted at paths, and every call names a path
+ * (or a file opened through one) instead of a filesys_t; the mount table finds the volume and hands the call
+ * to the ops of it's type. paths are absolute, like /c/notes.txt: the longest mount point the path begins
+ * with picks the volume, and the rest is the name of a file in it (volumes are flat, so the rest has no /)
+ *
+ * a mount point is looked up by the hash of it's components, and only as many components of a path are hashed
+ * as the deepest mount point has; with every volume mounted directly under / (the usual case), resolving a path
+ * is a single probe of the table however many volumes there are
+ */
+
+#define VFS_MOUNTS (32)      // most volumes mounted at once
+#define VFS_OPENS (64)       // most files open at once on a single volume
+#define VFS_BUCKETS (64)     // chains of the mount table; a power of two
+#define VFS_TYPES (8)        // most filesystem types registered at once, the built-in ones included
+#define VFS_MOUNT_LEN (64)   // longest mount point, the null included
+#define VFS_PATH_LEN (512)   // longest path, the null included
+#define VFS_NAME_LEN (255)   // longest file name within a volume
+
+/*
+ * what vfs_stat and vfs_fstat fill in
+ */
+typedef struct
+{
+    uint32_t inode; // the file's number within it's volume; 0 for the volume itself
+    uint32_t size;  // bytes in the file
+    uint16_t links; // names the file goes by
+    bool dir;       // the volume itself, rather than a file in it
+} vfs_stat_t;
+
+/*
+ * a single entry filled in by vfs_readdir
+ */
+typedef struct
+{
+    uint32_t inode;
+    uint32_t size;
+    char name[VFS_NAME_LEN + 1]; // null-terminated
+} vfs_dirent_t;
+
+/*
+ * a file opened with vfs_open; it keeps it's volume mounted until vfs_close. every open has an id of it's own,
+ * which the volume keeps among it's open files until the close, so a copy of the handle is caught once either
+ * copy has been closed, and the volume is let go of only once
+ */
+typedef struct
+{
+    uint8_t mount; // slot of the mount table
+    uint8_t open;  // entry of the volume's open files
+    uint32_t id;   // of the open; never 0
+    uint32_t inode;
+} vfs_file_t;
+
+/*
+ * a mounted volume, as listed by vfs_mounts
+ */
+typedef struct
+{
+    char path[VFS_MOUNT_LEN];
+    const char *type;
+    uint8_t drive_num; // the drive given to vfs_mount; 0 for a volume that came with vfs_attach
+    uint32_t users;    // open files and calls under way
+} vfs_mountinfo_t;
+
+/*
+ * the ops of a filesystem type; volume is whatever mount returned. inode numbers are the type's own, with 0
+ * never naming a file. every op is called with the volume pinned, so it can't be unmounted underneath it
+ */
+typedef struct
+{
+    const char *name;                                          // what vfs_mount is asked for
+    void *(*mount)(uint8_t drive_num, bool readonly);          // NULL on failure
+    void (*unmount)(void *volume);
+    uint32_t (*lookup)(void *volume, const char *name);        // the file called name; 0 if there is none
+    uint32_t (*create)(void *volume, const char *name);        // a new empty file; 0 on failure
+    bool (*unlink)(void *volume, uint32_t inode);
+    uint32_t (*read)(void *volume, uint32_t inode, uint32_t offset, uint8_t *buf, uint32_t len);
+    uint32_t (*write)(void *volume, uint32_t inode, uint32_t offset, uint8_t *buf, uint32_t len);
+    bool (*stat)(void *volume, uint32_t inode, vfs_stat_t *stat);
+    uint32_t (*readdir)(void *volume, uint32_t *cursor, vfs_dirent_t *entries, uint32_t count); // as fs_readdir_batch
+    bool (*sync)(void *volume);
+} vfs_ops_t;
+
+extern internal const vfs_ops_t neofs_ops; // the neoSys filesystem, on a drive (see filesys.h)
+extern internal const vfs_ops_t ramfs_ops; // files held in memory; the drive number is ignored, and they're gone once unmounted
+
+// adds a filesystem type; neofs and ramfs are there from the start. returns false if the name is taken or there's no room
+internal bool vfs_register(const vfs_ops_t *ops);
+
+// mounts drive_num at path with the filesystem type named type; returns false if path is taken or malformed,
+// the type is unknown, or the type couldn't mount the drive
+internal bool vfs_mount(const char *path, const char *type, uint8_t drive_num, bool readonly);
+
+// as vfs_mount, for a volume already mounted by it's type (such as the filesys_t of fs_format); the mount table
+// owns it from then on, and vfs_unmount unmounts it
+internal bool vfs_attach(const char *path, const char *type, void *volume);
+
+// returns false if nothing is mounted at path, or the volume is in use (an open file, or a call under way)
+internal bool vfs_unmount(const char *path);
+
+// fills in up to count mounts; returns how many there are
+internal uint32_t vfs_mounts(vfs_mountinfo_t *mounts, uint32_t count);
+
+// opens the file at path, creating it first if create is set and there's none; returns false on failure
+internal bool vfs_open(const char *path, bool create, vfs_file_t *file);
+internal bool vfs_close(vfs_file_t *file);
+internal uint32_t vfs_read(vfs_file_t *file, uint32_t offset, uint8_t *buf, uint32_t len);  // returns the bytes read
+internal uint32_t vfs_write(vfs_file_t *file, uint32_t offset, uint8_t *buf, uint32_t len); // returns the bytes written
+internal bool vfs_fstat(vfs_file_t *file, vfs_stat_t *stat);
+
+// stat of a file, or of the volume mounted at path
+internal bool vfs_stat(const char *path, vfs_stat_t *stat);
+internal bool vfs_unlink(const char *path);
+
+// lists the volume mounted at path, from *cursor on (0 to start), as fs_readdir_batch does; 0 once done
+internal uint32_t vfs_readdir(const char *path, uint32_t *cursor, vfs_dirent_t *entries, uint32_t count);
+
+// syncs the volume mounted at path, or every volume for /
+internal bool vfs_sync(const char *path);
+
+#endif // VFS_H
@@ -0,0 +1,181 @@
+#include <vfs.h>
+#include <filesys.h>
+#include <osapi.h>
+#include <string.h> // for strcmp() and strrchr()
+
+#define NEOFS_HITS (8)  // files sharing a name (or a hash of one) looked at by a lookup
+#define NEOFS_BATCH (32) // directory entries fetched by one fs_readdir_batch
+
+private void *neofs_mount(uint8_t drive_num, bool readonly);
+private void neofs_unmount(void *volume);
+private bool neofs_short(const char *str, filename_t *name);
+private bool neofs_named(filesys_t *filesys, uint16_t inode_index, const char *name);
+private uint32_t neofs_lookup(void *volume, const char *name);
+private uint32_t neofs_create(void *volume, const char *name);
+private bool neofs_unlink(void *volume, uint32_t inode);
+private uint32_t neofs_read(void *volume, uint32_t inode, uint32_t offset, uint8_t *buf, uint32_t len);
+private uint32_t neofs_write(void *volume, uint32_t inode, uint32_t offset, uint8_t *buf, uint32_t len);
+private bool neofs_stat(void *volume, uint32_t inode, vfs_stat_t *stat);
+private uint32_t neofs_readdir(void *volume, uint32_t *cursor, vfs_dirent_t *entries, uint32_t count);
+private bool neofs_sync(void *volume);
+
+internal const vfs_ops_t neofs_ops = {
+    .name = "neofs",
+    .mount = neofs_mount,
+    .unmount = neofs_unmount,
+    .lookup = neofs_lookup,
+    .create = neofs_create,
+    .unlink = neofs_unlink,
+    .read = neofs_read,
+    .write = neofs_write,
+    .stat = neofs_stat,
+    .readdir = neofs_readdir,
+    .sync = neofs_sync,
+};
+
+private void *neofs_mount(uint8_t drive_num, bool readonly)
+{
+    return fs_mount(drive_num, readonly);
+}
+
+private void neofs_unmount(void *volume)
+{
+    fs_unmount((filesys_t *)volume);
+}
+
+// fills in name from str if it's of the form name.ext (or name) and fits the 8.3 format; a name ending in a dot
+// doesn't, since it would read back without one
+private bool neofs_short(const char *str, filename_t *name)
+{
+    const char *dot;
+    uint32_t len;
+
+    zero(name, sizeof(filename_t));
+    dot = strrchr(str, '.');
+    len = dot ? (uint32_t)(dot - str) : strlen(str);
+    if (!len || len > FILENAME_LEN || (dot && (!dot[1] || strlen(dot + 1) > FILEEXT_LEN)))
+        return false;
+
+    copy(name->name, (void *)str, (uint16_t)len);
+    if (dot)
+        copy(name->extension, (void *)(dot + 1), (uint16_t)strlen(dot + 1));
+
+    return true;
+}
+
+// whether the file goes by name: it's long name, or it's 8.3 name as name.ext if it has none
+// the 8.3 name made from a long one doesn't count, so two long names sharing one are told apart
+private bool neofs_named(filesys_t *filesys, uint16_t inode_index, const char *name)
+{
+    char buf[LONG_NAME_LEN + 1];
+
+    return fs_get_long_name(filesys, inode_index, buf, sizeof(buf)) && !strcmp(buf, name);
+}
+
+private uint32_t neofs_lookup(void *volume, const char *name)
+{
+    filename_t short_form;
+    uint16_t hits[NEOFS_HITS];
+    uint16_t found, index;
+
+    found = fs_find_by_long_name((filesys_t *)volume, (char *)name, hits, NEOFS_HITS);
+    for (index = 0; index < found; index++)
+    {
+        if (neofs_named((filesys_t *)volume, hits[index], name))
+            return hits[index];
+    }
+
+    if (!neofs_short(name, &short_form))
+        return 0;
+
+    found = fs_find_by_name((filesys_t *)volume, &short_form, hits, NEOFS_HITS);
+    for (index = 0; index < found; index++)
+    {
+        if (neofs_named((filesys_t *)volume, hits[index], name))
+            return hits[index];
+    }
+
+    return 0;
+}
+
+// a name that fits the 8.3 format is all the file gets; small files start out inline
+private uint32_t neofs_create(void *volume, const char *name)
+{
+    filename_t short_form;
+
+    if (neofs_short(name, &short_form))
+        return fs_create((filesys_t *)volume, &short_form, TYPE_FILE | FLAG_INLINE);
+
+    return fs_create_long((filesys_t *)volume, (char *)name, TYPE_FILE | FLAG_INLINE);
+}
+
+private bool neofs_unlink(void *volume, uint32_t inode)
+{
+    return inode <= UINT16_MAX && fs_unlink((filesys_t *)volume, (uint16_t)inode);
+}
+
+private uint32_t neofs_read(void *volume, uint32_t inode, uint32_t offset, uint8_t *buf, uint32_t len)
+{
+    return inode <= UINT16_MAX ? fs_read((filesys_t *)volume, (uint16_t)inode, offset, buf, len) : 0;
+}
+
+private uint32_t neofs_write(void *volume, uint32_t inode, uint32_t offset, uint8_t *buf, uint32_t len)
+{
+    return inode <= UINT16_MAX ? fs_write((filesys_t *)volume, (uint16_t)inode, offset, buf, len) : 0;
+}
+
+// a link is stat'ed as the file it names, since that's what reading and writing through it reach
+private bool neofs_stat(void *volume, uint32_t inode, vfs_stat_t *stat)
+{
+    inode_t node;
+
+    if (inode > UINT16_MAX || !fs_get_inode((filesys_t *)volume, (uint16_t)inode, &node))
+        return false;
+
+    if ((node.file_type & FLAG_LINK) && !fs_get_inode((filesys_t *)volume, node.target, &node))
+        return false;
+
+    stat->inode = inode;
+    stat->size = node.file_size;
+    stat->links = node.links ? node.links : 1;
+    stat->dir = false;
+    return true;
+}
+
+// the root directory, and inodes whose own name was unlinked, aren't listed
+private uint32_t neofs_readdir(void *volume, uint32_t *cursor, vfs_dirent_t *entries, uint32_t count)
+{
+    dirent_t batch[NEOFS_BATCH];
+    vfs_stat_t stat;
+    uint32_t filled, index;
+    uint16_t got;
+
+    filled = 0;
+    while (filled < count)
+    {
+        // no more than will fit, so none fetched is left over
+        got = fs_readdir_batch((filesys_t *)volume, cursor, batch, count - filled < NEOFS_BATCH ? count - filled : NEOFS_BATCH);
+        if (!got)
+            break;
+
+        for (index = 0; index < got; index++)
+        {
+            if (!batch[index].inode || (batch[index].file_type & FLAG_NONAME) ||
+                !fs_get_long_name((filesys_t *)volume, batch[index].inode, entries[filled].name, VFS_NAME_LEN + 1))
+                continue;
+
+            entries[filled].inode = batch[index].inode;
+            entries[filled].size = batch[index].file_size;
+            if ((batch[index].file_type & FLAG_LINK) && neofs_stat(volume, batch[index].inode, &stat))
+                entries[filled].size = stat.size;
+            filled++;
+        }
+    }
+
+    return filled;
+}
+
+private bool neofs_sync(void *volume)
+{
+    return fs_sync((filesys_t *)volume);
+}
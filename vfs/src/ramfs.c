@@ -0,0 +1,271 @@
+#include <vfs.h>
+#include <osapi.h>
+#include <stdlib.h>
+#include <string.h> // for memcpy(), memset() and strcmp()
+#include <pthread.h>
+
+#define RAMFS_FILES (256)         // most files a volume holds
+#define RAMFS_FILE_MAX (1U << 26) // largest file, 64 MB
+
+typedef struct
+{
+    char name[VFS_NAME_LEN + 1];
+    uint8_t *data;
+    uint32_t size;
+    uint32_t room; // bytes data has room for
+    bool used;
+} ramfile_t;
+
+/*
+ * a volume of files held in memory; inode i is file[i - 1]
+ */
+typedef struct
+{
+    ramfile_t file[RAMFS_FILES];
+    pthread_rwlock_t lock; // shared by readers, and held exclusively by anything that changes a file or it's name
+} ramfs_t;
+
+private void *ramfs_mount(uint8_t drive_num, bool readonly);
+private void ramfs_unmount(void *volume);
+private uint32_t ramfs_lookup(void *volume, const char *name);
+private uint32_t ramfs_create(void *volume, const char *name);
+private bool ramfs_unlink(void *volume, uint32_t inode);
+private uint32_t ramfs_read(void *volume, uint32_t inode, uint32_t offset, uint8_t *buf, uint32_t len);
+private uint32_t ramfs_write(void *volume, uint32_t inode, uint32_t offset, uint8_t *buf, uint32_t len);
+private bool ramfs_stat(void *volume, uint32_t inode, vfs_stat_t *stat);
+private uint32_t ramfs_readdir(void *volume, uint32_t *cursor, vfs_dirent_t *entries, uint32_t count);
+private bool ramfs_sync(void *volume);
+
+internal const vfs_ops_t ramfs_ops = {
+    .name = "ramfs",
+    .mount = ramfs_mount,
+    .unmount = ramfs_unmount,
+    .lookup = ramfs_lookup,
+    .create = ramfs_create,
+    .unlink = ramfs_unlink,
+    .read = ramfs_read,
+    .write = ramfs_write,
+    .stat = ramfs_stat,
+    .readdir = ramfs_readdir,
+    .sync = ramfs_sync,
+};
+
+// nothing is read from a drive, and a read-only volume of nothing would be of no use, so both are ignored
+private void *ramfs_mount(uint8_t drive_num, bool readonly)
+{
+    ramfs_t *ramfs;
+
+    (void)drive_num;
+    (void)readonly;
+    ramfs = calloc(1, sizeof(ramfs_t));
+    if (ramfs)
+        pthread_rwlock_init(&ramfs->lock, NULL);
+
+    return ramfs;
+}
+
+private void ramfs_unmount(void *volume)
+{
+    ramfs_t *ramfs;
+    uint32_t index;
+
+    ramfs = (ramfs_t *)volume;
+    for (index = 0; index < RAMFS_FILES; index++)
+        free(ramfs->file[index].data);
+
+    pthread_rwlock_destroy(&ramfs->lock);
+    free(ramfs);
+}
+
+private uint32_t ramfs_lookup(void *volume, const char *name)
+{
+    ramfs_t *ramfs;
+    uint32_t index, inode;
+
+    ramfs = (ramfs_t *)volume;
+    inode = 0;
+    pthread_rwlock_rdlock(&ramfs->lock);
+    for (index = 0; index < RAMFS_FILES; index++)
+    {
+        if (ramfs->file[index].used && !strcmp(ramfs->file[index].name, name))
+        {
+            inode = index + 1;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&ramfs->lock);
+
+    return inode;
+}
+
+private uint32_t ramfs_create(void *volume, const char *name)
+{
+    ramfs_t *ramfs;
+    uint32_t index, inode;
+
+    ramfs = (ramfs_t *)volume;
+    if (!*name || strlen(name) > VFS_NAME_LEN)
+        return 0;
+
+    inode = 0;
+    pthread_rwlock_wrlock(&ramfs->lock);
+    for (index = 0; index < RAMFS_FILES; index++)
+    {
+        // names are unique, as on a neofs volume looked up through the vfs
+        if (ramfs->file[index].used && !strcmp(ramfs->file[index].name, name))
+        {
+            inode = 0;
+            break;
+        }
+
+        if (!ramfs->file[index].used && !inode)
+            inode = index + 1;
+    }
+
+    if (inode)
+    {
+        zero(&ramfs->file[inode - 1], sizeof(ramfile_t));
+        copy(ramfs->file[inode - 1].name, (void *)name, (uint16_t)strlen(name));
+        ramfs->file[inode - 1].used = true;
+    }
+    pthread_rwlock_unlock(&ramfs->lock);
+
+    return inode;
+}
+
+private bool ramfs_unlink(void *volume, uint32_t inode)
+{
+    ramfs_t *ramfs;
+    bool ret;
+
+    ramfs = (ramfs_t *)volume;
+    if (!inode || inode > RAMFS_FILES)
+        return false;
+
+    pthread_rwlock_wrlock(&ramfs->lock);
+    ret = ramfs->file[inode - 1].used;
+    free(ramfs->file[inode - 1].data);
+    zero(&ramfs->file[inode - 1], sizeof(ramfile_t));
+    pthread_rwlock_unlock(&ramfs->lock);
+
+    return ret;
+}
+
+private uint32_t ramfs_read(void *volume, uint32_t inode, uint32_t offset, uint8_t *buf, uint32_t len)
+{
+    ramfs_t *ramfs;
+    ramfile_t *file;
+
+    ramfs = (ramfs_t *)volume;
+    if (!inode || inode > RAMFS_FILES)
+        return 0;
+
+    pthread_rwlock_rdlock(&ramfs->lock);
+    file = &ramfs->file[inode - 1];
+    if (!file->used || offset >= file->size)
+        len = 0;
+    else if (len > file->size - offset)
+        len = file->size - offset;
+
+    if (len)
+        memcpy(buf, file->data + offset, len);
+    pthread_rwlock_unlock(&ramfs->lock);
+
+    return len;
+}
+
+// a file grows to twice what it needs, so a run of appends copies it a logarithmic number of times;
+// a gap left by writing past the end reads as zeroes
+private uint32_t ramfs_write(void *volume, uint32_t inode, uint32_t offset, uint8_t *buf, uint32_t len)
+{
+    ramfs_t *ramfs;
+    ramfile_t *file;
+    uint8_t *data;
+    uint64_t end, room;
+
+    ramfs = (ramfs_t *)volume;
+    end = (uint64_t)offset + len;
+    if (!inode || inode > RAMFS_FILES || !len || end > RAMFS_FILE_MAX)
+        return 0;
+
+    pthread_rwlock_wrlock(&ramfs->lock);
+    file = &ramfs->file[inode - 1];
+    if (!file->used)
+    {
+        pthread_rwlock_unlock(&ramfs->lock);
+        return 0;
+    }
+
+    if (end > file->room)
+    {
+        room = end * 2 < RAMFS_FILE_MAX ? end * 2 : RAMFS_FILE_MAX;
+        data = realloc(file->data, room);
+        if (!data)
+        {
+            pthread_rwlock_unlock(&ramfs->lock);
+            return 0;
+        }
+        file->data = data;
+        file->room = (uint32_t)room;
+    }
+
+    if (offset > file->size)
+        memset(file->data + file->size, 0, offset - file->size);
+    memcpy(file->data + offset, buf, len);
+    if (end > file->size)
+        file->size = (uint32_t)end;
+    pthread_rwlock_unlock(&ramfs->lock);
+
+    return len;
+}
+
+private bool ramfs_stat(void *volume, uint32_t inode, vfs_stat_t *stat)
+{
+    ramfs_t *ramfs;
+    bool ret;
+
+    ramfs = (ramfs_t *)volume;
+    if (!inode || inode > RAMFS_FILES)
+        return false;
+
+    pthread_rwlock_rdlock(&ramfs->lock);
+    ret = ramfs->file[inode - 1].used;
+    stat->inode = inode;
+    stat->size = ramfs->file[inode - 1].size;
+    stat->links = 1;
+    stat->dir = false;
+    pthread_rwlock_unlock(&ramfs->lock);
+
+    return ret;
+}
+
+// the cursor is the index of the next file to look at
+private uint32_t ramfs_readdir(void *volume, uint32_t *cursor, vfs_dirent_t *entries, uint32_t count)
+{
+    ramfs_t *ramfs;
+    uint32_t filled;
+
+    ramfs = (ramfs_t *)volume;
+    filled = 0;
+    pthread_rwlock_rdlock(&ramfs->lock);
+    for (; *cursor < RAMFS_FILES && filled < count; (*cursor)++)
+    {
+        if (!ramfs->file[*cursor].used)
+            continue;
+
+        entries[filled].inode = *cursor + 1;
+        entries[filled].size = ramfs->file[*cursor].size;
+        copy(entries[filled].name, ramfs->file[*cursor].name, (uint16_t)(strlen(ramfs->file[*cursor].name) + 1));
+        filled++;
+    }
+    pthread_rwlock_unlock(&ramfs->lock);
+
+    return filled;
+}
+
+// nothing is kept anywhere but memory
+private bool ramfs_sync(void *volume)
+{
+    (void)volume;
+    return true;
+}
@@ -0,0 +1,648 @@
+#include <vfs.h>
+#include <osapi.h>
+#include <string.h> // for memcmp(), strchr(), strcmp() and strlen()
+#include <pthread.h>
+
+#define FNV_BASIS (2166136261U)
+#define FNV_PRIME (16777619U)
+#define NO_MOUNT (0xff)
+
+/*
+ * a slot of the mount table; path is kept as normalized by normalize, and "" stands for /
+ */
+typedef struct
+{
+    char path[VFS_MOUNT_LEN];
+    uint32_t len;
+    uint32_t depth;       // components in path
+    uint32_t hash;        // hash_path of path
+    const vfs_ops_t *ops;
+    void *volume;
+    uint8_t drive_num;
+    uint8_t next;         // next slot in the chain of the bucket; NO_MOUNT at it's end
+    bool used;
+    uint32_t users;       // open files and calls under way
+    uint32_t opens[VFS_OPENS]; // ids of the files open on the volume; 0 for a free entry
+} mount_t;
+
+private mount_t mounts[VFS_MOUNTS];
+private uint8_t buckets[VFS_BUCKETS] = {[0 ... VFS_BUCKETS - 1] = NO_MOUNT}; // first slot of each chain
+private uint8_t root_mount = NO_MOUNT; // the volume mounted at /, which takes any path no other mount point begins
+private uint32_t max_depth;            // components of the deepest mount point
+private uint32_t last_open;            // id of the latest open
+private pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER; // guards the table; users is atomic besides
+
+private const vfs_ops_t *types[VFS_TYPES] = {&neofs_ops, &ramfs_ops};
+private pthread_mutex_t types_lock = PTHREAD_MUTEX_INITIALIZER;
+
+private uint32_t normalize(const char *path, char *out, uint32_t size, uint32_t *depth);
+private uint32_t hash_path(const char *path, uint32_t len);
+private uint32_t hash_prefixes(const char *path, uint32_t len, uint32_t *hashes, uint32_t *ends, uint32_t most);
+private uint8_t find_exact(const char *path, uint32_t len, uint32_t hash);
+private uint8_t resolve(const char *path, const char **rest);
+private void release(uint8_t slot);
+private const vfs_ops_t *find_type(const char *name);
+private bool add_mount(const char *path, const vfs_ops_t *ops, void *volume, uint8_t drive_num);
+private bool pin_file(vfs_file_t *file);
+
+// copies path into out with runs of / squeezed and any trailing / dropped, so /c//x/ becomes /c/x and / becomes "";
+// returns it's length, or UINT32_MAX if it's not absolute, is too long, or has a . or .. component
+private uint32_t normalize(const char *path, char *out, uint32_t size, uint32_t *depth)
+{
+    uint32_t len, start;
+
+    if (!path || *path != '/')
+        return UINT32_MAX;
+
+    len = 0;
+    *depth = 0;
+    while (*path)
+    {
+        while (*path == '/')
+            path++;
+        if (!*path)
+            break;
+
+        if (len + 1 >= size)
+            return UINT32_MAX;
+        out[len++] = '/';
+        start = len;
+        while (*path && *path != '/')
+        {
+            if (len + 1 >= size)
+                return UINT32_MAX;
+            out[len++] = *path++;
+        }
+
+        if ((len - start == 1 && out[start] == '.') || (len - start == 2 && out[start] == '.' && out[start + 1] == '.'))
+            return UINT32_MAX;
+        (*depth)++;
+    }
+
+    out[len] = '\0';
+    return len;
+}
+
+private uint32_t hash_path(const char *path, uint32_t len)
+{
+    uint32_t hash, index;
+
+    hash = FNV_BASIS;
+    for (index = 0; index < len; index++)
+        hash = (hash ^ (uint8_t)path[index]) * FNV_PRIME;
+
+    return hash;
+}
+
+// the hash_path of each of the first most prefixes of a normalized path that end on a component (/a, /a/b, ...),
+// along with where each ends; returns how many it worked out
+private uint32_t hash_prefixes(const char *path, uint32_t len, uint32_t *hashes, uint32_t *ends, uint32_t most)
+{
+    uint32_t hash, index, count;
+
+    hash = FNV_BASIS;
+    count = 0;
+    for (index = 0; index < len && count < most; index++)
+    {
+        if (index && path[index] == '/')
+        {
+            hashes[count] = hash;
+            ends[count++] = index;
+        }
+        hash = (hash ^ (uint8_t)path[index]) * FNV_PRIME;
+    }
+
+    if (index == len && count < most && len)
+    {
+        hashes[count] = hash;
+        ends[count++] = len;
+    }
+
+    return count;
+}
+
+// the slot mounted at exactly path, or NO_MOUNT; the caller holds table_lock
+private uint8_t find_exact(const char *path, uint32_t len, uint32_t hash)
+{
+    uint8_t slot;
+
+    if (!len)
+        return root_mount;
+
+    for (slot = buckets[hash & (VFS_BUCKETS - 1)]; slot != NO_MOUNT; slot = mounts[slot].next)
+    {
+        if (mounts[slot].hash == hash && mounts[slot].len == len && !memcmp(mounts[slot].path, path, len))
+            return slot;
+    }
+
+    return NO_MOUNT;
+}
+
+// the slot of the volume path lies in, pinned so it stays mounted until release, with *rest pointing at what
+// follows the mount point in path (without it's leading /); NO_MOUNT if there's none
+// path has to be normalized already
+private uint8_t resolve(const char *path, const char **rest)
+{
+    uint32_t hashes[VFS_MOUNT_LEN / 2], ends[VFS_MOUNT_LEN / 2]; // a mount point has no more components than that
+    uint32_t len, count;
+    uint8_t slot;
+
+    len = strlen(path);
+    pthread_rwlock_rdlock(&table_lock);
+
+    // the longest mount point first; no mount point is deeper than max_depth, so no more prefixes are worth hashing
+    count = hash_prefixes(path, len, hashes, ends, max_depth);
+    slot = NO_MOUNT;
+    while (count && slot == NO_MOUNT)
+    {
+        count--;
+        slot = find_exact(path, ends[count], hashes[count]);
+        if (slot != NO_MOUNT)
+            *rest = path + ends[count] + (path[ends[count]] == '/');
+    }
+
+    if (slot == NO_MOUNT && root_mount != NO_MOUNT)
+    {
+        slot = root_mount;
+        *rest = path + (*path == '/');
+    }
+
+    if (slot != NO_MOUNT)
+        __atomic_fetch_add(&mounts[slot].users, 1, __ATOMIC_ACQ_REL);
+    pthread_rwlock_unlock(&table_lock);
+
+    return slot;
+}
+
+private void release(uint8_t slot)
+{
+    __atomic_fetch_sub(&mounts[slot].users, 1, __ATOMIC_ACQ_REL);
+}
+
+private const vfs_ops_t *find_type(const char *name)
+{
+    const vfs_ops_t *ops;
+    uint32_t index;
+
+    ops = NULL;
+    pthread_mutex_lock(&types_lock);
+    for (index = 0; index < VFS_TYPES && types[index]; index++)
+    {
+        if (!strcmp(types[index]->name, name))
+        {
+            ops = types[index];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&types_lock);
+
+    return ops;
+}
+
+internal bool vfs_register(const vfs_ops_t *ops)
+{
+    uint32_t index;
+    bool ret;
+
+    if (!ops || !ops->name || !ops->mount || !ops->unmount || !ops->lookup || !ops->create || !ops->unlink || !ops->read ||
+        !ops->write || !ops->stat || !ops->readdir || !ops->sync || find_type(ops->name))
+        return false;
+
+    ret = false;
+    pthread_mutex_lock(&types_lock);
+    for (index = 0; index < VFS_TYPES; index++)
+    {
+        if (!types[index])
+        {
+            types[index] = ops;
+            ret = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&types_lock);
+
+    return ret;
+}
+
+private bool add_mount(const char *path, const vfs_ops_t *ops, void *volume, uint8_t drive_num)
+{
+    char norm[VFS_MOUNT_LEN];
+    uint32_t len, depth, hash;
+    uint8_t slot, free_slot;
+    mount_t *mount;
+
+    len = normalize(path, norm, VFS_MOUNT_LEN, &depth);
+    if (len == UINT32_MAX)
+        return false;
+
+    hash = hash_path(norm, len);
+    pthread_rwlock_wrlock(&table_lock);
+
+    free_slot = NO_MOUNT;
+    for (slot = 0; slot < VFS_MOUNTS && free_slot == NO_MOUNT; slot++)
+    {
+        if (!mounts[slot].used)
+            free_slot = slot;
+    }
+
+    if (free_slot == NO_MOUNT || find_exact(norm, len, hash) != NO_MOUNT)
+    {
+        pthread_rwlock_unlock(&table_lock);
+        return false;
+    }
+
+    mount = &mounts[free_slot];
+    copy(mount->path, norm, (uint16_t)(len + 1));
+    mount->len = len;
+    mount->depth = depth;
+    mount->hash = hash;
+    mount->ops = ops;
+    mount->volume = volume;
+    mount->drive_num = drive_num;
+    mount->users = 0;
+    zero(mount->opens, sizeof(mount->opens));
+    mount->used = true;
+
+    if (!len)
+        root_mount = free_slot;
+    else
+    {
+        mount->next = buckets[mount->hash & (VFS_BUCKETS - 1)];
+        buckets[mount->hash & (VFS_BUCKETS - 1)] = free_slot;
+    }
+
+    if (depth > max_depth)
+        max_depth = depth;
+
+    pthread_rwlock_unlock(&table_lock);
+    return true;
+}
+
+internal bool vfs_mount(const char *path, const char *type, uint8_t drive_num, bool readonly)
+{
+    const vfs_ops_t *ops;
+    void *volume;
+
+    ops = type ? find_type(type) : NULL;
+    if (!ops || !path)
+        return false;
+
+    volume = ops->mount(drive_num, readonly);
+    if (!volume)
+        return false;
+
+    if (!add_mount(path, ops, volume, drive_num))
+    {
+        ops->unmount(volume);
+        return false;
+    }
+
+    return true;
+}
+
+internal bool vfs_attach(const char *path, const char *type, void *volume)
+{
+    const vfs_ops_t *ops;
+
+    ops = type ? find_type(type) : NULL;
+    if (!ops || !path || !volume)
+        return false;
+
+    return add_mount(path, ops, volume, 0);
+}
+
+internal bool vfs_unmount(const char *path)
+{
+    char norm[VFS_MOUNT_LEN];
+    const vfs_ops_t *ops;
+    void *volume;
+    uint32_t len, depth, hash, index;
+    uint8_t slot, *link;
+    mount_t *mount;
+
+    len = normalize(path, norm, VFS_MOUNT_LEN, &depth);
+    if (len == UINT32_MAX)
+        return false;
+
+    hash = hash_path(norm, len);
+
+    // a pin is only taken under the read lock, so none can come along once the write lock is held
+    pthread_rwlock_wrlock(&table_lock);
+    slot = find_exact(norm, len, hash);
+    if (slot == NO_MOUNT || __atomic_load_n(&mounts[slot].users, __ATOMIC_ACQUIRE))
+    {
+        pthread_rwlock_unlock(&table_lock);
+        return false;
+    }
+
+    mount = &mounts[slot];
+    if (!len)
+        root_mount = NO_MOUNT;
+    else
+    {
+        for (link = &buckets[hash & (VFS_BUCKETS - 1)]; *link != slot; link = &mounts[*link].next)
+            ;
+        *link = mount->next;
+    }
+    ops = mount->ops;
+    volume = mount->volume;
+    mount->used = false;
+
+    max_depth = 0;
+    for (index = 0; index < VFS_MOUNTS; index++)
+    {
+        if (mounts[index].used && mounts[index].depth > max_depth)
+            max_depth = mounts[index].depth;
+    }
+    pthread_rwlock_unlock(&table_lock);
+
+    // the slot may be taken again already, but nobody can reach the volume any more
+    ops->unmount(volume);
+    return true;
+}
+
+internal uint32_t vfs_mounts(vfs_mountinfo_t *info, uint32_t count)
+{
+    uint32_t index, found;
+
+    found = 0;
+    pthread_rwlock_rdlock(&table_lock);
+    for (index = 0; index < VFS_MOUNTS; index++)
+    {
+        if (!mounts[index].used)
+            continue;
+
+        if (info && found < count)
+        {
+            if (mounts[index].len)
+                copy(info[found].path, mounts[index].path, (uint16_t)(mounts[index].len + 1));
+            else
+                copy(info[found].path, "/", 2);
+            info[found].type = mounts[index].ops->name;
+            info[found].drive_num = mounts[index].drive_num;
+            info[found].users = __atomic_load_n(&mounts[index].users, __ATOMIC_RELAXED);
+        }
+        found++;
+    }
+    pthread_rwlock_unlock(&table_lock);
+
+    return found;
+}
+
+internal bool vfs_open(const char *path, bool create, vfs_file_t *file)
+{
+    char norm[VFS_PATH_LEN];
+    const char *rest;
+    uint32_t depth, inode, id, none;
+    uint8_t slot, open;
+    mount_t *mount;
+
+    if (!file || normalize(path, norm, VFS_PATH_LEN, &depth) == UINT32_MAX)
+        return false;
+
+    slot = resolve(norm, &rest);
+    if (slot == NO_MOUNT)
+        return false;
+
+    // the volume itself isn't a file, and volumes have no directories
+    mount = &mounts[slot];
+    inode = 0;
+    if (*rest && !strchr(rest, '/') && strlen(rest) <= VFS_NAME_LEN)
+    {
+        inode = mount->ops->lookup(mount->volume, rest);
+        if (!inode && create)
+            inode = mount->ops->create(mount->volume, rest);
+    }
+
+    if (!inode)
+    {
+        release(slot);
+        return false;
+    }
+
+    // the file takes the first free entry of the volume's open files, under an id no other open has
+    do
+    {
+        id = __atomic_add_fetch(&last_open, 1, __ATOMIC_RELAXED);
+    } while (!id);
+
+    for (open = 0; open < VFS_OPENS; open++)
+    {
+        none = 0;
+        if (__atomic_compare_exchange_n(&mount->opens[open], &none, id, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (open == VFS_OPENS)
+    {
+        release(slot);
+        return false;
+    }
+
+    // the pin stays with the file until vfs_close
+    file->mount = slot;
+    file->open = open;
+    file->id = id;
+    file->inode = inode;
+    return true;
+}
+
+// pins the volume of an open file for a call on it, as resolve does; false if the file isn't open, as with a copy
+// of a handle that's been closed. the pin is taken under the read lock, so the volume can't go in the meantime
+private bool pin_file(vfs_file_t *file)
+{
+    bool ret;
+
+    if (!file || file->mount >= VFS_MOUNTS || file->open >= VFS_OPENS || !file->id)
+        return false;
+
+    pthread_rwlock_rdlock(&table_lock);
+    ret = mounts[file->mount].used && __atomic_load_n(&mounts[file->mount].opens[file->open], __ATOMIC_ACQUIRE) == file->id;
+    if (ret)
+        __atomic_fetch_add(&mounts[file->mount].users, 1, __ATOMIC_ACQ_REL);
+    pthread_rwlock_unlock(&table_lock);
+
+    return ret;
+}
+
+// of the copies of a handle being closed at once, only the one that takes the id out of the open files lets go of
+// the file's pin
+internal bool vfs_close(vfs_file_t *file)
+{
+    uint32_t id;
+    bool ret;
+
+    if (!pin_file(file))
+        return false;
+
+    id = file->id;
+    ret = __atomic_compare_exchange_n(&mounts[file->mount].opens[file->open], &id, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    if (ret)
+        release(file->mount);
+    release(file->mount);
+
+    file->id = 0;
+    return ret;
+}
+
+internal uint32_t vfs_read(vfs_file_t *file, uint32_t offset, uint8_t *buf, uint32_t len)
+{
+    mount_t *mount;
+    uint32_t done;
+
+    if (!buf || !pin_file(file))
+        return 0;
+
+    mount = &mounts[file->mount];
+    done = mount->ops->read(mount->volume, file->inode, offset, buf, len);
+    release(file->mount);
+    return done;
+}
+
+internal uint32_t vfs_write(vfs_file_t *file, uint32_t offset, uint8_t *buf, uint32_t len)
+{
+    mount_t *mount;
+    uint32_t done;
+
+    if (!buf || !pin_file(file))
+        return 0;
+
+    mount = &mounts[file->mount];
+    done = mount->ops->write(mount->volume, file->inode, offset, buf, len);
+    release(file->mount);
+    return done;
+}
+
+internal bool vfs_fstat(vfs_file_t *file, vfs_stat_t *stat)
+{
+    mount_t *mount;
+    bool ret;
+
+    if (!stat || !pin_file(file))
+        return false;
+
+    mount = &mounts[file->mount];
+    ret = mount->ops->stat(mount->volume, file->inode, stat);
+    release(file->mount);
+    return ret;
+}
+
+internal bool vfs_stat(const char *path, vfs_stat_t *stat)
+{
+    char norm[VFS_PATH_LEN];
+    const char *rest;
+    uint32_t depth, inode;
+    uint8_t slot;
+    mount_t *mount;
+    bool ret;
+
+    if (!stat || normalize(path, norm, VFS_PATH_LEN, &depth) == UINT32_MAX)
+        return false;
+
+    slot = resolve(norm, &rest);
+    if (slot == NO_MOUNT)
+        return false;
+
+    mount = &mounts[slot];
+    if (!*rest)
+    {
+        zero(stat, sizeof(vfs_stat_t));
+        stat->links = 1;
+        stat->dir = true;
+        ret = true;
+    }
+    else
+    {
+        inode = strchr(rest, '/') || strlen(rest) > VFS_NAME_LEN ? 0 : mount->ops->lookup(mount->volume, rest);
+        ret = inode && mount->ops->stat(mount->volume, inode, stat);
+    }
+
+    release(slot);
+    return ret;
+}
+
+internal bool vfs_unlink(const char *path)
+{
+    char norm[VFS_PATH_LEN];
+    const char *rest;
+    uint32_t depth, inode;
+    uint8_t slot;
+    mount_t *mount;
+    bool ret;
+
+    if (normalize(path, norm, VFS_PATH_LEN, &depth) == UINT32_MAX)
+        return false;
+
+    slot = resolve(norm, &rest);
+    if (slot == NO_MOUNT)
+        return false;
+
+    mount = &mounts[slot];
+    inode = !*rest || strchr(rest, '/') || strlen(rest) > VFS_NAME_LEN ? 0 : mount->ops->lookup(mount->volume, rest);
+    ret = inode && mount->ops->unlink(mount->volume, inode);
+
+    release(slot);
+    return ret;
+}
+
+internal uint32_t vfs_readdir(const char *path, uint32_t *cursor, vfs_dirent_t *entries, uint32_t count)
+{
+    char norm[VFS_PATH_LEN];
+    const char *rest;
+    uint32_t depth, ret;
+    uint8_t slot;
+
+    if (!cursor || !entries || !count || normalize(path, norm, VFS_PATH_LEN, &depth) == UINT32_MAX)
+        return 0;
+
+    slot = resolve(norm, &rest);
+    if (slot == NO_MOUNT)
+        return 0;
+
+    ret = *rest ? 0 : mounts[slot].ops->readdir(mounts[slot].volume, cursor, entries, count);
+
+    release(slot);
+    return ret;
+}
+
+internal bool vfs_sync(const char *path)
+{
+    char norm[VFS_PATH_LEN];
+    const char *rest;
+    uint32_t depth, index;
+    uint8_t slot;
+    bool ret;
+
+    if (normalize(path, norm, VFS_PATH_LEN, &depth) == UINT32_MAX)
+        return false;
+
+    if (*norm)
+    {
+        slot = resolve(norm, &rest);
+        if (slot == NO_MOUNT)
+            return false;
+
+        ret = !*rest && mounts[slot].ops->sync(mounts[slot].volume);
+        release(slot);
+        return ret;
+    }
+
+    // every volume, each pinned while it syncs
+    ret = true;
+    for (index = 0; index < VFS_MOUNTS; index++)
+    {
+        pthread_rwlock_rdlock(&table_lock);
+        if (!mounts[index].used)
+        {
+            pthread_rwlock_unlock(&table_lock);
+            continue;
+        }
+        __atomic_fetch_add(&mounts[index].users, 1, __ATOMIC_ACQ_REL);
+        pthread_rwlock_unlock(&table_lock);
+
+        ret = mounts[index].ops->sync(mounts[index].volume) && ret;
+        release(index);
+    }
+
+    return ret;
+}